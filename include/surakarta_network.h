@@ -1,4 +1,7 @@
 #pragma once
 
 #include "surakarta_agent_remote.h"
+#include "surakarta_network_logger.h"
+#include "surakarta_network_reactor.h"
 #include "surakarta_network_service.h"
+#include "surakarta_network_stats.h"
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include "surakarta_logger.h"
+
+enum class SurakartaLogLevel {
+    /// @brief Connections, rooms and games.
+    INFO,
+    /// @brief Every message sent or received.
+    DEBUG,
+};
+
+/// @brief A logger that writes to another one, up to a given level.
+/// Lines written with Log() are INFO. DEBUG lines, such as the message traffic, are only built
+/// by callers that first see SurakartaLogEnabled(logger, SurakartaLogLevel::DEBUG), so that
+/// nothing is decoded or formatted for a line that is filtered out.
+class SurakartaLoggerFiltered : public SurakartaLogger {
+   public:
+    /// @param sink The logger to write to.
+    /// @param max_level The most verbose level to let through.
+    SurakartaLoggerFiltered(std::shared_ptr<SurakartaLogger> sink, SurakartaLogLevel max_level);
+
+    void Log(const char* format, ...) override;
+
+    std::shared_ptr<SurakartaLogger> CreateSublogger(const std::string& prefix) override;
+
+    SurakartaLogLevel MaxLevel() const { return max_level_; }
+
+    const std::shared_ptr<SurakartaLogger>& Sink() const { return sink_; }
+
+   private:
+    const std::shared_ptr<SurakartaLogger> sink_;
+    const SurakartaLogLevel max_level_;
+    const bool sink_enabled_;
+};
+
+/// @brief Whether a line logged at the level would be written anywhere.
+/// This is false for SurakartaLoggerNull and for levels filtered out by SurakartaLoggerFiltered.
+/// Since neither changes after construction, the answer can be kept for the life of the logger.
+bool SurakartaLogEnabled(const SurakartaLogger& logger, SurakartaLogLevel level);
+
+enum class SurakartaLogOverflow {
+    /// @brief Drop the line and count it.
+    DROP,
+    /// @brief Wait for the writer to make room.
+    BLOCK,
+};
+
+struct SurakartaLoggerAsyncOptions {
+    /// @brief The number of lines that can wait for the writer; rounded up to a power of two.
+    size_t capacity = 4096;
+    /// @brief What Log() does when that many lines are already waiting.
+    SurakartaLogOverflow overflow = SurakartaLogOverflow::BLOCK;
+};
+
+class SurakartaLoggerAsyncImpl;
+
+/// @brief A logger that never writes on the calling thread. Log() formats the line, copies it
+/// into a lock-free ring and returns; one background thread writes the lines to a file
+/// descriptor in batches. A slow terminal or pipe therefore only fills the ring.
+/// Lines longer than about 500 bytes are cut.
+class SurakartaLoggerAsync : public SurakartaLogger {
+   public:
+    /// @param fd The file descriptor to write to; it is not closed.
+    explicit SurakartaLoggerAsync(int fd = 1, SurakartaLoggerAsyncOptions options = SurakartaLoggerAsyncOptions());
+
+    void Log(const char* format, ...) override;
+
+    /// @brief A logger sharing the ring and the writer, whose lines start with [prefix].
+    std::shared_ptr<SurakartaLogger> CreateSublogger(const std::string& prefix) override;
+
+    /// @brief Wait until every line logged before the call has been written.
+    void Flush();
+
+    /// @brief The number of lines dropped so far because the ring was full.
+    long long Dropped() const;
+
+   private:
+    SurakartaLoggerAsync(std::shared_ptr<SurakartaLoggerAsyncImpl> impl, std::string prefix);
+
+    std::shared_ptr<SurakartaLoggerAsyncImpl> impl_;
+    const std::string prefix_;
+};
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <vector>
+#include "surakarta_network_service.h"
+
+class SurakartaNetworkReactorServerImpl;
+
+struct SurakartaNetworkReactorOptions {
+    /// @brief The number of event loops; 0 means one per hardware thread.
+    int loops = 0;
+    /// @brief Give every loop a listening socket of its own on the port, with SO_REUSEPORT, so
+    /// that the kernel spreads new connections over the loops and each accepts its own, instead
+    /// of the first loop accepting them all and handing them out. The loops share the service,
+    /// so the players of a room meet whichever loops they land on.
+    bool reuse_port = false;
+    /// @brief Pin every loop to a hardware thread of its own, in turn over those the process may run on.
+    bool pin_threads = false;
+};
+
+/// @brief Serves a SurakartaNetworkService from a small fixed set of epoll event loops,
+/// instead of the thread per connection of NetworkFramework::Server. Only available on Linux.
+class SurakartaNetworkReactorServer {
+   public:
+    /// @brief Start listening. Throws if the port cannot be bound or the platform is not supported.
+    /// @param service The service to drive.
+    /// @param port The port to listen on.
+    /// @param loops The number of event loops; 0 means one per hardware thread.
+    SurakartaNetworkReactorServer(std::shared_ptr<SurakartaNetworkService> service, int port, int loops = 0);
+
+    SurakartaNetworkReactorServer(std::shared_ptr<SurakartaNetworkService> service, int port, SurakartaNetworkReactorOptions options);
+
+    ~SurakartaNetworkReactorServer();
+
+    /// @brief Stop the event loops and close every connection.
+    void Shutdown();
+
+    /// @brief The connections each event loop has accepted so far; empty after Shutdown().
+    std::vector<long long> AcceptedPerLoop() const;
+
+    static bool IsSupported();
+
+   private:
+    std::shared_ptr<SurakartaNetworkReactorServerImpl> impl_;
+};
@@ -1,20 +1,188 @@
 #pragma once
 
+#include <string>
+#include <utility>
+#include <vector>
 #include "service.h"
 #include "surakarta_logger.h"
 
 class SurakartaNetworkServiceImpl;
 
+/// @brief A token bucket: a connection may send burst messages at once, and per_second more
+/// every second.
+struct SurakartaNetworkRateLimit {
+    /// @brief 0 means no limit.
+    double per_second = 0;
+    int burst = 1;
+};
+
+struct SurakartaNetworkServiceOptions {
+    /// @brief The number of threads that run the games; 0 means one per hardware thread.
+    int worker_threads = 0;
+    /// @brief The directory to journal every game to, as it is played; empty to keep no journal.
+    /// Only available on Linux.
+    std::string journal_directory;
+    /// @brief How long a journaled move may wait for the disk flush that makes it durable, in
+    /// microseconds. The moves of all games arriving meanwhile share the flush.
+    int journal_commit_interval_us = 2000;
+    /// @brief The size past which the journal goes on in a new file.
+    long long journal_segment_bytes = 64LL << 20;
+    /// @brief How long a player who loses the connection during a game keeps the seat, in
+    /// milliseconds. The player may come back on a new connection with the token it was given
+    /// when the game started, and is sent the moves it missed; the game is lost with TIMEOUT if
+    /// it does not. 0 means the game is lost at once, with RESIGN, and no token is given.
+    int resume_grace_ms = 0;
+    /// @brief How long a new connection may take to send its first READY, in milliseconds,
+    /// before it is closed. 0 means no limit.
+    int handshake_timeout_ms = 0;
+    /// @brief How long a room may wait for its second player, in milliseconds. The first player
+    /// is then sent a REJECT, and the room removed. 0 means no limit.
+    int waiting_timeout_ms = 0;
+    /// @brief How long a player may take over a move, in milliseconds; the game is lost with
+    /// TIMEOUT if it does not move in time. 0 means no limit.
+    int move_timeout_ms = 0;
+    /// @brief How long a connection may be silent while it is neither playing, waiting for a game
+    /// nor watching one, in milliseconds, before it is closed. 0 means no limit.
+    int idle_timeout_ms = 0;
+    /// @brief The messages a connection may send: MOVE, RESIGN and LEAVE; CHAT; and the rest,
+    /// READY included. A message over the limit is dropped before it is logged or read.
+    SurakartaNetworkRateLimit game_rate_limit;
+    SurakartaNetworkRateLimit chat_rate_limit;
+    SurakartaNetworkRateLimit other_rate_limit;
+    /// @brief The number of messages dropped after which a connection is closed; 0 means never.
+    int max_dropped_messages = 0;
+    /// @brief The servers of the cluster this one is part of, as "<address>:<port>", itself
+    /// included, or none if it is on its own. Every server of a cluster must be given the same
+    /// list. Each room then belongs to one of them, picked from its id, and a player who asks
+    /// another for it is relayed there, or redirected with cluster_redirect.
+    std::vector<std::string> cluster_nodes;
+    /// @brief This server, as written in cluster_nodes.
+    std::string cluster_self;
+    /// @brief Answer a READY for a room of another server with a REJECT whose reason is
+    /// "Redirect to <address>:<port>", for the client to connect there, instead of relaying it.
+    /// Relaying is only available on Linux; elsewhere READYs are always redirected.
+    bool cluster_redirect = false;
+    /// @brief The connections to each other server kept ready for relaying; 0 for none. Only
+    /// available on Linux.
+    int cluster_pool_size = 0;
+    /// @brief A secret shared by every server of the cluster. The servers pass it on with the
+    /// READYs they relay, so that a relayed READY is told from one a client sends. With none,
+    /// no READY is taken as relayed, and every one is looked up, which only works if every
+    /// server has the same cluster_nodes. It shows in the READYs a server logs at DEBUG level.
+    std::string cluster_secret;
+};
+
+struct SurakartaNetworkServiceStats {
+    /// @brief The number of rooms that are waiting for the second player or playing.
+    int active_rooms = 0;
+    /// @brief The number of rooms currently attached to each game worker.
+    std::vector<int> rooms_per_worker;
+    /// @brief The number of rooms that have been removed, for whatever reason.
+    long long rooms_torn_down = 0;
+    /// @brief The time from asking a room to go away until it is removed, in microseconds.
+    double teardown_latency_mean_us = 0;
+    long long teardown_latency_max_us = 0;
+};
+
+/// @brief A distribution of durations, in microseconds. Percentiles are within about 6%.
+struct SurakartaNetworkLatency {
+    long long count = 0;
+    double mean_us = 0;
+    double p50_us = 0;
+    double p99_us = 0;
+    double p999_us = 0;
+    double max_us = 0;
+};
+
+struct SurakartaNetworkServiceMetrics {
+    /// @brief The time to handle one received message, by opcode: READY, MOVE, RESIGN, REJECT,
+    /// LEAVE, CHAT, END, OTHER, and DISCONNECT for a closed connection.
+    std::vector<std::pair<std::string, SurakartaNetworkLatency>> message_handling;
+    /// @brief From receiving a move until the worker of the room starts playing it.
+    SurakartaNetworkLatency move_queue;
+    /// @brief The time the game takes to check and commit a move.
+    SurakartaNetworkLatency move_commit;
+    /// @brief From receiving a move until it has been sent to the opponent.
+    SurakartaNetworkLatency move_relay;
+    /// @brief The time rooms spend waiting for the second player.
+    SurakartaNetworkLatency room_waiting;
+    /// @brief From the start of a game until its room is removed.
+    SurakartaNetworkLatency room_playing;
+    /// @brief From asking a room to go away until it is removed.
+    SurakartaNetworkLatency room_teardown;
+    long long connections_opened = 0;
+    int active_connections = 0;
+    int active_rooms = 0;
+    /// @brief The number of rooms in each state: WAITING_SECOND_PLAYER, PLAYING, ENDED and CLOSED.
+    /// Rooms are ENDED or CLOSED only for the moment it takes to remove them.
+    std::vector<std::pair<std::string, int>> rooms_by_status;
+    /// @brief The number of games ended, by the reason sent to the players. Cancelled games end with NONE.
+    std::vector<std::pair<std::string, long long>> games_ended;
+    /// @brief The number of connections watching a game.
+    int spectators = 0;
+    /// @brief Spectators closed because they could not keep up, or whose connection failed.
+    long long spectators_dropped = 0;
+    /// @brief The time to write and flush one batch of the journal; the count is that of the flushes.
+    SurakartaNetworkLatency journal_commit;
+    long long journal_records = 0;
+    long long journal_bytes = 0;
+    /// @brief Writes and flushes of the journal that failed; the records in them may be lost.
+    long long journal_failures = 0;
+    /// @brief The number of players who have lost the connection and may still come back.
+    int players_away = 0;
+    /// @brief Players who came back to their game on a new connection.
+    long long players_resumed = 0;
+    /// @brief From losing the connection until coming back, for the players who did.
+    SurakartaNetworkLatency player_away;
+    /// @brief The number of players waiting to be paired with anyone.
+    int matchmaking_waiting = 0;
+    /// @brief The number of games started by pairing players who asked for no room in particular.
+    long long matchmaking_pairs = 0;
+    /// @brief From asking to play anyone until being paired.
+    SurakartaNetworkLatency matchmaking_wait;
+    /// @brief The number of deadlines that have passed, by kind: HANDSHAKE and IDLE for the
+    /// connections closed, WAITING for the rooms removed, MOVE and GRACE for the games lost.
+    std::vector<std::pair<std::string, long long>> deadlines_expired;
+    /// @brief The number of deadlines being kept, for connections, rooms and seats.
+    long long timers_armed = 0;
+    /// @brief Messages dropped for going over the rate limit, by kind: GAME, CHAT and OTHER.
+    std::vector<std::pair<std::string, long long>> messages_dropped;
+    /// @brief Connections closed for having too many messages dropped.
+    long long connections_rate_limited = 0;
+    /// @brief Connections that asked for a room of another server of the cluster, relayed
+    /// there or redirected there.
+    long long cluster_forwarded = 0;
+    long long cluster_redirected = 0;
+    /// @brief The number of connections being relayed to another server.
+    int cluster_relaying = 0;
+    /// @brief From receiving a READY for a room of another server until it has been passed on
+    /// there, the connection to it made.
+    SurakartaNetworkLatency cluster_forward;
+};
+
 class SurakartaNetworkService : public NetworkFramework::Service {
    public:
     SurakartaNetworkService(
-        std::shared_ptr<SurakartaLogger> logger = std::make_shared<SurakartaLoggerNull>());
+        std::shared_ptr<SurakartaLogger> logger = std::make_shared<SurakartaLoggerNull>(),
+        SurakartaNetworkServiceOptions options = SurakartaNetworkServiceOptions());
 
     void Execute(std::shared_ptr<NetworkFramework::Socket> socket) override;
 
     /// @brief This method should be called manually before server shutdown.
     void ShutdownService();
 
+    /// @brief End the game in the room, telling the players, and remove the room.
+    /// It does not wait for the game; the room goes away right after the move being played, if any.
+    /// @return false if there is no such room.
+    bool CancelRoom(int room_id);
+
+    SurakartaNetworkServiceStats Stats() const;
+
+    /// @brief Sum up the latency histograms kept by every thread. This costs far more than Stats(),
+    /// but nothing is summed while the service runs.
+    SurakartaNetworkServiceMetrics Metrics() const;
+
    private:
+    friend class SurakartaNetworkReactorServerImpl;
     std::shared_ptr<SurakartaNetworkServiceImpl> impl_;
 };
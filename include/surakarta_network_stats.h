@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string>
+#include "surakarta_network_service.h"
+
+/// @brief Format the metrics of a service in the Prometheus text exposition format.
+std::string SurakartaNetworkFormatPrometheus(const SurakartaNetworkServiceStats& stats,
+                                             const SurakartaNetworkServiceMetrics& metrics);
+
+class SurakartaNetworkStatsServerImpl;
+
+/// @brief Serves snapshots of the metrics of a service to Prometheus, or to curl, over HTTP.
+/// Every request gets the same text, whatever its path. A snapshot only reads counters; it takes
+/// no room lock and never waits for a game, so it is safe to scrape often under full load.
+/// Requests are answered one at a time on a thread of its own. Only available on Linux.
+class SurakartaNetworkStatsServer {
+   public:
+    /// @brief Listen on a TCP port of the loopback interface.
+    /// Throws if the port cannot be bound or the platform is not supported.
+    SurakartaNetworkStatsServer(std::shared_ptr<SurakartaNetworkService> service, int port);
+
+    /// @brief Listen on a Unix socket, replacing whatever is at the path.
+    SurakartaNetworkStatsServer(std::shared_ptr<SurakartaNetworkService> service, const std::string& unix_socket_path);
+
+    ~SurakartaNetworkStatsServer();
+
+    /// @brief Stop answering, and remove the Unix socket if there is one.
+    void Shutdown();
+
+    static bool IsSupported();
+
+   private:
+    std::shared_ptr<SurakartaNetworkStatsServerImpl> impl_;
+};
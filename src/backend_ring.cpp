@@ -0,0 +1,71 @@
+#include "backend_ring.h"
+#include <algorithm>
+#include <stdexcept>
+#include "message.h"
+#include "opcode.h"
+
+// splitmix64's finalizer: every bit of the input moves about half of the output.
+static uint64_t Mix(uint64_t value) {
+    value ^= value >> 30;
+    value *= 0xbf58476d1ce4e5b9ULL;
+    value ^= value >> 27;
+    value *= 0x94d049bb133111ebULL;
+    value ^= value >> 31;
+    return value;
+}
+
+// FNV-1a, so that the points do not depend on the standard library.
+static uint64_t HashText(const std::string& text) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (unsigned char c : text) {
+        hash ^= c;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+std::optional<SurakartaBackend> SurakartaBackend::Parse(const std::string& text) {
+    auto colon = text.rfind(':');
+    if (colon == std::string::npos || colon == 0 || colon + 1 == text.size())
+        return std::nullopt;
+    try {
+        size_t used = 0;
+        int port = std::stoi(text.substr(colon + 1), &used);
+        if (used != text.size() - colon - 1 || port <= 0 || port > 65535)
+            return std::nullopt;
+        return SurakartaBackend{text.substr(0, colon), port};
+    } catch (...) {
+        return std::nullopt;
+    }
+}
+
+SurakartaBackendRing::SurakartaBackendRing(std::vector<SurakartaBackend> backends, int points_per_backend)
+    : backends_(std::move(backends)) {
+    if (backends_.empty())
+        throw std::invalid_argument("No backends to route to.");
+    points_.reserve(backends_.size() * points_per_backend);
+    for (uint32_t i = 0; i < backends_.size(); i++) {
+        uint64_t seed = HashText(backends_[i].ToString());
+        for (int point = 0; point < points_per_backend; point++)
+            points_.emplace_back(Mix(seed + 0x9e3779b97f4a7c15ULL * (point + 1)), i);
+    }
+    std::sort(points_.begin(), points_.end());
+}
+
+size_t SurakartaBackendRing::Pick(int room_id) const {
+    uint64_t hash = Mix((uint64_t)(uint32_t)room_id);
+    auto it = std::lower_bound(points_.begin(), points_.end(), std::make_pair(hash, (uint32_t)0));
+    if (it == points_.end())
+        it = points_.begin();
+    return it->second;
+}
+
+std::optional<int> SurakartaBackendRing::RoomOf(const NetworkFramework::Message& first) {
+    if (first.opcode != OPCODE::READY_OP)
+        return std::nullopt;
+    try {
+        return SurakartaNetworkMessageReady(first).RoomId();
+    } catch (...) {
+        return std::nullopt;
+    }
+}
@@ -0,0 +1,1249 @@
+// Load benchmark for the Surakarta network service.
+//
+// Plays scripted (non-AI) games between pairs of clients, either against a server run
+// in-process in the chosen execution mode or against a running surakarta-server. A number of
+// pairs play at the same time, each starting its next game as soon as the last one ends, at
+// no more than the join rate; players may think before each move. Each game may be watched by
+// a number of spectators, which join once both players are ready and before the first move.
+// A player may drop its connection in the middle of each game and take its seat back on a new
+// one. Instead of playing, the players may ask to be paired with anyone, and leave once they
+// are, to measure the matchmaker under a burst of joins. The clients may also reach the server
+// through a proxy run in-process, to compare the proxy that parses every message with the one
+// that forwards bytes, and the proxy may spread the rooms over several servers. All clients are driven by a single epoll loop, so the thread count of the process reflects
+// the server alone.
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <optional>
+#include <queue>
+#include <random>
+#include <thread>
+#include <vector>
+#include "network_framework.h"
+#include "private-include/capture.h"
+#include "private-include/forwarding_proxy.h"
+#include "private-include/message.h"
+#include "private-include/reverse_proxy_service.h"
+#include "private-include/socket_capture_wrapper.h"
+#include "private-include/socket_log_wrapper.h"
+#include "private-include/socket_raw_log_wrapper.h"
+#include "private-include/wire_codec.h"
+#include "surakarta.h"
+#include "surakarta_network.h"
+
+using Clock = std::chrono::steady_clock;
+
+// How long a scripted player waits before answering its opponent's move.
+struct BenchThinkTime {
+    enum class Kind { NONE, FIXED, UNIFORM, EXPONENTIAL } kind = Kind::NONE;
+    double a_ms = 0;  // FIXED: the time; UNIFORM: the minimum; EXPONENTIAL: the mean
+    double b_ms = 0;  // UNIFORM: the maximum
+
+    // none | fixed:<ms> | uniform:<min ms>:<max ms> | exp:<mean ms>
+    static std::optional<BenchThinkTime> Parse(const char* text) {
+        BenchThinkTime think;
+        if (strcmp(text, "none") == 0)
+            return think;
+        if (sscanf(text, "fixed:%lf", &think.a_ms) == 1 && think.a_ms >= 0) {
+            think.kind = Kind::FIXED;
+            return think;
+        }
+        if (sscanf(text, "uniform:%lf:%lf", &think.a_ms, &think.b_ms) == 2 && 0 <= think.a_ms && think.a_ms <= think.b_ms) {
+            think.kind = Kind::UNIFORM;
+            return think;
+        }
+        if (sscanf(text, "exp:%lf", &think.a_ms) == 1 && think.a_ms > 0) {
+            think.kind = Kind::EXPONENTIAL;
+            return think;
+        }
+        return std::nullopt;
+    }
+
+    Clock::duration Sample(std::mt19937_64& random) const {
+        double ms = 0;
+        switch (kind) {
+            case Kind::NONE:
+                break;
+            case Kind::FIXED:
+                ms = a_ms;
+                break;
+            case Kind::UNIFORM:
+                ms = std::uniform_real_distribution<double>(a_ms, b_ms)(random);
+                break;
+            case Kind::EXPONENTIAL:
+                ms = std::exponential_distribution<double>(1 / a_ms)(random);
+                break;
+        }
+        return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double, std::milli>(ms));
+    }
+
+    std::string ToString() const {
+        char text[64];
+        switch (kind) {
+            case Kind::FIXED:
+                snprintf(text, sizeof(text), "fixed:%g", a_ms);
+                break;
+            case Kind::UNIFORM:
+                snprintf(text, sizeof(text), "uniform:%g:%g", a_ms, b_ms);
+                break;
+            case Kind::EXPONENTIAL:
+                snprintf(text, sizeof(text), "exp:%g", a_ms);
+                break;
+            default:
+                return "none";
+        }
+        return text;
+    }
+};
+
+struct BenchOptions {
+    bool reactor = false;
+    int loops = 0;
+    bool reuse_port = false;   // every event loop listens on the port, with SO_REUSEPORT
+    bool pin_threads = false;  // every event loop pinned to a hardware thread
+    int workers = 0;
+    std::string address;  // empty: run the server in-process
+    int port = 6680;
+    int pairs = 100;
+    int games = 0;         // 0: one game per pair
+    double join_rate = 0;  // games started per second; 0: as fast as the pairs free up
+    BenchThinkTime think;
+    int moves = 0;  // 0: play until the server ends the game
+    int spectators = 0;  // per game
+    int reconnect = 0;   // the move after which a player drops its connection and comes back; 0 for never
+    bool matchmaking = false;  // players ask to be paired with anyone, and leave once they are
+    bool colors = false;       // the first player of a pair asks for black, the second for white
+    int timeout_seconds = 120;
+    int room_base = 0;
+    bool compact = false;
+    bool json = false;
+    std::string journal;  // the directory the in-process server journals to; empty for none
+    int journal_commit_us = 2000;
+    std::string proxy;  // empty: connect to the server directly; "threads" or "forward": through a proxy in-process
+    int proxy_loops = 0;
+    int proxy_pool = 0;  // connections the proxy keeps ready for each server
+    std::string proxy_log;      // the file the threads proxy logs every message to, as surakarta-reverse-proxy does
+    std::string proxy_capture;  // the file the threads proxy captures every message to
+    int backends = 1;   // servers on consecutive ports, the rooms spread over them by the proxy
+    std::string cluster;  // empty: the servers are on their own; "forward" or "redirect": they form a cluster
+    int cluster_pool = 0;  // connections each server of the cluster keeps ready for each other
+
+    int TotalGames() const { return games > 0 ? games : pairs; }
+};
+
+struct BenchPair;
+
+struct BenchClient {
+    int fd = -1;
+    size_t server = 0;  // the one connected to
+    BenchPair* pair = nullptr;
+    PieceColor color = PieceColor::NONE;
+    int step = 0;
+    bool closed = true;
+    bool compact = false;  // the server has agreed to the compact encoding
+    bool spectator = false;
+    int seen = 0;               // the moves sent or received in this game
+    std::string resume_token;   // for the seat, if the server keeps seats
+    bool resuming = false;      // waiting for the READY that gives the seat back
+    bool catching_up = false;   // waiting for the move to answer after coming back
+    Clock::time_point joined_at;
+    NetworkFramework::Message ready;  // the last sent, to send again where redirected
+    SurakartaWireDecoder decoder;
+    std::string pending;
+};
+
+// One of the concurrent pairs of players. It plays its games one after another, each in a
+// room of its own.
+struct BenchPair {
+    int room_id = -1;
+    unsigned generation = 0;  // counts the games, so that timers of a finished game are ignored
+    BenchClient clients[2];
+    std::vector<BenchClient> spectators;  // sized once, as epoll refers to the clients by address
+    Clock::time_point started_at;
+    Clock::time_point move_sent_at;
+    std::vector<Clock::time_point> move_sent_times;  // of every move, for the spectators
+    int readies = 0;
+    int spectators_ready = 0;  // greeted or rejected
+    int moves = 0;
+    Clock::time_point reconnect_started;
+    bool reconnected = false;
+    bool ended = true;
+    bool rejected = false;
+    bool failed = false;  // a connection could not be made
+};
+
+struct BenchResult {
+    int games_finished = 0;
+    int games_rejected = 0;
+    int games_failed = 0;
+    double seconds = 0;
+    std::vector<double> connect_latencies_us;  // from connect() until the connection is made
+    std::vector<double> setup_latencies_us;    // from the first connect() until both players got READY
+    std::vector<double> relay_latencies_us;    // from sending a move until the opponent received it
+    std::vector<double> spectator_latencies_us;  // from sending a move until a spectator received it
+    std::vector<double> reconnect_latencies_us;  // from dropping the connection until able to move again
+    std::vector<double> matchmaking_latencies_us;  // from asking to play anyone until the game started
+    Clock::time_point first_joined_at, last_paired_at;
+    Clock::time_point first_started_at, last_set_up_at;  // of the games, to tell how fast they are set up
+    std::vector<long long> accepted_per_loop;            // by the in-process reactor server
+    int spectators_rejected = 0;
+    long long proxy_bytes_forwarded = 0;
+    long long pool_hits = 0, pool_misses = 0, pool_discarded = 0;
+    long long capture_records = 0, capture_dropped = 0;
+    int redirects = 0;  // followed by the clients
+    long long cluster_forwarded = 0, cluster_redirected = 0;  // by all the servers
+    double cluster_forward_mean_us = 0, cluster_forward_p99_us = 0;  // the p99 of the server with the worst
+    std::vector<long long> games_per_backend;  // with several servers in-process
+    long long bytes_sent = 0;
+    long long bytes_received = 0;
+};
+
+static int CountThreads() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.rfind("Threads:", 0) == 0)
+            return std::stoi(line.substr(8));
+    }
+    return 0;
+}
+
+static std::optional<sockaddr_in> Resolve(const std::string& host, int port) {
+    addrinfo hints{};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* found = nullptr;
+    if (getaddrinfo(host.c_str(), nullptr, &hints, &found) != 0 || found == nullptr)
+        return std::nullopt;
+    sockaddr_in address = *(sockaddr_in*)found->ai_addr;
+    freeaddrinfo(found);
+    address.sin_port = htons(port);
+    return address;
+}
+
+static int ConnectTo(const sockaddr_in& address) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (const sockaddr*)&address, sizeof(address)) < 0) {
+        ::close(fd);
+        return -1;
+    }
+    int flag = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    return fd;
+}
+
+// Thousands of clients need as many descriptors, and more with the server or a proxy in-process.
+static void RaiseDescriptorLimit(int needed) {
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur >= limit.rlim_max)
+        return;
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    if (limit.rlim_cur < (rlim_t)needed)
+        fprintf(stderr, "Warning: %d descriptors are needed, but only %llu are allowed\n", needed,
+                (unsigned long long)limit.rlim_cur);
+}
+
+class BenchClientLoop {
+   public:
+    // The clients of a pair connect to the servers in turn, from a server of its own.
+    BenchClientLoop(const BenchOptions& options, std::vector<sockaddr_in> servers, BenchResult& result)
+        : options_(options), servers_(std::move(servers)), result_(result), pairs_(options.pairs) {
+        epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        for (auto& pair : pairs_)
+            pair.spectators.resize(options.spectators);
+    }
+
+    ~BenchClientLoop() {
+        for (auto& pair : pairs_) {
+            for (auto& client : pair.clients)
+                Close(client);
+            for (auto& client : pair.spectators)
+                Close(client);
+        }
+        ::close(epoll_fd_);
+    }
+
+    void Run() {
+        auto now = Clock::now();
+        auto deadline = now + std::chrono::seconds(options_.timeout_seconds);
+        next_join_at_ = now;
+        for (auto& pair : pairs_)
+            ScheduleGame(pair);
+        epoll_event events[256];
+        while (finished_ < options_.TotalGames() && Clock::now() < deadline) {
+            int count = epoll_wait(epoll_fd_, events, 256, WaitMilliseconds());
+            for (int i = 0; i < count; i++) {
+                auto client = static_cast<BenchClient*>(events[i].data.ptr);
+                if (client->closed)
+                    continue;
+                if (events[i].events & EPOLLOUT)
+                    Flush(*client);
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                    OnReadable(*client);
+            }
+            RunDueTimers();
+        }
+    }
+
+   private:
+    struct Timer {
+        Clock::time_point at;
+        BenchPair* pair;
+        unsigned generation;
+        int seat;  // the player to move, or -1 to start the pair's next game
+
+        bool operator>(const Timer& other) const { return at > other.at; }
+    };
+
+    void AddTimer(Clock::time_point at, BenchPair& pair, int seat) {
+        timers_.push(Timer{at, &pair, pair.generation, seat});
+    }
+
+    int WaitMilliseconds() const {
+        if (timers_.empty())
+            return 100;
+        auto wait = timers_.top().at - Clock::now();
+        if (wait <= Clock::duration::zero())
+            return 0;
+        // round up, or the loop spins until the timer is due
+        auto milliseconds = std::chrono::ceil<std::chrono::milliseconds>(wait).count();
+        return (int)std::min<long long>(milliseconds, 100);
+    }
+
+    void RunDueTimers() {
+        auto now = Clock::now();
+        while (!timers_.empty() && timers_.top().at <= now) {
+            auto timer = timers_.top();
+            timers_.pop();
+            auto& pair = *timer.pair;
+            if (timer.seat < 0)
+                StartGame(pair);
+            else if (timer.generation == pair.generation && !pair.ended)
+                SendNextMove(pair.clients[timer.seat]);
+        }
+    }
+
+    // Start the pair's next game, no sooner than the join rate allows.
+    void ScheduleGame(BenchPair& pair) {
+        if (started_ >= options_.TotalGames())
+            return;
+        started_++;
+        auto at = std::max(Clock::now(), next_join_at_);
+        if (options_.join_rate > 0)
+            next_join_at_ = at + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1 / options_.join_rate));
+        AddTimer(at, pair, -1);
+    }
+
+    void StartGame(BenchPair& pair) {
+        pair.generation++;
+        pair.room_id = options_.room_base + next_room_id_++;
+        pair.started_at = Clock::now();
+        if (result_.first_started_at == Clock::time_point())
+            result_.first_started_at = pair.started_at;
+        pair.readies = 0;
+        pair.spectators_ready = 0;
+        pair.move_sent_times.clear();
+        pair.moves = 0;
+        pair.reconnected = false;
+        pair.ended = false;
+        pair.rejected = false;
+        pair.failed = false;
+        for (int seat = 0; seat < 2; seat++) {
+            if (!Join(pair, pair.clients[seat], "bench" + std::to_string(seat), false))
+                return;
+        }
+    }
+
+    // Connect and send READY; on failure, the game is over.
+    bool Join(BenchPair& pair, BenchClient& client, const std::string& username, bool spectator) {
+        const size_t index = spectator ? 2 + (&client - pair.spectators.data()) : &client - pair.clients;
+        client = BenchClient();
+        client.pair = &pair;
+        client.spectator = spectator;
+        client.server = (&pair - pairs_.data() + index) % servers_.size();
+        if (!Connect(client))
+            return false;
+        auto color = PieceColor::NONE;
+        if (options_.colors && !spectator)
+            color = &client == &pair.clients[0] ? PieceColor::BLACK : PieceColor::WHITE;
+        int room_id = pair.room_id;
+        if (options_.matchmaking && !spectator) {
+            room_id = SURAKARTA_MATCHMAKING_ROOM_ID;
+            client.joined_at = Clock::now();
+            if (result_.first_joined_at == Clock::time_point())
+                result_.first_joined_at = client.joined_at;
+        }
+        client.ready = SurakartaNetworkMessageReady(username, color, room_id, spectator);
+        SurakartaWireSetCompactOption(client.ready, options_.compact);
+        Send(client, client.ready);
+        return true;
+    }
+
+    // Drop the connection right after a move, so that the answer to it is sent while the
+    // player is away, and take the seat back on a new one.
+    void Reconnect(BenchClient& client) {
+        auto& pair = *client.pair;
+        pair.reconnected = true;
+        pair.reconnect_started = Clock::now();
+        Close(client);
+        client.decoder = SurakartaWireDecoder();
+        client.pending.clear();
+        client.compact = false;
+        if (!Connect(client))
+            return;
+        client.resuming = true;
+        client.catching_up = true;
+        const int seat = &client == &pair.clients[0] ? 0 : 1;
+        client.ready = SurakartaNetworkMessageReady(
+            "bench" + std::to_string(seat), client.color, pair.room_id, client.resume_token, client.seen);
+        SurakartaWireSetCompactOption(client.ready, options_.compact);
+        Send(client, client.ready);
+    }
+
+    // Connect to the server a REJECT redirects to, and send the READY again there.
+    // @return false if the REJECT is not a redirect to one of the servers.
+    bool Redirect(BenchClient& client, const std::string& target) {
+        auto node = SurakartaBackend::Parse(target);
+        auto address = node.has_value() ? Resolve(node->address, node->port) : std::nullopt;
+        if (!address.has_value())
+            return false;
+        auto server = std::find_if(servers_.begin(), servers_.end(), [&](const sockaddr_in& server) {
+            return server.sin_addr.s_addr == address->sin_addr.s_addr && server.sin_port == address->sin_port;
+        });
+        if (server == servers_.end())
+            return false;
+        result_.redirects++;
+        Close(client);
+        client.decoder = SurakartaWireDecoder();
+        client.pending.clear();
+        client.compact = false;
+        client.server = server - servers_.begin();
+        if (Connect(client))
+            Send(client, client.ready);
+        return true;
+    }
+
+    // On failure, the game is over.
+    bool Connect(BenchClient& client) {
+        auto& pair = *client.pair;
+        auto connect_start = Clock::now();
+        client.fd = ConnectTo(servers_[client.server]);
+        if (client.fd < 0) {
+            if (result_.games_failed == 0)
+                fprintf(stderr, "Failed to connect: %s\n", strerror(errno));
+            pair.failed = true;
+            EndGame(pair);
+            return false;
+        }
+        client.closed = false;
+        result_.connect_latencies_us.push_back(std::chrono::duration<double, std::micro>(Clock::now() - connect_start).count());
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.ptr = &client;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, client.fd, &event);
+        return true;
+    }
+
+    // Once the last spectator is in, black opens the game.
+    void OnSpectatorReady(BenchPair& pair) {
+        if (++pair.spectators_ready < options_.spectators || pair.ended)
+            return;
+        for (auto& client : pair.clients) {
+            if (client.color == PieceColor::BLACK)
+                ScheduleMove(client);
+        }
+    }
+
+    void Send(BenchClient& client, const NetworkFramework::Message& message) {
+        if (client.closed)
+            return;
+        auto size = client.pending.size();
+        SurakartaWireEncode(message, client.pending, client.compact);
+        result_.bytes_sent += client.pending.size() - size;
+        Flush(client);
+    }
+
+    void Flush(BenchClient& client) {
+        while (!client.pending.empty()) {
+            auto written = ::send(client.fd, client.pending.data(), client.pending.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (written < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    epoll_event event{};
+                    event.events = EPOLLIN | EPOLLOUT;
+                    event.data.ptr = &client;
+                    epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, client.fd, &event);
+                    return;
+                }
+                client.pending.clear();
+                return;
+            }
+            client.pending.erase(0, written);
+        }
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.ptr = &client;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, client.fd, &event);
+    }
+
+    void Close(BenchClient& client) {
+        if (client.closed || client.fd < 0)
+            return;
+        client.closed = true;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, client.fd, nullptr);
+        ::close(client.fd);
+    }
+
+    // Answer after the think time, or at once without one.
+    void ScheduleMove(BenchClient& client) {
+        auto think = options_.think.Sample(random_);
+        if (think <= Clock::duration::zero())
+            SendNextMove(client);
+        else
+            AddTimer(Clock::now() + think, *client.pair, &client == &client.pair->clients[0] ? 0 : 1);
+    }
+
+    // Shuffle one piece forward and back again, on the rows nearest to the player.
+    // Such moves are never captures, so the game runs until the no-capture limit.
+    void SendNextMove(BenchClient& client) {
+        auto& pair = *client.pair;
+        if (options_.moves > 0 && pair.moves >= options_.moves) {
+            Send(client, SurakartaNetworkMessageResign());
+            EndGame(pair);
+            return;
+        }
+        const int home = client.color == PieceColor::BLACK ? 1 : BOARD_SIZE - 2;
+        const int forward = client.color == PieceColor::BLACK ? 2 : BOARD_SIZE - 3;
+        const int x = (client.step / 2) % BOARD_SIZE;
+        const bool out = client.step % 2 == 0;
+        client.step++;
+        client.seen++;
+        pair.moves++;
+        pair.move_sent_at = Clock::now();
+        if (options_.spectators > 0)
+            pair.move_sent_times.push_back(pair.move_sent_at);
+        Send(client, SurakartaNetworkMessageMove(SurakartaPosition(x, out ? home : forward),
+                                                 SurakartaPosition(x, out ? forward : home)));
+        if (options_.reconnect > 0 && pair.moves == options_.reconnect && !pair.reconnected)
+            Reconnect(client);
+    }
+
+    // The server tells how many moves it has; the move sent just before dropping the connection
+    // may not be among them, and is then sent again.
+    void OnResumed(BenchClient& client, int moves) {
+        auto& pair = *client.pair;
+        client.resuming = false;
+        if (moves >= client.seen)
+            return;  // the move to answer is on its way
+        RecordReconnect(client);
+        client.step--;
+        client.seen--;
+        pair.moves--;
+        if (options_.spectators > 0)
+            pair.move_sent_times.pop_back();
+        SendNextMove(client);
+    }
+
+    void RecordReconnect(BenchClient& client) {
+        client.catching_up = false;
+        auto latency = Clock::now() - client.pair->reconnect_started;
+        result_.reconnect_latencies_us.push_back(std::chrono::duration<double, std::micro>(latency).count());
+    }
+
+    // The pair's next game is started from a timer, after the events already returned by
+    // epoll_wait() for the old connections have been skipped.
+    //
+    // The spectators read on until they are told the game is over, so that a server lagging
+    // behind them shows in their latency rather than being cut short.
+    void EndGame(BenchPair& pair) {
+        if (pair.ended)
+            return;
+        pair.ended = true;
+        for (auto& client : pair.clients)
+            Close(client);
+        if (pair.failed) {
+            for (auto& client : pair.spectators)
+                Close(client);
+        }
+        if (!WatchedBy(pair))
+            FinishGame(pair);
+    }
+
+    void CloseSpectator(BenchClient& client) {
+        if (client.closed)
+            return;
+        Close(client);
+        auto& pair = *client.pair;
+        if (pair.ended && !WatchedBy(pair))
+            FinishGame(pair);
+    }
+
+    static bool WatchedBy(const BenchPair& pair) {
+        return std::any_of(pair.spectators.begin(), pair.spectators.end(), [](const BenchClient& client) { return !client.closed; });
+    }
+
+    void FinishGame(BenchPair& pair) {
+        finished_++;
+        if (pair.failed)
+            result_.games_failed++;
+        else if (pair.rejected)
+            result_.games_rejected++;
+        else
+            result_.games_finished++;
+        ScheduleGame(pair);
+    }
+
+    void OnReadable(BenchClient& client) {
+        char buffer[4096];
+        auto size = ::recv(client.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (size <= 0) {
+            if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return;
+            if (client.spectator)
+                CloseSpectator(client);
+            else
+                EndGame(*client.pair);
+            return;
+        }
+        result_.bytes_received += size;
+        client.decoder.Feed(buffer, size);
+        while (!client.closed) {
+            auto message = client.decoder.Next();
+            if (!message.has_value())
+                break;
+            OnMessage(client, message.value());
+        }
+    }
+
+    void OnMessage(BenchClient& client, const NetworkFramework::Message& message) {
+        auto& pair = *client.pair;
+        if (message.opcode == OPCODE::REJECT_OP && Redirect(client, SurakartaNetworkMessageReject(message).RedirectTarget()))
+            return;
+        if (client.spectator) {
+            OnSpectatorMessage(client, message);
+            return;
+        }
+        if (options_.matchmaking) {
+            OnMatchmakingMessage(client, message);
+            return;
+        }
+        if (message.opcode == OPCODE::READY_OP) {
+            SurakartaNetworkMessageReady ready(message);
+            client.color = ready.Color();
+            client.compact = SurakartaWireHasCompactOption(message);
+            client.resume_token = ready.ResumeToken();
+            if (client.resuming) {
+                OnResumed(client, ready.ResumeMoves());
+                return;
+            }
+            if (++pair.readies == 2) {
+                result_.last_set_up_at = Clock::now();
+                result_.setup_latencies_us.push_back(std::chrono::duration<double, std::micro>(result_.last_set_up_at - pair.started_at).count());
+                for (int i = 0; i < options_.spectators; i++) {
+                    if (!Join(pair, pair.spectators[i], "spectator" + std::to_string(i), true))
+                        return;
+                }
+            }
+            if (client.color == PieceColor::BLACK && options_.spectators == 0)
+                ScheduleMove(client);
+        } else if (message.opcode == OPCODE::MOVE_OP) {
+            client.seen++;
+            if (client.catching_up) {
+                RecordReconnect(client);
+            } else {
+                auto latency = std::chrono::duration<double, std::micro>(Clock::now() - pair.move_sent_at);
+                result_.relay_latencies_us.push_back(latency.count());
+            }
+            ScheduleMove(client);
+        } else if (message.opcode == OPCODE::END_OP) {
+            EndGame(pair);
+        } else if (message.opcode == OPCODE::REJECT_OP) {
+            pair.rejected = true;
+            EndGame(pair);
+        }
+    }
+
+    // The players of a pair are most likely paired with players of other pairs, so each leaves
+    // as soon as it is paired, and the pair is done once both are.
+    void OnMatchmakingMessage(BenchClient& client, const NetworkFramework::Message& message) {
+        auto& pair = *client.pair;
+        if (message.opcode == OPCODE::READY_OP) {
+            auto now = Clock::now();
+            result_.matchmaking_latencies_us.push_back(std::chrono::duration<double, std::micro>(now - client.joined_at).count());
+            result_.last_paired_at = now;
+            Close(client);
+            if (++pair.readies == 2)
+                EndGame(pair);
+        } else if (message.opcode == OPCODE::REJECT_OP) {
+            pair.rejected = true;
+            EndGame(pair);
+        }
+        // the END of a game whose other player has left already
+    }
+
+    void OnSpectatorMessage(BenchClient& client, const NetworkFramework::Message& message) {
+        auto& pair = *client.pair;
+        if (message.opcode == OPCODE::READY_OP) {
+            client.compact = SurakartaWireHasCompactOption(message);
+            OnSpectatorReady(pair);
+        } else if (message.opcode == OPCODE::MOVE_OP) {
+            // the moves arrive in order, so the step of a spectator is the index of the move
+            if (client.step < (int)pair.move_sent_times.size()) {
+                auto latency = Clock::now() - pair.move_sent_times[client.step];
+                result_.spectator_latencies_us.push_back(std::chrono::duration<double, std::micro>(latency).count());
+            }
+            client.step++;
+        } else if (message.opcode == OPCODE::REJECT_OP) {
+            result_.spectators_rejected++;
+            OnSpectatorReady(pair);
+            CloseSpectator(client);
+        } else if (message.opcode == OPCODE::END_OP) {
+            CloseSpectator(client);
+        }
+    }
+
+    const BenchOptions& options_;
+    const std::vector<sockaddr_in> servers_;
+    BenchResult& result_;
+    std::vector<BenchPair> pairs_;
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers_;
+    std::mt19937_64 random_{42};  // fixed, so that runs with the same options play the same games
+    Clock::time_point next_join_at_;
+    int next_room_id_ = 0;
+    int epoll_fd_;
+    int started_ = 0;
+    int finished_ = 0;
+};
+
+static double Percentile(const std::vector<double>& sorted, double p) {
+    if (sorted.empty())
+        return 0;
+    size_t index = std::min(sorted.size() - 1, (size_t)(p * sorted.size()));
+    return sorted[index];
+}
+
+static void PrintText(const BenchOptions& options,
+                      const BenchResult& result,
+                      int server_threads,
+                      const std::vector<int>& peak_rooms_per_worker,
+                      const std::optional<SurakartaNetworkServiceStats>& stats,
+                      const std::optional<SurakartaNetworkServiceMetrics>& metrics) {
+    auto& connects = result.connect_latencies_us;
+    auto& setups = result.setup_latencies_us;
+    auto& latencies = result.relay_latencies_us;
+    if (options.address.empty()) {
+        printf("mode:               %s%s%s\n", options.reactor ? "reactor" : "thread per connection",
+               options.reactor && options.reuse_port ? ", a listener per event loop" : "",
+               options.reactor && options.pin_threads ? ", event loops pinned" : "");
+    } else {
+        printf("server:             %s:%d\n", options.address.c_str(), options.port);
+    }
+    if (options.proxy == "threads" && !options.proxy_capture.empty())
+        printf("proxy:              threads, capturing every message: %lld records, %lld dropped\n",
+               result.capture_records, result.capture_dropped);
+    else if (options.proxy == "threads" && !options.proxy_log.empty())
+        printf("proxy:              threads, logging every message\n");
+    else if (options.proxy == "threads")
+        printf("proxy:              threads, parsing every message\n");
+    else if (options.proxy == "forward")
+        printf("proxy:              forward, %lld bytes spliced\n", result.proxy_bytes_forwarded);
+    if (!options.cluster.empty()) {
+        printf("cluster:            %d servers, %s: %lld relayed, %lld redirected (%d redirects followed)\n", options.backends,
+               options.cluster.c_str(), result.cluster_forwarded, result.cluster_redirected, result.redirects);
+        if (options.cluster == "forward")
+            printf("cluster relay (us): mean %.1f, p99 %.1f to pass a READY on%s\n", result.cluster_forward_mean_us,
+                   result.cluster_forward_p99_us, options.cluster_pool > 0 ? ", connections kept ready" : "");
+    }
+    if (options.proxy_pool > 0)
+        printf("proxy pool:         %d per server, %lld taken, %lld misses, %lld replaced\n", options.proxy_pool,
+               result.pool_hits, result.pool_misses, result.pool_discarded);
+    printf("connections:        %d concurrent\n", options.pairs * (2 + options.spectators));
+    if (options.spectators > 0)
+        printf("spectators:         %d per game, %d rejected\n", options.spectators, result.spectators_rejected);
+    printf("join rate:          ");
+    if (options.join_rate > 0)
+        printf("%.1f games/s\n", options.join_rate);
+    else
+        printf("unlimited\n");
+    printf("think time:         %s\n", options.think.ToString().c_str());
+    if (options.address.empty() || !options.proxy.empty())
+        printf("server threads:     %d (peak%s)\n", server_threads,
+               options.proxy.empty() ? "" : options.address.empty() ? ", the proxy's included" : ", the proxy's only");
+    if (!result.games_per_backend.empty()) {
+        printf("games per backend: ");
+        for (auto games : result.games_per_backend)
+            printf(" %lld", games);
+        printf("\n");
+    }
+    if (stats.has_value()) {
+        printf("rooms per worker:  ");
+        for (auto rooms : peak_rooms_per_worker)
+            printf(" %d", rooms);
+        printf(" (peak)\n");
+    }
+    printf("games finished:     %d, rejected: %d, failed: %d\n", result.games_finished, result.games_rejected, result.games_failed);
+    printf("elapsed:            %.3f s (%.1f games/s)\n", result.seconds, result.games_finished / result.seconds);
+    printf("moves relayed:      %zu\n", latencies.size());
+    printf("bytes on the wire:  %lld sent, %lld received\n", result.bytes_sent, result.bytes_received);
+    printf("connect (us):       p50 %.1f, p99 %.1f, max %.1f\n",
+           Percentile(connects, 0.50), Percentile(connects, 0.99), connects.empty() ? 0.0 : connects.back());
+    printf("game setup (us):    p50 %.1f, p99 %.1f, max %.1f\n",
+           Percentile(setups, 0.50), Percentile(setups, 0.99), setups.empty() ? 0.0 : setups.back());
+    double setup_seconds = std::chrono::duration<double>(result.last_set_up_at - result.first_started_at).count();
+    printf("games set up:       %zu in %.3f s (%.0f connections/s)\n", setups.size(), setup_seconds,
+           setup_seconds > 0 ? setups.size() * 2 / setup_seconds : 0.0);
+    if (!result.accepted_per_loop.empty()) {
+        printf("accepted per loop: ");
+        for (auto accepted : result.accepted_per_loop)
+            printf(" %lld", accepted);
+        printf("\n");
+    }
+    printf("relay latency (us): p50 %.1f, p99 %.1f, p999 %.1f, max %.1f\n",
+           Percentile(latencies, 0.50), Percentile(latencies, 0.99), Percentile(latencies, 0.999),
+           latencies.empty() ? 0.0 : latencies.back());
+    if (options.spectators > 0) {
+        auto& spectated = result.spectator_latencies_us;
+        printf("spectator (us):     p50 %.1f, p99 %.1f, p999 %.1f, max %.1f (%zu moves seen)\n",
+               Percentile(spectated, 0.50), Percentile(spectated, 0.99), Percentile(spectated, 0.999),
+               spectated.empty() ? 0.0 : spectated.back(), spectated.size());
+        if (metrics.has_value())
+            printf("spectators dropped: %lld\n", metrics->spectators_dropped);
+    }
+    if (options.matchmaking) {
+        auto& waits = result.matchmaking_latencies_us;
+        double seconds = std::chrono::duration<double>(result.last_paired_at - result.first_joined_at).count();
+        printf("matchmaking:        %zu players paired in %.3f s (%.0f games/s)\n", waits.size(), seconds,
+               seconds > 0 ? waits.size() / 2 / seconds : 0.0);
+        printf("paired after (us):  p50 %.1f, p99 %.1f, max %.1f\n", Percentile(waits, 0.50), Percentile(waits, 0.99),
+               waits.empty() ? 0.0 : waits.back());
+        if (metrics.has_value()) {
+            printf("server queue (us):  p50 %.1f, p99 %.1f, max %.1f (%lld pairs)\n", metrics->matchmaking_wait.p50_us,
+                   metrics->matchmaking_wait.p99_us, metrics->matchmaking_wait.max_us, metrics->matchmaking_pairs);
+        }
+    }
+    if (options.reconnect > 0) {
+        auto& reconnects = result.reconnect_latencies_us;
+        printf("reconnect (us):     p50 %.1f, p99 %.1f, max %.1f (%zu players back in their game)\n",
+               Percentile(reconnects, 0.50), Percentile(reconnects, 0.99), reconnects.empty() ? 0.0 : reconnects.back(),
+               reconnects.size());
+    }
+    if (metrics.has_value()) {
+        printf("server relay (us):  p50 %.1f, p99 %.1f, p999 %.1f (queued p50 %.1f, commit p50 %.1f)\n",
+               metrics->move_relay.p50_us, metrics->move_relay.p99_us, metrics->move_relay.p999_us,
+               metrics->move_queue.p50_us, metrics->move_commit.p50_us);
+    }
+    if (stats.has_value()) {
+        printf("rooms torn down:    %lld (teardown latency mean %.1f us, max %lld us)\n",
+               stats->rooms_torn_down, stats->teardown_latency_mean_us, stats->teardown_latency_max_us);
+    }
+    if (metrics.has_value() && !options.journal.empty()) {
+        auto& commit = metrics->journal_commit;
+        printf("journal:            %lld records, %lld bytes, %lld flushes (%.1f records each, flush p50 %.1f us, p99 %.1f us)\n",
+               metrics->journal_records, metrics->journal_bytes, commit.count,
+               commit.count > 0 ? (double)metrics->journal_records / commit.count : 0.0, commit.p50_us, commit.p99_us);
+    }
+}
+
+static void PrintLatenciesJson(const char* name, const std::vector<double>& sorted) {
+    printf(",\"%s\":{\"count\":%zu,\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}", name, sorted.size(),
+           Percentile(sorted, 0.50), Percentile(sorted, 0.99), Percentile(sorted, 0.999), sorted.empty() ? 0.0 : sorted.back());
+}
+
+// One object on one line, so that the results of many runs can be appended to a file and
+// compared.
+static void PrintJson(const BenchOptions& options,
+                      const BenchResult& result,
+                      int server_threads,
+                      const std::optional<SurakartaNetworkServiceStats>& stats,
+                      const std::optional<SurakartaNetworkServiceMetrics>& metrics) {
+    printf("{\"server\":\"%s\"", !options.address.empty() ? "external" : options.reactor ? "reactor" : "thread_per_connection");
+    if (!options.proxy.empty()) {
+        printf(",\"proxy\":\"%s\",\"proxy_bytes_forwarded\":%lld", options.proxy.c_str(), result.proxy_bytes_forwarded);
+        printf(",\"proxy_pool\":%d,\"pool_hits\":%lld,\"pool_misses\":%lld,\"pool_discarded\":%lld", options.proxy_pool,
+               result.pool_hits, result.pool_misses, result.pool_discarded);
+        if (!options.proxy_capture.empty())
+            printf(",\"capture_records\":%lld,\"capture_dropped\":%lld", result.capture_records, result.capture_dropped);
+        // with the servers in-process, their threads are counted together with the proxy's
+        if (!stats.has_value())
+            printf(",\"%s\":%d", options.address.empty() ? "server_threads" : "proxy_threads", server_threads);
+    }
+    if (!result.games_per_backend.empty()) {
+        printf(",\"backends\":%d,\"games_per_backend\":[", options.backends);
+        for (size_t i = 0; i < result.games_per_backend.size(); i++)
+            printf("%s%lld", i > 0 ? "," : "", result.games_per_backend[i]);
+        printf("]");
+    }
+    if (!options.cluster.empty()) {
+        printf(",\"cluster\":\"%s\",\"cluster_pool\":%d,\"cluster_forwarded\":%lld,\"cluster_redirected\":%lld,\"redirects\":%d",
+               options.cluster.c_str(), options.cluster_pool, result.cluster_forwarded, result.cluster_redirected, result.redirects);
+        printf(",\"cluster_forward_mean_us\":%.1f,\"cluster_forward_p99_us\":%.1f", result.cluster_forward_mean_us,
+               result.cluster_forward_p99_us);
+    }
+    printf(",\"pairs\":%d,\"games\":%d,\"join_rate\":%g,\"think\":\"%s\",\"moves\":%d,\"spectators\":%d,\"reconnect\":%d,\"matchmaking\":%s,\"compact\":%s",
+           options.pairs, options.TotalGames(), options.join_rate, options.think.ToString().c_str(), options.moves,
+           options.spectators, options.reconnect, options.matchmaking ? "true" : "false", options.compact ? "true" : "false");
+    printf(",\"games_finished\":%d,\"games_rejected\":%d,\"games_failed\":%d", result.games_finished,
+           result.games_rejected, result.games_failed);
+    printf(",\"seconds\":%.3f,\"games_per_second\":%.1f", result.seconds, result.games_finished / result.seconds);
+    printf(",\"moves_relayed\":%zu,\"bytes_sent\":%lld,\"bytes_received\":%lld", result.relay_latencies_us.size(),
+           result.bytes_sent, result.bytes_received);
+    PrintLatenciesJson("connect_us", result.connect_latencies_us);
+    double setup_seconds = std::chrono::duration<double>(result.last_set_up_at - result.first_started_at).count();
+    printf(",\"setup_connections_per_second\":%.0f",
+           setup_seconds > 0 ? result.setup_latencies_us.size() * 2 / setup_seconds : 0.0);
+    if (!result.accepted_per_loop.empty()) {
+        printf(",\"accepted_per_loop\":[");
+        for (size_t i = 0; i < result.accepted_per_loop.size(); i++)
+            printf("%s%lld", i == 0 ? "" : ",", result.accepted_per_loop[i]);
+        printf("]");
+    }
+    PrintLatenciesJson("setup_us", result.setup_latencies_us);
+    PrintLatenciesJson("relay_us", result.relay_latencies_us);
+    if (options.spectators > 0)
+        PrintLatenciesJson("spectator_us", result.spectator_latencies_us);
+    if (options.reconnect > 0)
+        PrintLatenciesJson("reconnect_us", result.reconnect_latencies_us);
+    if (options.matchmaking) {
+        double seconds = std::chrono::duration<double>(result.last_paired_at - result.first_joined_at).count();
+        printf(",\"matchmaking_games_per_second\":%.0f", seconds > 0 ? result.matchmaking_latencies_us.size() / 2 / seconds : 0.0);
+        PrintLatenciesJson("matchmaking_us", result.matchmaking_latencies_us);
+        if (metrics.has_value())
+            printf(",\"matchmaking_pairs\":%lld,\"matchmaking_queue_p50_us\":%.1f,\"matchmaking_queue_p99_us\":%.1f",
+                   metrics->matchmaking_pairs, metrics->matchmaking_wait.p50_us, metrics->matchmaking_wait.p99_us);
+    }
+    if (stats.has_value()) {
+        printf(",\"server_threads\":%d,\"rooms_torn_down\":%lld,\"teardown_mean_us\":%.1f,\"teardown_max_us\":%lld",
+               server_threads, stats->rooms_torn_down, stats->teardown_latency_mean_us, stats->teardown_latency_max_us);
+    }
+    if (metrics.has_value() && !options.journal.empty()) {
+        printf(",\"journal_records\":%lld,\"journal_bytes\":%lld,\"journal_flushes\":%lld,\"journal_flush_p50_us\":%.1f,\"journal_flush_p99_us\":%.1f",
+               metrics->journal_records, metrics->journal_bytes, metrics->journal_commit.count,
+               metrics->journal_commit.p50_us, metrics->journal_commit.p99_us);
+    }
+    printf("}\n");
+}
+
+int main(int argc, char** argv) {
+    BenchOptions options;
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--reactor") == 0 || strcmp(argv[i], "-R") == 0) {
+            options.reactor = true;
+        } else if ((strcmp(argv[i], "--loops") == 0 || strcmp(argv[i], "-l") == 0) && has_value) {
+            options.loops = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--reuse-port") == 0) {
+            options.reuse_port = true;
+        } else if (strcmp(argv[i], "--pin-threads") == 0) {
+            options.pin_threads = true;
+        } else if ((strcmp(argv[i], "--workers") == 0 || strcmp(argv[i], "-w") == 0) && has_value) {
+            options.workers = atoi(argv[++i]);
+        } else if ((strcmp(argv[i], "--address") == 0 || strcmp(argv[i], "-a") == 0) && has_value) {
+            options.address = argv[++i];
+        } else if ((strcmp(argv[i], "--port") == 0 || strcmp(argv[i], "-p") == 0) && has_value) {
+            options.port = atoi(argv[++i]);
+        } else if ((strcmp(argv[i], "--pairs") == 0 || strcmp(argv[i], "-n") == 0) && has_value) {
+            options.pairs = atoi(argv[++i]);
+        } else if ((strcmp(argv[i], "--games") == 0 || strcmp(argv[i], "-g") == 0) && has_value) {
+            options.games = atoi(argv[++i]);
+        } else if ((strcmp(argv[i], "--join-rate") == 0 || strcmp(argv[i], "-j") == 0) && has_value) {
+            options.join_rate = atof(argv[++i]);
+        } else if ((strcmp(argv[i], "--think") == 0 || strcmp(argv[i], "-k") == 0) && has_value) {
+            auto think = BenchThinkTime::Parse(argv[++i]);
+            if (!think.has_value()) {
+                fprintf(stderr, "Invalid think time: %s\n", argv[i]);
+                return 1;
+            }
+            options.think = think.value();
+        } else if ((strcmp(argv[i], "--moves") == 0 || strcmp(argv[i], "-m") == 0) && has_value) {
+            options.moves = atoi(argv[++i]);
+        } else if ((strcmp(argv[i], "--spectators") == 0 || strcmp(argv[i], "-s") == 0) && has_value) {
+            options.spectators = atoi(argv[++i]);
+        } else if ((strcmp(argv[i], "--reconnect") == 0 || strcmp(argv[i], "-r") == 0) && has_value) {
+            options.reconnect = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--matchmaking") == 0 || strcmp(argv[i], "-M") == 0) {
+            options.matchmaking = true;
+        } else if (strcmp(argv[i], "--colors") == 0) {
+            options.colors = true;
+        } else if ((strcmp(argv[i], "--timeout") == 0 || strcmp(argv[i], "-t") == 0) && has_value) {
+            options.timeout_seconds = atoi(argv[++i]);
+        } else if ((strcmp(argv[i], "--room-base") == 0 || strcmp(argv[i], "-b") == 0) && has_value) {
+            options.room_base = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--compact") == 0 || strcmp(argv[i], "-c") == 0) {
+            options.compact = true;
+        } else if ((strcmp(argv[i], "--journal") == 0 || strcmp(argv[i], "-J") == 0) && has_value) {
+            options.journal = argv[++i];
+        } else if (strcmp(argv[i], "--journal-commit-us") == 0 && has_value) {
+            options.journal_commit_us = atoi(argv[++i]);
+        } else if ((strcmp(argv[i], "--proxy") == 0 || strcmp(argv[i], "-P") == 0) && has_value &&
+                   (strcmp(argv[i + 1], "threads") == 0 || strcmp(argv[i + 1], "forward") == 0)) {
+            options.proxy = argv[++i];
+        } else if (strcmp(argv[i], "--proxy-loops") == 0 && has_value) {
+            options.proxy_loops = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--proxy-pool") == 0 && has_value) {
+            options.proxy_pool = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--proxy-log") == 0 && has_value) {
+            options.proxy_log = argv[++i];
+        } else if (strcmp(argv[i], "--proxy-capture") == 0 && has_value) {
+            options.proxy_capture = argv[++i];
+        } else if ((strcmp(argv[i], "--backends") == 0 || strcmp(argv[i], "-B") == 0) && has_value && atoi(argv[i + 1]) > 0) {
+            options.backends = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--cluster") == 0 && has_value &&
+                   (strcmp(argv[i + 1], "forward") == 0 || strcmp(argv[i + 1], "redirect") == 0)) {
+            options.cluster = argv[++i];
+        } else if (strcmp(argv[i], "--cluster-pool") == 0 && has_value) {
+            options.cluster_pool = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--json") == 0) {
+            options.json = true;
+        } else {
+            printf("Usage: %s [args..]\n", argv[0]);
+            printf("Args:\n");
+            printf("  -R|--reactor             Run the server in reactor mode instead of thread per connection\n");
+            printf("  -l|--loops     <loops>   The number of event loops in reactor mode, default: one per hardware thread\n");
+            printf("     --reuse-port          In reactor mode, every event loop listens on the port (SO_REUSEPORT)\n");
+            printf("     --pin-threads         In reactor mode, pin every event loop to a hardware thread of its own\n");
+            printf("  -w|--workers   <workers> The number of game worker threads, default: one per hardware thread\n");
+            printf("  -a|--address   <address> Play against the surakarta-server at this address instead of one in-process\n");
+            printf("  -p|--port      <port>    The port of the server, default: 6680\n");
+            printf("  -n|--pairs     <pairs>   The number of concurrent games, default: 100\n");
+            printf("  -g|--games     <games>   The number of games to play in all, default: one per pair\n");
+            printf("  -j|--join-rate <games/s> Start no more games than this per second, default: unlimited\n");
+            printf("  -k|--think     <time>    How long players think before each move: none, fixed:<ms>,\n");
+            printf("                           uniform:<min ms>:<max ms> or exp:<mean ms>, default: none\n");
+            printf("  -m|--moves     <moves>   Resign after this many moves per game, default: play until the game ends\n");
+            printf("  -s|--spectators <n>      Watch every game with this many spectators, default: 0\n");
+            printf("  -r|--reconnect <moves>   After this many moves of every game, the player who made the last drops the\n");
+            printf("                           connection and takes its seat back on a new one, default: never\n");
+            printf("  -M|--matchmaking         Ask to be paired with anyone, and leave once paired, instead of playing\n");
+            printf("     --colors              The first player of each pair asks for black, the second for white\n");
+            printf("  -t|--timeout   <seconds> Give up after this many seconds, default: 120\n");
+            printf("  -b|--room-base <room id> The first room id to use, to run several benchmarks against one server, default: 0\n");
+            printf("  -c|--compact             Ask for the compact encoding (only the reactor agrees)\n");
+            printf("  -J|--journal   <dir>     Have the in-process server journal every game to this directory\n");
+            printf("     --journal-commit-us <us> How long a journaled move may wait for the disk flush, default: 2000\n");
+            printf("  -P|--proxy     <kind>    Connect through a proxy in-process, on the port after the servers': threads,\n");
+            printf("                           two threads per connection that parse every message, or forward, bytes\n");
+            printf("                           spliced from epoll event loops\n");
+            printf("     --proxy-loops <loops> The number of event loops of the forward proxy, default: one per hardware thread\n");
+            printf("     --proxy-pool <n>      Have the proxy keep this many connections to each server ready, default: 0\n");
+            printf("     --proxy-log <file>    Have the threads proxy log every message to this file, as the reverse proxy does\n");
+            printf("     --proxy-capture <file> Have the threads proxy append every message to this capture file instead\n");
+            printf("  -B|--backends  <n>       Spread the rooms over this many servers, on the port and those after it,\n");
+            printf("                           through a proxy (forward unless -P says otherwise), default: 1\n");
+            printf("     --cluster <kind>      Have the servers form a cluster instead, and connect to all of them, the\n");
+            printf("                           players of a game to different ones: forward, relayed to the server of the\n");
+            printf("                           room, or redirect, sent there\n");
+            printf("     --cluster-pool <n>    Have each server of the cluster keep this many connections to each other ready\n");
+            printf("     --json                Print the results as one line of JSON\n");
+            return 1;
+        }
+    }
+
+    if ((!options.proxy_log.empty() || !options.proxy_capture.empty()) && options.proxy.empty())
+        options.proxy = "threads";
+    if (options.backends > 1 && options.proxy.empty() && options.cluster.empty())
+        options.proxy = "forward";
+    const std::string host = options.address.empty() ? "127.0.0.1" : options.address;
+    const int proxy_port = options.port + options.backends;
+    auto server_address = options.proxy.empty() ? Resolve(host, options.port) : Resolve("127.0.0.1", proxy_port);
+    if (!server_address.has_value()) {
+        fprintf(stderr, "Failed to resolve %s\n", options.address.c_str());
+        return 1;
+    }
+    std::vector<sockaddr_in> client_servers{server_address.value()};
+    if (!options.cluster.empty() && options.proxy.empty()) {
+        for (int i = 1; i < options.backends; i++)
+            client_servers.push_back(Resolve(host, options.port + i).value());
+    }
+    int descriptors_per_client = 1 + (options.address.empty() ? 1 : 0) + (options.proxy.empty() ? 0 : 2) +
+                                 (options.cluster == "forward" && options.address.empty() ? 2 : 0);
+    RaiseDescriptorLimit(options.pairs * (2 + options.spectators) * descriptors_per_client + 64);
+
+    const int baseline_threads = CountThreads();
+    std::vector<std::shared_ptr<SurakartaNetworkService>> services;
+    std::vector<std::unique_ptr<NetworkFramework::Server>> servers;
+    std::vector<std::unique_ptr<SurakartaNetworkReactorServer>> reactor_servers;
+    if (options.address.empty()) {
+        SurakartaNetworkServiceOptions service_options;
+        service_options.worker_threads = options.workers;
+        service_options.journal_directory = options.journal;
+        service_options.journal_commit_interval_us = options.journal_commit_us;
+        if (options.reconnect > 0)
+            service_options.resume_grace_ms = 10000;
+        if (!options.cluster.empty()) {
+            for (int i = 0; i < options.backends; i++)
+                service_options.cluster_nodes.push_back(host + ":" + std::to_string(options.port + i));
+            service_options.cluster_redirect = options.cluster == "redirect";
+            service_options.cluster_pool_size = options.cluster_pool;
+            service_options.cluster_secret = "surakarta-network-bench";
+        }
+        for (int i = 0; i < options.backends; i++) {
+            if (options.backends > 1 && !options.journal.empty())
+                service_options.journal_directory = options.journal + "/" + std::to_string(i);
+            if (!options.cluster.empty())
+                service_options.cluster_self = service_options.cluster_nodes[i];
+            services.push_back(std::make_shared<SurakartaNetworkService>(std::make_shared<SurakartaLoggerNull>(), service_options));
+            SurakartaNetworkReactorOptions reactor_options;
+            reactor_options.loops = options.loops;
+            reactor_options.reuse_port = options.reuse_port;
+            reactor_options.pin_threads = options.pin_threads;
+            if (options.reactor)
+                reactor_servers.push_back(std::make_unique<SurakartaNetworkReactorServer>(services.back(), options.port + i, reactor_options));
+            else
+                servers.push_back(std::make_unique<NetworkFramework::Server>(services.back(), options.port + i));
+        }
+    }
+    // the stats of the server, if there is only one
+    auto service = services.size() == 1 ? services[0] : nullptr;
+    std::vector<SurakartaBackend> backends;
+    for (int i = 0; i < options.backends; i++)
+        backends.push_back({host, options.port + i});
+    SurakartaUpstreamPoolOptions pool_options;
+    pool_options.size = options.proxy_pool;
+    std::shared_ptr<ReverseProxyService> proxy_service;
+    std::unique_ptr<NetworkFramework::Server> proxy_server;
+    std::unique_ptr<SurakartaForwardingProxy> forwarding_proxy;
+    std::shared_ptr<SurakartaCapture> capture;
+    std::shared_ptr<SurakartaLoggerAsync> proxy_logger;
+    int proxy_log_fd = -1;
+    if (!options.proxy_capture.empty()) {
+        capture = std::make_shared<SurakartaCapture>(SurakartaCapture::Options{options.proxy_capture});
+    } else if (!options.proxy_log.empty()) {
+        proxy_log_fd = open(options.proxy_log.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (proxy_log_fd < 0) {
+            fprintf(stderr, "Failed to open %s: %s\n", options.proxy_log.c_str(), strerror(errno));
+            return 1;
+        }
+        proxy_logger = std::make_shared<SurakartaLoggerAsync>(proxy_log_fd);
+    }
+    if (options.proxy == "threads") {
+        // the same layers as surakarta-reverse-proxy puts around its clients
+        auto wrap = [&](std::shared_ptr<NetworkFramework::Socket> socket) -> std::shared_ptr<NetworkFramework::Socket> {
+            if (capture)
+                return std::make_shared<SurakartaNetworkSocketCaptureWrapper>(socket, capture);
+            if (proxy_logger) {
+                auto prefixed_logger = proxy_logger->CreateSublogger(socket->PeerAddress() + ":" + std::to_string(socket->PeerPort()));
+                return std::make_shared<SurakartaNetworkSocketLogWrapper>(
+                    std::make_shared<SurakartaNetworkSocketRawLogWrapper>(socket, prefixed_logger), prefixed_logger);
+            }
+            return socket;
+        };
+        proxy_service = std::make_shared<ReverseProxyService>(backends, wrap, pool_options);
+        proxy_server = std::make_unique<NetworkFramework::Server>(proxy_service, proxy_port);
+    } else if (options.proxy == "forward") {
+        forwarding_proxy = std::make_unique<SurakartaForwardingProxy>(backends, proxy_port, options.proxy_loops, pool_options);
+    }
+    const SurakartaUpstreamPool* pool = proxy_service ? proxy_service->UpstreamPool() : forwarding_proxy ? forwarding_proxy->UpstreamPool() : nullptr;
+    if (pool) {
+        // start with the pool full, as a proxy that has been up for a while would be
+        for (size_t i = 0; i < backends.size(); i++) {
+            for (int tries = 0; tries < 500 && pool->Ready(i) < options.proxy_pool; tries++)
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+    std::atomic<bool> sampling = true;
+    std::atomic<int> peak_threads = 0;
+    std::vector<int> peak_rooms_per_worker;
+    std::thread sampler([&] {
+        while (sampling && (!services.empty() || !options.proxy.empty())) {
+            peak_threads = std::max(peak_threads.load(), CountThreads());
+            if (service) {
+                auto rooms_per_worker = service->Stats().rooms_per_worker;
+                peak_rooms_per_worker.resize(rooms_per_worker.size());
+                for (size_t i = 0; i < rooms_per_worker.size(); i++)
+                    peak_rooms_per_worker[i] = std::max(peak_rooms_per_worker[i], rooms_per_worker[i]);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+    });
+
+    BenchResult result;
+    {
+        BenchClientLoop clients(options, client_servers, result);
+        auto start = Clock::now();
+        clients.Run();
+        result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    }
+    sampling = false;
+    sampler.join();
+
+    std::optional<SurakartaNetworkServiceStats> stats;
+    std::optional<SurakartaNetworkServiceMetrics> metrics;
+    if (service) {
+        stats = service->Stats();
+        metrics = service->Metrics();
+    }
+    if (services.size() > 1) {
+        for (auto& backend_service : services)
+            result.games_per_backend.push_back(backend_service->Stats().rooms_torn_down);
+    }
+    if (!options.cluster.empty()) {
+        double forward_total_us = 0;
+        for (auto& backend_service : services) {
+            auto backend_metrics = backend_service->Metrics();
+            result.cluster_forwarded += backend_metrics.cluster_forwarded;
+            result.cluster_redirected += backend_metrics.cluster_redirected;
+            forward_total_us += backend_metrics.cluster_forward.mean_us * backend_metrics.cluster_forward.count;
+            result.cluster_forward_p99_us = std::max(result.cluster_forward_p99_us, backend_metrics.cluster_forward.p99_us);
+        }
+        if (result.cluster_forwarded > 0)
+            result.cluster_forward_mean_us = forward_total_us / result.cluster_forwarded;
+    }
+    for (auto& backend_service : services)
+        backend_service->ShutdownService();
+    if (pool) {
+        result.pool_hits = pool->Hits();
+        result.pool_misses = pool->Misses();
+        result.pool_discarded = pool->Discarded();
+    }
+    if (forwarding_proxy) {
+        result.proxy_bytes_forwarded = forwarding_proxy->BytesForwarded();
+        forwarding_proxy->Shutdown();
+    }
+    if (proxy_server)
+        proxy_server->Shutdown();
+    if (capture) {
+        capture->Flush();
+        result.capture_records = capture->Records();
+        result.capture_dropped = capture->Dropped();
+    }
+    if (proxy_logger) {
+        proxy_logger->Flush();
+        close(proxy_log_fd);
+    }
+    if (!reactor_servers.empty())
+        result.accepted_per_loop = reactor_servers[0]->AcceptedPerLoop();
+    for (auto& reactor_server : reactor_servers)
+        reactor_server->Shutdown();
+    for (auto& server : servers)
+        server->Shutdown();
+
+    std::sort(result.connect_latencies_us.begin(), result.connect_latencies_us.end());
+    std::sort(result.setup_latencies_us.begin(), result.setup_latencies_us.end());
+    std::sort(result.relay_latencies_us.begin(), result.relay_latencies_us.end());
+    std::sort(result.spectator_latencies_us.begin(), result.spectator_latencies_us.end());
+    std::sort(result.reconnect_latencies_us.begin(), result.reconnect_latencies_us.end());
+    std::sort(result.matchmaking_latencies_us.begin(), result.matchmaking_latencies_us.end());
+    // the sampler thread is the only thread of the benchmark itself besides main
+    const int server_threads = peak_threads - baseline_threads - 1;
+    if (options.json)
+        PrintJson(options, result, server_threads, stats, metrics);
+    else
+        PrintText(options, result, server_threads, peak_rooms_per_worker, stats, metrics);
+    return result.games_failed == 0 ? 0 : 1;
+}
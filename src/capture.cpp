@@ -0,0 +1,238 @@
+#include "capture.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+static uint64_t NowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static void EncodeRecord(std::string& out,
+                         SurakartaCaptureRecordType type,
+                         uint32_t connection,
+                         const void* payload,
+                         size_t payload_size,
+                         const std::string& data1,
+                         const std::string& data2,
+                         const std::string& data3) {
+    SurakartaCaptureRecordHeader header{};
+    header.size = (uint32_t)(sizeof(header) + payload_size + data1.size() + data2.size() + data3.size());
+    header.connection = connection;
+    header.time_ns = NowNs();
+    header.type = (uint8_t)type;
+    out.append((const char*)&header, sizeof(header));
+    out.append((const char*)payload, payload_size);
+    out += data1;
+    out += data2;
+    out += data3;
+}
+
+SurakartaCapture::SurakartaCapture(Options options)
+    : options_(std::move(options)) {
+    file_ = std::fopen(options_.path.c_str(), "ab+");
+    if (file_ == nullptr)
+        throw std::runtime_error("Failed to open the capture file " + options_.path + ": " + strerror(errno));
+    std::fseek(file_, 0, SEEK_END);
+    if (std::ftell(file_) == 0) {
+        SurakartaCaptureFileHeader header{};
+        memcpy(header.magic, SURAKARTA_CAPTURE_MAGIC, sizeof(header.magic));
+        header.created_ns = NowNs();
+        batch_.append((const char*)&header, sizeof(header));
+        appended_++;
+    } else {
+        // appending to a file of another kind would spoil it
+        SurakartaCaptureFileHeader header{};
+        std::fseek(file_, 0, SEEK_SET);
+        if (std::fread(&header, sizeof(header), 1, file_) != 1 ||
+            memcmp(header.magic, SURAKARTA_CAPTURE_MAGIC, sizeof(header.magic)) != 0) {
+            std::fclose(file_);
+            throw std::runtime_error(options_.path + " is not a capture file.");
+        }
+        std::fseek(file_, 0, SEEK_END);
+    }
+    batch_.reserve(std::min<size_t>(options_.buffer_bytes, 1 << 20));
+    writer_ = std::thread([this] { Run(); });
+}
+
+SurakartaCapture::~SurakartaCapture() {
+    {
+        std::lock_guard lock(mutex_);
+        stopping_ = true;
+        when_flush_requested_.notify_all();
+    }
+    writer_.join();
+    std::fclose(file_);
+}
+
+uint32_t SurakartaCapture::Open(const std::string& peer) {
+    uint32_t connection;
+    {
+        std::lock_guard lock(mutex_);
+        connection = next_connection_++;
+    }
+    Append(SurakartaCaptureRecordType::OPEN, connection, peer.data(), peer.size());
+    return connection;
+}
+
+void SurakartaCapture::Received(uint32_t connection, const NetworkFramework::Message& message) {
+    AppendMessage(SurakartaCaptureRecordType::RECEIVED, connection, message);
+}
+
+void SurakartaCapture::Sent(uint32_t connection, const NetworkFramework::Message& message) {
+    AppendMessage(SurakartaCaptureRecordType::SENT, connection, message);
+}
+
+void SurakartaCapture::Close(uint32_t connection) {
+    Append(SurakartaCaptureRecordType::CLOSE, connection, nullptr, 0);
+}
+
+void SurakartaCapture::AppendMessage(SurakartaCaptureRecordType type,
+                                     uint32_t connection,
+                                     const NetworkFramework::Message& message) {
+    SurakartaCaptureMessage payload{};
+    payload.opcode = (int32_t)message.opcode;
+    payload.data1_size = (uint32_t)message.data1.size();
+    payload.data2_size = (uint32_t)message.data2.size();
+    payload.data3_size = (uint32_t)message.data3.size();
+    Append(type, connection, &payload, sizeof(payload), message.data1, message.data2, message.data3);
+}
+
+void SurakartaCapture::Append(SurakartaCaptureRecordType type,
+                              uint32_t connection,
+                              const void* payload,
+                              size_t payload_size,
+                              const std::string& data1,
+                              const std::string& data2,
+                              const std::string& data3) {
+    const size_t size = sizeof(SurakartaCaptureRecordHeader) + payload_size + data1.size() + data2.size() + data3.size();
+    std::lock_guard lock(mutex_);
+    if (batch_.size() + size > options_.buffer_bytes) {
+        dropped_unreported_++;
+        dropped_.Add();
+        return;
+    }
+    const bool was_empty = appended_ == written_;
+    EncodeRecord(batch_, type, connection, payload, payload_size, data1, data2, data3);
+    appended_++;
+    records_.Add();
+    // the writer only needs waking for the first record of a batch, or to make room
+    if (was_empty || batch_.size() >= options_.buffer_bytes / 2)
+        when_flush_requested_.notify_one();
+}
+
+void SurakartaCapture::Flush() {
+    std::unique_lock lock(mutex_);
+    const uint64_t target = appended_;
+    if (written_ >= target)
+        return;
+    flush_requested_ = true;
+    when_flush_requested_.notify_one();
+    when_written_.wait(lock, [&] { return written_ >= target; });
+}
+
+// Gathers what is appended for one flush interval from the first record, then writes it all.
+void SurakartaCapture::Run() {
+    std::string batch;
+    batch.reserve(batch_.capacity());
+    std::unique_lock lock(mutex_);
+    while (true) {
+        when_flush_requested_.wait(lock, [&] { return stopping_ || appended_ > written_ || dropped_unreported_ > 0; });
+        if (appended_ == written_ && dropped_unreported_ == 0)
+            return;  // stopping, with nothing left
+        when_flush_requested_.wait_for(lock, options_.flush_interval, [&] {
+            return stopping_ || flush_requested_ || batch_.size() >= options_.buffer_bytes / 2;
+        });
+        if (dropped_unreported_ > 0) {
+            uint64_t dropped = dropped_unreported_;
+            EncodeRecord(batch_, SurakartaCaptureRecordType::DROPPED, 0, &dropped, sizeof(dropped), {}, {}, {});
+            dropped_unreported_ = 0;
+        }
+        const uint64_t through = appended_;
+        batch.swap(batch_);
+        flush_requested_ = false;
+        lock.unlock();
+        Write(batch);
+        batch.clear();
+        lock.lock();
+        written_ = through;
+        when_written_.notify_all();
+    }
+}
+
+void SurakartaCapture::Write(const std::string& batch) {
+    if (std::fwrite(batch.data(), 1, batch.size(), file_) != batch.size() || std::fflush(file_) != 0) {
+        failures_.Add();
+        std::clearerr(file_);
+        return;
+    }
+    bytes_.Add((long long)batch.size());
+}
+
+SurakartaCaptureReader::SurakartaCaptureReader(const std::string& path) {
+    file_ = std::fopen(path.c_str(), "rb");
+    if (file_ == nullptr)
+        throw std::runtime_error("Failed to open " + path + ": " + strerror(errno));
+    if (std::fread(&header_, sizeof(header_), 1, file_) != 1 ||
+        memcmp(header_.magic, SURAKARTA_CAPTURE_MAGIC, sizeof(header_.magic)) != 0) {
+        std::fclose(file_);
+        throw std::runtime_error(path + " is not a capture file.");
+    }
+}
+
+SurakartaCaptureReader::~SurakartaCaptureReader() {
+    std::fclose(file_);
+}
+
+std::optional<SurakartaCaptureRecord> SurakartaCaptureReader::Next() {
+    SurakartaCaptureRecordHeader header;
+    size_t read = std::fread(&header, 1, sizeof(header), file_);
+    if (read == 0)
+        return std::nullopt;
+    if (read < sizeof(header) || header.size < sizeof(header)) {
+        torn_ = true;
+        return std::nullopt;
+    }
+    payload_.resize(header.size - sizeof(header));
+    if (std::fread(payload_.data(), 1, payload_.size(), file_) != payload_.size()) {
+        torn_ = true;
+        return std::nullopt;
+    }
+    SurakartaCaptureRecord record;
+    record.type = (SurakartaCaptureRecordType)header.type;
+    record.connection = header.connection;
+    record.time_ns = header.time_ns;
+    switch (record.type) {
+        case SurakartaCaptureRecordType::OPEN:
+            record.peer = payload_;
+            break;
+        case SurakartaCaptureRecordType::RECEIVED:
+        case SurakartaCaptureRecordType::SENT: {
+            SurakartaCaptureMessage message;
+            if (payload_.size() < sizeof(message)) {
+                torn_ = true;
+                return std::nullopt;
+            }
+            memcpy(&message, payload_.data(), sizeof(message));
+            if ((uint64_t)message.data1_size + message.data2_size + message.data3_size != payload_.size() - sizeof(message)) {
+                torn_ = true;
+                return std::nullopt;
+            }
+            size_t offset = sizeof(message);
+            record.message.opcode = message.opcode;
+            record.message.data1.assign(payload_, offset, message.data1_size);
+            offset += message.data1_size;
+            record.message.data2.assign(payload_, offset, message.data2_size);
+            offset += message.data2_size;
+            record.message.data3.assign(payload_, offset, message.data3_size);
+            break;
+        }
+        case SurakartaCaptureRecordType::DROPPED:
+            if (payload_.size() >= sizeof(record.dropped))
+                memcpy(&record.dropped, payload_.data(), sizeof(record.dropped));
+            break;
+        default:
+            break;
+    }
+    return record;
+}
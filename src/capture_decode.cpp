@@ -0,0 +1,141 @@
+// Prints a capture written by surakarta-reverse-proxy --capture in the format the proxy logs
+// messages in at the debug level, so that what used to be read in the log can be read here.
+//
+// Every message gives the two lines the logging wrappers would have written, the decoded one
+// and the raw one, in the order they would have written them, under the address and port of
+// the client.
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include "private-include/capture.h"
+#include "private-include/socket_log_wrapper.h"
+#include "private-include/socket_raw_log_wrapper.h"
+#include "surakarta_network_logger.h"
+
+struct DecodeOptions {
+    std::string path;
+    bool time = false;
+    bool connections = false;
+    uint32_t connection = 0;  // 0 for all
+};
+
+// The loggers of a connection, as the proxy makes them for it.
+struct DecodeConnection {
+    std::shared_ptr<SurakartaLogger> logger;
+    std::shared_ptr<SurakartaLogger> send_logger;
+    std::shared_ptr<SurakartaLogger> recv_logger;
+    std::shared_ptr<SurakartaLogger> send_raw_logger;
+    std::shared_ptr<SurakartaLogger> recv_raw_logger;
+
+    DecodeConnection(std::shared_ptr<SurakartaLogger> base, const std::string& peer)
+        : logger(base->CreateSublogger(peer)),
+          send_logger(logger->CreateSublogger("send")),
+          recv_logger(logger->CreateSublogger("recv")),
+          send_raw_logger(send_logger->CreateSublogger("raw")),
+          recv_raw_logger(recv_logger->CreateSublogger("raw")) {}
+};
+
+static std::string FormatTime(uint64_t time_ns) {
+    time_t seconds = (time_t)(time_ns / 1000000000);
+    tm local{};
+#ifdef _WIN32
+    localtime_s(&local, &seconds);
+#else
+    localtime_r(&seconds, &local);
+#endif
+    char text[64];
+    size_t length = strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", &local);
+    snprintf(text + length, sizeof(text) - length, ".%06llu", (unsigned long long)(time_ns % 1000000000 / 1000));
+    return text;
+}
+
+int main(int argc, char** argv) {
+    DecodeOptions options;
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--time") == 0 || strcmp(argv[i], "-t") == 0) {
+            options.time = true;
+        } else if (strcmp(argv[i], "--connections") == 0) {
+            options.connections = true;
+        } else if ((strcmp(argv[i], "--connection") == 0 || strcmp(argv[i], "-c") == 0) && has_value) {
+            options.connection = (uint32_t)atoll(argv[++i]);
+        } else if (argv[i][0] != '-' && options.path.empty()) {
+            options.path = argv[i];
+        } else {
+            options.path.clear();
+            break;
+        }
+    }
+    if (options.path.empty()) {
+        printf("Usage: %s <capture file> [args..]\n", argv[0]);
+        printf("Args:\n");
+        printf("  -t|--time              Start every line with the time the message went through the proxy\n");
+        printf("     --connections       Also print when connections were opened and closed\n");
+        printf("  -c|--connection <id>   Only print the connection with this number\n");
+        return 1;
+    }
+
+    std::unique_ptr<SurakartaCaptureReader> reader;
+    try {
+        reader = std::make_unique<SurakartaCaptureReader>(options.path);
+    } catch (const std::exception& e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    auto async_logger = std::make_shared<SurakartaLoggerAsync>(1);
+    std::shared_ptr<SurakartaLogger> logger = async_logger;
+    std::unordered_map<uint32_t, std::string> peers;
+    std::unordered_map<uint32_t, DecodeConnection> connections;  // without --time only
+    long long records = 0;
+    long long messages = 0;
+    while (auto record = reader->Next()) {
+        records++;
+        if (record->type == SurakartaCaptureRecordType::DROPPED) {
+            logger->CreateSublogger("capture")->Log("%llu records dropped", (unsigned long long)record->dropped);
+            continue;
+        }
+        if (options.connection != 0 && record->connection != options.connection)
+            continue;
+        if (record->type == SurakartaCaptureRecordType::OPEN)
+            peers[record->connection] = record->peer;
+        auto peer = peers.find(record->connection);
+        if (peer == peers.end())
+            continue;  // opened before the file was started
+        auto base = options.time ? logger->CreateSublogger(FormatTime(record->time_ns)) : logger;
+        auto made = options.time ? std::make_unique<DecodeConnection>(base, peer->second) : nullptr;
+        auto& connection = made ? *made : connections.try_emplace(record->connection, base, peer->second).first->second;
+        switch (record->type) {
+            case SurakartaCaptureRecordType::OPEN:
+                if (options.connections)
+                    connection.logger->Log("Connection %u opened", record->connection);
+                break;
+            case SurakartaCaptureRecordType::RECEIVED:
+                // the raw wrapper is the inner one, so it saw what was received first
+                SurakartaLogRawMessage(connection.recv_raw_logger, record->message);
+                SurakartaLogMessage(connection.recv_logger, record->message);
+                messages++;
+                break;
+            case SurakartaCaptureRecordType::SENT:
+                SurakartaLogMessage(connection.send_logger, record->message);
+                SurakartaLogRawMessage(connection.send_raw_logger, record->message);
+                messages++;
+                break;
+            case SurakartaCaptureRecordType::CLOSE:
+                if (options.connections)
+                    connection.logger->Log("Connection %u closed", record->connection);
+                connections.erase(record->connection);
+                peers.erase(record->connection);
+                break;
+            default:
+                break;
+        }
+    }
+    async_logger->Flush();
+    fprintf(stderr, "%lld records, %lld messages%s\n", records, messages,
+            reader->Torn() ? ", the last one torn" : "");
+    return 0;
+}
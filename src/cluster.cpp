@@ -0,0 +1,553 @@
+#include "cluster.h"
+#include <stdexcept>
+#include "opcode.h"
+#include "wire_codec.h"
+
+#ifdef __linux__
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#endif
+
+std::vector<SurakartaBackend> SurakartaClusterDirectory::ParseNodes(const std::vector<std::string>& nodes) {
+    std::vector<SurakartaBackend> parsed;
+    for (auto& node : nodes) {
+        auto backend = SurakartaBackend::Parse(node);
+        if (!backend.has_value())
+            throw std::invalid_argument("Invalid cluster node: " + node);
+        parsed.push_back(backend.value());
+    }
+    return parsed;
+}
+
+bool SurakartaClusterDirectory::IsPeer(const std::string& address) const {
+    for (auto& peer : peer_addresses_) {
+        if (peer == address)
+            return true;
+    }
+    return false;
+}
+
+// Compares every byte whatever the first that differs, so that the time taken does not tell how
+// much of a guess is right.
+static bool SameSecret(const std::string& a, const std::string& b) {
+    if (a.size() != b.size())
+        return false;
+    unsigned char differ = 0;
+    for (size_t i = 0; i < a.size(); i++)
+        differ |= (unsigned char)(a[i] ^ b[i]);
+    return differ == 0;
+}
+
+bool SurakartaClusterDirectory::TakeForwarded(NetworkFramework::Message& ready, const std::string& address) const {
+    const std::string option = std::string(SURAKARTA_CLUSTER_FORWARDED_OPTION) + "=";
+    auto& data3 = ready.data3;
+    if (ready.opcode != OPCODE::READY_OP)
+        return false;
+    auto at = data3.rfind(option);
+    if (at == std::string::npos)
+        return false;
+    const std::string secret = data3.substr(at + option.size());
+    data3.resize(at);
+    return !secret_.empty() && SameSecret(secret, secret_) && IsPeer(address);
+}
+
+#ifdef __linux__
+
+// How long a connection to a server may take to be made.
+static constexpr auto CONNECT_TIMEOUT = std::chrono::seconds(3);
+
+struct SurakartaClusterRelay::State {
+    enum Phase {
+        NEW,         // not yet seen by the loop
+        CONNECTING,  // the connection to the server is being made
+        CONNECTED,   // the READY has been passed on
+        DONE,        // both connections are closed, or being closed
+    };
+
+    State(std::shared_ptr<NetworkFramework::Socket> client,
+          size_t node,
+          SurakartaNetworkMessageReady ready,
+          std::chrono::steady_clock::time_point received,
+          SurakartaClusterCounters& counters,
+          std::shared_ptr<SurakartaLogger> logger)
+        : client(std::move(client)),
+          node(node),
+          room_id(ready.RoomId()),
+          username(ready.Username()),
+          ready(std::move(ready)),
+          received(received),
+          counters(counters),
+          logger(std::move(logger)) {}
+
+    const std::shared_ptr<NetworkFramework::Socket> client;
+    const size_t node;
+    const int room_id;
+    const std::string username;
+    SurakartaNetworkMessageReady ready;  // until it is passed on
+    const std::chrono::steady_clock::time_point received;
+    SurakartaClusterCounters& counters;
+    const std::shared_ptr<SurakartaLogger> logger;
+
+    std::mutex mutex;  // for the following
+    Phase phase = NEW;
+    bool closed = false;      // the client has gone
+    bool overflowed = false;  // the server has not read what the client sent; both are closed
+    int fd = -1;
+    int epoll_fd = -1;
+    bool watching_writable = false;
+    std::string outbound;  // what the server has not been sent yet
+
+    // Only used by the loop.
+    SurakartaWireDecoder decoder;
+    std::chrono::steady_clock::time_point connecting_since;
+
+    // The following require mutex.
+
+    // Write what can be written without blocking, and watch for the rest.
+    void FlushLocked() {
+        size_t written = 0;
+        while (written < outbound.size()) {
+            auto size = ::send(fd, outbound.data() + written, outbound.size() - written, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (size < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    written = outbound.size();  // the loop reads the error next
+                break;
+            }
+            written += size;
+        }
+        outbound.erase(0, written);
+        WatchLocked(!outbound.empty());
+    }
+
+    void WatchLocked(bool writable) {
+        if (writable == watching_writable)
+            return;
+        watching_writable = writable;
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLRDHUP;
+        if (writable)
+            event.events |= EPOLLOUT;
+        event.data.fd = fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
+    }
+};
+
+// The thread that drives the connections of all relays of a directory to the other servers.
+class SurakartaClusterRelayLoop {
+   public:
+    using State = SurakartaClusterRelay::State;
+
+    SurakartaClusterRelayLoop(std::vector<std::vector<char>> addresses,
+                              SurakartaUpstreamPool* pool,
+                              std::vector<size_t> pooled,
+                              std::string forwarded_option)
+        : addresses_(std::move(addresses)), pool_(pool), pooled_(std::move(pooled)), forwarded_option_(std::move(forwarded_option)) {
+        epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epoll_fd_ < 0 || wake_fd_ < 0)
+            throw std::runtime_error(std::string("Failed to create event loop: ") + strerror(errno));
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = wake_fd_;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &event);
+        thread_ = std::thread([this] { Run(); });
+    }
+
+    ~SurakartaClusterRelayLoop() {
+        Stop();
+        auto relays = std::move(relays_);
+        for (auto& [fd, state] : relays)
+            Finish(state, false);
+        for (auto& state : posted_)
+            Finish(state, false);
+        ::close(wake_fd_);
+        ::close(epoll_fd_);
+    }
+
+    void Stop() {
+        {
+            std::lock_guard lock(post_mutex_);
+            stopping_ = true;
+        }
+        Wake();
+        if (thread_.joinable())
+            thread_.join();
+    }
+
+    /// @brief Have the loop look at a relay: start it if new, or finish it if closed.
+    /// May be called from any thread.
+    void Post(std::shared_ptr<State> state) {
+        {
+            std::lock_guard lock(post_mutex_);
+            posted_.push_back(std::move(state));
+        }
+        Wake();
+    }
+
+   private:
+    void Wake() {
+        uint64_t one = 1;
+        [[maybe_unused]] auto _ = ::write(wake_fd_, &one, sizeof(one));
+    }
+
+    void Run() {
+        epoll_event events[256];
+        while (true) {
+            std::vector<std::shared_ptr<State>> posted;
+            {
+                std::lock_guard lock(post_mutex_);
+                if (stopping_)
+                    break;
+                posted.swap(posted_);
+            }
+            for (auto& state : posted)
+                OnPosted(state);
+            SweepConnecting();
+            // wake up in time to give up on a connection that takes too long
+            int count = epoll_wait(epoll_fd_, events, 256, connecting_.empty() ? -1 : 100);
+            for (int i = 0; i < count; i++) {
+                int fd = events[i].data.fd;
+                if (fd == wake_fd_) {
+                    uint64_t value;
+                    [[maybe_unused]] auto _ = ::read(wake_fd_, &value, sizeof(value));
+                } else {
+                    OnEvent(fd, events[i].events);
+                }
+            }
+        }
+    }
+
+    void OnPosted(const std::shared_ptr<State>& state) {
+        State::Phase phase;
+        bool closed;
+        {
+            std::lock_guard lock(state->mutex);
+            phase = state->phase;
+            closed = state->closed || state->overflowed;
+        }
+        if (phase == State::DONE)
+            return;
+        if (closed)
+            Finish(state, false);
+        else if (phase == State::NEW)
+            Connect(state);
+    }
+
+    void Connect(const std::shared_ptr<State>& state) {
+        int fd = pool_ ? pool_->Take(pooled_.at(state->node)) : -1;
+        bool connected = fd >= 0;
+        if (fd < 0) {
+            auto address = (const sockaddr*)addresses_[state->node].data();
+            fd = socket(address->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd < 0) {
+                state->logger->Log("Failed to reach the server of room %d: %s", state->room_id, strerror(errno));
+                Finish(state, true);
+                return;
+            }
+            int flag = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+            if (connect(fd, address, addresses_[state->node].size()) == 0) {
+                connected = true;
+            } else if (errno != EINPROGRESS) {
+                state->logger->Log("Failed to reach the server of room %d: %s", state->room_id, strerror(errno));
+                ::close(fd);
+                Finish(state, true);
+                return;
+            }
+        }
+        {
+            std::lock_guard lock(state->mutex);
+            state->fd = fd;
+            state->epoll_fd = epoll_fd_;
+            state->phase = State::CONNECTING;
+            state->watching_writable = true;
+        }
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLRDHUP | EPOLLOUT;
+        event.data.fd = fd;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event);
+        relays_[fd] = state;
+        if (connected) {
+            OnConnected(state);
+        } else {
+            state->connecting_since = std::chrono::steady_clock::now();
+            connecting_.push_back(state);
+        }
+    }
+
+    void OnConnected(const std::shared_ptr<State>& state) {
+        std::lock_guard lock(state->mutex);
+        // The compact encoding belongs to the client's connection, not to this one.
+        SurakartaWireSetCompactOption(state->ready, false);
+        state->ready.data3 += forwarded_option_;
+        std::string bytes;
+        SurakartaWireEncode(state->ready, bytes);
+        state->outbound.insert(0, bytes);
+        state->phase = State::CONNECTED;
+        state->FlushLocked();
+        state->counters.forward_latency.RecordSince(state->received);
+    }
+
+    // Give up on the connections that have been made for too long, the oldest first.
+    void SweepConnecting() {
+        auto now = std::chrono::steady_clock::now();
+        while (!connecting_.empty()) {
+            auto state = connecting_.front();
+            State::Phase phase;
+            {
+                std::lock_guard lock(state->mutex);
+                phase = state->phase;
+            }
+            if (phase == State::CONNECTING) {
+                if (now - state->connecting_since < CONNECT_TIMEOUT)
+                    break;
+                state->logger->Log("Failed to reach the server of room %d: timed out.", state->room_id);
+                Finish(state, true);
+            }
+            connecting_.pop_front();
+        }
+    }
+
+    void OnEvent(int fd, uint32_t events) {
+        auto it = relays_.find(fd);
+        if (it == relays_.end())
+            return;
+        auto state = it->second;
+        State::Phase phase;
+        {
+            std::lock_guard lock(state->mutex);
+            phase = state->phase;
+            if (phase == State::CONNECTED && (events & EPOLLOUT))
+                state->FlushLocked();
+        }
+        if (phase == State::CONNECTING) {
+            int error = 0;
+            socklen_t length = sizeof(error);
+            if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+                state->logger->Log("Failed to reach the server of room %d: %s", state->room_id, strerror(error));
+                Finish(state, true);
+                return;
+            }
+            OnConnected(state);
+        }
+        if (!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+            return;
+        bool open = true;
+        char buffer[4096];
+        while (true) {
+            auto size = ::recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+            if (size < 0 && errno == EINTR)
+                continue;
+            if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if (size <= 0) {
+                open = false;
+                break;
+            }
+            state->decoder.Feed(buffer, size);
+        }
+        // Passed on without holding the lock, as sending to the client may take the lock of
+        // its connection, under which the thread of the client may be forwarding.
+        try {
+            while (auto message = state->decoder.Next())
+                state->client->Send(std::move(message.value()));
+        } catch (...) {
+            // either connection has failed; both are closed
+            open = false;
+        }
+        if (!open)
+            Finish(state, false);
+    }
+
+    // Close both connections, telling the client first if the server could not be reached.
+    void Finish(const std::shared_ptr<State>& state, bool unavailable) {
+        int fd;
+        bool closed;
+        {
+            std::lock_guard lock(state->mutex);
+            if (state->phase == State::DONE)
+                return;
+            state->phase = State::DONE;
+            fd = state->fd;
+            closed = state->closed;
+            state->fd = -1;
+            state->outbound.clear();
+        }
+        if (fd >= 0) {
+            epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+            ::close(fd);
+            relays_.erase(fd);
+        }
+        state->counters.relaying.Add(-1);
+        if (closed)
+            return;
+        try {
+            if (unavailable)
+                state->client->Send(SurakartaNetworkMessageReject(
+                    state->username, "Room " + std::to_string(state->room_id) + " is unavailable."));
+            state->client->Close();
+        } catch (...) {
+            // the client has gone anyway
+        }
+    }
+
+    const std::vector<std::vector<char>> addresses_;
+    SurakartaUpstreamPool* const pool_;
+    const std::vector<size_t> pooled_;
+    const std::string forwarded_option_;  // with the secret, if any
+    int epoll_fd_ = -1;
+    int wake_fd_ = -1;
+    std::unordered_map<int, std::shared_ptr<State>> relays_;  // by the connection to the server
+    std::deque<std::shared_ptr<State>> connecting_;          // in the order they started
+    std::mutex post_mutex_;
+    bool stopping_ = false;
+    std::vector<std::shared_ptr<State>> posted_;
+    std::thread thread_;  // last, so that it starts once the rest is ready
+};
+
+SurakartaClusterDirectory::SurakartaClusterDirectory(const std::vector<std::string>& nodes,
+                                                     const std::string& self,
+                                                     SurakartaUpstreamPoolOptions pool_options,
+                                                     std::string secret)
+    : ring_(ParseNodes(nodes)), self_(nodes.size()), secret_(std::move(secret)) {
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (Node(i).ToString() == self)
+            self_ = i;
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* resolved = nullptr;
+        int error = getaddrinfo(Node(i).address.c_str(), std::to_string(Node(i).port).c_str(), &hints, &resolved);
+        if (error != 0 || resolved == nullptr)
+            throw std::runtime_error("Failed to resolve " + Node(i).address + ": " + gai_strerror(error));
+        socket_addresses_.emplace_back((char*)resolved->ai_addr, (char*)resolved->ai_addr + resolved->ai_addrlen);
+        char text[INET6_ADDRSTRLEN] = "";
+        if (resolved->ai_family == AF_INET)
+            inet_ntop(AF_INET, &((sockaddr_in*)resolved->ai_addr)->sin_addr, text, sizeof(text));
+        else if (resolved->ai_family == AF_INET6)
+            inet_ntop(AF_INET6, &((sockaddr_in6*)resolved->ai_addr)->sin6_addr, text, sizeof(text));
+        peer_addresses_.push_back(text);
+        freeaddrinfo(resolved);
+    }
+    if (self_ == nodes.size())
+        throw std::invalid_argument("This server, " + self + ", is not among the cluster nodes.");
+    if (pool_options.size > 0) {
+        std::vector<SurakartaBackend> others;
+        for (size_t i = 0; i < nodes.size(); i++) {
+            pooled_.push_back(others.size());
+            if (i != self_)
+                others.push_back(Node(i));
+        }
+        if (!others.empty())
+            pool_ = std::make_unique<SurakartaUpstreamPool>(others, pool_options);
+    }
+    relays_ = std::make_shared<SurakartaClusterRelayLoop>(socket_addresses_, pool_.get(), pooled_,
+                                                          std::string(SURAKARTA_CLUSTER_FORWARDED_OPTION) + "=" + secret_);
+}
+
+SurakartaClusterDirectory::~SurakartaClusterDirectory() {
+    // before the pool goes, even if a relay still holds on to the loop
+    relays_->Stop();
+}
+
+std::unique_ptr<SurakartaClusterRelay> SurakartaClusterDirectory::Relay(size_t node,
+                                                                        std::shared_ptr<NetworkFramework::Socket> client,
+                                                                        SurakartaNetworkMessageReady ready,
+                                                                        std::chrono::steady_clock::time_point received,
+                                                                        SurakartaClusterCounters& counters,
+                                                                        std::shared_ptr<SurakartaLogger> logger) {
+    auto state = std::make_shared<SurakartaClusterRelay::State>(std::move(client), node, std::move(ready), received, counters, std::move(logger));
+    counters.relaying.Add();
+    relays_->Post(state);
+    return std::make_unique<SurakartaClusterRelay>(std::move(state), relays_);
+}
+
+void SurakartaClusterRelay::Forward(NetworkFramework::Message message) {
+    {
+        std::lock_guard lock(state_->mutex);
+        if (state_->closed || state_->overflowed || state_->phase == State::DONE)
+            return;
+        const bool idle = state_->outbound.empty();
+        SurakartaWireEncode(message, state_->outbound);
+        // Until connected, the loop sends it after the READY; while bytes are queued, the loop
+        // sends it after them.
+        if (state_->phase == State::CONNECTED && idle)
+            state_->FlushLocked();
+        if (state_->outbound.size() <= MAX_OUTBOUND_BYTES)
+            return;
+        state_->overflowed = true;
+        state_->outbound.clear();
+    }
+    state_->logger->Log("Relay of room %d closed: the server is not reading.", state_->room_id);
+    if (auto loop = loop_.lock())
+        loop->Post(state_);
+}
+
+void SurakartaClusterRelay::Close() {
+    {
+        std::lock_guard lock(state_->mutex);
+        if (state_->closed || state_->phase == State::DONE)
+            return;
+        state_->closed = true;
+    }
+    if (auto loop = loop_.lock())
+        loop->Post(state_);
+}
+
+bool SurakartaClusterRelay::IsSupported() {
+    return true;
+}
+
+#else
+
+struct SurakartaClusterRelay::State {};
+class SurakartaClusterRelayLoop {};
+
+SurakartaClusterDirectory::SurakartaClusterDirectory(const std::vector<std::string>& nodes,
+                                                     const std::string& self,
+                                                     SurakartaUpstreamPoolOptions,
+                                                     std::string secret)
+    : ring_(ParseNodes(nodes)), self_(nodes.size()), secret_(std::move(secret)) {
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (Node(i).ToString() == self)
+            self_ = i;
+        peer_addresses_.push_back(Node(i).address);
+    }
+    if (self_ == nodes.size())
+        throw std::invalid_argument("This server, " + self + ", is not among the cluster nodes.");
+}
+
+SurakartaClusterDirectory::~SurakartaClusterDirectory() {}
+
+std::unique_ptr<SurakartaClusterRelay> SurakartaClusterDirectory::Relay(size_t,
+                                                                        std::shared_ptr<NetworkFramework::Socket>,
+                                                                        SurakartaNetworkMessageReady,
+                                                                        std::chrono::steady_clock::time_point,
+                                                                        SurakartaClusterCounters&,
+                                                                        std::shared_ptr<SurakartaLogger>) {
+    throw std::logic_error("Relaying to other servers is only supported on Linux.");
+}
+
+void SurakartaClusterRelay::Forward(NetworkFramework::Message) {}
+
+void SurakartaClusterRelay::Close() {}
+
+bool SurakartaClusterRelay::IsSupported() {
+    return false;
+}
+
+#endif
@@ -0,0 +1,561 @@
+#include "forwarding_proxy.h"
+
+#ifdef __linux__
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "metrics.h"
+#include "wire_codec.h"
+
+// What splice() moves at most at once; the capacity of a pipe by default.
+static constexpr size_t PIPE_BYTES = 65536;
+
+// A connection whose first message is not within this many bytes goes to the default backend.
+static constexpr size_t ROUTE_PEEK_BYTES = 4096;
+
+// One direction of a connection. Bytes are moved through the pipe of the loop and leave it
+// before the loop turns to anything else; those the destination cannot take yet are read out
+// into the backlog, and nothing more is read from the source until it has been written. So a
+// slow reader holds up its writer by no more than one pipe, and a connection only ever needs
+// its two sockets.
+struct SurakartaForwardingDirection {
+    std::string backlog;
+    size_t written = 0;  // of the backlog
+    bool eof = false;    // read from the source
+    bool done = false;   // and passed on to the destination
+};
+
+struct SurakartaForwardingLink {
+    int client_fd = -1;
+    int server_fd = -1;      // once the first message has picked the server
+    bool connected = false;  // to the server
+    SurakartaForwardingDirection up;    // from the client to the server
+    SurakartaForwardingDirection down;  // from the server to the client
+};
+
+struct SurakartaForwardingServer {
+    sockaddr_storage address{};
+    socklen_t address_length = 0;
+    SurakartaCounter routed;
+};
+
+struct SurakartaForwardingShared {
+    SurakartaForwardingShared(std::vector<SurakartaBackend> backends, SurakartaUpstreamPoolOptions pool_options)
+        : ring(std::move(backends)),
+          servers(ring.Backends().size()),
+          pool(pool_options.size > 0 ? std::make_unique<SurakartaUpstreamPool>(ring.Backends(), pool_options) : nullptr) {}
+
+    SurakartaBackendRing ring;
+    std::vector<SurakartaForwardingServer> servers;  // as in the ring
+    std::unique_ptr<SurakartaUpstreamPool> pool;
+    std::atomic<long long> connections = 0;
+    SurakartaCounter bytes_forwarded;
+};
+
+class SurakartaForwardingLoop {
+   public:
+    explicit SurakartaForwardingLoop(SurakartaForwardingShared& shared) : shared_(shared) {
+        epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epoll_fd_ < 0 || wake_fd_ < 0 || pipe2(pipe_, O_NONBLOCK | O_CLOEXEC) < 0)
+            throw std::runtime_error(std::string("Failed to create event loop: ") + strerror(errno));
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = wake_fd_;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &event);
+    }
+
+    ~SurakartaForwardingLoop() {
+        Stop();
+        for (auto& [fd, link] : links_) {
+            // a link may be in the map twice; close it once
+            if (fd == link->client_fd)
+                Release(*link);
+        }
+        links_.clear();
+        for (int fd : adopted_)
+            ::close(fd);
+        ::close(pipe_[0]);
+        ::close(pipe_[1]);
+        ::close(wake_fd_);
+        ::close(epoll_fd_);
+    }
+
+    void Start(int listen_fd, std::vector<SurakartaForwardingLoop*> loops) {
+        listen_fd_ = listen_fd;
+        loops_ = std::move(loops);
+        if (listen_fd_ >= 0)
+            WatchListener();
+        thread_ = std::thread([this] { Run(); });
+    }
+
+    void Stop() {
+        running_ = false;
+        uint64_t one = 1;
+        [[maybe_unused]] auto _ = ::write(wake_fd_, &one, sizeof(one));
+        if (thread_.joinable())
+            thread_.join();
+    }
+
+    // May be called from any thread; the link is made on the loop thread.
+    void Adopt(int fd) {
+        {
+            std::lock_guard lock(adopt_mutex_);
+            adopted_.push_back(fd);
+        }
+        uint64_t one = 1;
+        [[maybe_unused]] auto _ = ::write(wake_fd_, &one, sizeof(one));
+    }
+
+   private:
+    static constexpr int LISTENER_PAUSE_MS = 100;
+
+    void WatchListener() {
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = listen_fd_;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &event);
+    }
+
+    void Run() {
+        // splice() cannot be told not to raise SIGPIPE when the peer has gone, as send() can.
+        // It is blocked on this thread only, so that the process keeps its own disposition, and
+        // the one left pending by a broken splice is taken back at once.
+        sigset_t sigpipe;
+        sigemptyset(&sigpipe);
+        sigaddset(&sigpipe, SIGPIPE);
+        pthread_sigmask(SIG_BLOCK, &sigpipe, nullptr);
+        epoll_event events[256];
+        while (running_) {
+            int count = epoll_wait(epoll_fd_, events, 256, listener_paused_ ? LISTENER_PAUSE_MS : -1);
+            if (listener_paused_ && std::chrono::steady_clock::now() >= listener_paused_until_) {
+                listener_paused_ = false;
+                WatchListener();
+            }
+            for (int i = 0; i < count; i++) {
+                int fd = events[i].data.fd;
+                if (fd == wake_fd_) {
+                    uint64_t value;
+                    [[maybe_unused]] auto _ = ::read(wake_fd_, &value, sizeof(value));
+                    AdoptPending();
+                } else if (fd == listen_fd_) {
+                    Accept();
+                } else {
+                    OnEvent(fd, events[i].events);
+                }
+            }
+        }
+    }
+
+    void Accept() {
+        while (true) {
+            int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EMFILE || errno == ENFILE)
+                    PauseListener();
+                return;
+            }
+            int flag = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+            loops_[next_loop_++ % loops_.size()]->Adopt(fd);
+        }
+    }
+
+    // As the reactor does when out of descriptors: stop watching the listener, which would stay
+    // readable, and leave the clients in the backlog for LISTENER_PAUSE_MS.
+    void PauseListener() {
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, listen_fd_, nullptr);
+        listener_paused_ = true;
+        listener_paused_until_ = std::chrono::steady_clock::now() + std::chrono::milliseconds(LISTENER_PAUSE_MS);
+    }
+
+    void AdoptPending() {
+        std::vector<int> adopted;
+        {
+            std::lock_guard lock(adopt_mutex_);
+            adopted.swap(adopted_);
+        }
+        for (int fd : adopted)
+            Open(fd);
+    }
+
+    void Open(int client_fd) {
+        auto link = std::make_shared<SurakartaForwardingLink>();
+        link->client_fd = client_fd;
+        shared_.connections++;
+        links_[client_fd] = link;
+        Watch(client_fd);
+        // with one server, there is nothing to wait for
+        if (shared_.servers.size() == 1 && !Connect(*link, 0))
+            Close(link);
+    }
+
+    // Edge-triggered: each direction is pumped until its source or its destination would
+    // block, and the edge that unblocks it brings the loop back.
+    void Watch(int fd) {
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.fd = fd;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event);
+    }
+
+    // Peek at the first message of the client to pick its server; the bytes stay in the socket,
+    // to be forwarded like the rest.
+    // @return false if the client has gone or the server cannot be reached.
+    bool Route(SurakartaForwardingLink& link) {
+        char buffer[ROUTE_PEEK_BYTES];
+        ssize_t size;
+        do {
+            size = ::recv(link.client_fd, buffer, sizeof(buffer), MSG_PEEK);
+        } while (size < 0 && errno == EINTR);
+        if (size == 0)
+            return false;
+        if (size < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        std::optional<int> room_id;
+        bool complete = false;
+        SurakartaWireDecoder decoder;
+        decoder.Feed(buffer, size);
+        try {
+            if (auto first = decoder.Next()) {
+                complete = true;
+                room_id = SurakartaBackendRing::RoomOf(first.value());
+            }
+        } catch (...) {
+            // the server will find out
+            complete = true;
+        }
+        if (!complete && size < (ssize_t)sizeof(buffer))
+            return true;  // the next bytes bring the loop back
+        return Connect(link, room_id.has_value() ? shared_.ring.Pick(room_id.value()) : shared_.ring.PickDefault());
+    }
+
+    // Take a connection to the server for the client from the pool, or make one without waiting
+    // for it to be made.
+    bool Connect(SurakartaForwardingLink& link, size_t index) {
+        auto& server = shared_.servers[index];
+        link.server_fd = shared_.pool ? shared_.pool->Take(index) : -1;
+        if (link.server_fd >= 0) {
+            link.connected = true;
+        } else {
+            link.server_fd = socket(server.address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (link.server_fd < 0)
+                return false;
+            int flag = 1;
+            setsockopt(link.server_fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+            if (connect(link.server_fd, (sockaddr*)&server.address, server.address_length) == 0)
+                link.connected = true;
+            else if (errno != EINPROGRESS)
+                return false;
+        }
+        server.routed.Add();
+        links_[link.server_fd] = links_[link.client_fd];
+        Watch(link.server_fd);
+        return true;
+    }
+
+    void OnEvent(int fd, uint32_t events) {
+        auto it = links_.find(fd);
+        if (it == links_.end())
+            return;
+        auto link = it->second;
+        if (link->server_fd < 0) {
+            if (!Route(*link)) {
+                Close(link);
+                return;
+            }
+            if (link->server_fd < 0)
+                return;
+        }
+        if (!link->connected) {
+            // Bytes from the client wait in its socket meanwhile, and are pumped once connected.
+            if (fd != link->server_fd)
+                return;
+            sockaddr_storage peer;
+            socklen_t length = sizeof(peer);
+            if (getpeername(link->server_fd, (sockaddr*)&peer, &length) == 0) {
+                link->connected = true;
+            } else {
+                if (events & (EPOLLERR | EPOLLHUP))
+                    Close(link);
+                return;
+            }
+        }
+        bool ok = Pump(link->up, link->client_fd, link->server_fd) && Pump(link->down, link->server_fd, link->client_fd);
+        if (!ok || (link->up.done && link->down.done))
+            Close(link);
+    }
+
+    // @return false if either socket is broken.
+    bool Pump(SurakartaForwardingDirection& direction, int from, int to) {
+        while (!direction.done) {
+            if (direction.written < direction.backlog.size()) {
+                auto size = ::send(to, direction.backlog.data() + direction.written,
+                                   direction.backlog.size() - direction.written, MSG_NOSIGNAL | MSG_DONTWAIT);
+                if (size < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    return errno == EAGAIN || errno == EWOULDBLOCK;
+                }
+                direction.written += size;
+                shared_.bytes_forwarded.Add(size);
+                if (direction.written == direction.backlog.size()) {
+                    direction.backlog.clear();
+                    direction.written = 0;
+                }
+                continue;
+            }
+            if (direction.eof) {
+                // pass the half-close on, so that the other side sees the end after the last byte
+                ::shutdown(to, SHUT_WR);
+                direction.done = true;
+                break;
+            }
+            auto size = splice(from, nullptr, pipe_[1], nullptr, PIPE_BYTES, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (size < 0) {
+                if (errno == EINTR)
+                    continue;
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            if (size == 0) {
+                direction.eof = true;
+                continue;
+            }
+            size_t moved = 0;
+            bool broken = false;
+            while (moved < (size_t)size) {
+                auto part = splice(pipe_[0], nullptr, to, nullptr, size - moved, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (part < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    broken = errno != EAGAIN && errno != EWOULDBLOCK;
+                    if (errno == EPIPE)
+                        ClearSigpipe();
+                    break;
+                }
+                moved += part;
+            }
+            shared_.bytes_forwarded.Add(moved);
+            if (moved < (size_t)size) {
+                // empty the pipe for the next connection
+                direction.backlog.resize(size - moved);
+                if (!ReadPipe(direction.backlog.data(), direction.backlog.size()) || broken)
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    static void ClearSigpipe() {
+        sigset_t sigpipe;
+        sigemptyset(&sigpipe);
+        sigaddset(&sigpipe, SIGPIPE);
+        timespec now{};
+        while (sigtimedwait(&sigpipe, nullptr, &now) < 0 && errno == EINTR) {
+        }
+    }
+
+    // The bytes are in the pipe already, so this never waits.
+    bool ReadPipe(char* data, size_t size) {
+        while (size > 0) {
+            auto part = ::read(pipe_[0], data, size);
+            if (part < 0 && errno == EINTR)
+                continue;
+            if (part <= 0)
+                return false;
+            data += part;
+            size -= part;
+        }
+        return true;
+    }
+
+    void Close(const std::shared_ptr<SurakartaForwardingLink>& link) {
+        links_.erase(link->client_fd);
+        if (link->server_fd >= 0)
+            links_.erase(link->server_fd);
+        shared_.connections--;
+        Release(*link);
+    }
+
+    // Closing the sockets also takes them out of the epoll set.
+    static void Release(SurakartaForwardingLink& link) {
+        if (link.client_fd >= 0)
+            ::close(link.client_fd);
+        if (link.server_fd >= 0)
+            ::close(link.server_fd);
+    }
+
+    SurakartaForwardingShared& shared_;
+    int epoll_fd_ = -1;
+    int wake_fd_ = -1;
+    int pipe_[2] = {-1, -1};  // empty whenever the loop waits
+    int listen_fd_ = -1;
+    bool listener_paused_ = false;  // out of descriptors; only touched by the loop
+    std::chrono::steady_clock::time_point listener_paused_until_;
+    std::vector<SurakartaForwardingLoop*> loops_;
+    size_t next_loop_ = 0;
+    std::atomic<bool> running_ = true;
+    std::thread thread_;
+    std::unordered_map<int, std::shared_ptr<SurakartaForwardingLink>> links_;  // by each of their sockets
+    std::mutex adopt_mutex_;
+    std::vector<int> adopted_;
+};
+
+class SurakartaForwardingProxyImpl {
+   public:
+    SurakartaForwardingProxyImpl(std::vector<SurakartaBackend> servers, int port, int loops, SurakartaUpstreamPoolOptions pool_options)
+        : shared_(std::move(servers), pool_options) {
+        if (loops <= 0)
+            loops = std::max(1u, std::thread::hardware_concurrency());
+        for (size_t i = 0; i < shared_.servers.size(); i++) {
+            auto& backend = shared_.ring.Backends()[i];
+            addrinfo hints{};
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            addrinfo* resolved = nullptr;
+            int error = getaddrinfo(backend.address.c_str(), std::to_string(backend.port).c_str(), &hints, &resolved);
+            if (error != 0 || resolved == nullptr)
+                throw std::runtime_error("Failed to resolve " + backend.address + ": " + gai_strerror(error));
+            memcpy(&shared_.servers[i].address, resolved->ai_addr, resolved->ai_addrlen);
+            shared_.servers[i].address_length = resolved->ai_addrlen;
+            freeaddrinfo(resolved);
+        }
+        listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listen_fd_ < 0)
+            throw std::runtime_error(std::string("Failed to create socket: ") + strerror(errno));
+        int flag = 1;
+        setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        address.sin_port = htons(port);
+        if (bind(listen_fd_, (sockaddr*)&address, sizeof(address)) < 0 || listen(listen_fd_, SOMAXCONN) < 0) {
+            auto error = std::string("Failed to listen on port ") + std::to_string(port) + ": " + strerror(errno);
+            ::close(listen_fd_);
+            throw std::runtime_error(error);
+        }
+        std::vector<SurakartaForwardingLoop*> raw_loops;
+        for (int i = 0; i < loops; i++) {
+            loops_.push_back(std::make_unique<SurakartaForwardingLoop>(shared_));
+            raw_loops.push_back(loops_.back().get());
+        }
+        // the first loop also accepts, and hands connections out round-robin
+        for (int i = 0; i < loops; i++)
+            loops_[i]->Start(i == 0 ? listen_fd_ : -1, raw_loops);
+    }
+
+    ~SurakartaForwardingProxyImpl() {
+        Shutdown();
+    }
+
+    void Shutdown() {
+        if (listen_fd_ < 0)
+            return;
+        for (auto& loop : loops_)
+            loop->Stop();
+        loops_.clear();
+        ::close(listen_fd_);
+        listen_fd_ = -1;
+    }
+
+    long long Connections() const { return shared_.connections.load(std::memory_order_relaxed); }
+    long long BytesForwarded() const { return shared_.bytes_forwarded.Value(); }
+    long long Routed(size_t server) const { return shared_.servers.at(server).routed.Value(); }
+    const SurakartaUpstreamPool* UpstreamPool() const { return shared_.pool.get(); }
+
+   private:
+    SurakartaForwardingShared shared_;
+    int listen_fd_ = -1;
+    std::vector<std::unique_ptr<SurakartaForwardingLoop>> loops_;
+};
+
+SurakartaForwardingProxy::SurakartaForwardingProxy(std::vector<SurakartaBackend> servers, int port, int loops, SurakartaUpstreamPoolOptions pool_options)
+    : impl_(std::make_shared<SurakartaForwardingProxyImpl>(std::move(servers), port, loops, pool_options)) {}
+
+long long SurakartaForwardingProxy::Connections() const {
+    return impl_->Connections();
+}
+
+long long SurakartaForwardingProxy::BytesForwarded() const {
+    return impl_->BytesForwarded();
+}
+
+long long SurakartaForwardingProxy::Routed(size_t server) const {
+    return impl_->Routed(server);
+}
+
+const SurakartaUpstreamPool* SurakartaForwardingProxy::UpstreamPool() const {
+    return impl_->UpstreamPool();
+}
+
+bool SurakartaForwardingProxy::IsSupported() {
+    return true;
+}
+
+#else
+
+#include <stdexcept>
+
+class SurakartaForwardingProxyImpl {
+   public:
+    void Shutdown() {}
+};
+
+SurakartaForwardingProxy::SurakartaForwardingProxy(std::vector<SurakartaBackend>, int, int, SurakartaUpstreamPoolOptions) {
+    throw std::runtime_error("The forwarding proxy is only supported on Linux.");
+}
+
+long long SurakartaForwardingProxy::Connections() const {
+    return 0;
+}
+
+long long SurakartaForwardingProxy::BytesForwarded() const {
+    return 0;
+}
+
+long long SurakartaForwardingProxy::Routed(size_t) const {
+    return 0;
+}
+
+const SurakartaUpstreamPool* SurakartaForwardingProxy::UpstreamPool() const {
+    return nullptr;
+}
+
+bool SurakartaForwardingProxy::IsSupported() {
+    return false;
+}
+
+#endif
+
+SurakartaForwardingProxy::SurakartaForwardingProxy(const std::string& server_address, int server_port, int port, int loops)
+    : SurakartaForwardingProxy(std::vector<SurakartaBackend>{{server_address, server_port}}, port, loops) {}
+
+SurakartaForwardingProxy::~SurakartaForwardingProxy() {
+    Shutdown();
+}
+
+void SurakartaForwardingProxy::Shutdown() {
+    if (impl_)
+        impl_->Shutdown();
+}
@@ -0,0 +1,334 @@
+#include "journal.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+uint32_t SurakartaJournalChecksum(const void* data, size_t size) {
+    static const auto table = [] {
+        std::vector<uint32_t> table(256);
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++)
+                crc = (crc & 1) ? (crc >> 1) ^ 0xedb88320u : crc >> 1;
+            table[i] = crc;
+        }
+        return table;
+    }();
+    uint32_t crc = 0xffffffffu;
+    auto bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++)
+        crc = table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+    return crc ^ 0xffffffffu;
+}
+
+#ifdef __linux__
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+
+static uint64_t NowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static std::string SegmentPath(const std::string& directory, uint64_t segment) {
+    char name[64];
+    snprintf(name, sizeof(name), "/journal-%08llu.skj", (unsigned long long)segment);
+    return directory + name;
+}
+
+std::vector<std::pair<uint64_t, std::string>> SurakartaJournalSegments(const std::string& path) {
+    DIR* directory = opendir(path.c_str());
+    if (directory == nullptr)
+        throw std::runtime_error("Failed to open the journal directory " + path + ": " + strerror(errno));
+    std::vector<std::pair<uint64_t, std::string>> segments;
+    while (auto entry = readdir(directory)) {
+        unsigned long long segment;
+        char suffix[8];
+        if (sscanf(entry->d_name, "journal-%llu.%7s", &segment, suffix) == 2 && strcmp(suffix, "skj") == 0)
+            segments.emplace_back(segment, SegmentPath(path, segment));
+    }
+    closedir(directory);
+    std::sort(segments.begin(), segments.end());
+    return segments;
+}
+
+SurakartaJournalSegment::SurakartaJournalSegment(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw std::runtime_error("Failed to open " + path + ": " + strerror(errno));
+    struct stat status;
+    if (fstat(fd, &status) < 0 || status.st_size < (off_t)sizeof(SurakartaJournalSegmentHeader)) {
+        ::close(fd);
+        throw std::runtime_error(path + " is not a journal segment.");
+    }
+    void* data = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+        throw std::runtime_error("Failed to map " + path + ": " + strerror(errno));
+    madvise(data, status.st_size, MADV_SEQUENTIAL);
+    data_ = static_cast<const char*>(data);
+    size_ = status.st_size;
+    if (memcmp(Header().magic, SURAKARTA_JOURNAL_MAGIC, sizeof(SURAKARTA_JOURNAL_MAGIC)) != 0) {
+        munmap(data, size_);
+        throw std::runtime_error(path + " is not a journal segment.");
+    }
+}
+
+SurakartaJournalSegment::~SurakartaJournalSegment() {
+    munmap(const_cast<char*>(data_), size_);
+}
+
+SurakartaJournal::SurakartaJournal(Options options, std::shared_ptr<SurakartaLogger> logger)
+    : options_(std::move(options)), logger_(std::move(logger)) {
+    if (mkdir(options_.directory.c_str(), 0755) < 0 && errno != EEXIST)
+        throw std::runtime_error("Failed to create the journal directory " + options_.directory + ": " + strerror(errno));
+    auto segments = SurakartaJournalSegments(options_.directory);
+    segment_ = segments.empty() ? 1 : segments.back().first + 1;
+    BeginSegmentLocked();
+    // Fail here rather than on the first commit.
+    OpenSegment(segment_);
+    writer_ = std::thread([this] { Run(); });
+}
+
+SurakartaJournal::~SurakartaJournal() {
+    {
+        std::lock_guard lock(mutex_);
+        stopping_ = true;
+        when_appended_.notify_all();
+    }
+    writer_.join();
+    CloseSegment();
+}
+
+uint64_t SurakartaJournal::Start(int room,
+                                 const std::string& first_player_username,
+                                 PieceColor first_player_color,
+                                 const std::string& second_player_username,
+                                 PieceColor second_player_color) {
+    SurakartaJournalStart start{};
+    start.first_player_color = (uint8_t)first_player_color;
+    start.second_player_color = (uint8_t)second_player_color;
+    start.first_player_username_size = (uint16_t)std::min<size_t>(first_player_username.size(), UINT16_MAX);
+    start.second_player_username_size = (uint16_t)std::min<size_t>(second_player_username.size(), UINT16_MAX);
+    thread_local std::string payload;
+    payload.assign((const char*)&start, sizeof(start));
+    payload.append(first_player_username, 0, start.first_player_username_size);
+    payload.append(second_player_username, 0, start.second_player_username_size);
+    return Append(SurakartaJournalRecordType::START, 0, room, payload.data(), payload.size());
+}
+
+void SurakartaJournal::Move(uint64_t game, int room, const SurakartaMove& move, SurakartaIllegalMoveReason move_reason) {
+    SurakartaJournalMove record{};
+    record.from_x = (uint8_t)move.from.x;
+    record.from_y = (uint8_t)move.from.y;
+    record.to_x = (uint8_t)move.to.x;
+    record.to_y = (uint8_t)move.to.y;
+    record.player = (uint8_t)move.player;
+    record.move_reason = (uint8_t)move_reason;
+    Append(SurakartaJournalRecordType::MOVE, game, room, &record, sizeof(record));
+}
+
+void SurakartaJournal::End(uint64_t game,
+                           int room,
+                           SurakartaEndReason end_reason,
+                           PieceColor winner,
+                           std::optional<SurakartaIllegalMoveReason> illegal_move_reason) {
+    SurakartaJournalEnd record{};
+    record.end_reason = (uint8_t)end_reason;
+    record.winner = (uint8_t)winner;
+    record.illegal_move_reason = illegal_move_reason.has_value() ? (uint8_t)illegal_move_reason.value()
+                                                                 : SurakartaJournalEnd::NO_MOVE_REASON;
+    Append(SurakartaJournalRecordType::END, game, room, &record, sizeof(record));
+}
+
+uint64_t SurakartaJournal::Append(SurakartaJournalRecordType type,
+                                  uint64_t game,
+                                  int room,
+                                  const void* payload,
+                                  size_t payload_size) {
+    SurakartaJournalRecordHeader header{};
+    header.size = (uint32_t)(sizeof(header) + payload_size);
+    header.time_ns = NowNs();
+    header.game = game;
+    header.room = room;
+    header.type = (uint8_t)type;
+    const size_t padded = (header.size + 7) & ~(size_t)7;
+    std::lock_guard lock(mutex_);
+    if (segment_offset_ + padded > (uint64_t)options_.segment_bytes && segment_offset_ > sizeof(SurakartaJournalSegmentHeader)) {
+        segment_++;
+        BeginSegmentLocked();
+    }
+    const uint64_t position = (segment_ << 40) | segment_offset_;
+    if (type == SurakartaJournalRecordType::START)
+        header.game = position;
+    auto& bytes = batch_.back().bytes;
+    const size_t at = bytes.size();
+    bytes.resize(at + padded);
+    memcpy(&bytes[at], &header, sizeof(header));
+    memcpy(&bytes[at + sizeof(header)], payload, payload_size);
+    auto checksummed = &bytes[at + offsetof(SurakartaJournalRecordHeader, time_ns)];
+    header.checksum = SurakartaJournalChecksum(checksummed, header.size - offsetof(SurakartaJournalRecordHeader, time_ns));
+    memcpy(&bytes[at + offsetof(SurakartaJournalRecordHeader, checksum)], &header.checksum, sizeof(header.checksum));
+    segment_offset_ += padded;
+    batch_bytes_ += padded;
+    appended_++;
+    records_.Add();
+    if (appended_ == durable_ + 1 || batch_bytes_ >= MAX_BATCH_BYTES)
+        when_appended_.notify_one();
+    return position;
+}
+
+// Must be called with mutex_ held.
+void SurakartaJournal::BeginSegmentLocked() {
+    SurakartaJournalSegmentHeader header{};
+    memcpy(header.magic, SURAKARTA_JOURNAL_MAGIC, sizeof(header.magic));
+    header.index = segment_;
+    header.created_ns = NowNs();
+    batch_.push_back(Piece{segment_, std::string((const char*)&header, sizeof(header))});
+    segment_offset_ = sizeof(header);
+    batch_bytes_ += sizeof(header);
+}
+
+// Must be called with mutex_ held.
+bool SurakartaJournal::ShouldCommitLocked() const {
+    return stopping_ || sync_requested_ || batch_bytes_ >= MAX_BATCH_BYTES;
+}
+
+void SurakartaJournal::Sync() {
+    std::unique_lock lock(mutex_);
+    const uint64_t target = appended_;
+    if (durable_ >= target)
+        return;
+    sync_requested_ = true;
+    when_appended_.notify_one();
+    when_durable_.wait(lock, [&] { return durable_ >= target; });
+}
+
+// Gathers what is appended for one commit interval from the first record, then writes it all
+// and flushes it once.
+void SurakartaJournal::Run() {
+    std::vector<Piece> batch;
+    std::unique_lock lock(mutex_);
+    while (true) {
+        when_appended_.wait(lock, [&] { return stopping_ || appended_ > durable_; });
+        if (appended_ == durable_)
+            return;  // stopping, with nothing left
+        when_appended_.wait_for(lock, options_.commit_interval, [&] { return ShouldCommitLocked(); });
+        const uint64_t through = appended_;
+        batch.swap(batch_);
+        batch_.push_back(Piece{segment_, std::string()});
+        batch_.back().bytes.reserve(batch.back().bytes.capacity());
+        batch_bytes_ = 0;
+        sync_requested_ = false;
+        lock.unlock();
+        Write(batch);
+        batch.clear();
+        lock.lock();
+        durable_ = through;
+        when_durable_.notify_all();
+    }
+}
+
+void SurakartaJournal::Write(std::vector<Piece>& batch) {
+    auto started = std::chrono::steady_clock::now();
+    for (auto& piece : batch) {
+        if (piece.bytes.empty())
+            continue;
+        if (piece.segment != open_segment_)
+            OpenSegment(piece.segment);
+        size_t offset = 0;
+        while (fd_ >= 0 && offset < piece.bytes.size()) {
+            auto written = ::write(fd_, piece.bytes.data() + offset, piece.bytes.size() - offset);
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                failures_.Add();
+                logger_->Log("Failed to write the journal: %s", strerror(errno));
+                break;
+            }
+            offset += written;
+        }
+        bytes_.Add((long long)offset);
+    }
+    if (fd_ >= 0 && fdatasync(fd_) < 0) {
+        failures_.Add();
+        logger_->Log("Failed to flush the journal: %s", strerror(errno));
+    }
+    commits_.Add();
+    commit_latency_.RecordSince(started);
+}
+
+// Runs on the writer, except for the first segment.
+void SurakartaJournal::OpenSegment(uint64_t segment) {
+    CloseSegment();
+    open_segment_ = segment;
+    auto path = SegmentPath(options_.directory, segment);
+    fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+    if (fd_ < 0) {
+        auto error = "Failed to create the journal segment " + path + ": " + strerror(errno);
+        if (!writer_.joinable())
+            throw std::runtime_error(error);
+        failures_.Add();
+        logger_->Log("%s", error.c_str());
+        return;
+    }
+    // make the new name durable as well
+    int directory = ::open(options_.directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (directory >= 0) {
+        fsync(directory);
+        ::close(directory);
+    }
+}
+
+void SurakartaJournal::CloseSegment() {
+    if (fd_ < 0)
+        return;
+    fdatasync(fd_);
+    ::close(fd_);
+    fd_ = -1;
+}
+
+bool SurakartaJournal::IsSupported() {
+    return true;
+}
+
+#else
+
+std::vector<std::pair<uint64_t, std::string>> SurakartaJournalSegments(const std::string&) {
+    throw std::runtime_error("The game journal is only supported on Linux.");
+}
+
+SurakartaJournalSegment::SurakartaJournalSegment(const std::string&) {
+    throw std::runtime_error("The game journal is only supported on Linux.");
+}
+
+SurakartaJournalSegment::~SurakartaJournalSegment() {}
+
+SurakartaJournal::SurakartaJournal(Options options, std::shared_ptr<SurakartaLogger> logger)
+    : options_(std::move(options)), logger_(std::move(logger)) {
+    throw std::runtime_error("The game journal is only supported on Linux.");
+}
+
+SurakartaJournal::~SurakartaJournal() {}
+
+uint64_t SurakartaJournal::Start(int, const std::string&, PieceColor, const std::string&, PieceColor) {
+    return 0;
+}
+
+void SurakartaJournal::Move(uint64_t, int, const SurakartaMove&, SurakartaIllegalMoveReason) {}
+
+void SurakartaJournal::End(uint64_t, int, SurakartaEndReason, PieceColor, std::optional<SurakartaIllegalMoveReason>) {}
+
+void SurakartaJournal::Sync() {}
+
+bool SurakartaJournal::IsSupported() {
+    return false;
+}
+
+#endif
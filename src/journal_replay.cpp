@@ -0,0 +1,200 @@
+#include "journal_replay.h"
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+void SurakartaReplayTotals::Merge(const SurakartaReplayTotals& other) {
+    games += other.games;
+    moves += other.moves;
+    mismatched += other.mismatched;
+    for (int i = 0; i < COLORS; i++)
+        winners[i] += other.winners[i];
+    for (int i = 0; i < END_REASONS; i++)
+        end_reasons[i] += other.end_reasons[i];
+    for (int i = 0; i <= MAX_LENGTH; i++)
+        lengths[i] += other.lengths[i];
+    for (auto& [name, user] : other.users) {
+        auto& mine = users[name];
+        mine.games += user.games;
+        mine.wins += user.wins;
+        mine.losses += user.losses;
+        mine.as_black += user.as_black;
+    }
+}
+
+int SurakartaReplayTotals::LengthPercentile(double p) const {
+    long long rank = std::max<long long>(1, (long long)(p * games + 0.5));
+    long long seen = 0;
+    for (int i = 0; i <= MAX_LENGTH; i++) {
+        seen += lengths[i];
+        if (seen >= rank)
+            return i;
+    }
+    return MAX_LENGTH;
+}
+
+static void AddUser(SurakartaReplayTotals& totals, const char* name, size_t size, PieceColor color, PieceColor winner) {
+    auto& user = totals.users[std::string(name, size)];
+    user.games++;
+    if (winner == color)
+        user.wins++;
+    else if (winner != PieceColor::NONE)
+        user.losses++;
+    if (color == PieceColor::BLACK)
+        user.as_black++;
+}
+
+// Rebuild a whole game, from its START to its END, and add it to the totals.
+static void ReplayGame(const std::vector<const SurakartaJournalRecordHeader*>& records,
+                       bool rebuild,
+                       SurakartaReplayTotals& totals) {
+    auto start = reinterpret_cast<const SurakartaJournalStart*>(records.front() + 1);
+    auto end = reinterpret_cast<const SurakartaJournalEnd*>(records.back() + 1);
+    std::unique_ptr<SurakartaGame> game;
+    if (rebuild) {
+        game = std::make_unique<SurakartaGame>(BOARD_SIZE, MAX_NO_CAPTURE_ROUND);
+        game->StartGame();
+    }
+    bool mismatched = false;
+    int length = 0;
+    for (size_t i = 1; i + 1 < records.size(); i++) {
+        if (records[i]->type != (uint8_t)SurakartaJournalRecordType::MOVE)
+            continue;
+        auto move = reinterpret_cast<const SurakartaJournalMove*>(records[i] + 1);
+        length++;
+        if (game) {
+            auto response = game->Move(SurakartaMove(SurakartaPosition(move->from_x, move->from_y),
+                                                     SurakartaPosition(move->to_x, move->to_y),
+                                                     (PieceColor)move->player));
+            if ((uint8_t)response.GetMoveReason() != move->move_reason)
+                mismatched = true;
+        }
+    }
+    totals.games++;
+    totals.moves += length;
+    totals.mismatched += mismatched;
+    totals.lengths[std::min(length, SurakartaReplayTotals::MAX_LENGTH)]++;
+    if (end->winner < SurakartaReplayTotals::COLORS)
+        totals.winners[end->winner]++;
+    if (end->end_reason < SurakartaReplayTotals::END_REASONS)
+        totals.end_reasons[end->end_reason]++;
+    auto names = reinterpret_cast<const char*>(start + 1);
+    auto winner = (PieceColor)end->winner;
+    AddUser(totals, names, start->first_player_username_size, (PieceColor)start->first_player_color, winner);
+    AddUser(totals, names + start->first_player_username_size, start->second_player_username_size,
+            (PieceColor)start->second_player_color, winner);
+}
+
+bool SurakartaJournalReplay::Open(const std::vector<std::string>& paths) {
+    std::vector<std::pair<uint64_t, std::string>> found;
+    for (auto& path : paths) {
+        if (path.size() > 4 && path.compare(path.size() - 4, 4, ".skj") == 0) {
+            found.emplace_back(0, path);
+            continue;
+        }
+        try {
+            auto segments = SurakartaJournalSegments(path);
+            found.insert(found.end(), segments.begin(), segments.end());
+        } catch (const std::exception& e) {
+            errors_.push_back(e.what());
+        }
+    }
+    for (auto& [index, path] : found) {
+        try {
+            segments_.push_back(std::make_unique<SurakartaJournalSegment>(path));
+            bytes_ += segments_.back()->Size();
+        } catch (const std::exception& e) {
+            errors_.push_back(e.what());
+        }
+    }
+    // in the order they were written, so that the pieces of a game come in order
+    std::sort(segments_.begin(), segments_.end(),
+              [](auto& a, auto& b) { return a->Header().index < b->Header().index; });
+    return !segments_.empty();
+}
+
+void SurakartaJournalReplay::Run(int threads, std::function<void(size_t, long long)> progress) {
+    std::vector<std::thread> workers;
+    std::vector<SurakartaReplayTotals> totals(threads);
+    std::vector<Pieces> pieces(threads);
+    for (int i = 0; i < threads; i++)
+        workers.emplace_back([this, &totals, &pieces, i] { Work(totals[i], pieces[i]); });
+    std::thread reporter;
+    if (progress)
+        reporter = std::thread([this, &progress] { Report(progress); });
+    for (auto& worker : workers)
+        worker.join();
+    {
+        std::lock_guard lock(mutex_);
+        done_ = true;
+        when_done_.notify_all();
+    }
+    if (reporter.joinable())
+        reporter.join();
+    for (auto& thread_totals : totals)
+        totals_.Merge(thread_totals);
+    JoinPieces(pieces);
+}
+
+void SurakartaJournalReplay::Work(SurakartaReplayTotals& totals, Pieces& pieces) {
+    std::unordered_map<uint64_t, std::vector<Record>> games;  // in flight: the records so far
+    std::vector<std::vector<Record>> spare;                   // emptied, to be reused
+    while (true) {
+        size_t next = next_segment_++;
+        if (next >= segments_.size())
+            return;
+        auto& segment = *segments_[next];
+        const uint64_t index = segment.Header().index;
+        long long games_before = totals.games;
+        torn_bytes_ += segment.ForEachRecord([&](const SurakartaJournalRecordHeader& record) {
+            auto [found, inserted] = games.try_emplace(record.game);
+            if (inserted && !spare.empty()) {
+                found->second.swap(spare.back());
+                spare.pop_back();
+            }
+            auto& records = found->second;
+            records.push_back(&record);
+            if (record.type == (uint8_t)SurakartaJournalRecordType::END &&
+                records.front()->type == (uint8_t)SurakartaJournalRecordType::START) {
+                ReplayGame(records, rebuild_, totals);
+                records.clear();
+                spare.push_back(std::move(records));
+                games.erase(found);
+            }
+        });
+        // what is left crosses into another segment
+        for (auto& [game, records] : games)
+            pieces[game].push_back(Piece{index, std::move(records)});
+        games.clear();
+        replayed_ += totals.games - games_before;
+    }
+}
+
+void SurakartaJournalReplay::JoinPieces(std::vector<Pieces>& pieces) {
+    Pieces by_game;
+    for (auto& thread_pieces : pieces) {
+        for (auto& [game, game_pieces] : thread_pieces) {
+            auto& mine = by_game[game];
+            for (auto& piece : game_pieces)
+                mine.push_back(std::move(piece));
+        }
+    }
+    std::vector<Record> records;
+    for (auto& [game, game_pieces] : by_game) {
+        std::sort(game_pieces.begin(), game_pieces.end(), [](auto& a, auto& b) { return a.segment < b.segment; });
+        records.clear();
+        for (auto& piece : game_pieces)
+            records.insert(records.end(), piece.records.begin(), piece.records.end());
+        if (records.front()->type == (uint8_t)SurakartaJournalRecordType::START &&
+            records.back()->type == (uint8_t)SurakartaJournalRecordType::END)
+            ReplayGame(records, rebuild_, totals_);
+        else
+            unfinished_++;  // still being played, or its start is in a segment that is gone
+    }
+}
+
+void SurakartaJournalReplay::Report(const std::function<void(size_t, long long)>& progress) {
+    std::unique_lock lock(mutex_);
+    while (!when_done_.wait_for(lock, std::chrono::seconds(1), [this] { return done_; }))
+        progress(std::min(next_segment_.load(), segments_.size()), replayed_.load());
+}
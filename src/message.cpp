@@ -1,23 +1,33 @@
 #include "message.h"
 #include "exception.h"
 
-SurakartaNetworkMessageReady::SurakartaNetworkMessageReady(const std::string& username, PieceColor color, int room_id)
+SurakartaNetworkMessageReady::SurakartaNetworkMessageReady(const std::string& username, PieceColor color, int room_id, bool spectating)
     : NetworkFramework::Message(
           OPCODE::READY_OP,
           username,
           color == PieceColor::BLACK ? "BLACK" : color == PieceColor::WHITE ? "WHITE"
                                                                             : "",
-          std::to_string(room_id)),
-      username_(username),
+          spectating ? std::to_string(room_id) + SURAKARTA_SPECTATE_OPTION : std::to_string(room_id)),
       color_(color),
-      room_id_(room_id) {}
+      room_id_(room_id),
+      spectating_(spectating) {}
+
+SurakartaNetworkMessageReady::SurakartaNetworkMessageReady(const std::string& username,
+                                                           PieceColor color,
+                                                           int room_id,
+                                                           const std::string& resume_token,
+                                                           int resume_moves)
+    : SurakartaNetworkMessageReady(username, color, room_id) {
+    data3 += SURAKARTA_RESUME_OPTION + resume_token + "," + std::to_string(resume_moves);
+    resume_token_ = resume_token;
+    resume_moves_ = resume_moves;
+}
 
-SurakartaNetworkMessageReady::SurakartaNetworkMessageReady(const NetworkFramework::Message& message)
-    : NetworkFramework::Message(message) {
-    if (message.opcode != OPCODE::READY_OP) {
+SurakartaNetworkMessageReady::SurakartaNetworkMessageReady(NetworkFramework::Message message)
+    : NetworkFramework::Message(std::move(message)) {
+    if (opcode != OPCODE::READY_OP) {
         throw SurakartaNetworkMessageParsingException<SurakartaNetworkMessageReady>();
     }
-    username_ = data1;
     if (data2 != "BLACK" && data2 != "WHITE" && data2.empty() == false) {
         throw SurakartaNetworkMessageParsingException<SurakartaNetworkMessageReady>();
     }
@@ -28,18 +38,41 @@ SurakartaNetworkMessageReady::SurakartaNetworkMessageReady(const NetworkFramewor
     } catch (std::invalid_argument&) {
         throw SurakartaNetworkMessageParsingException<SurakartaNetworkMessageReady>();
     }
+    spectating_ = data3.find(SURAKARTA_SPECTATE_OPTION) != std::string::npos;
+    auto resume = data3.find(SURAKARTA_RESUME_OPTION);
+    if (resume != std::string::npos) {
+        auto token = resume + std::string(SURAKARTA_RESUME_OPTION).size();
+        auto comma = data3.find(',', token);
+        if (comma == std::string::npos || comma == token) {
+            throw SurakartaNetworkMessageParsingException<SurakartaNetworkMessageReady>();
+        }
+        resume_token_ = data3.substr(token, comma - token);
+        try {
+            resume_moves_ = std::stoi(data3.substr(comma + 1));
+        } catch (std::exception&) {
+            throw SurakartaNetworkMessageParsingException<SurakartaNetworkMessageReady>();
+        }
+        if (resume_moves_ < 0) {
+            throw SurakartaNetworkMessageParsingException<SurakartaNetworkMessageReady>();
+        }
+    }
 }
 
 SurakartaNetworkMessageReject::SurakartaNetworkMessageReject(const std::string& username, const std::string& reason)
-    : NetworkFramework::Message(OPCODE::REJECT_OP, username, reason), username_(username), reason_(reason) {}
+    : NetworkFramework::Message(OPCODE::REJECT_OP, username, reason) {}
 
-SurakartaNetworkMessageReject::SurakartaNetworkMessageReject(const NetworkFramework::Message& message)
-    : NetworkFramework::Message(message) {
-    if (message.opcode != OPCODE::REJECT_OP) {
+SurakartaNetworkMessageReject::SurakartaNetworkMessageReject(NetworkFramework::Message message)
+    : NetworkFramework::Message(std::move(message)) {
+    if (opcode != OPCODE::REJECT_OP) {
         throw SurakartaNetworkMessageParsingException<SurakartaNetworkMessageReject>();
     }
-    username_ = data1;
-    reason_ = data2;
+}
+
+std::string SurakartaNetworkMessageReject::RedirectTarget() const {
+    const std::string prefix = SURAKARTA_REDIRECT_REASON;
+    if (data2.compare(0, prefix.size(), prefix) != 0)
+        return std::string();
+    return data2.substr(prefix.size());
 }
 
 static SurakartaPosition ToPosition(const std::string& str) {
@@ -68,9 +101,9 @@ static std::string SurakartaNetworkMessageMove_ToString(const SurakartaPosition&
 SurakartaNetworkMessageMove::SurakartaNetworkMessageMove(const SurakartaPosition& from, const SurakartaPosition& to)
     : NetworkFramework::Message(OPCODE::MOVE_OP, SurakartaNetworkMessageMove_ToString(from), SurakartaNetworkMessageMove_ToString(to)), from_(from), to_(to) {}
 
-SurakartaNetworkMessageMove::SurakartaNetworkMessageMove(const NetworkFramework::Message& message)
-    : NetworkFramework::Message(message) {
-    if (message.opcode != OPCODE::MOVE_OP) {
+SurakartaNetworkMessageMove::SurakartaNetworkMessageMove(NetworkFramework::Message message)
+    : NetworkFramework::Message(std::move(message)) {
+    if (opcode != OPCODE::MOVE_OP) {
         throw SurakartaNetworkMessageParsingException<SurakartaNetworkMessageMove>();
     }
     from_ = ToPosition(data1);
@@ -80,10 +113,9 @@ SurakartaNetworkMessageMove::SurakartaNetworkMessageMove(const NetworkFramework:
 SurakartaNetworkMessageResign::SurakartaNetworkMessageResign()
     : NetworkFramework::Message(OPCODE::RESIGN_OP) {}
 
-SurakartaNetworkMessageResign::SurakartaNetworkMessageResign(const NetworkFramework::Message& message)
-    : NetworkFramework::Message(message) {
-    opcode = message.opcode;
-    if (message.opcode != OPCODE::RESIGN_OP) {
+SurakartaNetworkMessageResign::SurakartaNetworkMessageResign(NetworkFramework::Message message)
+    : NetworkFramework::Message(std::move(message)) {
+    if (opcode != OPCODE::RESIGN_OP) {
         throw SurakartaNetworkMessageParsingException<SurakartaNetworkMessageResign>();
     }
 }
@@ -100,9 +132,9 @@ SurakartaNetworkMessageEnd::SurakartaNetworkMessageEnd(
       end_reason_(end_reason),
       winner_(winner) {}
 
-SurakartaNetworkMessageEnd::SurakartaNetworkMessageEnd(const NetworkFramework::Message& message)
-    : NetworkFramework::Message(message) {
-    if (message.opcode != OPCODE::END_OP) {
+SurakartaNetworkMessageEnd::SurakartaNetworkMessageEnd(NetworkFramework::Message message)
+    : NetworkFramework::Message(std::move(message)) {
+    if (opcode != OPCODE::END_OP) {
         throw SurakartaNetworkMessageParsingException<SurakartaNetworkMessageEnd>();
     }
     if (data1.empty()) {
@@ -127,25 +159,21 @@ SurakartaNetworkMessageEnd::SurakartaNetworkMessageEnd(const NetworkFramework::M
 }
 
 SurakartaNetworkMessageLeave::SurakartaNetworkMessageLeave(const std::string& username, const std::string& leave_reason)
-    : NetworkFramework::Message(OPCODE::LEAVE_OP, username, leave_reason), username_(username), leave_reason_(leave_reason) {}
+    : NetworkFramework::Message(OPCODE::LEAVE_OP, username, leave_reason) {}
 
-SurakartaNetworkMessageLeave::SurakartaNetworkMessageLeave(const NetworkFramework::Message& message)
-    : NetworkFramework::Message(message) {
-    if (message.opcode != OPCODE::LEAVE_OP) {
+SurakartaNetworkMessageLeave::SurakartaNetworkMessageLeave(NetworkFramework::Message message)
+    : NetworkFramework::Message(std::move(message)) {
+    if (opcode != OPCODE::LEAVE_OP) {
         throw SurakartaNetworkMessageParsingException<SurakartaNetworkMessageLeave>();
     }
-    username_ = data1;
-    leave_reason_ = data2;
 }
 
 SurakartaNetworkMessageChat::SurakartaNetworkMessageChat(const std::string& username, const std::string& chat_message)
-    : NetworkFramework::Message(OPCODE::CHAT_OP, username, chat_message), username_(username), chat_message_(chat_message) {}
+    : NetworkFramework::Message(OPCODE::CHAT_OP, username, chat_message) {}
 
-SurakartaNetworkMessageChat::SurakartaNetworkMessageChat(const NetworkFramework::Message& message)
-    : NetworkFramework::Message(message) {
-    if (message.opcode != OPCODE::CHAT_OP) {
+SurakartaNetworkMessageChat::SurakartaNetworkMessageChat(NetworkFramework::Message message)
+    : NetworkFramework::Message(std::move(message)) {
+    if (opcode != OPCODE::CHAT_OP) {
         throw SurakartaNetworkMessageParsingException<SurakartaNetworkMessageChat>();
     }
-    username_ = data1;
-    chat_message_ = data2;
 }
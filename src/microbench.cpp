@@ -0,0 +1,599 @@
+// Microbenchmarks for the building blocks of the Surakarta network service.
+//
+// Usage: surakarta-network-microbench [name..]
+// Without arguments every benchmark runs; otherwise only those whose name starts with an argument.
+
+#include <fcntl.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "capture.h"
+#include "exception_as_eof_wrapper.h"
+#include "matchmaker.h"
+#include "memory_socket.h"
+#include "message.h"
+#include "metrics.h"
+#include "rate_limit.h"
+#include "room_registry.h"
+#include "socket_capture_wrapper.h"
+#include "socket_log_wrapper.h"
+#include "socket_raw_log_wrapper.h"
+#include "surakarta_network_logger.h"
+#include "timer_wheel.h"
+#include "wire_codec.h"
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+using Clock = std::chrono::steady_clock;
+
+// Run body(thread_index, iterations) on the given number of threads at once, and return the
+// total operations per second.
+static double RunThreads(int threads, long iterations_per_thread, const std::function<void(int, long)>& body) {
+    std::atomic<int> ready = 0;
+    std::atomic<bool> go = false;
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] {
+            ready++;
+            while (!go)
+                std::this_thread::yield();
+            body(t, iterations_per_thread);
+        });
+    }
+    while (ready < threads)
+        std::this_thread::yield();
+    auto start = Clock::now();
+    go = true;
+    for (auto& worker : workers)
+        worker.join();
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    return threads * iterations_per_thread / seconds;
+}
+
+static void Report(const char* name, const std::string& variant, double ops_per_second) {
+    printf("%-28s %-24s %14.0f ops/s\n", name, variant.c_str(), ops_per_second);
+}
+
+// ---- room registry ----
+
+struct BenchRoom {
+    explicit BenchRoom(int id)
+        : id(id) {}
+    const int id;
+};
+
+// The registry as it was before sharding: one vector behind one service-wide mutex.
+class VectorRegistry {
+   public:
+    std::shared_ptr<BenchRoom> GetOrCreate(int id) {
+        std::lock_guard lock(mutex_);
+        for (auto& room : rooms_) {
+            if (room->id == id)
+                return room;
+        }
+        rooms_.push_back(std::make_shared<BenchRoom>(id));
+        return rooms_.back();
+    }
+
+    void Remove(const std::shared_ptr<BenchRoom>& room) {
+        std::lock_guard lock(mutex_);
+        for (size_t i = 0; i < rooms_.size(); i++) {
+            if (rooms_[i] == room) {
+                rooms_.erase(rooms_.begin() + i);
+                return;
+            }
+        }
+    }
+
+   private:
+    std::mutex mutex_;
+    std::vector<std::shared_ptr<BenchRoom>> rooms_;
+};
+
+static void BenchRoomRegistry() {
+    // rooms that stay open during the run, as on a busy server
+    const int open_rooms = 2000;
+    const long iterations = 20000;
+    for (int threads : {1, 8, 32}) {
+        // each iteration creates a room, looks it up as the second player would, then removes it
+        {
+            VectorRegistry registry;
+            for (int i = 0; i < open_rooms; i++)
+                registry.GetOrCreate(-1 - i);
+            auto ops = RunThreads(threads, iterations / threads, [&](int t, long n) {
+                for (long i = 0; i < n; i++) {
+                    int id = t * 1000000 + (int)i;
+                    auto room = registry.GetOrCreate(id);
+                    registry.GetOrCreate(id);
+                    registry.Remove(room);
+                }
+            });
+            Report("room_registry", "vector " + std::to_string(threads) + " threads", ops);
+        }
+        {
+            SurakartaShardedRegistry<int, BenchRoom> registry;
+            auto create = [](int id) { return [id] { return std::make_shared<BenchRoom>(id); }; };
+            auto retired = [](const std::shared_ptr<BenchRoom>&) { return false; };
+            for (int i = 0; i < open_rooms; i++)
+                registry.GetOrCreate(-1 - i, create(-1 - i), retired);
+            auto ops = RunThreads(threads, iterations * 10 / threads, [&](int t, long n) {
+                for (long i = 0; i < n; i++) {
+                    int id = t * 1000000 + (int)i;
+                    auto room = registry.GetOrCreate(id, create(id), retired).first;
+                    registry.Find(id);
+                    registry.Remove(id, room);
+                }
+            });
+            Report("room_registry", "sharded " + std::to_string(threads) + " threads", ops);
+        }
+    }
+    {
+        SurakartaShardedRegistry<int, BenchRoom> registry;
+        for (int i = 0; i < open_rooms; i++)
+            registry.GetOrCreate(i, [i] { return std::make_shared<BenchRoom>(i); }, [](auto&) { return false; });
+        auto ops = RunThreads(1, 2000, [&](int, long n) {
+            for (long i = 0; i < n; i++)
+                registry.Values();
+        });
+        Report("room_registry_values", std::to_string(open_rooms) + " rooms", ops);
+    }
+}
+
+// ---- message logging ----
+
+// Sends what is written to stdout to the null device while alive, so that a benchmark can
+// log through SurakartaLoggerStdout without flooding the terminal.
+class StdoutToNull {
+   public:
+    StdoutToNull() {
+        fflush(stdout);
+#ifdef _WIN32
+        saved_ = _dup(1);
+        int null_fd = _open("NUL", _O_WRONLY);
+        _dup2(null_fd, 1);
+        _close(null_fd);
+#else
+        saved_ = dup(1);
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, 1);
+        close(null_fd);
+#endif
+    }
+    ~StdoutToNull() {
+        fflush(stdout);
+#ifdef _WIN32
+        _dup2(saved_, 1);
+        _close(saved_);
+#else
+        dup2(saved_, 1);
+        close(saved_);
+#endif
+    }
+
+   private:
+    int saved_;
+};
+
+static void BenchMessageLogging() {
+    const std::vector<NetworkFramework::Message> messages = {
+        SurakartaNetworkMessageReady("player", PieceColor::BLACK, 42),
+        SurakartaNetworkMessageMove(SurakartaPosition(1, 1), SurakartaPosition(1, 2)),
+        SurakartaNetworkMessageChat("player", "good game"),
+    };
+    // every iteration sends a message and receives it back
+    auto run = [&](std::shared_ptr<SurakartaLogger> logger, long iterations) {
+        auto memory_socket = std::make_shared<SurakartaMemorySocket>();
+        std::shared_ptr<NetworkFramework::Socket> socket = memory_socket;
+        if (logger)
+            socket = std::make_shared<SurakartaNetworkSocketLogWrapper>(memory_socket, logger);
+        return 2 * RunThreads(1, iterations, [&](int, long n) {
+                   for (long i = 0; i < n; i++) {
+                       socket->Send(messages[i % messages.size()]);
+                       socket->Receive();
+                   }
+               });
+    };
+    auto stdout_logger = std::make_shared<SurakartaLoggerStdout>();
+    Report("message_logging", "no wrapper", run(nullptr, 1000000));
+    Report("message_logging", "null sink", run(std::make_shared<SurakartaLoggerNull>(), 1000000));
+    Report("message_logging", "stdout filtered to info",
+           run(std::make_shared<SurakartaLoggerFiltered>(stdout_logger, SurakartaLogLevel::INFO), 1000000));
+    double stdout_ops;
+    {
+        StdoutToNull redirect;
+        stdout_ops = run(stdout_logger, 100000);
+    }
+    Report("message_logging", "stdout to null device", stdout_ops);
+}
+
+// ---- async logging ----
+
+static void BenchAsyncLogging() {
+    const long lines = 400000;
+    for (int threads : {1, 8}) {
+        auto log_lines = [&](const std::shared_ptr<SurakartaLogger>& logger) {
+            return RunThreads(threads, lines / threads, [&](int t, long n) {
+                auto sublogger = logger->CreateSublogger("thread " + std::to_string(t));
+                for (long i = 0; i < n; i++)
+                    sublogger->Log("Move message: from: %s, to: %s", "B2", "B3");
+            });
+        };
+        const std::string variant = " " + std::to_string(threads) + " threads";
+        double stdout_ops, block_ops, drop_ops;
+        long long dropped;
+        {
+            StdoutToNull redirect;
+            stdout_ops = log_lines(std::make_shared<SurakartaLoggerStdout>());
+            fflush(stdout);
+            SurakartaLoggerAsyncOptions options;
+            auto block_logger = std::make_shared<SurakartaLoggerAsync>(1, options);
+            block_ops = log_lines(block_logger);
+            block_logger->Flush();
+            options.overflow = SurakartaLogOverflow::DROP;
+            auto drop_logger = std::make_shared<SurakartaLoggerAsync>(1, options);
+            drop_ops = log_lines(drop_logger);
+            drop_logger->Flush();
+            dropped = drop_logger->Dropped();
+        }
+        Report("async_logging", "stdout" + variant, stdout_ops);
+        Report("async_logging", "async block" + variant, block_ops);
+        Report("async_logging", "async drop" + variant, drop_ops);
+        printf("%-28s %-24s %14lld lines\n", "async_logging", "  dropped", dropped);
+    }
+}
+
+// ---- wire encoding ----
+
+static void BenchWireEncoding() {
+    const std::pair<const char*, NetworkFramework::Message> messages[] = {
+        {"move", SurakartaNetworkMessageMove(SurakartaPosition(1, 1), SurakartaPosition(1, 2))},
+        {"end", SurakartaNetworkMessageEnd(SurakartaIllegalMoveReason::LEGAL_NON_CAPTURE_MOVE, SurakartaEndReason::STALEMATE, PieceColor::NONE)},
+        {"resign", SurakartaNetworkMessageResign()},
+        {"ready", SurakartaNetworkMessageReady("player", PieceColor::BLACK, 42)},
+        {"chat", SurakartaNetworkMessageChat("player", "good game")},
+    };
+    const long iterations = 1000000;
+    for (auto& [name, message] : messages) {
+        for (bool compact : {false, true}) {
+            std::string bytes;
+            SurakartaWireEncode(message, bytes, compact);
+            std::string buffer;
+            auto encode_ops = RunThreads(1, iterations, [&](int, long n) {
+                for (long i = 0; i < n; i++) {
+                    buffer.clear();
+                    SurakartaWireEncode(message, buffer, compact);
+                }
+            });
+            SurakartaWireDecoder decoder;
+            auto decode_ops = RunThreads(1, iterations, [&](int, long n) {
+                for (long i = 0; i < n; i++) {
+                    decoder.Feed(bytes.data(), bytes.size());
+                    decoder.Next();
+                }
+            });
+            printf("%-28s %-24s %8zu bytes %8.1f ns encode %8.1f ns decode\n", "wire_encoding",
+                   (std::string(name) + (compact ? " compact" : " json")).c_str(),
+                   bytes.size(), 1e9 / encode_ops, 1e9 / decode_ops);
+        }
+    }
+}
+
+// ---- message codec ----
+
+// Construct each message type from its fields, and parse it back from a received message.
+// Parsing starts from a copy of the message, as the constructors take it by value; the
+// strings are short enough that the copy does not allocate.
+template <typename Typed, typename Construct, typename Check>
+static void BenchMessageType(const char* name, Construct&& construct, Check&& check) {
+    const long iterations = 1000000;
+    const NetworkFramework::Message message = construct();
+    auto construct_ops = RunThreads(1, iterations, [&](int, long n) {
+        for (long i = 0; i < n; i++) {
+            NetworkFramework::Message constructed = construct();
+            if (constructed.opcode != message.opcode)
+                abort();
+        }
+    });
+    auto parse_ops = RunThreads(1, iterations, [&](int, long n) {
+        for (long i = 0; i < n; i++) {
+            if (!check(Typed(message)))
+                abort();
+        }
+    });
+    printf("%-28s %-24s %8.1f ns construct %8.1f ns parse\n", "message_codec", name, 1e9 / construct_ops, 1e9 / parse_ops);
+}
+
+static void BenchMessageCodec() {
+    BenchMessageType<SurakartaNetworkMessageReady>(
+        "ready", [] { return SurakartaNetworkMessageReady("player", PieceColor::BLACK, 42); },
+        [](const SurakartaNetworkMessageReady& ready) { return ready.RoomId() == 42; });
+    BenchMessageType<SurakartaNetworkMessageReject>(
+        "reject", [] { return SurakartaNetworkMessageReject("player", "Room is full."); },
+        [](const SurakartaNetworkMessageReject& reject) { return !reject.Reason().empty(); });
+    BenchMessageType<SurakartaNetworkMessageMove>(
+        "move", [] { return SurakartaNetworkMessageMove(SurakartaPosition(1, 1), SurakartaPosition(1, 2)); },
+        [](const SurakartaNetworkMessageMove& move) { return move.To().y == 2; });
+    BenchMessageType<SurakartaNetworkMessageResign>(
+        "resign", [] { return SurakartaNetworkMessageResign(); },
+        [](const SurakartaNetworkMessageResign&) { return true; });
+    BenchMessageType<SurakartaNetworkMessageEnd>(
+        "end", [] { return SurakartaNetworkMessageEnd(std::nullopt, SurakartaEndReason::CHECKMATE, PieceColor::BLACK); },
+        [](const SurakartaNetworkMessageEnd& end) { return end.Winner() == PieceColor::BLACK; });
+    BenchMessageType<SurakartaNetworkMessageLeave>(
+        "leave", [] { return SurakartaNetworkMessageLeave("player", "bye"); },
+        [](const SurakartaNetworkMessageLeave& leave) { return !leave.LeaveReason().empty(); });
+    BenchMessageType<SurakartaNetworkMessageChat>(
+        "chat", [] { return SurakartaNetworkMessageChat("player", "good game"); },
+        [](const SurakartaNetworkMessageChat& chat) { return !chat.ChatMessage().empty(); });
+
+    // what the service pays for every message a client gets wrong
+    const NetworkFramework::Message malformed(OPCODE::READY_OP, "player", "BLACK", "room");
+    auto malformed_ops = RunThreads(1, 100000, [&](int, long n) {
+        for (long i = 0; i < n; i++) {
+            try {
+                SurakartaNetworkMessageReady ready(malformed);
+                abort();
+            } catch (const std::exception&) {
+            }
+        }
+    });
+    printf("%-28s %-24s %8s             %8.1f ns parse\n", "message_codec", "ready malformed", "", 1e9 / malformed_ops);
+}
+
+// ---- socket wrappers ----
+
+// Send a move and receive it back through each layer the service may put around a
+// connection, and report what the layer adds to the bare in-memory socket.
+static void BenchSocketWrappers() {
+    using Wrap = std::function<std::shared_ptr<NetworkFramework::Socket>(std::shared_ptr<NetworkFramework::Socket>)>;
+    auto null_logger = std::make_shared<SurakartaLoggerNull>();
+    auto stdout_logger = std::make_shared<SurakartaLoggerStdout>();
+    auto info_logger = std::make_shared<SurakartaLoggerFiltered>(stdout_logger, SurakartaLogLevel::INFO);
+    SurakartaRateLimitCounters rate_limit_counters;
+    const SurakartaNetworkRateLimit unlimited_rates[SURAKARTA_RATE_CLASSES] = {{1e9, 1000}, {1e9, 1000}, {1e9, 1000}};
+    const char* capture_path = "surakarta-microbench.skcap";
+    std::remove(capture_path);
+    auto capture = std::make_shared<SurakartaCapture>(SurakartaCapture::Options{capture_path});
+    const std::pair<const char*, Wrap> layers[] = {
+        {"bare", [](auto socket) { return socket; }},
+        {"rate limit, let through", [&](auto socket) {
+             return std::make_shared<SurakartaRateLimitWrapper>(socket, unlimited_rates, 0, rate_limit_counters, null_logger);
+         }},
+        {"exception as eof", [](auto socket) { return std::make_shared<SurakartaExceptionAsEofWrapper>(socket); }},
+        {"raw log, null", [&](auto socket) { return std::make_shared<SurakartaNetworkSocketRawLogWrapper>(socket, null_logger); }},
+        {"log, null", [&](auto socket) { return std::make_shared<SurakartaNetworkSocketLogWrapper>(socket, null_logger); }},
+        {"log, info", [&](auto socket) { return std::make_shared<SurakartaNetworkSocketLogWrapper>(socket, info_logger); }},
+        {"log, debug", [&](auto socket) { return std::make_shared<SurakartaNetworkSocketLogWrapper>(socket, stdout_logger); }},
+        {"raw log, debug", [&](auto socket) { return std::make_shared<SurakartaNetworkSocketRawLogWrapper>(socket, stdout_logger); }},
+        {"service chain, null", [&](auto socket) {
+             return std::make_shared<SurakartaExceptionAsEofWrapper>(std::make_shared<SurakartaNetworkSocketLogWrapper>(socket, null_logger));
+         }},
+        // what the reverse proxy puts around a client, logging or capturing
+        {"proxy logs, debug", [&](auto socket) {
+             return std::make_shared<SurakartaNetworkSocketLogWrapper>(
+                 std::make_shared<SurakartaNetworkSocketRawLogWrapper>(socket, stdout_logger), stdout_logger);
+         }},
+        {"capture", [&](auto socket) { return std::make_shared<SurakartaNetworkSocketCaptureWrapper>(socket, capture); }},
+    };
+    const long iterations = 1000000;
+    double bare_ns = 0;
+    for (auto& [name, wrap] : layers) {
+        auto socket = wrap(std::make_shared<SurakartaMemorySocket>());
+        const bool logs = strstr(name, "debug") != nullptr;
+        double ops;
+        {
+            StdoutToNull redirect;
+            ops = RunThreads(1, logs ? iterations / 10 : iterations, [&](int, long n) {
+                for (long i = 0; i < n; i++) {
+                    socket->Send(SurakartaNetworkMessageMove(SurakartaPosition(i % 6, 1), SurakartaPosition(i % 6, 2)));
+                    SurakartaNetworkMessageMove(std::move(socket->Receive().value()));
+                }
+            });
+        }
+        double ns = 1e9 / ops;
+        if (bare_ns == 0)
+            bare_ns = ns;
+        printf("%-28s %-24s %8.1f ns round trip %+8.1f ns\n", "socket_wrappers", name, ns, ns - bare_ns);
+    }
+    capture->Flush();
+    printf("%-28s %-24s %8lld records  %8lld dropped\n", "socket_wrappers", "capture", capture->Records(), capture->Dropped());
+    capture.reset();
+    std::remove(capture_path);
+    // a flood, all of it but the first message dropped by one Receive
+    const SurakartaNetworkRateLimit one_per_second[SURAKARTA_RATE_CLASSES] = {{1, 1}, {1, 1}, {1, 1}};
+    auto memory = std::make_shared<SurakartaMemorySocket>();
+    SurakartaRateLimitWrapper limited(memory, one_per_second, 0, rate_limit_counters, null_logger);
+    for (long i = 0; i < iterations; i++)
+        memory->Send(SurakartaNetworkMessageChat("flood", "spam"));
+    memory->Close();
+    auto start = Clock::now();
+    while (limited.Receive().has_value()) {
+    }
+    double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / iterations;
+    printf("%-28s %-24s %8.1f ns per message dropped\n", "socket_wrappers", "rate limit, dropped", ns);
+}
+
+// ---- metrics ----
+
+// What the service's instrumentation costs a message. Every message is timed by one scope;
+// a move also records its queueing, commit and relay times. Most of it is reading the clock,
+// so that is measured first.
+static void BenchMetrics() {
+    const long iterations = 10000000;
+    std::atomic<long long> sink = 0;
+    auto clock_ops = RunThreads(1, iterations, [&](int, long n) {
+        long long sum = 0;
+        for (long i = 0; i < n; i++)
+            sum += std::chrono::steady_clock::now().time_since_epoch().count();
+        sink += sum;
+    });
+    printf("%-28s %-24s %8.1f ns\n", "metrics", "clock", 1e9 / clock_ops);
+    for (int threads : {1, 8}) {
+        const std::string variant = " " + std::to_string(threads) + " threads";
+        SurakartaCounter counter;
+        auto ops = RunThreads(threads, iterations / threads, [&](int, long n) {
+            for (long i = 0; i < n; i++)
+                counter.Add();
+        });
+        printf("%-28s %-24s %8.1f ns\n", "metrics", ("counter" + variant).c_str(), 1e9 / ops);
+        SurakartaHistogram histogram;
+        ops = RunThreads(threads, iterations / threads, [&](int, long n) {
+            for (long i = 0; i < n; i++)
+                histogram.Record(i & 0xfffff);
+        });
+        printf("%-28s %-24s %8.1f ns\n", "metrics", ("record" + variant).c_str(), 1e9 / ops);
+    }
+    SurakartaHistogram handling, queue, commit, relay;
+    auto ops = RunThreads(1, iterations / 10, [&](int, long n) {
+        for (long i = 0; i < n; i++)
+            SurakartaHistogram::Scope scope(handling);
+    });
+    printf("%-28s %-24s %8.1f ns\n", "metrics", "message", 1e9 / ops);
+    ops = RunThreads(1, iterations / 10, [&](int, long n) {
+        for (long i = 0; i < n; i++) {
+            SurakartaHistogram::Scope scope(handling);
+            auto received = scope.Start();
+            auto commit_started = std::chrono::steady_clock::now();
+            queue.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(commit_started - received).count());
+            commit.RecordSince(commit_started);
+            relay.RecordSince(received);
+        }
+    });
+    printf("%-28s %-24s %8.1f ns\n", "metrics", "move", 1e9 / ops);
+    auto start = Clock::now();
+    auto snapshot = handling.Collect();
+    printf("%-28s %-24s %8.1f us (p50 of the scope %.0f ns)\n", "metrics", "collect",
+           std::chrono::duration<double, std::micro>(Clock::now() - start).count(), snapshot.Percentile(0.5));
+}
+
+struct BenchTicket {
+    std::atomic<int> state = SurakartaMatchmaker<BenchTicket>::WAITING;
+    PieceColor color = PieceColor::NONE;
+    std::chrono::steady_clock::time_point joined_at = std::chrono::steady_clock::now();
+};
+
+// A burst of joins from many threads at once, paired by the one matchmaker thread. Players ask
+// for no color, or by turns for black and white, which then have to be paired with each other.
+static void BenchMatchmaking() {
+    const long joins = 200000;
+    for (bool colors : {false, true}) {
+        for (int threads : {1, 8, 32}) {
+            SurakartaMatchmaker<BenchTicket> matchmaker(1 << 16, [](auto&, auto&) {});
+            std::atomic<long> full = 0;
+            auto start = Clock::now();
+            auto join_ops = RunThreads(threads, joins / threads, [&](int, long n) {
+                for (long i = 0; i < n; i++) {
+                    auto ticket = std::make_shared<BenchTicket>();
+                    if (colors)
+                        ticket->color = i % 2 == 0 ? PieceColor::BLACK : PieceColor::WHITE;
+                    while (!matchmaker.Join(ticket)) {
+                        full++;
+                        std::this_thread::yield();
+                    }
+                }
+            });
+            while (matchmaker.Pairs() < joins / 2)
+                std::this_thread::yield();
+            double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+            auto wait = matchmaker.Wait().Collect();
+            const std::string variant = std::string(colors ? "colors " : "any ") + std::to_string(threads) + " threads";
+            printf("%-28s %-24s %14.0f joins/s %10.0f pairs/s, wait p50 %.0f us, p99 %.0f us, ring full %ld times\n",
+                   "matchmaking", variant.c_str(), join_ops, joins / 2 / seconds, wait.Percentile(0.5) / 1000,
+                   wait.Percentile(0.99) / 1000, full.load());
+        }
+    }
+}
+
+struct Benchmark {
+    const char* name;
+    void (*run)();
+};
+
+// ---- timers ----
+
+// Deadlines as an ordered map behind one mutex, which is what a timer that can be cancelled
+// costs without the wheel.
+class MapTimers {
+   public:
+    using TimerId = std::multimap<Clock::time_point, std::function<void()>>::iterator;
+
+    TimerId Arm(Clock::duration delay, std::function<void()> task) {
+        std::lock_guard lock(mutex_);
+        return timers_.emplace(Clock::now() + delay, std::move(task));
+    }
+
+    void Cancel(TimerId id) {
+        std::lock_guard lock(mutex_);
+        timers_.erase(id);
+    }
+
+   private:
+    std::mutex mutex_;
+    std::multimap<Clock::time_point, std::function<void()>> timers_;
+};
+
+// Every connection has a deadline, which each of its messages puts off: a cancel and an arm.
+template <typename Timers>
+static void BenchRearm(const char* variant, Timers& timers) {
+    const int connections = 100000;
+    const long rearms = 1000000;
+    std::vector<typename Timers::TimerId> ids;
+    for (int i = 0; i < connections; i++)
+        ids.push_back(timers.Arm(std::chrono::seconds(60 + i % 60), [] {}));
+    for (int threads : {1, 8}) {
+        // each thread owns a share of the connections, as a session owns its own
+        auto ops = RunThreads(threads, rearms / threads, [&](int t, long n) {
+            const int share = connections / threads;
+            for (long i = 0; i < n; i++) {
+                auto& id = ids[t * share + (i * 7919) % share];
+                timers.Cancel(id);
+                id = timers.Arm(std::chrono::seconds(60 + i % 60), [] {});
+            }
+        });
+        Report("timers", std::string(variant) + " " + std::to_string(threads) + " threads", ops);
+    }
+    for (auto& id : ids)
+        timers.Cancel(id);
+}
+
+static void BenchTimers() {
+    SurakartaTimerWheel wheel;
+    BenchRearm("wheel", wheel);
+    MapTimers map;
+    BenchRearm("map", map);
+}
+
+static const Benchmark benchmarks[] = {
+    {"room_registry", BenchRoomRegistry},
+    {"message_logging", BenchMessageLogging},
+    {"async_logging", BenchAsyncLogging},
+    {"wire_encoding", BenchWireEncoding},
+    {"message_codec", BenchMessageCodec},
+    {"socket_wrappers", BenchSocketWrappers},
+    {"metrics", BenchMetrics},
+    {"matchmaking", BenchMatchmaking},
+    {"timers", BenchTimers},
+};
+
+int main(int argc, char** argv) {
+    for (auto& benchmark : benchmarks) {
+        bool selected = argc <= 1;
+        for (int i = 1; i < argc; i++) {
+            if (strncmp(benchmark.name, argv[i], strlen(argv[i])) == 0)
+                selected = true;
+        }
+        if (selected)
+            benchmark.run();
+    }
+    return 0;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+#include "network_framework.h"
+
+struct SurakartaBackend {
+    std::string address;
+    int port = 0;
+
+    /// @brief Parse "<address>:<port>".
+    static std::optional<SurakartaBackend> Parse(const std::string& text);
+
+    std::string ToString() const { return address + ":" + std::to_string(port); }
+};
+
+// Picks the backend of a room by consistent hashing, so that both players of a room, and
+// whoever comes back to it, are sent to the same server. Each backend stands at a number of
+// points of a ring of 64-bit hashes, and a room goes to the first point at or after its own
+// hash. So adding a backend to n others takes over only about 1/(n+1) of the rooms, all from
+// the others and none moved between them, and the rooms are spread evenly enough with many
+// points each.
+//
+// The points are hashes of the address and port only, so every proxy given the same backends
+// picks the same one for a room, whatever their order.
+class SurakartaBackendRing {
+   public:
+    explicit SurakartaBackendRing(std::vector<SurakartaBackend> backends, int points_per_backend = 160);
+
+    /// @return The index of the backend of the room, in the order given.
+    size_t Pick(int room_id) const;
+
+    /// @return The index of the backend for a connection that does not start with a READY.
+    size_t PickDefault() const { return Pick(0); }
+
+    const std::vector<SurakartaBackend>& Backends() const { return backends_; }
+
+    /// @return The room a connection asks for, if its first message is a READY.
+    static std::optional<int> RoomOf(const NetworkFramework::Message& first);
+
+   private:
+    std::vector<SurakartaBackend> backends_;
+    std::vector<std::pair<uint64_t, uint32_t>> points_;  // the hash and the backend, by hash
+};
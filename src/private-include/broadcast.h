@@ -0,0 +1,35 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include "network_framework.h"
+#include "wire_codec.h"
+
+// One event for the spectators of a room. It is encoded once in each wire encoding, and the
+// bytes are shared, read-only, by every connection it is sent to.
+struct SurakartaBroadcastFrame {
+    explicit SurakartaBroadcastFrame(NetworkFramework::Message message)
+        : message(std::move(message)), json(Encode(this->message, false)), compact(Encode(this->message, true)) {}
+
+    const NetworkFramework::Message message;
+    const std::shared_ptr<const std::string> json;
+    const std::shared_ptr<const std::string> compact;
+
+   private:
+    static std::shared_ptr<const std::string> Encode(const NetworkFramework::Message& message, bool compact) {
+        std::string bytes;
+        SurakartaWireEncode(message, bytes, compact);
+        return std::make_shared<const std::string>(std::move(bytes));
+    }
+};
+
+// A connection that can take a frame as it is, without encoding it again. The frame goes
+// around the socket wrappers, so it is not logged.
+class SurakartaFrameSink {
+   public:
+    virtual ~SurakartaFrameSink() = default;
+
+    /// @brief Send the frame or queue it, without ever blocking.
+    /// @return false if the connection is closed, or so far behind that it has been closed.
+    virtual bool SendFrame(const std::shared_ptr<const SurakartaBroadcastFrame>& frame) = 0;
+};
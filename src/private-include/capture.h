@@ -0,0 +1,160 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include "metrics.h"
+#include "socket.h"
+
+// The traffic capture: the messages a proxy passes between its clients and the servers,
+// appended to one file so that they can be looked at later with surakarta-network-capture-decode
+// instead of being formatted as they go by.
+//
+// A capture file is a SurakartaCaptureFileHeader followed by records. Every record starts with a
+// SurakartaCaptureRecordHeader and a payload given by its type, without padding. Numbers are in
+// the byte order of the host, which is little-endian on every platform the proxy runs on. A file
+// that already exists is appended to. The last record may be torn by a crash; a reader stops at
+// the first record that does not fit in the file.
+
+constexpr char SURAKARTA_CAPTURE_MAGIC[8] = {'S', 'K', 'C', 'A', 'P', 'T', '0', '1'};
+
+enum class SurakartaCaptureRecordType : uint8_t {
+    OPEN = 1,      // a connection was accepted; followed by its peer, "<address>:<port>"
+    RECEIVED = 2,  // a message from the client; followed by SurakartaCaptureMessage
+    SENT = 3,      // a message to the client; followed by SurakartaCaptureMessage
+    CLOSE = 4,     // the connection is gone; no payload
+    DROPPED = 5,   // records were dropped before this one; followed by their number, a uint64_t
+};
+
+struct SurakartaCaptureFileHeader {
+    char magic[8];
+    uint64_t created_ns;  // since the Unix epoch
+};
+
+struct SurakartaCaptureRecordHeader {
+    uint32_t size;        // of the header and the payload
+    uint32_t connection;  // numbered from 1 in each run of the proxy; 0 for DROPPED
+    uint64_t time_ns;     // since the Unix epoch
+    uint8_t type;
+    uint8_t reserved[7];
+};
+
+// Followed by data1, data2 and data3.
+struct SurakartaCaptureMessage {
+    int32_t opcode;
+    uint32_t data1_size;
+    uint32_t data2_size;
+    uint32_t data3_size;
+};
+
+static_assert(sizeof(SurakartaCaptureFileHeader) == 16);
+static_assert(sizeof(SurakartaCaptureRecordHeader) == 24);
+static_assert(sizeof(SurakartaCaptureMessage) == 16);
+
+// Appends records to a capture file from any thread. Appending copies the record into the
+// batch being gathered under a lock, which is all the forwarding threads pay; a writer thread of
+// its own writes the batch every flush interval. If the writer falls behind by more than the
+// buffer, records are dropped and counted rather than slowing the proxy down.
+class SurakartaCapture {
+   public:
+    struct Options {
+        std::string path;
+        size_t buffer_bytes = 64 << 20;
+        std::chrono::milliseconds flush_interval = std::chrono::milliseconds(100);
+    };
+
+    /// @brief Open the file for appending. Throws if it cannot, or if it is not a capture file.
+    explicit SurakartaCapture(Options options);
+
+    /// @brief Write what has been appended, then stop the writer.
+    ~SurakartaCapture();
+
+    SurakartaCapture(const SurakartaCapture&) = delete;
+    SurakartaCapture& operator=(const SurakartaCapture&) = delete;
+
+    /// @return The connection, for the later records of it.
+    uint32_t Open(const std::string& peer);
+    void Received(uint32_t connection, const NetworkFramework::Message& message);
+    void Sent(uint32_t connection, const NetworkFramework::Message& message);
+    void Close(uint32_t connection);
+
+    /// @brief Wait until everything appended so far is written.
+    void Flush();
+
+    long long Records() const { return records_.Value(); }
+    long long Bytes() const { return bytes_.Value(); }
+    long long Dropped() const { return dropped_.Value(); }
+    long long Failures() const { return failures_.Value(); }
+
+   private:
+    void AppendMessage(SurakartaCaptureRecordType type, uint32_t connection, const NetworkFramework::Message& message);
+    // Copy a record into the batch, or drop it if the batch is full.
+    void Append(SurakartaCaptureRecordType type,
+                uint32_t connection,
+                const void* payload,
+                size_t payload_size,
+                const std::string& data1 = std::string(),
+                const std::string& data2 = std::string(),
+                const std::string& data3 = std::string());
+
+    void Run();
+    void Write(const std::string& batch);
+
+    const Options options_;
+    std::FILE* file_ = nullptr;
+
+    std::mutex mutex_;
+    std::condition_variable when_written_;
+    std::condition_variable when_flush_requested_;
+    std::string batch_;
+    uint64_t appended_ = 0;  // records, counted from the start, the dropped ones included
+    uint64_t written_ = 0;
+    uint64_t dropped_unreported_ = 0;
+    uint32_t next_connection_ = 1;
+    bool flush_requested_ = false;
+    bool stopping_ = false;
+
+    SurakartaCounter records_;
+    SurakartaCounter bytes_;
+    SurakartaCounter dropped_;
+    SurakartaCounter failures_;
+    std::thread writer_;  // last, so that it starts once the rest is ready
+};
+
+struct SurakartaCaptureRecord {
+    SurakartaCaptureRecordType type;
+    uint32_t connection;
+    uint64_t time_ns;
+    std::string peer;                   // of OPEN
+    NetworkFramework::Message message;  // of RECEIVED and SENT
+    uint64_t dropped = 0;               // of DROPPED
+};
+
+// Reads a capture file from the start, one record at a time.
+class SurakartaCaptureReader {
+   public:
+    /// @brief Throws if the file cannot be opened or is not a capture file.
+    explicit SurakartaCaptureReader(const std::string& path);
+    ~SurakartaCaptureReader();
+    SurakartaCaptureReader(const SurakartaCaptureReader&) = delete;
+    SurakartaCaptureReader& operator=(const SurakartaCaptureReader&) = delete;
+
+    const SurakartaCaptureFileHeader& Header() const { return header_; }
+
+    /// @return The next record, or nothing at the end of the file or at a torn record.
+    std::optional<SurakartaCaptureRecord> Next();
+
+    /// @brief Whether reading stopped at a record that does not fit in the file.
+    bool Torn() const { return torn_; }
+
+   private:
+    std::FILE* file_ = nullptr;
+    SurakartaCaptureFileHeader header_{};
+    std::string payload_;
+    bool torn_ = false;
+};
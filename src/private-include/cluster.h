@@ -0,0 +1,128 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include "backend_ring.h"
+#include "message.h"
+#include "metrics.h"
+#include "network_framework.h"
+#include "surakarta_logger.h"
+#include "upstream_pool.h"
+
+// Several servers may act as one cluster, each given the same list of them. Every room
+// belongs to one server of the list, picked by consistent hashing of its id (see
+// backend_ring.h), so that any server knows where a room is without asking another, and a
+// proxy given the same list sends the players of a room straight there. A server asked for a
+// room of another either relays the connection there (SurakartaClusterRelay) or redirects it
+// with a REJECT naming the server (SURAKARTA_REDIRECT_REASON).
+//
+// Only the rooms asked for by their number are placed so. Players who ask to play anyone are
+// paired by the server they are connected to, in a room whose number belongs to that server,
+// so that they may come back to their seat through any server.
+
+struct SurakartaClusterCounters {
+    SurakartaCounter forwarded;
+    SurakartaCounter redirected;
+    SurakartaCounter relaying;  // used as a gauge
+    // from receiving a READY for a room of another server until it has been passed on there
+    SurakartaHistogram forward_latency;
+};
+
+class SurakartaClusterRelay;
+class SurakartaClusterRelayLoop;
+
+// Where the rooms of a cluster are, seen from one of its servers.
+class SurakartaClusterDirectory {
+   public:
+    /// @param nodes The servers of the cluster, as "<address>:<port>", this one included.
+    /// @param self This server, as written in nodes.
+    /// @param pool_options The connections kept ready to each of the other servers.
+    /// @param secret Shared by every server of the cluster, and carried by the READYs relayed;
+    /// empty for none, in which case no READY is taken as relayed.
+    /// @throw std::invalid_argument if a server cannot be parsed, or self is not among them.
+    /// @throw std::runtime_error if a server cannot be resolved.
+    SurakartaClusterDirectory(const std::vector<std::string>& nodes,
+                              const std::string& self,
+                              SurakartaUpstreamPoolOptions pool_options,
+                              std::string secret = "");
+
+    /// @brief Stop relaying; the relayed clients are closed.
+    ~SurakartaClusterDirectory();
+
+    SurakartaClusterDirectory(const SurakartaClusterDirectory&) = delete;
+    SurakartaClusterDirectory& operator=(const SurakartaClusterDirectory&) = delete;
+
+    /// @return The index of the server of the room, in the order given.
+    size_t Owner(int room_id) const { return ring_.Pick(room_id); }
+    bool IsLocal(int room_id) const { return Owner(room_id) == self_; }
+    const SurakartaBackend& Node(size_t node) const { return ring_.Backends()[node]; }
+    size_t Size() const { return ring_.Backends().size(); }
+
+    /// @brief Remove SURAKARTA_CLUSTER_FORWARDED_OPTION from a READY.
+    /// @param address The address of the connection it came from.
+    /// @return Whether it has been relayed here by another server of the cluster: it had the
+    /// option, with the secret of the cluster, on a connection from the address of one of them.
+    bool TakeForwarded(NetworkFramework::Message& ready, const std::string& address) const;
+
+    /// @brief Relay a client to another server, starting with its READY.
+    /// @throw std::logic_error if relaying is not supported (see SurakartaClusterRelay).
+    std::unique_ptr<SurakartaClusterRelay> Relay(size_t node,
+                                                 std::shared_ptr<NetworkFramework::Socket> client,
+                                                 SurakartaNetworkMessageReady ready,
+                                                 std::chrono::steady_clock::time_point received,
+                                                 SurakartaClusterCounters& counters,
+                                                 std::shared_ptr<SurakartaLogger> logger);
+
+   private:
+    static std::vector<SurakartaBackend> ParseNodes(const std::vector<std::string>& nodes);
+
+    bool IsPeer(const std::string& address) const;
+
+    SurakartaBackendRing ring_;
+    size_t self_;
+    const std::string secret_;
+    std::vector<std::string> peer_addresses_;       // of every server, numeric
+    std::vector<std::vector<char>> socket_addresses_;  // of every server, a sockaddr of its family
+    std::vector<size_t> pooled_;  // the index in the pool of each server; unused for this one
+    std::unique_ptr<SurakartaUpstreamPool> pool_;  // of the other servers, if connections are kept ready
+    std::shared_ptr<SurakartaClusterRelayLoop> relays_;  // last, as it uses the pool
+};
+
+// A connection relayed to the server of its room. The thread that drives the connection passes
+// on what the client sends; one thread of the directory drives the connections to the servers
+// of all relays without blocking, connecting, passing on what the client has sent meanwhile and
+// then what the server sends. If the server cannot be reached, the client is sent a REJECT and
+// its connection closed; once either side closes, so does the other, and so do both once more
+// than MAX_OUTBOUND_BYTES wait for a server that does not read. Closing hands the connection to
+// the server over to that thread, so no relay is ever waited for.
+//
+// Only available on Linux; elsewhere a server redirects the clients of rooms of other servers.
+class SurakartaClusterRelay {
+   public:
+    struct State;
+
+    static constexpr size_t MAX_OUTBOUND_BYTES = 256 * 1024;
+
+    SurakartaClusterRelay(std::shared_ptr<State> state, std::weak_ptr<SurakartaClusterRelayLoop> loop)
+        : state_(std::move(state)), loop_(std::move(loop)) {}
+
+    /// @brief Close the connection to the server.
+    ~SurakartaClusterRelay() { Close(); }
+
+    SurakartaClusterRelay(const SurakartaClusterRelay&) = delete;
+    SurakartaClusterRelay& operator=(const SurakartaClusterRelay&) = delete;
+
+    /// @brief Pass a message from the client on to the server.
+    void Forward(NetworkFramework::Message message);
+
+    /// @brief The client has gone; close the connection to the server.
+    void Close();
+
+    static bool IsSupported();
+
+   private:
+    const std::shared_ptr<State> state_;
+    const std::weak_ptr<SurakartaClusterRelayLoop> loop_;
+};
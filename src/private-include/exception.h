@@ -2,6 +2,7 @@
 
 #include <exception>
 #include "network_framework.h"
+#include "surakarta.h"
 
 class SurakartaNetworkException : public std::exception {};
 
@@ -32,6 +33,19 @@ class SurakartaNetworkUnexpectedEofException : public SurakartaNetworkException
     std::string message_;
 };
 
+class SurakartaNetworkWireFormatException : public SurakartaNetworkException {
+   public:
+    SurakartaNetworkWireFormatException(const std::string& reason)
+        : message_(std::string("Malformed message on the wire: ") + reason) {}
+
+    const char* what() const noexcept override {
+        return message_.c_str();
+    }
+
+   private:
+    std::string message_;
+};
+
 class SurakartaNetworkUnexpectedMessageException : public SurakartaNetworkException {
    public:
     SurakartaNetworkUnexpectedMessageException(NetworkFramework::Message message)
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "backend_ring.h"
+#include "upstream_pool.h"
+
+class SurakartaForwardingProxyImpl;
+
+// A proxy that neither reads nor changes what it carries: the bytes of each connection are
+// moved to a connection of its own to the server, and back, with splice() through a pipe of
+// the event loop, so that they only leave the kernel when the receiver cannot take them yet.
+// All connections are served by a small fixed set of epoll event loops, like the reactor
+// server, instead of two threads each, and each needs no descriptors besides its two sockets.
+//
+// With several servers, the proxy peeks at the READY each connection starts with, and picks the
+// server of its room from a SurakartaBackendRing. Nothing else is parsed, so the peers may agree
+// on any encoding between themselves. There is no middleware either: use ReverseProxyService to
+// log the traffic. Only available on Linux.
+class SurakartaForwardingProxy {
+   public:
+    /// @brief Start listening. Throws if the port cannot be bound, the server address cannot be
+    /// resolved or the platform is not supported.
+    /// @param server_address The server each connection is forwarded to.
+    /// @param server_port The port of the server.
+    /// @param port The port to listen on.
+    /// @param loops The number of event loops; 0 means one per hardware thread.
+    SurakartaForwardingProxy(const std::string& server_address, int server_port, int port, int loops = 0);
+
+    /// @param servers The servers the rooms are spread over, at least one.
+    /// @param pool_options The connections to keep ready for each server, if any.
+    SurakartaForwardingProxy(std::vector<SurakartaBackend> servers, int port, int loops = 0, SurakartaUpstreamPoolOptions pool_options = {});
+
+    ~SurakartaForwardingProxy();
+
+    /// @brief Stop the event loops and close every connection.
+    void Shutdown();
+
+    /// @brief The number of connections being forwarded.
+    long long Connections() const;
+
+    /// @brief The number of bytes forwarded so far, in both directions.
+    long long BytesForwarded() const;
+
+    /// @brief The number of connections sent to a server so far, by its index in the list given.
+    long long Routed(size_t server) const;
+
+    /// @brief The pool of connections to the servers, or nullptr if there is none.
+    const SurakartaUpstreamPool* UpstreamPool() const;
+
+    static bool IsSupported();
+
+   private:
+    std::shared_ptr<SurakartaForwardingProxyImpl> impl_;
+};
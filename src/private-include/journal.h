@@ -0,0 +1,227 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+#include "metrics.h"
+#include "surakarta.h"
+#include "surakarta_logger.h"
+
+// The game journal: an append-only record of every game played, written in segments.
+//
+// A segment is a file named journal-<index>.skj in the journal directory, made of a
+// SurakartaJournalSegmentHeader followed by records. Every record starts with a
+// SurakartaJournalRecordHeader and a payload given by its type, and is padded to a multiple of
+// 8 bytes, so that a segment mapped into memory can be read in place. Numbers are in the byte
+// order of the host, which is little-endian on every platform the server runs on.
+//
+// A service starts a new segment when it starts, and whenever the current one is full, so a
+// segment is only ever appended to by one process. The last records of a segment may be torn by
+// a crash; a reader stops at the first record whose size or checksum is wrong.
+//
+// A game is identified by the position of its START record, (segment index << 40) | offset, so
+// that it is unique within the directory and tells a reader where the game begins.
+
+constexpr char SURAKARTA_JOURNAL_MAGIC[8] = {'S', 'K', 'J', 'R', 'N', 'L', '0', '1'};
+
+enum class SurakartaJournalRecordType : uint8_t {
+    START = 1,  // followed by SurakartaJournalStart
+    MOVE = 2,   // followed by SurakartaJournalMove
+    END = 3,    // followed by SurakartaJournalEnd
+};
+
+struct SurakartaJournalSegmentHeader {
+    char magic[8];
+    uint64_t index;
+    uint64_t created_ns;  // since the Unix epoch
+    uint64_t reserved;
+};
+
+struct SurakartaJournalRecordHeader {
+    uint32_t size;      // of the header and the payload, without the padding
+    uint32_t checksum;  // CRC-32 of the size bytes from the field after this one
+    uint64_t time_ns;   // since the Unix epoch
+    uint64_t game;
+    int32_t room;
+    uint8_t type;
+    uint8_t reserved[3];
+};
+
+// Followed by the usernames of the first and the second player, in that order.
+struct SurakartaJournalStart {
+    uint8_t first_player_color;
+    uint8_t second_player_color;
+    uint16_t first_player_username_size;
+    uint16_t second_player_username_size;
+    uint8_t reserved[2];
+};
+
+struct SurakartaJournalMove {
+    uint8_t from_x, from_y, to_x, to_y;
+    uint8_t player;       // PieceColor
+    uint8_t move_reason;  // SurakartaIllegalMoveReason, which tells whether it was legal
+    uint8_t reserved[2];
+};
+
+struct SurakartaJournalEnd {
+    static constexpr uint8_t NO_MOVE_REASON = 0xff;
+
+    uint8_t end_reason;           // SurakartaEndReason
+    uint8_t winner;               // PieceColor
+    uint8_t illegal_move_reason;  // SurakartaIllegalMoveReason, or NO_MOVE_REASON
+    uint8_t reserved[5];
+};
+
+static_assert(sizeof(SurakartaJournalSegmentHeader) == 32);
+static_assert(sizeof(SurakartaJournalRecordHeader) == 32);
+static_assert(sizeof(SurakartaJournalStart) == 8);
+static_assert(sizeof(SurakartaJournalMove) == 8);
+static_assert(sizeof(SurakartaJournalEnd) == 8);
+
+uint32_t SurakartaJournalChecksum(const void* data, size_t size);
+
+/// @brief The segments in a journal directory, as (index, path), in order. Throws if the
+/// directory cannot be read.
+std::vector<std::pair<uint64_t, std::string>> SurakartaJournalSegments(const std::string& directory);
+
+// A segment mapped into memory for reading. Pages are read in as the records are visited, and
+// being backed by the file, they can be dropped again by the kernel at any time. Only available
+// on Linux.
+class SurakartaJournalSegment {
+   public:
+    /// @brief Throws if the file cannot be mapped or is not a segment.
+    explicit SurakartaJournalSegment(const std::string& path);
+    ~SurakartaJournalSegment();
+    SurakartaJournalSegment(const SurakartaJournalSegment&) = delete;
+    SurakartaJournalSegment& operator=(const SurakartaJournalSegment&) = delete;
+
+    const SurakartaJournalSegmentHeader& Header() const {
+        return *reinterpret_cast<const SurakartaJournalSegmentHeader*>(data_);
+    }
+    size_t Size() const { return size_; }
+
+    /// @brief Call visit(const SurakartaJournalRecordHeader&) on every record, in order, up to the
+    /// first one that is torn. The payload follows the header.
+    /// @return The number of bytes after the last good record: 0 unless the tail is torn.
+    template <typename Visit>
+    size_t ForEachRecord(Visit&& visit) const {
+        size_t offset = sizeof(SurakartaJournalSegmentHeader);
+        while (offset + sizeof(SurakartaJournalRecordHeader) <= size_) {
+            auto record = reinterpret_cast<const SurakartaJournalRecordHeader*>(data_ + offset);
+            if (record->size < sizeof(SurakartaJournalRecordHeader) || record->size > size_ - offset)
+                break;
+            const size_t checked_from = offsetof(SurakartaJournalRecordHeader, time_ns);
+            if (SurakartaJournalChecksum(data_ + offset + checked_from, record->size - checked_from) != record->checksum)
+                break;
+            visit(*record);
+            offset += (record->size + 7) & ~(size_t)7;
+        }
+        return size_ > offset ? size_ - offset : 0;
+    }
+
+   private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+// Appends records to the journal from any thread. Appending only copies the record into the
+// batch being gathered; a writer thread of its own writes the batch and makes it durable with
+// one fdatasync, every commit interval, so that a thousand games moving at once cost a
+// thousand copies and one disk flush. Only available on Linux.
+class SurakartaJournal {
+   public:
+    struct Options {
+        std::string directory;
+        long long segment_bytes = 64LL << 20;
+        // How long a record may wait for the flush that makes it durable; the longer, the
+        // fewer flushes under load.
+        std::chrono::microseconds commit_interval = std::chrono::microseconds(2000);
+    };
+
+    /// @brief Open a new segment in the directory, which is created if needed.
+    /// Throws if it cannot, or if the platform is not supported.
+    SurakartaJournal(Options options, std::shared_ptr<SurakartaLogger> logger);
+
+    /// @brief Make what has been appended durable, then stop the writer.
+    ~SurakartaJournal();
+
+    /// @return The game, for the later records of it.
+    uint64_t Start(int room,
+                   const std::string& first_player_username,
+                   PieceColor first_player_color,
+                   const std::string& second_player_username,
+                   PieceColor second_player_color);
+    void Move(uint64_t game, int room, const SurakartaMove& move, SurakartaIllegalMoveReason move_reason);
+    void End(uint64_t game,
+             int room,
+             SurakartaEndReason end_reason,
+             PieceColor winner,
+             std::optional<SurakartaIllegalMoveReason> illegal_move_reason);
+
+    /// @brief Wait until everything appended so far is durable, without waiting for the commit interval.
+    void Sync();
+
+    static bool IsSupported();
+
+    long long Records() const { return records_.Value(); }
+    long long Commits() const { return commits_.Value(); }
+    long long Bytes() const { return bytes_.Value(); }
+    long long Failures() const { return failures_.Value(); }
+    const SurakartaHistogram& CommitLatency() const { return commit_latency_; }
+
+   private:
+    static constexpr size_t MAX_BATCH_BYTES = 1 << 20;  // written without waiting for the interval
+
+    struct Piece {
+        uint64_t segment;
+        std::string bytes;
+    };
+
+    // @return The position of the record.
+    uint64_t Append(SurakartaJournalRecordType type,
+                    uint64_t game,
+                    int room,
+                    const void* payload,
+                    size_t payload_size);
+    // The following require mutex_.
+    void BeginSegmentLocked();
+    bool ShouldCommitLocked() const;
+
+    void Run();
+    void Write(std::vector<Piece>& batch);
+    void OpenSegment(uint64_t segment);
+    void CloseSegment();
+
+    const Options options_;
+    const std::shared_ptr<SurakartaLogger> logger_;
+
+    std::mutex mutex_;
+    std::condition_variable when_appended_;
+    std::condition_variable when_durable_;
+    std::vector<Piece> batch_;
+    size_t batch_bytes_ = 0;
+    uint64_t segment_ = 0;
+    uint64_t segment_offset_ = 0;
+    uint64_t appended_ = 0;  // records, counted from the start
+    uint64_t durable_ = 0;
+    bool sync_requested_ = false;
+    bool stopping_ = false;
+
+    // only touched by the writer
+    int fd_ = -1;
+    uint64_t open_segment_ = 0;
+
+    SurakartaCounter records_;
+    SurakartaCounter commits_;
+    SurakartaCounter bytes_;
+    SurakartaCounter failures_;
+    SurakartaHistogram commit_latency_;  // of writing a batch and flushing it
+    std::thread writer_;
+};
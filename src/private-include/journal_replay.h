@@ -0,0 +1,98 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "journal.h"
+#include "surakarta.h"
+
+// The replay of a journal: every game in it rebuilt with the rules the server plays by, and
+// summed up, for surakarta-network-replay.
+//
+// Segments are mapped, not read, and handed out to the threads one at a time. A thread keeps
+// the records of each game it has seen the START of until the END, then rebuilds the game and
+// adds it to its own totals, so that memory grows with the games in flight, not with the
+// journal. A game that crosses from one segment into the next is left in pieces by both threads
+// and put together once they are done.
+
+struct SurakartaReplayUser {
+    long long games = 0;
+    long long wins = 0;
+    long long losses = 0;
+    long long as_black = 0;
+};
+
+// What a thread has summed up; merged at the end.
+struct SurakartaReplayTotals {
+    static constexpr int MAX_LENGTH = 1000;  // longer games share the last bucket
+    static constexpr int COLORS = (int)PieceColor::UNKNOWN + 1;
+    static constexpr int END_REASONS = (int)SurakartaEndReason::ILLIGAL_MOVE + 1;
+
+    long long games = 0;
+    long long moves = 0;
+    long long mismatched = 0;  // games in which the rules disagree with the journal about a move
+    long long winners[COLORS] = {};
+    long long end_reasons[END_REASONS] = {};
+    std::vector<long long> lengths = std::vector<long long>(MAX_LENGTH + 1);
+    std::unordered_map<std::string, SurakartaReplayUser> users;
+
+    void Merge(const SurakartaReplayTotals& other);
+    int LengthPercentile(double p) const;
+};
+
+class SurakartaJournalReplay {
+   public:
+    /// @param rebuild Whether to play the moves by the rules, or only sum up the records.
+    explicit SurakartaJournalReplay(bool rebuild)
+        : rebuild_(rebuild) {}
+
+    /// @brief Map the segments of the given directories, and the given segments. The ones that
+    /// cannot be are left out, and told of by Errors().
+    /// @return false if no segment could be mapped.
+    bool Open(const std::vector<std::string>& paths);
+
+    /// @brief Replay every segment on the given number of threads, calling progress every
+    /// second meanwhile with the segments taken and the games replayed so far.
+    void Run(int threads, std::function<void(size_t, long long)> progress = nullptr);
+
+    const SurakartaReplayTotals& Totals() const { return totals_; }
+    const std::vector<std::string>& Errors() const { return errors_; }
+    size_t Segments() const { return segments_.size(); }
+    long long Bytes() const { return bytes_; }
+    long long TornBytes() const { return torn_bytes_; }
+    long long Unfinished() const { return unfinished_; }
+
+   private:
+    using Record = const SurakartaJournalRecordHeader*;
+
+    // The records of a game one thread has seen, in one segment.
+    struct Piece {
+        uint64_t segment;
+        std::vector<Record> records;
+    };
+    using Pieces = std::unordered_map<uint64_t, std::vector<Piece>>;
+
+    void Work(SurakartaReplayTotals& totals, Pieces& pieces);
+    void JoinPieces(std::vector<Pieces>& pieces);
+    void Report(const std::function<void(size_t, long long)>& progress);
+
+    const bool rebuild_;
+    std::vector<std::unique_ptr<SurakartaJournalSegment>> segments_;
+    std::vector<std::string> errors_;
+    long long bytes_ = 0;
+    std::atomic<size_t> next_segment_ = 0;
+    std::atomic<long long> replayed_ = 0;
+    std::atomic<long long> torn_bytes_ = 0;
+    long long unfinished_ = 0;
+    SurakartaReplayTotals totals_;
+    std::mutex mutex_;
+    std::condition_variable when_done_;
+    bool done_ = false;
+};
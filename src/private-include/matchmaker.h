@@ -0,0 +1,160 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "metrics.h"
+#include "mpmc_ring.h"
+#include "surakarta.h"
+
+// Pairs players who asked for no room in particular. Joining only pushes the player's ticket
+// onto a lock-free ring; one matchmaker thread takes the tickets in the order they came and
+// pairs each with the player who has waited longest among those it can play against, so the
+// queues of waiting players need no lock, and two players joining at once cannot miss each
+// other. Two players can play unless they asked for the same color, as ResolveColor decides.
+//
+// A ticket is WAITING until the matchmaker pairs it or its player leaves; whichever comes
+// first wins the compare-and-swap on its state. Tickets left behind in the queues are skipped.
+//
+// Ticket must have the members `std::atomic<int> state`, `PieceColor color` and
+// `std::chrono::steady_clock::time_point joined_at`.
+template <typename Ticket>
+class SurakartaMatchmaker {
+   public:
+    using TicketPtr = std::shared_ptr<Ticket>;
+
+    enum State : int {
+        WAITING,
+        MATCHED,
+        CANCELLED,
+    };
+
+    /// @param match Called on the matchmaker thread with the player who waited and the one who
+    /// joined, in that order, once both are MATCHED. If it throws, both are CANCELLED.
+    SurakartaMatchmaker(size_t capacity, std::function<void(const TicketPtr&, const TicketPtr&)> match)
+        : match_(std::move(match)), ring_(capacity), thread_([this] { Run(); }) {}
+
+    /// @brief Players still waiting are left so.
+    ~SurakartaMatchmaker() {
+        {
+            std::lock_guard lock(mutex_);
+            stopping_ = true;
+            when_joined_.notify_one();
+        }
+        thread_.join();
+    }
+
+    /// @return false if too many players are joining at once.
+    bool Join(TicketPtr ticket) {
+        waiting_.Add();
+        if (!ring_.TryPush(std::move(ticket))) {
+            waiting_.Add(-1);
+            return false;
+        }
+        // only the first joiner to see the matchmaker asleep pays for the wake-up
+        if (sleeping_.load(std::memory_order_relaxed) && sleeping_.exchange(false)) {
+            std::lock_guard lock(mutex_);
+            when_joined_.notify_one();
+        }
+        return true;
+    }
+
+    /// @return false if the player has been paired meanwhile, or is being paired this very moment.
+    bool Cancel(Ticket& ticket) {
+        int expected = WAITING;
+        if (ticket.state.compare_exchange_strong(expected, CANCELLED)) {
+            waiting_.Add(-1);
+            return true;
+        }
+        return expected == CANCELLED;
+    }
+
+    /// @brief The number of players who joined and are neither paired nor gone.
+    long long Waiting() const { return waiting_.Value(); }
+    long long Pairs() const { return pairs_.Value(); }
+    /// @brief From joining until being paired, for every player paired.
+    const SurakartaHistogram& Wait() const { return wait_; }
+
+   private:
+    void Run() {
+        while (true) {
+            TicketPtr ticket;
+            while (ring_.TryPop(ticket))
+                Pair(std::move(ticket));
+            std::unique_lock lock(mutex_);
+            if (stopping_)
+                return;
+            sleeping_ = true;
+            if (ring_.Empty())
+                when_joined_.wait_for(lock, std::chrono::milliseconds(10));
+            sleeping_ = false;
+        }
+    }
+
+    void Pair(TicketPtr ticket) {
+        int expected = WAITING;
+        if (!ticket->state.compare_exchange_strong(expected, MATCHED))
+            return;  // gone before its turn
+        while (auto* queue = OldestOpponentQueue(ticket->color)) {
+            auto waited = std::move(queue->front());
+            queue->pop_front();
+            expected = WAITING;
+            if (!waited->state.compare_exchange_strong(expected, MATCHED))
+                continue;
+            auto now = std::chrono::steady_clock::now();
+            wait_.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(now - waited->joined_at).count());
+            wait_.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(now - ticket->joined_at).count());
+            waiting_.Add(-2);
+            pairs_.Add();
+            try {
+                match_(waited, ticket);
+            } catch (...) {
+                waited->state = CANCELLED;
+                ticket->state = CANCELLED;
+            }
+            return;
+        }
+        // Nobody to play against: back to WAITING, so that its player may leave again. One that
+        // tried to leave meanwhile has been waiting for this.
+        ticket->state = WAITING;
+        QueueOf(ticket->color).push_back(std::move(ticket));
+    }
+
+    // @return The queue whose first player has waited longest among those who can play against
+    // the color, or null if there is none.
+    std::deque<TicketPtr>* OldestOpponentQueue(PieceColor color) {
+        std::deque<TicketPtr>* oldest = nullptr;
+        for (auto* queue : {&black_, &white_, &any_}) {
+            if (queue == &QueueOf(color) && color != PieceColor::NONE)
+                continue;
+            // the players who have left are dropped when they come to the front
+            while (!queue->empty() && queue->front()->state.load() == CANCELLED)
+                queue->pop_front();
+            if (!queue->empty() && (oldest == nullptr || queue->front()->joined_at < oldest->front()->joined_at))
+                oldest = queue;
+        }
+        return oldest;
+    }
+
+    std::deque<TicketPtr>& QueueOf(PieceColor color) {
+        return color == PieceColor::BLACK ? black_ : color == PieceColor::WHITE ? white_ : any_;
+    }
+
+    const std::function<void(const TicketPtr&, const TicketPtr&)> match_;
+    SurakartaMpmcRing<TicketPtr> ring_;
+    // the players waiting, by the color they asked for; only touched by the matchmaker thread
+    std::deque<TicketPtr> black_, white_, any_;
+    std::atomic<bool> sleeping_ = false;
+    std::mutex mutex_;
+    std::condition_variable when_joined_;
+    bool stopping_ = false;
+    SurakartaCounter waiting_;  // used as a gauge
+    SurakartaCounter pairs_;
+    SurakartaHistogram wait_;
+    std::thread thread_;  // last, so that it starts once the rest is ready
+};
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "socket.h"
+
+// A socket that works in memory, without touching the network: either a loopback whose
+// Receive() returns what has been sent on it, or one end of a connected pair. Used to
+// measure and test the socket wrappers and the service alone. Once its queues have grown
+// to the number of messages in flight, it never allocates.
+class SurakartaMemorySocket : public NetworkFramework::Socket {
+   public:
+    /// @brief A loopback socket.
+    SurakartaMemorySocket()
+        : inbox_(std::make_shared<Queue>()), outbox_(inbox_) {}
+
+    /// @brief Two connected sockets; what is sent on one is received on the other.
+    static std::pair<std::shared_ptr<SurakartaMemorySocket>, std::shared_ptr<SurakartaMemorySocket>> CreatePair() {
+        auto a_to_b = std::make_shared<Queue>();
+        auto b_to_a = std::make_shared<Queue>();
+        return std::make_pair(std::shared_ptr<SurakartaMemorySocket>(new SurakartaMemorySocket(b_to_a, a_to_b)),
+                              std::shared_ptr<SurakartaMemorySocket>(new SurakartaMemorySocket(a_to_b, b_to_a)));
+    }
+
+    void Send(NetworkFramework::Message message) override {
+        outbox_->Push(std::move(message));
+    }
+
+    std::optional<NetworkFramework::Message> Receive() override {
+        return inbox_->Pop();
+    }
+
+    /// @brief Both ends see EOF once they have received what was already sent.
+    void Close() override {
+        inbox_->Close();
+        outbox_->Close();
+    }
+
+    std::string PeerAddress() const override { return "memory"; }
+    int PeerPort() const override { return 0; }
+
+   private:
+    class Queue {
+       public:
+        void Push(NetworkFramework::Message message) {
+            std::lock_guard lock(mutex_);
+            if (closed_)
+                return;
+            if (size_ == ring_.size())
+                Grow();
+            ring_[(head_ + size_) % ring_.size()] = std::move(message);
+            size_++;
+            when_pushed_.notify_one();
+        }
+
+        std::optional<NetworkFramework::Message> Pop() {
+            std::unique_lock lock(mutex_);
+            when_pushed_.wait(lock, [this] { return closed_ || size_ > 0; });
+            if (size_ == 0)
+                return std::nullopt;
+            std::optional<NetworkFramework::Message> message = std::move(ring_[head_]);
+            head_ = (head_ + 1) % ring_.size();
+            size_--;
+            return message;
+        }
+
+        void Close() {
+            std::lock_guard lock(mutex_);
+            closed_ = true;
+            when_pushed_.notify_all();
+        }
+
+       private:
+        void Grow() {
+            std::vector<NetworkFramework::Message> ring(std::max<size_t>(8, ring_.size() * 2));
+            for (size_t i = 0; i < size_; i++)
+                ring[i] = std::move(ring_[(head_ + i) % ring_.size()]);
+            ring_.swap(ring);
+            head_ = 0;
+        }
+
+        std::mutex mutex_;
+        std::condition_variable when_pushed_;
+        std::vector<NetworkFramework::Message> ring_;  // size_ messages from head_, wrapping around
+        size_t head_ = 0;
+        size_t size_ = 0;
+        bool closed_ = false;
+    };
+
+    SurakartaMemorySocket(std::shared_ptr<Queue> inbox, std::shared_ptr<Queue> outbox)
+        : inbox_(std::move(inbox)), outbox_(std::move(outbox)) {}
+
+    const std::shared_ptr<Queue> inbox_;
+    const std::shared_ptr<Queue> outbox_;
+};
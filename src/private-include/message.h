@@ -4,22 +4,67 @@
 #include "opcode.h"
 #include "surakarta.h"
 
+// Typed views of NetworkFramework::Message. Each class is the message itself: the string
+// accessors return references to data1..data3 instead of keeping copies, and the
+// constructors from a Message take it by value, so that a received message can be moved in
+// and decoded without copying its strings.
+
+// Appended to the room id in data3 by a client that wants to watch the room rather than play,
+// and by the server in its answer. Servers that do not know it read the room id alone.
+inline constexpr const char* SURAKARTA_SPECTATE_OPTION = ";spectate";
+
+// Appended to the room id in data3 as ";resume=<token>,<moves>". The server sends it to each
+// player when the game starts, with a token for that player's seat, if it keeps seats for
+// players who lose their connection. A player coming back sends it with the token and the
+// number of moves it has seen; the server answers with it and the number of moves played,
+// and sends the moves the player has not seen.
+inline constexpr const char* SURAKARTA_RESUME_OPTION = ";resume=";
+
+// The room id of a READY from a player who wants to play anyone rather than in a given room.
+// The player is paired with the next one it can play against, and told the room the server
+// picked for them in the READY that starts the game.
+inline constexpr int SURAKARTA_MATCHMAKING_ROOM_ID = -1;
+
+// Appended to the room id in data3, followed by "=" and the secret of the cluster, by a server of
+// a cluster that passes a READY on to the server of the room, which then takes the room whatever
+// it makes of the room id itself, so that no READY goes round the cluster. Clients never send it;
+// one that does without the secret is looked up as usual.
+inline constexpr const char* SURAKARTA_CLUSTER_FORWARDED_OPTION = ";forwarded";
+
+// The reason of the REJECT that a server of a cluster answers a READY for a room of another
+// server with, if it redirects players rather than relaying them, followed by
+// "<address>:<port>" of that server. The client connects there and sends the READY again.
+inline constexpr const char* SURAKARTA_REDIRECT_REASON = "Redirect to ";
+
 class SurakartaNetworkMessageReady : public NetworkFramework::Message {
    public:
     SurakartaNetworkMessageReady(const std::string& username,
                                  PieceColor color,
-                                 int room_id);
+                                 int room_id,
+                                 bool spectating = false);
 
-    SurakartaNetworkMessageReady(const NetworkFramework::Message& message);
+    SurakartaNetworkMessageReady(const std::string& username,
+                                 PieceColor color,
+                                 int room_id,
+                                 const std::string& resume_token,
+                                 int resume_moves);
 
-    std::string Username() const { return username_; }
+    SurakartaNetworkMessageReady(NetworkFramework::Message message);
+
+    const std::string& Username() const { return data1; }
     PieceColor Color() const { return color_; }
     int RoomId() const { return room_id_; }
+    bool Spectating() const { return spectating_; }
+    /// @brief Empty if the message has no SURAKARTA_RESUME_OPTION.
+    const std::string& ResumeToken() const { return resume_token_; }
+    int ResumeMoves() const { return resume_moves_; }
 
    private:
-    std::string username_;
     PieceColor color_;
     int room_id_;
+    bool spectating_ = false;
+    std::string resume_token_;
+    int resume_moves_ = 0;
 };
 
 class SurakartaNetworkMessageReject : public NetworkFramework::Message {
@@ -27,20 +72,18 @@ class SurakartaNetworkMessageReject : public NetworkFramework::Message {
     SurakartaNetworkMessageReject(const std::string& username,
                                   const std::string& reason);
 
-    SurakartaNetworkMessageReject(const NetworkFramework::Message& message);
-
-    std::string Username() const { return username_; }
-    std::string Reason() const { return reason_; }
+    SurakartaNetworkMessageReject(NetworkFramework::Message message);
 
-   private:
-    std::string username_;
-    std::string reason_;
+    const std::string& Username() const { return data1; }
+    const std::string& Reason() const { return data2; }
+    /// @brief The "<address>:<port>" the client is redirected to, or empty if it is not.
+    std::string RedirectTarget() const;
 };
 
 class SurakartaNetworkMessageMove : public NetworkFramework::Message {
    public:
     SurakartaNetworkMessageMove(const SurakartaPosition& from, const SurakartaPosition& to);
-    SurakartaNetworkMessageMove(const NetworkFramework::Message& message);
+    SurakartaNetworkMessageMove(NetworkFramework::Message message);
 
     SurakartaPosition From() const { return from_; }
     SurakartaPosition To() const { return to_; }
@@ -53,7 +96,7 @@ class SurakartaNetworkMessageMove : public NetworkFramework::Message {
 class SurakartaNetworkMessageResign : public NetworkFramework::Message {
    public:
     SurakartaNetworkMessageResign();
-    SurakartaNetworkMessageResign(const NetworkFramework::Message& message);
+    SurakartaNetworkMessageResign(NetworkFramework::Message message);
 };
 
 class SurakartaNetworkMessageEnd : public NetworkFramework::Message {
@@ -61,7 +104,7 @@ class SurakartaNetworkMessageEnd : public NetworkFramework::Message {
     SurakartaNetworkMessageEnd(std::optional<SurakartaIllegalMoveReason> illegal_move_reason,
                                SurakartaEndReason end_reason,
                                PieceColor winner);
-    SurakartaNetworkMessageEnd(const NetworkFramework::Message& message);
+    SurakartaNetworkMessageEnd(NetworkFramework::Message message);
 
     std::optional<SurakartaIllegalMoveReason> IllegalMoveReason() const { return illegal_move_reason_; }
     SurakartaEndReason EndReason() const { return end_reason_; }
@@ -76,25 +119,17 @@ class SurakartaNetworkMessageEnd : public NetworkFramework::Message {
 class SurakartaNetworkMessageLeave : public NetworkFramework::Message {
    public:
     SurakartaNetworkMessageLeave(const std::string& username, const std::string& leave_reason);
-    SurakartaNetworkMessageLeave(const NetworkFramework::Message& message);
-
-    std::string Username() const { return username_; }
-    std::string LeaveReason() const { return leave_reason_; }
+    SurakartaNetworkMessageLeave(NetworkFramework::Message message);
 
-   private:
-    std::string username_;
-    std::string leave_reason_;
+    const std::string& Username() const { return data1; }
+    const std::string& LeaveReason() const { return data2; }
 };
 
 class SurakartaNetworkMessageChat : public NetworkFramework::Message {
    public:
     SurakartaNetworkMessageChat(const std::string& username, const std::string& chat_message);
-    SurakartaNetworkMessageChat(const NetworkFramework::Message& message);
+    SurakartaNetworkMessageChat(NetworkFramework::Message message);
 
-    std::string Username() const { return username_; }
-    std::string ChatMessage() const { return chat_message_; }
-
-   private:
-    std::string username_;
-    std::string chat_message_;
+    const std::string& Username() const { return data1; }
+    const std::string& ChatMessage() const { return data2; }
 };
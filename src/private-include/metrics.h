@@ -0,0 +1,170 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Instrumentation cheap enough to leave on: recording is a relaxed atomic add on a slot that
+// belongs, in practice, to the calling thread alone, and nothing is summed until somebody asks.
+
+constexpr int SURAKARTA_METRICS_SLOTS = 16;
+
+// The slot of the calling thread. Threads take slots in turn; with more threads than slots,
+// some share one, which costs contention but not correctness.
+inline int SurakartaMetricsSlot() {
+    static std::atomic<int> next_slot = 0;
+    thread_local const int slot = next_slot.fetch_add(1, std::memory_order_relaxed) % SURAKARTA_METRICS_SLOTS;
+    return slot;
+}
+
+class SurakartaCounter {
+   public:
+    void Add(long long value = 1) {
+        slots_[SurakartaMetricsSlot()].value.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    long long Value() const {
+        long long value = 0;
+        for (auto& slot : slots_)
+            value += slot.value.load(std::memory_order_relaxed);
+        return value;
+    }
+
+   private:
+    struct alignas(64) Slot {
+        std::atomic<long long> value = 0;
+    };
+    Slot slots_[SURAKARTA_METRICS_SLOTS];
+};
+
+// A histogram of durations in nanoseconds, with buckets in the manner of HdrHistogram: below
+// 16 ns every value has a bucket of its own, and above that every power of two is split into
+// 16 buckets, so that a value is known to within about 6%. Values above about 73 minutes
+// land in the last bucket.
+class SurakartaHistogram {
+   public:
+    static constexpr int SUB_BUCKET_BITS = 4;
+    static constexpr int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static constexpr int MAX_EXPONENT = 42;
+    static constexpr int BUCKETS = (MAX_EXPONENT - SUB_BUCKET_BITS + 2) * SUB_BUCKETS;
+    SurakartaHistogram()
+        : slots_(std::make_unique<Slot[]>(SURAKARTA_METRICS_SLOTS)) {}
+
+    void Record(long long nanoseconds) {
+        auto& slot = slots_[SurakartaMetricsSlot()];
+        slot.buckets[BucketOf(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+        slot.sum.fetch_add(nanoseconds, std::memory_order_relaxed);
+    }
+
+    void RecordSince(std::chrono::steady_clock::time_point start) {
+        Record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    // Records the time from its construction to its destruction.
+    class Scope {
+       public:
+        explicit Scope(SurakartaHistogram& histogram)
+            : histogram_(histogram), start_(std::chrono::steady_clock::now()) {}
+        ~Scope() { histogram_.RecordSince(start_); }
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+        std::chrono::steady_clock::time_point Start() const { return start_; }
+
+       private:
+        SurakartaHistogram& histogram_;
+        const std::chrono::steady_clock::time_point start_;
+    };
+
+    // The sum of all slots at one point in time; recording goes on meanwhile, so a snapshot
+    // taken during a burst may be off by the values being recorded.
+    struct Snapshot {
+        long long count = 0;
+        long long sum = 0;
+        std::vector<long long> buckets;
+
+        double Mean() const { return count > 0 ? (double)sum / count : 0; }
+
+        // The middle of the bucket holding the value below which the fraction p of values lie.
+        double Percentile(double p) const {
+            if (count == 0)
+                return 0;
+            long long rank = std::max<long long>(1, (long long)(p * count + 0.5));
+            long long seen = 0;
+            for (int i = 0; i < (int)buckets.size(); i++) {
+                seen += buckets[i];
+                if (seen >= rank)
+                    return Middle(i);
+            }
+            return Middle((int)buckets.size() - 1);
+        }
+
+        double Max() const {
+            for (int i = (int)buckets.size() - 1; i >= 0; i--) {
+                if (buckets[i] > 0)
+                    return Middle(i);
+            }
+            return 0;
+        }
+    };
+
+    Snapshot Collect() const {
+        Snapshot snapshot;
+        snapshot.buckets.assign(BUCKETS, 0);
+        for (int s = 0; s < SURAKARTA_METRICS_SLOTS; s++) {
+            auto& slot = slots_[s];
+            for (int i = 0; i < BUCKETS; i++) {
+                auto value = slot.buckets[i].load(std::memory_order_relaxed);
+                snapshot.buckets[i] += value;
+                snapshot.count += value;
+            }
+            snapshot.sum += slot.sum.load(std::memory_order_relaxed);
+        }
+        return snapshot;
+    }
+
+    static int BucketOf(long long value) {
+        if (value < SUB_BUCKETS)
+            return value < 0 ? 0 : (int)value;
+        int exponent = 63 - CountLeadingZeros((uint64_t)value);
+        if (exponent > MAX_EXPONENT)
+            return BUCKETS - 1;
+        int sub_bucket = (int)(value >> (exponent - SUB_BUCKET_BITS)) - SUB_BUCKETS;
+        return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub_bucket;
+    }
+
+    static long long LowestOf(int bucket) {
+        if (bucket < SUB_BUCKETS)
+            return bucket;
+        int exponent = bucket / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+        return (long long)(SUB_BUCKETS + bucket % SUB_BUCKETS) << (exponent - SUB_BUCKET_BITS);
+    }
+
+    static double Middle(int bucket) {
+        if (bucket < SUB_BUCKETS)
+            return bucket;
+        int exponent = bucket / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+        return LowestOf(bucket) + (double)(1LL << (exponent - SUB_BUCKET_BITS)) / 2;
+    }
+
+   private:
+    static int CountLeadingZeros(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_clzll(value);
+#else
+        int zeros = 0;
+        for (uint64_t bit = 1ULL << 63; (value & bit) == 0; bit >>= 1)
+            zeros++;
+        return zeros;
+#endif
+    }
+
+    struct alignas(64) Slot {
+        std::atomic<long long> sum = 0;
+        std::atomic<long long> buckets[BUCKETS] = {};
+    };
+    std::unique_ptr<Slot[]> slots_;
+};
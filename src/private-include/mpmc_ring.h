@@ -0,0 +1,108 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+// A bounded queue for many producers and many consumers that never takes a lock, after
+// Dmitry Vyukov's design. Every cell carries a sequence number that tells whether it is free
+// for the producer of the current lap or filled for its consumer, so a push or a pop is one
+// compare-and-swap on the shared position plus one store to the cell.
+template <typename T>
+class SurakartaMpmcRing {
+   public:
+    /// @param capacity Rounded up to a power of two.
+    explicit SurakartaMpmcRing(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity)
+            size *= 2;
+        mask_ = size - 1;
+        cells_ = std::make_unique<Cell[]>(size);
+        for (size_t i = 0; i < size; i++)
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    size_t Capacity() const { return mask_ + 1; }
+
+    /// @brief Claim a free cell and let fill(T&) write it in place.
+    /// @return false if the ring is full.
+    template <typename Fill>
+    bool TryPushWith(Fill&& fill) {
+        size_t position = enqueue_.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells_[position & mask_];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            auto difference = (std::ptrdiff_t)sequence - (std::ptrdiff_t)position;
+            if (difference == 0) {
+                if (enqueue_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                    break;
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = enqueue_.load(std::memory_order_relaxed);
+            }
+        }
+        fill(cell->value);
+        cell->sequence.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool TryPush(T value) {
+        return TryPushWith([&](T& cell) { cell = std::move(value); });
+    }
+
+    /// @brief Take the oldest filled cell and let take(T&) read it in place.
+    /// @return false if the ring is empty.
+    template <typename Take>
+    bool TryPopWith(Take&& take) {
+        size_t position = dequeue_.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells_[position & mask_];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            auto difference = (std::ptrdiff_t)sequence - (std::ptrdiff_t)(position + 1);
+            if (difference == 0) {
+                if (dequeue_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                    break;
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = dequeue_.load(std::memory_order_relaxed);
+            }
+        }
+        take(cell->value);
+        cell->sequence.store(position + mask_ + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool TryPop(T& value) {
+        return TryPopWith([&](T& cell) { value = std::move(cell); });
+    }
+
+    /// @brief Whether there was nothing to pop at the time of the call.
+    bool Empty() const {
+        size_t position = dequeue_.load(std::memory_order_relaxed);
+        return (std::ptrdiff_t)cells_[position & mask_].sequence.load(std::memory_order_acquire) -
+                   (std::ptrdiff_t)(position + 1) <
+               0;
+    }
+
+    /// @brief The number of filled cells, possibly already out of date.
+    size_t ApproximateSize() const {
+        size_t dequeue = dequeue_.load(std::memory_order_relaxed);
+        size_t enqueue = enqueue_.load(std::memory_order_relaxed);
+        return enqueue > dequeue ? enqueue - dequeue : 0;
+    }
+
+   private:
+    struct alignas(64) Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> cells_;
+    size_t mask_;
+    alignas(64) std::atomic<size_t> enqueue_ = 0;
+    alignas(64) std::atomic<size_t> dequeue_ = 0;
+};
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include "broadcast.h"
+#include "socket.h"
+#include "timer_wheel.h"
+#include "worker_pool.h"
+
+// Gives a blocking NetworkFramework::Socket a Send that never blocks, as the reactor's
+// connections have. Messages are queued, and written in order by one of a few writer threads
+// shared by every connection, so that a worker sending to a player who reads slowly, or not at
+// all, goes on with its other rooms, and a connection costs no thread of its own to write.
+//
+// The socket underneath only has a blocking Send, so a writer may still be held up by a peer
+// that has stopped reading once its kernel buffers are full. Such a write is cut short by
+// closing the connection after STALL_LIMIT, which bounds how long the other connections of that
+// writer wait. A connection whose queue grows past MAX_PENDING_MESSAGES is closed as well,
+// player or spectator, rather than waited for; so is one whose write fails. What is still
+// queued is then dropped. Receive is passed through.
+//
+// It is also the frame sink of a spectator on such a connection, so that the broadcaster never
+// waits for one either.
+class SurakartaQueuedSocket : public NetworkFramework::Socket,
+                              public SurakartaFrameSink,
+                              public std::enable_shared_from_this<SurakartaQueuedSocket> {
+   public:
+    static constexpr size_t MAX_PENDING_MESSAGES = 1024;
+    static constexpr std::chrono::seconds STALL_LIMIT = std::chrono::seconds(5);
+
+    /// @param writers The writer threads; the connection is attached to one of them.
+    /// @param timers Where the stall limit of a write is kept.
+    /// Both must outlive the socket.
+    SurakartaQueuedSocket(std::shared_ptr<NetworkFramework::Socket> socket,
+                          SurakartaWorkerPool& writers,
+                          SurakartaTimerWheel& timers);
+
+    ~SurakartaQueuedSocket() override;
+
+    SurakartaQueuedSocket(const SurakartaQueuedSocket&) = delete;
+    SurakartaQueuedSocket& operator=(const SurakartaQueuedSocket&) = delete;
+
+    void Send(NetworkFramework::Message message) override;
+
+    /// @brief Queue the message of the frame. The bytes of the frame are not used, as the socket
+    /// underneath encodes for itself.
+    bool SendFrame(const std::shared_ptr<const SurakartaBroadcastFrame>& frame) override;
+
+    std::optional<NetworkFramework::Message> Receive() override { return socket_->Receive(); }
+
+    /// @brief Close the connection; what is still queued is dropped.
+    void Close() override;
+
+    std::string PeerAddress() const override { return socket_->PeerAddress(); }
+    int PeerPort() const override { return socket_->PeerPort(); }
+
+    /// @brief Wait until what is queued has been written, or the connection closed. Later sends
+    /// are dropped.
+    void Stop();
+
+   private:
+    // @return false if the connection is closed, or has been for going over the limit.
+    bool Queue(NetworkFramework::Message message);
+    // Runs on the writer: write one batch, and come back later for the rest.
+    void Flush();
+
+    const std::shared_ptr<NetworkFramework::Socket> socket_;
+    SurakartaWorkerPool& writers_;
+    SurakartaTimerWheel& timers_;
+    const int writer_;
+    std::mutex mutex_;
+    std::condition_variable when_written_;
+    std::deque<NetworkFramework::Message> queue_;
+    bool scheduled_ = false;  // a Flush is posted to the writer, or running
+    bool stopping_ = false;
+    bool closed_ = false;
+};
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include "metrics.h"
+#include "opcode.h"
+#include "socket.h"
+#include "surakarta_logger.h"
+#include "surakarta_network_service.h"
+
+// Limits the messages a connection may send, by kind, with a token bucket for each: MOVE,
+// RESIGN and LEAVE play the game; CHAT goes to the opponent; anything else, READY and opcodes
+// nobody knows included, is only ever needed a few times per game.
+//
+// It sits right above the connection, so that a message over the limit is dropped before it is
+// logged or decoded: all it costs is a comparison and a relaxed add. A connection that has had
+// too many messages dropped is closed.
+//
+// The buckets are kept as the time the next message is due if the connection sent at the
+// steady rate (GCRA): a message is let through unless it comes earlier than that by more than
+// the burst allows.
+
+enum SurakartaRateClass {
+    SURAKARTA_RATE_GAME,
+    SURAKARTA_RATE_CHAT,
+    SURAKARTA_RATE_OTHER,
+    SURAKARTA_RATE_CLASSES,
+};
+
+inline SurakartaRateClass SurakartaRateClassOf(int opcode) {
+    switch (opcode) {
+        case OPCODE::MOVE_OP:
+        case OPCODE::RESIGN_OP:
+        case OPCODE::LEAVE_OP:
+            return SURAKARTA_RATE_GAME;
+        case OPCODE::CHAT_OP:
+            return SURAKARTA_RATE_CHAT;
+        default:
+            return SURAKARTA_RATE_OTHER;
+    }
+}
+
+// Shared by every connection of a service.
+struct SurakartaRateLimitCounters {
+    SurakartaCounter dropped[SURAKARTA_RATE_CLASSES];
+    SurakartaCounter disconnected;
+};
+
+class SurakartaRateLimitWrapper : public NetworkFramework::Socket {
+   public:
+    /// @param limits By SurakartaRateClass.
+    SurakartaRateLimitWrapper(std::shared_ptr<NetworkFramework::Socket> socket,
+                              const SurakartaNetworkRateLimit (&limits)[SURAKARTA_RATE_CLASSES],
+                              int max_dropped,
+                              SurakartaRateLimitCounters& counters,
+                              std::shared_ptr<SurakartaLogger> logger)
+        : socket_(std::move(socket)), max_dropped_(max_dropped), counters_(counters), logger_(std::move(logger)) {
+        for (int i = 0; i < SURAKARTA_RATE_CLASSES; i++) {
+            auto& bucket = buckets_[i];
+            if (limits[i].per_second <= 0)
+                continue;
+            bucket.interval = std::chrono::nanoseconds((long long)(1e9 / limits[i].per_second));
+            bucket.tolerance = bucket.interval * (std::max(limits[i].burst, 1) - 1);
+        }
+    }
+
+    void Send(NetworkFramework::Message message) override { socket_->Send(std::move(message)); }
+
+    /// @brief The next message within the limits. Nothing if there is none: at the end of the
+    /// connection, when it has been closed for sending too much, or, on a connection that does
+    /// not block, when the messages received so far have all been dropped.
+    std::optional<NetworkFramework::Message> Receive() override {
+        while (true) {
+            auto message = socket_->Receive();
+            if (!message.has_value())
+                return message;
+            auto rate_class = SurakartaRateClassOf(message->opcode);
+            if (Admit(buckets_[rate_class]))
+                return message;
+            counters_.dropped[rate_class].Add();
+            if (max_dropped_ > 0 && ++dropped_ >= max_dropped_) {
+                counters_.disconnected.Add();
+                logger_->Log("Connection closed after %d messages over the rate limit.", dropped_);
+                socket_->Close();
+                return std::nullopt;
+            }
+        }
+    }
+
+    void Close() override { socket_->Close(); }
+    std::string PeerAddress() const override { return socket_->PeerAddress(); }
+    int PeerPort() const override { return socket_->PeerPort(); }
+
+   private:
+    struct Bucket {
+        std::chrono::steady_clock::duration interval = std::chrono::steady_clock::duration::zero();  // zero for no limit
+        std::chrono::steady_clock::duration tolerance = std::chrono::steady_clock::duration::zero();
+        std::chrono::steady_clock::time_point due;  // of the next message, at the steady rate
+    };
+
+    static bool Admit(Bucket& bucket) {
+        if (bucket.interval == std::chrono::steady_clock::duration::zero())
+            return true;
+        auto now = std::chrono::steady_clock::now();
+        if (bucket.due - now > bucket.tolerance)
+            return false;
+        bucket.due = std::max(bucket.due, now) + bucket.interval;
+        return true;
+    }
+
+    std::shared_ptr<NetworkFramework::Socket> socket_;
+    Bucket buckets_[SURAKARTA_RATE_CLASSES];
+    const int max_dropped_;
+    int dropped_ = 0;
+    SurakartaRateLimitCounters& counters_;
+    std::shared_ptr<SurakartaLogger> logger_;
+};
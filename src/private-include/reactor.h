@@ -0,0 +1,81 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include "broadcast.h"
+#include "socket.h"
+#include "wire_codec.h"
+
+// A non-blocking connection owned by one reactor event loop. The owning loop reads,
+// decodes and finally destroys it; any thread may Send. Send writes directly while the
+// kernel buffer has room, and otherwise queues the bytes and asks the loop for EPOLLOUT.
+// Queued frames are kept by reference, not copied.
+class SurakartaReactorConnection : public NetworkFramework::Socket, public SurakartaFrameSink {
+   public:
+    /// @brief A spectator whose queue grows past this is closed rather than waited for.
+    static constexpr size_t MAX_PENDING_FRAME_BYTES = 256 * 1024;
+
+    SurakartaReactorConnection(int fd, int epoll_fd, std::string peer_address, int peer_port)
+        : fd_(fd), epoll_fd_(epoll_fd), peer_address_(std::move(peer_address)), peer_port_(peer_port) {}
+
+    void Send(NetworkFramework::Message message) override;
+
+    bool SendFrame(const std::shared_ptr<const SurakartaBroadcastFrame>& frame) override;
+
+    /// @brief Take the next message decoded by the owning loop, or nothing after EOF.
+    std::optional<NetworkFramework::Message> Receive() override;
+
+    /// @brief Shut the connection down. The owning loop observes EOF and destroys it.
+    void Close() override;
+
+    std::string PeerAddress() const override { return peer_address_; }
+    int PeerPort() const override { return peer_port_; }
+
+    // The following methods are only called by the owning loop.
+
+    int Fd() const { return fd_; }
+
+    /// @brief Read what is available, up to MAX_READS_PER_EVENT reads, and decode it. Messages
+    /// decoded before an EOF or an error are kept for the loop to handle.
+    /// @return false on EOF, error or a malformed stream.
+    bool ReadAvailable();
+
+    bool HasInbound() const { return !inbound_.empty(); }
+
+    /// @brief Write queued bytes once the socket is writable again.
+    void FlushPending();
+
+    /// @brief Close the file descriptor. Later sends are dropped.
+    void Destroy();
+
+   private:
+    static constexpr int MAX_READS_PER_EVENT = 4;
+
+    struct Chunk {
+        std::shared_ptr<const std::string> bytes;
+        size_t offset;  // what has been written already
+    };
+
+    // The following require mutex_.
+
+    // Send bytes after whatever is queued; the part that cannot be written now is queued.
+    void SendLocked(std::shared_ptr<const std::string> bytes);
+    // @return How much could be written without blocking; all of it if the connection is broken.
+    size_t WriteLocked(const char* data, size_t size);
+    void WatchWritable(bool writable);
+
+    const int fd_;
+    const int epoll_fd_;
+    const std::string peer_address_;
+    const int peer_port_;
+
+    std::mutex mutex_;
+    bool closed_ = false;
+    std::deque<Chunk> pending_;  // bytes waiting for EPOLLOUT
+    size_t pending_size_ = 0;
+    bool peer_asked_compact_ = false;  // the peer's READY carried the compact option
+    bool compact_ = false;             // we have agreed, so messages go out compact
+
+    SurakartaWireDecoder decoder_;
+    std::deque<NetworkFramework::Message> inbound_;
+};
@@ -2,8 +2,14 @@
 
 #include <functional>
 #include <thread>
+#include "backend_ring.h"
 #include "network_framework.h"
+#include "upstream_pool.h"
 
+// Relays each connection to a server of its own, with two threads that read and write whole
+// messages. With several servers, the READY the connection starts with picks the server of its
+// room, so that both players of a room meet there. The connection to the server comes from the
+// pool, if there is one and it has one ready.
 class ReverseProxyService : public NetworkFramework::Service {
    public:
     typedef std::function<std::shared_ptr<NetworkFramework::Socket>(std::shared_ptr<NetworkFramework::Socket>)> SocketMiddleWare;
@@ -12,12 +18,23 @@ class ReverseProxyService : public NetworkFramework::Service {
         std::string server_address,
         int server_port,
         SocketMiddleWare middle_ware = [](auto socket) { return socket; })
-        : server_address_(server_address), server_port_(server_port), middle_ware_(middle_ware) {}
+        : ReverseProxyService(std::vector<SurakartaBackend>{{std::move(server_address), server_port}}, std::move(middle_ware)) {}
+
+    ReverseProxyService(
+        std::vector<SurakartaBackend> servers,
+        SocketMiddleWare middle_ware = [](auto socket) { return socket; },
+        SurakartaUpstreamPoolOptions pool_options = {})
+        : ring_(std::move(servers)),
+          middle_ware_(std::move(middle_ware)),
+          pool_(pool_options.size > 0 ? std::make_unique<SurakartaUpstreamPool>(ring_.Backends(), pool_options) : nullptr) {}
 
     void Execute(std::shared_ptr<NetworkFramework::Socket> socket) override;
 
+    /// @brief The pool of connections to the servers, or nullptr if there is none.
+    const SurakartaUpstreamPool* UpstreamPool() const { return pool_.get(); }
+
    private:
-    std::string server_address_;
-    int server_port_;
+    SurakartaBackendRing ring_;
     SocketMiddleWare middle_ware_;
+    std::unique_ptr<SurakartaUpstreamPool> pool_;
 };
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// A hash map from key to shared object, split into shards that each have their own lock,
+// so that joins and leaves on different rooms rarely contend. Lookup, insertion and removal
+// are O(1) and lock one shard only. Values() enumerates, locking each shard in turn.
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class SurakartaShardedRegistry {
+   public:
+    using ValuePtr = std::shared_ptr<Value>;
+    using ValueList = std::vector<ValuePtr>;
+
+    explicit SurakartaShardedRegistry(int shards = 64)
+        : shards_(shards) {}
+
+    /// @brief Return the value of the key, or insert the one made by create() if there is none
+    /// or the present one is retired.
+    /// @return The value and whether it has been created by this call.
+    template <typename Create, typename Retired>
+    std::pair<ValuePtr, bool> GetOrCreate(const Key& key, Create&& create, Retired&& retired) {
+        auto& shard = ShardOf(key);
+        std::lock_guard lock(shard.mutex);
+        auto it = shard.map.find(key);
+        if (it != shard.map.end() && !retired(it->second))
+            return std::make_pair(it->second, false);
+        ValuePtr value = create();
+        if (it != shard.map.end()) {
+            it->second = value;
+        } else {
+            shard.map.emplace(key, value);
+            size_++;
+        }
+        return std::make_pair(value, true);
+    }
+
+    ValuePtr Find(const Key& key) const {
+        auto& shard = ShardOf(key);
+        std::lock_guard lock(shard.mutex);
+        auto it = shard.map.find(key);
+        return it == shard.map.end() ? nullptr : it->second;
+    }
+
+    /// @brief Remove the key if it still maps to the given value.
+    bool Remove(const Key& key, const ValuePtr& value) {
+        auto& shard = ShardOf(key);
+        std::lock_guard lock(shard.mutex);
+        auto it = shard.map.find(key);
+        if (it == shard.map.end() || it->second != value)
+            return false;
+        shard.map.erase(it);
+        size_--;
+        return true;
+    }
+
+    /// @brief Every value present, locking each shard in turn. A value inserted into a shard
+    /// already visited is missed, but none present throughout.
+    ValueList Values() const {
+        ValueList result;
+        result.reserve(size_);
+        for (auto& shard : shards_) {
+            std::lock_guard lock(shard.mutex);
+            for (auto& [key, value] : shard.map)
+                result.push_back(value);
+        }
+        return result;
+    }
+
+    size_t Size() const { return size_; }
+
+   private:
+    struct alignas(64) Shard {
+        mutable std::mutex mutex;
+        std::unordered_map<Key, ValuePtr, Hash> map;
+    };
+
+    Shard& ShardOf(const Key& key) const {
+        return shards_[Hash()(key) % shards_.size()];
+    }
+
+    mutable std::vector<Shard> shards_;
+    std::atomic<size_t> size_ = 0;
+};
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <memory>
+#include "capture.h"
+#include "socket.h"
+
+// Appends every message to a capture, as the logging wrappers would log it, for a fraction of
+// the cost: the message is copied as it is and nothing is formatted.
+class SurakartaNetworkSocketCaptureWrapper : public NetworkFramework::Socket {
+   public:
+    SurakartaNetworkSocketCaptureWrapper(
+        std::shared_ptr<NetworkFramework::Socket> socket,
+        std::shared_ptr<SurakartaCapture> capture)
+        : socket_(std::move(socket)), capture_(std::move(capture)) {
+        connection_ = capture_->Open(socket_->PeerAddress() + ":" + std::to_string(socket_->PeerPort()));
+    }
+
+    ~SurakartaNetworkSocketCaptureWrapper() override { capture_->Close(connection_); }
+
+    void Send(NetworkFramework::Message message) override {
+        capture_->Sent(connection_, message);
+        socket_->Send(std::move(message));
+    }
+
+    std::optional<NetworkFramework::Message> Receive() override {
+        auto message = socket_->Receive();
+        if (message.has_value())
+            capture_->Received(connection_, message.value());
+        return message;
+    }
+
+    void Close() override { socket_->Close(); }
+    std::string PeerAddress() const override { return socket_->PeerAddress(); }
+    int PeerPort() const override { return socket_->PeerPort(); }
+
+   private:
+    std::shared_ptr<NetworkFramework::Socket> socket_;
+    std::shared_ptr<SurakartaCapture> capture_;
+    uint32_t connection_ = 0;
+};
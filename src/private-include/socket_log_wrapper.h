@@ -2,14 +2,24 @@
 
 #include "opcode.h"
 #include "socket.h"
-#include "surakarta_logger.h"
+#include "surakarta_network_logger.h"
 
+/// @brief Log a message decoded by its opcode, as the wrapper below does.
+void SurakartaLogMessage(const std::shared_ptr<SurakartaLogger>& logger, const NetworkFramework::Message& message);
+
+// Logs every message at DEBUG level. Whether that is written anywhere is decided once here,
+// so that a disabled logger costs a branch per message and nothing is decoded for it.
 class SurakartaNetworkSocketLogWrapper : public NetworkFramework::Socket {
    public:
     SurakartaNetworkSocketLogWrapper(
         std::shared_ptr<NetworkFramework::Socket> socket,
         std::shared_ptr<SurakartaLogger> logger)
-        : socket_(std::move(socket)), logger_(logger) {}
+        : socket_(std::move(socket)) {
+        if (SurakartaLogEnabled(*logger, SurakartaLogLevel::DEBUG)) {
+            send_logger_ = logger->CreateSublogger("send");
+            recv_logger_ = logger->CreateSublogger("recv");
+        }
+    }
 
     void Send(NetworkFramework::Message message) override;
     std::optional<NetworkFramework::Message> Receive() override;
@@ -19,5 +29,6 @@ class SurakartaNetworkSocketLogWrapper : public NetworkFramework::Socket {
 
    private:
     std::shared_ptr<NetworkFramework::Socket> socket_;
-    std::shared_ptr<SurakartaLogger> logger_;
+    std::shared_ptr<SurakartaLogger> send_logger_;  // null if not logging
+    std::shared_ptr<SurakartaLogger> recv_logger_;
 };
@@ -1,25 +1,36 @@
 #pragma once
 
 #include "socket.h"
-#include "surakarta_logger.h"
+#include "surakarta_network_logger.h"
+
+/// @brief Log the fields of a message as they are.
+inline void SurakartaLogRawMessage(const std::shared_ptr<SurakartaLogger>& logger,
+                                   const NetworkFramework::Message& message) {
+    logger->Log("%d \"%s\" \"%s\" \"%s\"", message.opcode, message.data1.c_str(), message.data2.c_str(), message.data3.c_str());
+}
 
 class SurakartaNetworkSocketRawLogWrapper : public NetworkFramework::Socket {
    public:
     SurakartaNetworkSocketRawLogWrapper(
         std::shared_ptr<NetworkFramework::Socket> socket,
         std::shared_ptr<SurakartaLogger> logger)
-        : socket_(std::move(socket)), logger_(logger) {}
+        : socket_(std::move(socket)) {
+        if (SurakartaLogEnabled(*logger, SurakartaLogLevel::DEBUG)) {
+            send_logger_ = logger->CreateSublogger("send")->CreateSublogger("raw");
+            recv_logger_ = logger->CreateSublogger("recv")->CreateSublogger("raw");
+        }
+    }
 
     void Send(NetworkFramework::Message message) override {
-        logger_->CreateSublogger("send")->CreateSublogger("raw")->Log("%d \"%s\" \"%s\" \"%s\"", message.opcode, message.data1.c_str(), message.data2.c_str(), message.data3.c_str());
-        socket_->Send(message);
+        if (send_logger_)
+            SurakartaLogRawMessage(send_logger_, message);
+        socket_->Send(std::move(message));
     }
 
     std::optional<NetworkFramework::Message> Receive() override {
         auto message = socket_->Receive();
-        if (message.has_value()) {
-            logger_->CreateSublogger("recv")->CreateSublogger("raw")->Log("%d \"%s\" \"%s\" \"%s\"", message->opcode, message->data1.c_str(), message->data2.c_str(), message->data3.c_str());
-        }
+        if (message.has_value() && recv_logger_)
+            SurakartaLogRawMessage(recv_logger_, message.value());
         return message;
     }
 
@@ -29,5 +40,6 @@ class SurakartaNetworkSocketRawLogWrapper : public NetworkFramework::Socket {
 
    private:
     std::shared_ptr<NetworkFramework::Socket> socket_;
-    std::shared_ptr<SurakartaLogger> logger_;
+    std::shared_ptr<SurakartaLogger> send_logger_;  // null if not logging
+    std::shared_ptr<SurakartaLogger> recv_logger_;
 };
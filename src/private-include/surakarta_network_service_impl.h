@@ -0,0 +1,413 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include "broadcast.h"
+#include "cluster.h"
+#include "journal.h"
+#include "matchmaker.h"
+#include "message.h"
+#include "metrics.h"
+#include "rate_limit.h"
+#include "room_registry.h"
+#include "surakarta.h"
+#include "surakarta_network_service.h"
+#include "timer_wheel.h"
+#include "worker_pool.h"
+
+// The service is written as a set of event handlers on a per-connection Session, so that
+// it can be driven either by a blocking thread per connection (Execute) or by an event
+// loop (see reactor.h). Handlers never wait for the peer; they only send, and sending only
+// queues (see queued_socket.h for the blocking sockets of the former).
+//
+// Games are step driven: a move received on a session is posted to the worker the room is
+// attached to, which advances the room's SurakartaGame by one move and relays the result.
+//
+// Spectators are told of the moves and the end of a game by a broadcaster thread of their own,
+// after the players, so that the worker only hands each event over and a slow spectator holds
+// up nobody but the other spectators of its room.
+//
+// If seats are kept (resume_grace_ms), a player whose connection is lost is only marked away;
+// it may take the seat back from a new connection with its token before the grace deadline.
+//
+// Deadlines are timers on one wheel for the whole service (see timer_wheel.h): a room has one
+// for its second player to come, and then for the player to move; a seat has one while its player
+// is away; and a connection has one for being silent while it waits on nobody. A connection that
+// is past its deadline is closed, which its session sees as a disconnection. The timer of a
+// connection is not reset on every message: the session only notes when it heard from it, and
+// the timer, when it fires, arms itself again for the rest of the time if need be.
+//
+// A player who asks for SURAKARTA_MATCHMAKING_ROOM_ID holds a ticket in the matchmaker until it
+// is paired; the matchmaker starts the game in a room of its own, and the session takes the
+// room from the ticket when it next hears from its connection.
+//
+// A server of a cluster (see cluster.h) only plays the rooms that belong to it. A session that
+// asks for a room of another server is relayed there for the rest of its connection, and has
+// nothing else to do, or is redirected there.
+class SurakartaNetworkServiceImpl : public NetworkFramework::Service {
+   public:
+    SurakartaNetworkServiceImpl(std::shared_ptr<SurakartaLogger> logger,
+                                SurakartaNetworkServiceOptions options)
+        : logger_(logger),
+          resume_grace_(std::chrono::milliseconds(options.resume_grace_ms)),
+          handshake_timeout_(std::chrono::milliseconds(options.handshake_timeout_ms)),
+          waiting_timeout_(std::chrono::milliseconds(options.waiting_timeout_ms)),
+          move_timeout_(std::chrono::milliseconds(options.move_timeout_ms)),
+          idle_timeout_(std::chrono::milliseconds(options.idle_timeout_ms)),
+          rate_limits_{options.game_rate_limit, options.chat_rate_limit, options.other_rate_limit},
+          max_dropped_messages_(options.max_dropped_messages),
+          cluster_(OpenCluster(options)),
+          cluster_redirect_(options.cluster_redirect || !SurakartaClusterRelay::IsSupported()),
+          journal_(OpenJournal(options, logger)),
+          writers_(options.worker_threads),
+          workers_(options.worker_threads),
+          matchmaker_(MATCHMAKING_CAPACITY, [this](const std::shared_ptr<MatchTicket>& first, const std::shared_ptr<MatchTicket>& second) {
+              StartMatchedGame(first, second);
+          }) {
+        LowerBroadcasterPriority();
+    }
+
+    ~SurakartaNetworkServiceImpl() {
+        // No timer may fire and post to the workers while they are joined; the tasks they run
+        // meanwhile still find the wheel, which is destroyed after them.
+        timers_.Stop();
+    }
+
+    enum class RoomStatus {
+        EMPTY,
+        WAITING_SECOND_PLAYER,
+        PLAYING,
+        ENDED,
+        CLOSED,
+        REMOVED,
+    };
+
+    struct Spectator {
+        std::shared_ptr<NetworkFramework::Socket> socket;
+        std::shared_ptr<SurakartaFrameSink> frame_sink;  // null if the connection can only Send
+    };
+
+    // A player's hold on its seat in a game; see ResumeRoom.
+    struct Seat {
+        std::string token;  // written once, when the game starts; empty if seats are not kept
+        // The following are guarded by the mutex of the room.
+        bool away = false;
+        unsigned departures = 0;  // tells a grace deadline whether it is for the current departure
+        std::chrono::steady_clock::time_point left_at;
+        SurakartaTimerWheel::TimerId grace_timer = SurakartaTimerWheel::NO_TIMER;
+    };
+
+    struct Room {
+        const int id;  // This field can be access without lock, since it is only written once
+        mutable std::mutex mutex;
+        RoomStatus status = RoomStatus::WAITING_SECOND_PLAYER;
+        // Once the game has started, only the worker changes these, with std::atomic_store, and
+        // only while the player is away are they null; other threads take them with std::atomic_load.
+        std::shared_ptr<NetworkFramework::Socket> first_player_socket;
+        std::shared_ptr<NetworkFramework::Socket> second_player_socket;
+        Seat first_player_seat, second_player_seat;
+        const SurakartaNetworkMessageReady first_player_message;
+        // The first player has gone before the second came, who then wins at once; guarded by mutex.
+        bool first_player_left = false;
+        int worker = -1;                      // the worker the game runs on, once started
+        // For the second player to come, and then for the player to move; guarded by mutex.
+        SurakartaTimerWheel::TimerId deadline = SurakartaTimerWheel::NO_TIMER;
+        std::shared_ptr<SurakartaGame> game;  // only accessed by the worker
+        PieceColor first_player_color, second_player_color;
+        const std::chrono::steady_clock::time_point created_at = std::chrono::steady_clock::now();
+        std::optional<std::chrono::steady_clock::time_point> started_at;
+        // when the room was first asked to go away, for the teardown latency
+        std::optional<std::chrono::steady_clock::time_point> teardown_started;
+        // Replaced rather than changed, with the mutex held, so that the worker can take it with
+        // std::atomic_load alone.
+        std::shared_ptr<const std::vector<Spectator>> spectators;
+        std::optional<SurakartaNetworkMessageEnd> end_message;  // how the game ended, for the spectators and the journal
+        uint64_t journal_game = 0;                                // 0 if not journaled
+        std::vector<std::pair<SurakartaPosition, SurakartaPosition>> moves;  // only accessed by the worker
+        std::string first_player_username, second_player_username;
+        const std::shared_ptr<SurakartaLogger> logger;
+
+        Room(int id,
+             std::shared_ptr<NetworkFramework::Socket> first_player_socket,
+             SurakartaNetworkMessageReady first_player_message,
+             std::shared_ptr<SurakartaLogger> logger)
+            : id(id), first_player_socket(first_player_socket), first_player_message(first_player_message), logger(logger) {}
+
+        RoomStatus Status() const {
+            std::lock_guard lock(mutex);
+            return status;
+        }
+
+        std::shared_ptr<NetworkFramework::Socket>& PlayerSocket(bool is_first_player) {
+            return is_first_player ? first_player_socket : second_player_socket;
+        }
+
+        Seat& PlayerSeat(bool is_first_player) { return is_first_player ? first_player_seat : second_player_seat; }
+
+        // Must be called with mutex held.
+        void BeginTeardown() {
+            if (!teardown_started.has_value())
+                teardown_started = std::chrono::steady_clock::now();
+        }
+    };
+
+    // A player waiting in the matchmaker.
+    struct MatchTicket {
+        std::atomic<int> state = SurakartaMatchmaker<MatchTicket>::WAITING;
+        PieceColor color;
+        std::chrono::steady_clock::time_point joined_at = std::chrono::steady_clock::now();
+        std::shared_ptr<NetworkFramework::Socket> socket;
+        std::shared_ptr<SurakartaLogger> logger;
+        std::optional<SurakartaNetworkMessageReady> ready;
+        // Set by the matchmaker once the game has started; is_first_player is written before
+        // room is stored, and read after it is loaded, with std::atomic_store and std::atomic_load.
+        bool is_first_player = false;
+        std::shared_ptr<Room> room;
+    };
+
+    // State of one connection. Only the thread (or event loop) that drives the connection
+    // touches a Session, so it needs no lock; shared state lives in the Room.
+    struct Session {
+        std::shared_ptr<NetworkFramework::Socket> socket;
+        std::shared_ptr<SurakartaLogger> logger;
+        std::shared_ptr<Room> room;
+        bool is_first_player = false;
+        std::shared_ptr<Room> watched_room;
+        std::shared_ptr<MatchTicket> ticket;  // while waiting to be paired
+        std::shared_ptr<SurakartaFrameSink> frame_sink;  // the connection under the wrappers, if it is one
+        SurakartaCounter* closed_sessions = nullptr;  // counts this one when it goes away
+        // The following are for the handshake and idle deadlines, which the timer wheel checks.
+        std::atomic<bool> greeted = false;  // has sent a READY
+        std::atomic<std::chrono::steady_clock::rep> heard_at;
+        // What the connection was left waiting on when last heard from, if anything; written
+        // with std::atomic_store and read with std::atomic_load.
+        std::shared_ptr<Room> waiting_on_room;
+        std::shared_ptr<MatchTicket> waiting_on_ticket;
+        std::atomic<SurakartaTimerWheel::TimerId> quiet_timer = SurakartaTimerWheel::NO_TIMER;
+        // To the server of its room, if it is in another server of the cluster; the deadlines
+        // are then kept by that server, and relayed tells the timer wheel so.
+        std::unique_ptr<SurakartaClusterRelay> relay;
+        std::atomic<bool> relayed = false;
+
+        ~Session() {
+            if (closed_sessions)
+                closed_sessions->Add();
+        }
+    };
+
+    std::shared_ptr<Session> OpenSession(std::shared_ptr<NetworkFramework::Socket> socket);
+
+    /// @brief Handle one message received on a session, or its disconnection if message is empty.
+    /// @return false if the connection should be closed.
+    bool HandleMessage(const std::shared_ptr<Session>& session, std::optional<NetworkFramework::Message> message);
+
+    /// @brief Release whatever the session holds, as if its connection had been closed.
+    void CloseSession(const std::shared_ptr<Session>& session);
+
+    void Execute(std::shared_ptr<NetworkFramework::Socket> socket) override;
+
+    void ShutdownService();
+
+    bool CancelRoom(int room_id);
+
+    SurakartaNetworkServiceStats Stats() const;
+
+    SurakartaNetworkServiceMetrics Metrics() const;
+
+   private:
+    enum Deadline {
+        HANDSHAKE_DEADLINE,
+        WAITING_DEADLINE,
+        MOVE_DEADLINE,
+        GRACE_DEADLINE,
+        IDLE_DEADLINE,
+        DEADLINES,
+    };
+
+    bool DispatchMessage(const std::shared_ptr<Session>& session,
+                         std::optional<NetworkFramework::Message> message,
+                         std::chrono::steady_clock::time_point received);
+
+    // Note that the connection has been heard from, and what it is now waiting on.
+    void NoteHeard(Session& session, std::chrono::steady_clock::time_point heard_at);
+    // How long the connection may be silent while it waits on nobody; zero for ever.
+    std::chrono::steady_clock::duration QuietLimit(const Session& session) const;
+    // Whether the game or the matchmaker will send something to the connection yet.
+    static bool IsWaitingOnService(const Session& session);
+    // The following run on the timer wheel. The silence of the connection counts from quiet_since
+    // or from when it was last heard from, whichever is later; quiet_since is the maximum if the
+    // connection was waiting on the service at the last check, so that the silence only counts
+    // from the next.
+    void WatchQuiet(const std::shared_ptr<Session>& session,
+                    std::chrono::steady_clock::duration delay,
+                    std::chrono::steady_clock::time_point quiet_since);
+    void CheckQuiet(const std::weak_ptr<Session>& weak_session, std::chrono::steady_clock::time_point quiet_since);
+
+    // Must be called with room.mutex held, while the room is playing, with the moves played.
+    void ArmMoveDeadline(const std::shared_ptr<Room>& room, size_t played);
+    // The second player has not come in time; runs on the timer wheel.
+    void ExpireWaitingRoom(const std::shared_ptr<Room>& room);
+
+    // returns the room and whether it has been created by this call; prepare, if given, is
+    // run on a new room before anyone else can find it
+    std::pair<std::shared_ptr<Room>, bool> GetOrCreateRoom(
+        int room_id,
+        const SurakartaNetworkMessageReady& message,
+        std::shared_ptr<NetworkFramework::Socket> socket_of_first_player,
+        const std::shared_ptr<SurakartaLogger>& logger,
+        const std::function<void(const std::shared_ptr<Room>&)>& prepare = nullptr);
+
+    void ShutdownAndRemoveRoom(std::shared_ptr<Room> room,
+                               std::shared_ptr<SurakartaLogger> logger);
+
+    void CancelRoom(const std::shared_ptr<Room>& room);
+
+    void JoinRoom(const std::shared_ptr<Session>& session, const SurakartaNetworkMessageReady& ready);
+
+    void StartGame(const std::shared_ptr<Room>& room, PieceColor first_player_color, PieceColor second_player_color);
+
+    void JoinMatchmaking(const std::shared_ptr<Session>& session, const SurakartaNetworkMessageReady& ready);
+    // @return The room the session has been paired to meanwhile, or null if it has left the matchmaker.
+    std::shared_ptr<Room> LeaveMatchmaking(const std::shared_ptr<MatchTicket>& ticket);
+    // Runs on the matchmaker thread.
+    void StartMatchedGame(const std::shared_ptr<MatchTicket>& first, const std::shared_ptr<MatchTicket>& second);
+    // Whether the matchmaker has given out the room id, in this round of the numbers or an
+    // earlier one; such a room may be watched or resumed, but not joined by its number.
+    bool IsMatchedRoomId(int room_id) const;
+
+    void WatchRoom(const std::shared_ptr<Session>& session, const SurakartaNetworkMessageReady& ready);
+
+    // The room of the READY belongs to another server of the cluster; the session is relayed
+    // or redirected there.
+    void ForwardToOwner(const std::shared_ptr<Session>& session,
+                        SurakartaNetworkMessageReady ready,
+                        std::chrono::steady_clock::time_point received);
+
+    // The session takes the seat its token is for, if the game is still being played.
+    void ResumeRoom(const std::shared_ptr<Session>& session, const SurakartaNetworkMessageReady& ready);
+
+    // What a player is told when the game starts or it comes back: the opponent, its color, and
+    // the token for its seat with the number of moves played, if seats are kept.
+    static SurakartaNetworkMessageReady ReadyForPlayer(const Room& room, bool is_first_player, int moves);
+
+    // Must be called with room.mutex held, while the room is waiting or playing. The spectator is
+    // greeted with a READY for the room and the moves played so far, and then told of the rest.
+    void AddSpectator(Room& room, const Spectator& spectator, std::vector<NetworkFramework::Message> greeting);
+    // @return false if it was not watching the room, or no longer is.
+    bool RemoveSpectator(const std::shared_ptr<Room>& room, const std::shared_ptr<NetworkFramework::Socket>& socket);
+
+    // Hand a message for the spectators of the room over to the broadcaster. Only the worker of
+    // the room calls it, so that the spectators see the moves in order.
+    void Broadcast(const std::shared_ptr<Room>& room, NetworkFramework::Message message);
+
+    // The following run on the broadcaster.
+    void SendToSpectators(const std::shared_ptr<Room>& room,
+                          const std::vector<Spectator>& spectators,
+                          const std::shared_ptr<const SurakartaBroadcastFrame>& frame);
+    void DropSpectator(const std::shared_ptr<Room>& room, const Spectator& spectator);
+
+    void HandleGameMessage(const std::shared_ptr<Session>& session,
+                           std::optional<NetworkFramework::Message> message,
+                           std::chrono::steady_clock::time_point received);
+
+    // The following run on the worker of the room.
+    // Moves and resignations from a connection the player has been given back the seat from are ignored.
+    void StepGame(const std::shared_ptr<Room>& room,
+                  SurakartaMove move,
+                  std::chrono::steady_clock::time_point received,
+                  const std::shared_ptr<NetworkFramework::Socket>& from);
+    void Resign(const std::shared_ptr<Room>& room, bool is_first_player, const std::shared_ptr<NetworkFramework::Socket>& from);
+    // The player loses the game for the reason given.
+    void Forfeit(const std::shared_ptr<Room>& room, bool is_first_player, SurakartaEndReason reason);
+    // The player's connection has been lost; the seat is kept for the grace period.
+    void LeaveSeat(const std::shared_ptr<Room>& room, bool is_first_player, const std::shared_ptr<NetworkFramework::Socket>& socket);
+    // The player is back; it is sent the moves after the first seen.
+    void ReturnToSeat(const std::shared_ptr<Room>& room,
+                      bool is_first_player,
+                      const std::shared_ptr<NetworkFramework::Socket>& socket,
+                      const std::string& username,
+                      int seen);
+    // Nothing is sent to a player who is away; it is sent what it missed when it comes back.
+    void SendToPlayer(Room& room, bool is_first_player, NetworkFramework::Message message);
+
+    // Must be called with room.mutex held.
+    void SetRoomStatus(Room& room, RoomStatus status) {
+        rooms_by_status_[(int)room.status].Add(-1);
+        rooms_by_status_[(int)status].Add();
+        room.status = status;
+    }
+
+    void CountGameEnded(SurakartaEndReason reason) {
+        int index = (int)reason;
+        if (index >= 0 && index < END_REASONS)
+            games_ended_[index].Add();
+    }
+
+    // Spectators then get what CPU the players leave, on a machine with few cores.
+    void LowerBroadcasterPriority();
+
+    static std::unique_ptr<SurakartaJournal> OpenJournal(const SurakartaNetworkServiceOptions& options,
+                                                         const std::shared_ptr<SurakartaLogger>& logger);
+
+    static std::shared_ptr<SurakartaClusterDirectory> OpenCluster(const SurakartaNetworkServiceOptions& options);
+
+    static std::optional<std::pair<PieceColor, PieceColor>> ResolveColor(std::pair<PieceColor, PieceColor> request);
+
+    static std::string NewResumeToken();
+
+    std::shared_ptr<SurakartaLogger> logger_;
+    const std::chrono::steady_clock::duration resume_grace_;  // zero if seats are not kept
+    // each zero if there is no such deadline
+    const std::chrono::steady_clock::duration handshake_timeout_;
+    const std::chrono::steady_clock::duration waiting_timeout_;
+    const std::chrono::steady_clock::duration move_timeout_;
+    const std::chrono::steady_clock::duration idle_timeout_;
+    const SurakartaNetworkRateLimit rate_limits_[SURAKARTA_RATE_CLASSES];
+    const int max_dropped_messages_;
+    // before the cluster, whose relays count on them until it has gone
+    SurakartaClusterCounters cluster_counters_;
+    // null if the server is on its own
+    const std::shared_ptr<SurakartaClusterDirectory> cluster_;
+    const bool cluster_redirect_;
+    SurakartaRateLimitCounters rate_limit_counters_;
+    SurakartaShardedRegistry<int, Room> rooms_;
+    std::atomic<long long> rooms_torn_down_ = 0;
+    std::atomic<long long> teardown_total_us_ = 0;
+    std::atomic<long long> teardown_max_us_ = 0;
+    // the histograms behind Metrics()
+    static constexpr int HANDLED_OTHER = 7;
+    static constexpr int HANDLED_DISCONNECT = 8;
+    SurakartaHistogram message_handling_[HANDLED_DISCONNECT + 1];  // by opcode, from READY_OP on
+    SurakartaHistogram move_queue_;
+    SurakartaHistogram move_commit_;
+    SurakartaHistogram move_relay_;
+    SurakartaHistogram room_waiting_;
+    SurakartaHistogram room_playing_;
+    SurakartaHistogram room_teardown_;
+    SurakartaCounter opened_sessions_;
+    SurakartaCounter closed_sessions_;
+    SurakartaCounter rooms_by_status_[(int)RoomStatus::REMOVED + 1];  // used as gauges
+    static constexpr int END_REASONS = (int)SurakartaEndReason::ILLIGAL_MOVE + 1;
+    SurakartaCounter games_ended_[END_REASONS];
+    SurakartaCounter spectators_;  // used as a gauge
+    SurakartaCounter spectators_dropped_;
+    SurakartaCounter players_away_;  // used as a gauge
+    SurakartaCounter players_resumed_;
+    SurakartaHistogram player_away_;
+    SurakartaCounter deadlines_expired_[DEADLINES];
+    const std::unique_ptr<SurakartaJournal> journal_;  // outlives the workers, which append to it
+    SurakartaWorkerPool broadcaster_{1};  // outlives the workers, which post to it
+    SurakartaTimerWheel timers_;          // outlives the workers, whose last tasks cancel and arm timers
+    SurakartaWorkerPool writers_;         // of the sockets of Execute; outlives the workers, which send to them
+    SurakartaWorkerPool workers_;         // joined before the rooms go away
+    static constexpr size_t MATCHMAKING_CAPACITY = 1 << 16;  // players joining at once
+    // counts down, and starts again after the lowest int; only touched by the matchmaker
+    int next_matched_room_id_ = SURAKARTA_MATCHMAKING_ROOM_ID - 1;
+    // The lowest room id given out so far, and whether the numbers have started again; read by
+    // the sessions.
+    std::atomic<int> lowest_matched_room_id_ = SURAKARTA_MATCHMAKING_ROOM_ID;
+    std::atomic<bool> matched_room_ids_wrapped_ = false;
+    SurakartaMatchmaker<MatchTicket> matchmaker_;  // last, as it posts to the workers
+};
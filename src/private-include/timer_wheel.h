@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "metrics.h"
+
+// Deadlines for any number of connections and rooms, kept in a hierarchical timing wheel run by
+// a thread of its own. Time is counted in ticks; a timer due within 64 ticks sits in the slot of
+// the first wheel for its tick, one due later in a slot of a coarser wheel, whose slots span 64
+// times as many ticks, and is moved down a wheel each time the finer one has gone round. So
+// arming and cancelling a timer only link and unlink it from a list, whatever the number of
+// timers, and the thread only looks at the slot of the tick it has reached.
+//
+// Timers live in a pool indexed by their id, so cancelling needs no search; an id carries the
+// generation of its entry, so that cancelling a timer that has fired or been cancelled already
+// does nothing, even if the entry has been reused since.
+//
+// A timer fires within one tick after its deadline. Its task runs on the thread of the wheel,
+// which it holds up, so it should only hand work over or close a connection.
+class SurakartaTimerWheel {
+   public:
+    using TimerId = uint64_t;
+    static constexpr TimerId NO_TIMER = 0;
+
+    explicit SurakartaTimerWheel(std::chrono::steady_clock::duration tick = std::chrono::milliseconds(10));
+
+    /// @brief Timers not yet due are dropped.
+    ~SurakartaTimerWheel();
+
+    /// @brief Stop firing timers, and join the thread once the tasks firing now have run. Timers
+    /// may still be armed and cancelled, but none fires.
+    void Stop();
+
+    SurakartaTimerWheel(const SurakartaTimerWheel&) = delete;
+    SurakartaTimerWheel& operator=(const SurakartaTimerWheel&) = delete;
+
+    /// @brief Run the task on the thread of the wheel once the delay has passed.
+    TimerId Arm(std::chrono::steady_clock::duration delay, std::function<void()> task);
+
+    /// @return false if the timer has fired, or is firing, or has been cancelled already.
+    bool Cancel(TimerId id);
+
+    /// @brief The number of timers armed and not yet fired or cancelled.
+    long long Armed() const { return armed_.load(std::memory_order_relaxed); }
+    long long Fired() const { return fired_.Value(); }
+
+   private:
+    static constexpr int SLOT_BITS = 6;
+    static constexpr int SLOTS = 1 << SLOT_BITS;
+    static constexpr int LEVELS = 4;  // 2^24 ticks: nearly two days of 10 ms ticks; later ones wait in the last wheel
+    static constexpr uint64_t SPAN = 1ULL << (SLOT_BITS * LEVELS);
+    static constexpr int32_t NONE = -1;
+
+    struct Timer {
+        uint32_t generation = 1;  // bumped whenever the entry is released
+        int32_t previous = NONE;
+        int32_t next = NONE;  // in the slot, or in the free list
+        int32_t slot = NONE;  // the list it is in, if armed
+        uint64_t due = 0;     // in ticks
+        std::function<void()> task;
+    };
+
+    // The following require mutex_.
+    int32_t Allocate();
+    void Release(int32_t index);
+    void Link(int32_t index);
+    void Unlink(int32_t index);
+    // Move the timers of a slot of a coarser wheel down to where they belong now.
+    void Cascade(int level);
+    // Advance by one tick, moving the timers due at it to fired.
+    void AdvanceLocked(std::vector<std::function<void()>>& fired);
+
+    uint64_t TicksAt(std::chrono::steady_clock::time_point time) const;
+
+    void Run();
+
+    const std::chrono::steady_clock::duration tick_;
+    const std::chrono::steady_clock::time_point start_;
+
+    std::mutex mutex_;
+    std::condition_variable when_armed_;
+    std::vector<Timer> timers_;
+    int32_t free_ = NONE;
+    std::vector<int32_t> slots_ = std::vector<int32_t>(LEVELS * SLOTS, NONE);  // the first timer in each
+    uint64_t now_ = 0;                // the last tick the wheel has reached
+    std::atomic<long long> armed_ = 0;  // only changed with mutex_ held
+    bool stopping_ = false;
+
+    SurakartaCounter fired_;
+    std::thread thread_;  // last, so that it starts once the rest is ready
+};
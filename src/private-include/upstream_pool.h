@@ -0,0 +1,103 @@
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "backend_ring.h"
+#include "metrics.h"
+#include "network_framework.h"
+
+struct SurakartaUpstreamPoolOptions {
+    /// @brief The connections kept ready for each server; 0 for none.
+    int size = 0;
+    /// @brief How long a connection may wait in the pool, in milliseconds, before it is replaced.
+    /// Keep it below the handshake timeout of the servers, which close connections that stay
+    /// quiet for longer.
+    int max_idle_ms = 30000;
+};
+
+// Connections to the servers of a proxy, made ahead of the clients that will need them, so that
+// a client does not wait for a handshake with the server before its first message is passed on.
+//
+// A thread of the pool keeps each server at the size, connecting without blocking and in
+// parallel, and makes up for each connection taken as soon as it is taken. Connections are
+// checked when taken and whenever the thread wakes up: one the server has closed, or that has
+// waited too long, is closed and replaced. A server that cannot be reached is tried again
+// after a second. When a server has no connection ready, the proxy connects itself.
+//
+// Only available on Linux; elsewhere the pool never has a connection ready.
+class SurakartaUpstreamPool {
+   public:
+    SurakartaUpstreamPool(const std::vector<SurakartaBackend>& servers, SurakartaUpstreamPoolOptions options);
+
+    /// @brief Close every connection in the pool.
+    ~SurakartaUpstreamPool();
+
+    SurakartaUpstreamPool(const SurakartaUpstreamPool&) = delete;
+    SurakartaUpstreamPool& operator=(const SurakartaUpstreamPool&) = delete;
+
+    /// @param server The index of the server in the list given.
+    /// @return A connected, non-blocking socket, now owned by the caller, or -1 if none is ready.
+    int Take(size_t server);
+
+    /// @brief The same connection as a blocking NetworkFramework::Socket, or nothing.
+    std::shared_ptr<NetworkFramework::Socket> TakeSocket(size_t server);
+
+    /// @brief The number of connections ready for the server.
+    int Ready(size_t server) const;
+
+    /// @brief The number of connections handed out, of times none was ready, and of connections
+    /// closed in the pool because the server had closed them or they had waited too long.
+    long long Hits() const { return hits_.Value(); }
+    long long Misses() const { return misses_.Value(); }
+    long long Discarded() const { return discarded_.Value(); }
+
+    static bool IsSupported();
+
+   private:
+    struct Idle {
+        int fd;
+        std::chrono::steady_clock::time_point since;
+    };
+
+    struct Pending {
+        int fd;
+        size_t server;
+        std::chrono::steady_clock::time_point since;
+    };
+
+    struct Server {
+        std::vector<char> address;  // a sockaddr of its family
+        std::deque<Idle> idle;      // the newest last
+        int connecting = 0;
+        std::chrono::steady_clock::time_point retry_at;
+    };
+
+    // Whether a connection in the pool can still be used: the server has neither closed it nor
+    // sent anything on it.
+    static bool Healthy(int fd);
+
+    // The following require mutex_.
+
+    // Start the connections the servers are short of.
+    void ConnectLocked(std::vector<Pending>& pending);
+    // Close the connections that cannot be used any more.
+    void SweepLocked();
+
+    void Wake();
+    void Run();
+
+    const SurakartaUpstreamPoolOptions options_;
+    mutable std::mutex mutex_;
+    std::vector<Server> servers_;
+    bool stopping_ = false;
+    int wake_fds_[2] = {-1, -1};  // a pipe, which Take() writes to for the thread
+
+    SurakartaCounter hits_;
+    SurakartaCounter misses_;
+    SurakartaCounter discarded_;
+    std::thread thread_;  // last, so that it starts once the rest is ready
+};
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include "socket.h"
+
+// Encoding of NetworkFramework::Message for transports that work on raw file descriptors
+// (the epoll reactor and the benchmark clients) instead of NetworkFramework::Socket.
+//
+// Each message is a JSON object {"op":...,"data1":"...","data2":"...","data3":"..."},
+// as in the protocol referenced by opcode.h. Objects may arrive split across reads or
+// several in one read, so decoding is incremental.
+
+//
+// A compact binary form of MOVE, END and RESIGN can be negotiated in the READY exchange.
+// A client that understands it appends SURAKARTA_WIRE_COMPACT_OPTION to the room id in data3
+// of its READY; a server that does not know the option reads the room id with std::stoi and
+// ignores the rest. A server that agrees appends the same to the READY it answers with, and
+// from then on both sides may send those messages compact. A compact frame starts with a
+// byte that cannot start a JSON object, so the decoder accepts both forms at any time:
+//
+//   MOVE    2 bytes  0001ffff fftttttt: from and to as x * 8 + y
+//   END     4 bytes  0011000r, illegal move reason (if r), end reason, winner
+//   RESIGN  1 byte   01000000
+//
+// Only messages whose fields are exactly what the typed constructors in message.h produce
+// are sent compact, so decoding gives back the very same Message; others stay JSON.
+
+inline constexpr const char* SURAKARTA_WIRE_COMPACT_OPTION = ";compact";
+
+/// @brief Whether the message is a READY carrying the compact option.
+bool SurakartaWireHasCompactOption(const NetworkFramework::Message& message);
+
+/// @brief Add the compact option to a READY message, or remove it.
+void SurakartaWireSetCompactOption(NetworkFramework::Message& message, bool compact);
+
+/// @brief Append the wire representation of a message to a buffer.
+/// @param compact Whether the peer has agreed to the compact form.
+void SurakartaWireEncode(const NetworkFramework::Message& message, std::string& out, bool compact = false);
+
+class SurakartaWireDecoder {
+   public:
+    /// @brief The longest message taken, so that a peer cannot make the buffer grow for ever by
+    /// never ending an object. Any message of the protocol is a small fraction of it.
+    static constexpr size_t MAX_MESSAGE_SIZE = 64 * 1024;
+
+    /// @brief Append bytes received from the peer.
+    void Feed(const char* data, size_t size);
+
+    /// @brief Take the next complete message, if any.
+    /// @throw SurakartaNetworkWireFormatException if the stream is malformed, or a message is
+    /// longer than MAX_MESSAGE_SIZE.
+    std::optional<NetworkFramework::Message> Next();
+
+    /// @brief Number of buffered bytes not yet returned as a message.
+    size_t Pending() const { return buffer_.size() - consumed_; }
+
+   private:
+    std::string buffer_;
+    size_t consumed_ = 0;  // bytes before this offset are already returned
+    size_t scanned_ = 0;   // bytes before this offset are already scanned for the current object
+    int depth_ = 0;
+    bool in_string_ = false;
+    bool escaped_ = false;
+};
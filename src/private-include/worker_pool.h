@@ -0,0 +1,48 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads, each with its own task queue. A room is attached to one
+// worker for its whole life, so every step of its game runs on the same thread in order,
+// and the game itself needs no lock.
+class SurakartaWorkerPool {
+   public:
+    /// @param workers The number of threads; 0 means one per hardware thread.
+    explicit SurakartaWorkerPool(int workers);
+
+    /// @brief Run the tasks already queued, then join the threads.
+    ~SurakartaWorkerPool();
+
+    int Workers() const { return (int)workers_.size(); }
+
+    /// @brief Pick the worker with the fewest rooms for a new room.
+    /// @return The index of the worker.
+    int Attach();
+
+    void Detach(int worker);
+
+    void Post(int worker, std::function<void()> task);
+
+    std::vector<int> RoomsPerWorker() const;
+
+   private:
+    struct Worker {
+        std::mutex mutex;
+        std::condition_variable when_task_posted;
+        std::deque<std::function<void()>> tasks;
+        bool stopping = false;
+        std::atomic<int> rooms = 0;
+        std::thread thread;
+    };
+
+    static void Run(Worker& worker);
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+};
@@ -0,0 +1,90 @@
+#include "queued_socket.h"
+
+SurakartaQueuedSocket::SurakartaQueuedSocket(std::shared_ptr<NetworkFramework::Socket> socket,
+                                             SurakartaWorkerPool& writers,
+                                             SurakartaTimerWheel& timers)
+    : socket_(std::move(socket)), writers_(writers), timers_(timers), writer_(writers.Attach()) {}
+
+SurakartaQueuedSocket::~SurakartaQueuedSocket() {
+    writers_.Detach(writer_);
+}
+
+void SurakartaQueuedSocket::Send(NetworkFramework::Message message) {
+    Queue(std::move(message));
+}
+
+bool SurakartaQueuedSocket::SendFrame(const std::shared_ptr<const SurakartaBroadcastFrame>& frame) {
+    return Queue(frame->message);
+}
+
+bool SurakartaQueuedSocket::Queue(NetworkFramework::Message message) {
+    bool over_limit = false;
+    bool post = false;
+    {
+        std::lock_guard lock(mutex_);
+        if (closed_ || stopping_)
+            return false;
+        if (queue_.size() >= MAX_PENDING_MESSAGES) {
+            over_limit = true;
+        } else {
+            queue_.push_back(std::move(message));
+            post = !scheduled_;
+            scheduled_ = true;
+        }
+    }
+    if (over_limit) {
+        Close();
+        return false;
+    }
+    // Posted with no lock held; the pool holds the socket until the flush has run.
+    if (post)
+        writers_.Post(writer_, [self = shared_from_this()] { self->Flush(); });
+    return true;
+}
+
+void SurakartaQueuedSocket::Close() {
+    {
+        std::lock_guard lock(mutex_);
+        closed_ = true;
+        queue_.clear();
+    }
+    // a write under way fails, and the writer finds the queue empty
+    socket_->Close();
+}
+
+void SurakartaQueuedSocket::Stop() {
+    std::unique_lock lock(mutex_);
+    stopping_ = true;
+    when_written_.wait(lock, [this] { return !scheduled_; });
+}
+
+void SurakartaQueuedSocket::Flush() {
+    std::deque<NetworkFramework::Message> batch;
+    {
+        std::lock_guard lock(mutex_);
+        batch.swap(queue_);
+    }
+    if (!batch.empty()) {
+        auto stall = timers_.Arm(STALL_LIMIT, [weak_self = weak_from_this()] {
+            if (auto self = weak_self.lock())
+                self->Close();
+        });
+        try {
+            for (auto& message : batch)
+                socket_->Send(std::move(message));
+        } catch (...) {
+            Close();
+        }
+        timers_.Cancel(stall);
+    }
+    {
+        std::lock_guard lock(mutex_);
+        if (queue_.empty() || closed_) {
+            scheduled_ = false;
+            when_written_.notify_all();
+            return;
+        }
+    }
+    // the rest after the connections already waiting on this writer
+    writers_.Post(writer_, [self = shared_from_this()] { self->Flush(); });
+}
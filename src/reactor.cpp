@@ -0,0 +1,529 @@
+#include "surakarta_network_reactor.h"
+
+#ifdef __linux__
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "opcode.h"
+#include "reactor.h"
+#include "surakarta_network_service_impl.h"
+
+void SurakartaReactorConnection::Send(NetworkFramework::Message message) {
+    std::string bytes;
+    std::lock_guard lock(mutex_);
+    if (closed_)
+        return;
+    if (peer_asked_compact_ && message.opcode == OPCODE::READY_OP) {
+        // agree; the peer switches once it reads this
+        SurakartaWireSetCompactOption(message, true);
+        SurakartaWireEncode(message, bytes, compact_);
+        compact_ = true;
+    } else {
+        SurakartaWireEncode(message, bytes, compact_);
+    }
+    if (pending_.empty()) {
+        // the usual case, which needs no shared copy
+        size_t written = WriteLocked(bytes.data(), bytes.size());
+        if (written < bytes.size()) {
+            pending_.push_back(Chunk{std::make_shared<const std::string>(std::move(bytes)), written});
+            pending_size_ += pending_.back().bytes->size() - written;
+            WatchWritable(true);
+        }
+        return;
+    }
+    SendLocked(std::make_shared<const std::string>(std::move(bytes)));
+}
+
+bool SurakartaReactorConnection::SendFrame(const std::shared_ptr<const SurakartaBroadcastFrame>& frame) {
+    std::lock_guard lock(mutex_);
+    if (closed_)
+        return false;
+    if (pending_size_ > MAX_PENDING_FRAME_BYTES) {
+        // let the loop observe EOF and destroy the connection
+        ::shutdown(fd_, SHUT_RDWR);
+        return false;
+    }
+    SendLocked(compact_ ? frame->compact : frame->json);
+    return true;
+}
+
+void SurakartaReactorConnection::SendLocked(std::shared_ptr<const std::string> bytes) {
+    size_t written = pending_.empty() ? WriteLocked(bytes->data(), bytes->size()) : 0;
+    if (written == bytes->size())
+        return;
+    if (pending_.empty())
+        WatchWritable(true);
+    pending_size_ += bytes->size() - written;
+    pending_.push_back(Chunk{std::move(bytes), written});
+}
+
+size_t SurakartaReactorConnection::WriteLocked(const char* data, size_t size) {
+    size_t total = 0;
+    while (total < size) {
+        auto written = ::send(fd_, data + total, size - total, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return total;
+            // broken connection; let the loop observe EOF
+            ::shutdown(fd_, SHUT_RDWR);
+            return size;
+        }
+        total += written;
+    }
+    return total;
+}
+
+void SurakartaReactorConnection::WatchWritable(bool writable) {
+    epoll_event event{};
+    event.events = EPOLLIN | EPOLLRDHUP | (writable ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+    event.data.fd = fd_;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd_, &event);
+}
+
+void SurakartaReactorConnection::FlushPending() {
+    std::lock_guard lock(mutex_);
+    if (closed_)
+        return;
+    while (!pending_.empty()) {
+        auto& chunk = pending_.front();
+        size_t remaining = chunk.bytes->size() - chunk.offset;
+        size_t written = WriteLocked(chunk.bytes->data() + chunk.offset, remaining);
+        pending_size_ -= written;
+        if (written < remaining) {
+            chunk.offset += written;
+            return;
+        }
+        pending_.pop_front();
+    }
+    WatchWritable(false);
+}
+
+std::optional<NetworkFramework::Message> SurakartaReactorConnection::Receive() {
+    if (inbound_.empty())
+        return std::nullopt;
+    auto message = std::move(inbound_.front());
+    inbound_.pop_front();
+    return message;
+}
+
+void SurakartaReactorConnection::Close() {
+    std::lock_guard lock(mutex_);
+    if (!closed_)
+        ::shutdown(fd_, SHUT_RDWR);
+}
+
+bool SurakartaReactorConnection::ReadAvailable() {
+    char buffer[16384];
+    // A peer that sends faster than it is handled is read again on the next round of the loop,
+    // so that neither the other connections nor the messages waiting here pile up behind it.
+    for (int reads = 0; reads < MAX_READS_PER_EVENT; reads++) {
+        auto size = ::recv(fd_, buffer, sizeof(buffer), 0);
+        if (size == 0)
+            return false;
+        if (size < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return true;
+            return false;
+        }
+        decoder_.Feed(buffer, size);
+        try {
+            while (auto message = decoder_.Next()) {
+                if (SurakartaWireHasCompactOption(message.value())) {
+                    // the option belongs to this transport; the service sees a plain READY
+                    SurakartaWireSetCompactOption(message.value(), false);
+                    std::lock_guard lock(mutex_);
+                    peer_asked_compact_ = true;
+                }
+                inbound_.push_back(std::move(message.value()));
+            }
+        } catch (...) {
+            return false;
+        }
+        if (size < (ssize_t)sizeof(buffer))
+            return true;
+    }
+    return true;  // level-triggered, so the rest is reported again
+}
+
+void SurakartaReactorConnection::Destroy() {
+    std::lock_guard lock(mutex_);
+    if (closed_)
+        return;
+    closed_ = true;
+    pending_.clear();
+    pending_size_ = 0;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd_, nullptr);
+    ::close(fd_);
+}
+
+class SurakartaReactorLoop {
+   public:
+    SurakartaReactorLoop(std::shared_ptr<SurakartaNetworkServiceImpl> service)
+        : service_(std::move(service)) {
+        epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epoll_fd_ < 0 || wake_fd_ < 0)
+            throw std::runtime_error(std::string("Failed to create event loop: ") + strerror(errno));
+        Watch(wake_fd_);
+    }
+
+    ~SurakartaReactorLoop() {
+        Stop();
+        for (auto& [fd, entry] : connections_) {
+            service_->CloseSession(entry.session);
+            entry.connection->Destroy();
+        }
+        connections_.clear();
+        for (auto& item : adopted_)
+            ::close(item.fd);
+        ::close(wake_fd_);
+        ::close(epoll_fd_);
+    }
+
+    /// @param listen_fd The socket to accept from, or -1 to only adopt connections.
+    /// @param loops The loops to hand accepted connections out to, in turn.
+    /// @param cpu The hardware thread to pin the loop to, or -1.
+    void Start(int listen_fd, std::vector<SurakartaReactorLoop*> loops, int cpu) {
+        listen_fd_ = listen_fd;
+        loops_ = std::move(loops);
+        if (listen_fd_ >= 0)
+            Watch(listen_fd_);
+        thread_ = std::thread([this] { Run(); });
+        if (cpu >= 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            pthread_setaffinity_np(thread_.native_handle(), sizeof(set), &set);
+        }
+    }
+
+    void Stop() {
+        running_ = false;
+        uint64_t one = 1;
+        [[maybe_unused]] auto _ = ::write(wake_fd_, &one, sizeof(one));
+        if (thread_.joinable())
+            thread_.join();
+    }
+
+    // May be called from any thread; the connection is created on the loop thread.
+    void Adopt(int fd, std::string address, int port) {
+        {
+            std::lock_guard lock(adopt_mutex_);
+            adopted_.push_back({fd, std::move(address), port});
+        }
+        uint64_t one = 1;
+        [[maybe_unused]] auto _ = ::write(wake_fd_, &one, sizeof(one));
+    }
+
+    long long Accepted() const { return accepted_.load(std::memory_order_relaxed); }
+
+   private:
+    struct Entry {
+        std::shared_ptr<SurakartaReactorConnection> connection;
+        std::shared_ptr<SurakartaNetworkServiceImpl::Session> session;
+    };
+
+    struct Adopted {
+        int fd;
+        std::string address;
+        int port;
+    };
+
+    void Watch(int fd) {
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.fd = fd;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event);
+    }
+
+    void Run() {
+        epoll_event events[256];
+        while (running_) {
+            int count = epoll_wait(epoll_fd_, events, 256, listener_paused_ ? LISTENER_PAUSE_MS : -1);
+            if (listener_paused_ && std::chrono::steady_clock::now() >= listener_paused_until_) {
+                listener_paused_ = false;
+                Watch(listen_fd_);
+            }
+            for (int i = 0; i < count; i++) {
+                int fd = events[i].data.fd;
+                if (fd == wake_fd_) {
+                    uint64_t value;
+                    [[maybe_unused]] auto _ = ::read(wake_fd_, &value, sizeof(value));
+                    AdoptPending();
+                } else if (fd == listen_fd_) {
+                    Accept();
+                } else {
+                    OnConnectionEvent(fd, events[i].events);
+                }
+            }
+        }
+    }
+
+    void Accept() {
+        while (true) {
+            sockaddr_in address{};
+            socklen_t length = sizeof(address);
+            int fd = accept4(listen_fd_, (sockaddr*)&address, &length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EMFILE || errno == ENFILE)
+                    PauseListener();
+                return;
+            }
+            int flag = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+            char text[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &address.sin_addr, text, sizeof(text));
+            accepted_.fetch_add(1, std::memory_order_relaxed);
+            auto loop = loops_[next_loop_++ % loops_.size()];
+            if (loop == this)
+                AddConnection(fd, text, ntohs(address.sin_port));  // no need to wake ourselves
+            else
+                loop->Adopt(fd, text, ntohs(address.sin_port));
+        }
+    }
+
+    // Out of descriptors, the pending connections cannot be taken, and the listener would stay
+    // readable and spin the loop; it is left alone for a while instead, and the connections wait
+    // in the backlog until some have been closed.
+    void PauseListener() {
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, listen_fd_, nullptr);
+        listener_paused_ = true;
+        listener_paused_until_ = std::chrono::steady_clock::now() + std::chrono::milliseconds(LISTENER_PAUSE_MS);
+    }
+
+    void AdoptPending() {
+        std::vector<Adopted> adopted;
+        {
+            std::lock_guard lock(adopt_mutex_);
+            adopted.swap(adopted_);
+        }
+        for (auto& item : adopted)
+            AddConnection(item.fd, std::move(item.address), item.port);
+    }
+
+    void AddConnection(int fd, std::string address, int port) {
+        auto connection = std::make_shared<SurakartaReactorConnection>(fd, epoll_fd_, std::move(address), port);
+        auto session = service_->OpenSession(connection);
+        connections_[fd] = Entry{connection, session};
+        Watch(fd);
+    }
+
+    void OnConnectionEvent(int fd, uint32_t events) {
+        auto it = connections_.find(fd);
+        if (it == connections_.end())
+            return;
+        auto entry = it->second;
+        if (events & EPOLLOUT)
+            entry.connection->FlushPending();
+        if (!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+            return;
+        const bool readable = entry.connection->ReadAvailable();
+        bool open = true;
+        try {
+            // What arrived along with the EOF, such as a last MOVE, is handled before the close.
+            while (open && entry.connection->HasInbound()) {
+                auto message = entry.session->socket->Receive();
+                // Nothing if the rest has been dropped by the rate limit. One that closes the
+                // connection shuts it down, and the loop reads EOF next.
+                if (!message.has_value())
+                    break;
+                open = service_->HandleMessage(entry.session, std::move(message));
+            }
+            open = open && readable;
+            if (!open)
+                service_->CloseSession(entry.session);
+        } catch (const std::exception& e) {
+            entry.session->logger->Log("Oops! Service failed with exception: %s", e.what());
+            service_->CloseSession(entry.session);
+            open = false;
+        } catch (...) {
+            entry.session->logger->Log("Oops! Service failed with unknown exception.");
+            service_->CloseSession(entry.session);
+            open = false;
+        }
+        if (!open) {
+            entry.connection->Destroy();
+            connections_.erase(fd);
+        }
+    }
+
+    static constexpr int LISTENER_PAUSE_MS = 100;
+
+    std::shared_ptr<SurakartaNetworkServiceImpl> service_;
+    int epoll_fd_ = -1;
+    int wake_fd_ = -1;
+    int listen_fd_ = -1;
+    bool listener_paused_ = false;  // out of descriptors; only touched by the loop
+    std::chrono::steady_clock::time_point listener_paused_until_;
+    std::vector<SurakartaReactorLoop*> loops_;
+    size_t next_loop_ = 0;
+    std::atomic<long long> accepted_ = 0;
+    std::atomic<bool> running_ = true;
+    std::thread thread_;
+    std::unordered_map<int, Entry> connections_;
+    std::mutex adopt_mutex_;
+    std::vector<Adopted> adopted_;
+};
+
+// The hardware threads the process may run on, in order.
+static std::vector<int> AllowedCpus() {
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set))
+                cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+static int Listen(int port, bool reuse_port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        throw std::runtime_error(std::string("Failed to create socket: ") + strerror(errno));
+    int flag = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+    if (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag)) < 0) {
+        auto error = std::string("Failed to set SO_REUSEPORT: ") + strerror(errno);
+        ::close(fd);
+        throw std::runtime_error(error);
+    }
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    if (bind(fd, (sockaddr*)&address, sizeof(address)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        auto error = std::string("Failed to listen on port ") + std::to_string(port) + ": " + strerror(errno);
+        ::close(fd);
+        throw std::runtime_error(error);
+    }
+    return fd;
+}
+
+class SurakartaNetworkReactorServerImpl {
+   public:
+    SurakartaNetworkReactorServerImpl(std::shared_ptr<SurakartaNetworkService> service, int port, SurakartaNetworkReactorOptions options) {
+        int loops = options.loops;
+        if (loops <= 0)
+            loops = std::max(1u, std::thread::hardware_concurrency());
+        try {
+            // with SO_REUSEPORT, every loop listens; otherwise the first one does for all
+            for (int i = 0; i < (options.reuse_port ? loops : 1); i++)
+                listen_fds_.push_back(Listen(port, options.reuse_port));
+        } catch (...) {
+            CloseListeners();
+            throw;
+        }
+        std::vector<SurakartaReactorLoop*> raw_loops;
+        for (int i = 0; i < loops; i++) {
+            loops_.push_back(std::make_unique<SurakartaReactorLoop>(service->impl_));
+            raw_loops.push_back(loops_.back().get());
+        }
+        auto cpus = options.pin_threads ? AllowedCpus() : std::vector<int>();
+        for (int i = 0; i < loops; i++) {
+            int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+            if (options.reuse_port)
+                loops_[i]->Start(listen_fds_[i], {raw_loops[i]}, cpu);
+            else
+                loops_[i]->Start(i == 0 ? listen_fds_[0] : -1, raw_loops, cpu);
+        }
+    }
+
+    ~SurakartaNetworkReactorServerImpl() {
+        Shutdown();
+    }
+
+    void Shutdown() {
+        if (listen_fds_.empty())
+            return;
+        for (auto& loop : loops_)
+            loop->Stop();
+        loops_.clear();
+        CloseListeners();
+    }
+
+    std::vector<long long> AcceptedPerLoop() const {
+        std::vector<long long> accepted;
+        for (auto& loop : loops_)
+            accepted.push_back(loop->Accepted());
+        return accepted;
+    }
+
+   private:
+    void CloseListeners() {
+        for (int fd : listen_fds_)
+            ::close(fd);
+        listen_fds_.clear();
+    }
+
+    std::vector<int> listen_fds_;
+    std::vector<std::unique_ptr<SurakartaReactorLoop>> loops_;
+};
+
+SurakartaNetworkReactorServer::SurakartaNetworkReactorServer(std::shared_ptr<SurakartaNetworkService> service,
+                                                             int port,
+                                                             SurakartaNetworkReactorOptions options)
+    : impl_(std::make_shared<SurakartaNetworkReactorServerImpl>(service, port, options)) {}
+
+bool SurakartaNetworkReactorServer::IsSupported() {
+    return true;
+}
+
+#else
+
+#include <stdexcept>
+
+class SurakartaNetworkReactorServerImpl {
+   public:
+    void Shutdown() {}
+    std::vector<long long> AcceptedPerLoop() const { return {}; }
+};
+
+SurakartaNetworkReactorServer::SurakartaNetworkReactorServer(std::shared_ptr<SurakartaNetworkService>, int, SurakartaNetworkReactorOptions) {
+    throw std::runtime_error("The reactor server is only supported on Linux.");
+}
+
+bool SurakartaNetworkReactorServer::IsSupported() {
+    return false;
+}
+
+#endif
+
+SurakartaNetworkReactorServer::SurakartaNetworkReactorServer(std::shared_ptr<SurakartaNetworkService> service, int port, int loops)
+    : SurakartaNetworkReactorServer(std::move(service), port, SurakartaNetworkReactorOptions{loops}) {}
+
+SurakartaNetworkReactorServer::~SurakartaNetworkReactorServer() {
+    Shutdown();
+}
+
+void SurakartaNetworkReactorServer::Shutdown() {
+    if (impl_)
+        impl_->Shutdown();
+}
+
+std::vector<long long> SurakartaNetworkReactorServer::AcceptedPerLoop() const {
+    return impl_ ? impl_->AcceptedPerLoop() : std::vector<long long>();
+}
@@ -0,0 +1,164 @@
+// Replays the games in a journal written by surakarta-server --journal, and sums them up; see
+// journal_replay.h. The totals are printed every second while the replay goes on.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include "private-include/journal_replay.h"
+
+using Clock = std::chrono::steady_clock;
+
+struct ReplayOptions {
+    std::vector<std::string> paths;  // directories or segments
+    int threads = 0;
+    bool rebuild = true;
+    int users = 10;
+    bool json = false;
+};
+
+static const char* ColorName(int color) {
+    static const char* const names[] = {"BLACK", "WHITE", "NONE", "UNKNOWN"};
+    return color >= 0 && color < SurakartaReplayTotals::COLORS ? names[color] : "?";
+}
+
+static const char* EndReasonName(int reason) {
+    static const char* const names[] = {"NONE", "STALEMATE", "CHECKMATE", "TRAPPED", "RESIGN", "TIMEOUT", "ILLIGAL_MOVE"};
+    return reason >= 0 && reason < SurakartaReplayTotals::END_REASONS ? names[reason] : "?";
+}
+
+static std::vector<std::pair<std::string, SurakartaReplayUser>> TopUsers(const SurakartaReplayTotals& totals, int count) {
+    std::vector<std::pair<std::string, SurakartaReplayUser>> users(totals.users.begin(), totals.users.end());
+    std::sort(users.begin(), users.end(), [](auto& a, auto& b) {
+        return a.second.games != b.second.games ? a.second.games > b.second.games : a.first < b.first;
+    });
+    if ((int)users.size() > count)
+        users.resize(count);
+    return users;
+}
+
+static void PrintText(const ReplayOptions& options, const SurakartaJournalReplay& replay, int threads, double seconds) {
+    auto& totals = replay.Totals();
+    double per_second = totals.games / seconds;
+    printf("segments:      %zu (%.1f MiB, %lld torn bytes)\n", replay.Segments(), replay.Bytes() / 1048576.0, replay.TornBytes());
+    printf("games:         %lld replayed, %lld unfinished, %lld moves\n", totals.games, replay.Unfinished(), totals.moves);
+    if (options.rebuild)
+        printf("mismatched:    %lld games in which the rules disagree with the journal\n", totals.mismatched);
+    printf("elapsed:       %.3f s, %.0f games/s, %.0f games/s per thread (%d threads)\n", seconds, per_second,
+           per_second / threads, threads);
+    printf("winner:       ");
+    for (int color = 0; color < SurakartaReplayTotals::COLORS; color++) {
+        if (totals.winners[color] > 0)
+            printf(" %s %lld (%.1f%%)", ColorName(color), totals.winners[color], 100.0 * totals.winners[color] / totals.games);
+    }
+    printf("\nend reason:   ");
+    for (int reason = 0; reason < SurakartaReplayTotals::END_REASONS; reason++) {
+        if (totals.end_reasons[reason] > 0)
+            printf(" %s %lld", EndReasonName(reason), totals.end_reasons[reason]);
+    }
+    printf("\nmoves a game:  p50 %d, p90 %d, p99 %d, max %d\n", totals.LengthPercentile(0.50),
+           totals.LengthPercentile(0.90), totals.LengthPercentile(0.99), totals.LengthPercentile(1.0));
+    auto users = TopUsers(totals, options.users);
+    if (!users.empty()) {
+        printf("%-24s %10s %10s %10s %10s %8s\n", "user", "games", "wins", "losses", "as black", "win %");
+        for (auto& [name, user] : users) {
+            printf("%-24s %10lld %10lld %10lld %10lld %7.1f%%\n", name.c_str(), user.games, user.wins, user.losses,
+                   user.as_black, 100.0 * user.wins / user.games);
+        }
+    }
+}
+
+static void PrintJsonString(const std::string& text) {
+    putchar('"');
+    for (unsigned char c : text) {
+        if (c == '"' || c == '\\')
+            printf("\\%c", c);
+        else if (c < 0x20)
+            printf("\\u%04x", c);
+        else
+            putchar(c);
+    }
+    putchar('"');
+}
+
+static void PrintJson(const ReplayOptions& options, const SurakartaJournalReplay& replay, int threads, double seconds) {
+    auto& totals = replay.Totals();
+    printf("{\"segments\":%zu,\"bytes\":%lld,\"torn_bytes\":%lld", replay.Segments(), replay.Bytes(), replay.TornBytes());
+    printf(",\"games\":%lld,\"unfinished\":%lld,\"moves\":%lld", totals.games, replay.Unfinished(), totals.moves);
+    if (options.rebuild)
+        printf(",\"mismatched\":%lld", totals.mismatched);
+    printf(",\"threads\":%d,\"seconds\":%.3f,\"games_per_second\":%.0f,\"games_per_second_per_thread\":%.0f", threads,
+           seconds, totals.games / seconds, totals.games / seconds / threads);
+    printf(",\"winner\":{");
+    for (int color = 0; color < SurakartaReplayTotals::COLORS; color++)
+        printf("%s\"%s\":%lld", color > 0 ? "," : "", ColorName(color), totals.winners[color]);
+    printf("},\"end_reason\":{");
+    for (int reason = 0; reason < SurakartaReplayTotals::END_REASONS; reason++)
+        printf("%s\"%s\":%lld", reason > 0 ? "," : "", EndReasonName(reason), totals.end_reasons[reason]);
+    printf("},\"moves_per_game\":{\"p50\":%d,\"p90\":%d,\"p99\":%d,\"max\":%d}", totals.LengthPercentile(0.50),
+           totals.LengthPercentile(0.90), totals.LengthPercentile(0.99), totals.LengthPercentile(1.0));
+    printf(",\"users\":[");
+    bool first = true;
+    for (auto& [name, user] : TopUsers(totals, options.users)) {
+        printf("%s{\"name\":", first ? "" : ",");
+        PrintJsonString(name);
+        printf(",\"games\":%lld,\"wins\":%lld,\"losses\":%lld,\"as_black\":%lld}", user.games, user.wins, user.losses,
+               user.as_black);
+        first = false;
+    }
+    printf("]}\n");
+}
+
+int main(int argc, char** argv) {
+    ReplayOptions options;
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if ((strcmp(argv[i], "--threads") == 0 || strcmp(argv[i], "-t") == 0) && has_value) {
+            options.threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--no-rebuild") == 0 || strcmp(argv[i], "-n") == 0) {
+            options.rebuild = false;
+        } else if ((strcmp(argv[i], "--users") == 0 || strcmp(argv[i], "-u") == 0) && has_value) {
+            options.users = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--json") == 0) {
+            options.json = true;
+        } else if (argv[i][0] != '-') {
+            options.paths.push_back(argv[i]);
+        } else {
+            options.paths.clear();
+            break;
+        }
+    }
+    if (options.paths.empty()) {
+        printf("Usage: %s <journal directory or segment>.. [args..]\n", argv[0]);
+        printf("Args:\n");
+        printf("  -t|--threads <threads> The number of threads, default: one per hardware thread\n");
+        printf("  -n|--no-rebuild        Only sum up the records, without playing the moves by the rules\n");
+        printf("  -u|--users   <users>   The number of users to list, by games played, default: 10\n");
+        printf("     --json              Print the results as one line of JSON\n");
+        return 1;
+    }
+    int threads = options.threads > 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+
+    SurakartaJournalReplay replay(options.rebuild);
+    bool opened = replay.Open(options.paths);
+    for (auto& error : replay.Errors())
+        fprintf(stderr, "%s\n", error.c_str());
+    if (!opened) {
+        fprintf(stderr, "No journal segment found.\n");
+        return 1;
+    }
+    auto started = Clock::now();
+    replay.Run(threads, [&](size_t segments, long long games) {
+        double seconds = std::chrono::duration<double>(Clock::now() - started).count();
+        fprintf(stderr, "%zu/%zu segments, %lld games, %.0f games/s\n", segments, replay.Segments(), games, games / seconds);
+    });
+    double seconds = std::chrono::duration<double>(Clock::now() - started).count();
+    if (options.json)
+        PrintJson(options, replay, threads, seconds);
+    else
+        PrintText(options, replay, threads, seconds);
+    return 0;
+}
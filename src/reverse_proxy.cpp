@@ -1,11 +1,15 @@
 #include <condition_variable>
 #include <csignal>
+#include <cstring>
 #include <mutex>
 #include "network_framework.h"
+#include "private-include/forwarding_proxy.h"
 #include "private-include/reverse_proxy_service.h"
+#include "private-include/socket_capture_wrapper.h"
 #include "private-include/socket_log_wrapper.h"
 #include "private-include/socket_raw_log_wrapper.h"
 #include "surakarta.h"
+#include "surakarta_network_logger.h"
 
 bool running = true;
 std::mutex mutex;
@@ -22,14 +26,71 @@ void onSignal(int signal) {
 int main(int argc, char** argv) {
     if (argc > 3) {
         int port = std::stoi(argv[1]);
-        std::string server_address = argv[2];
-        int server_port = std::stoi(argv[3]);
-        auto logger = std::make_shared<SurakartaLoggerStdout>();
-        auto service = std::make_shared<ReverseProxyService>(server_address, server_port, [&](auto socket) {
+        std::vector<SurakartaBackend> servers{{argv[2], std::stoi(argv[3])}};
+        std::string log_level = "debug";
+        int loops = 0;
+        SurakartaUpstreamPoolOptions pool_options;
+        SurakartaLoggerAsyncOptions log_options;
+        std::string capture_path;
+        for (int i = 4; i < argc; i++) {
+            if ((strcmp(argv[i], "--log-level") == 0 || strcmp(argv[i], "-L") == 0) && i + 1 < argc) {
+                log_level = argv[++i];
+            } else if (strcmp(argv[i], "--log-drop") == 0) {
+                log_options.overflow = SurakartaLogOverflow::DROP;
+            } else if ((strcmp(argv[i], "--loops") == 0 || strcmp(argv[i], "-l") == 0) && i + 1 < argc) {
+                loops = std::stoi(argv[++i]);
+            } else if ((strcmp(argv[i], "--backend") == 0 || strcmp(argv[i], "-b") == 0) && i + 1 < argc) {
+                auto server = SurakartaBackend::Parse(argv[++i]);
+                if (!server.has_value()) {
+                    fprintf(stderr, "Invalid backend: %s\n", argv[i]);
+                    return 1;
+                }
+                servers.push_back(server.value());
+            } else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+                capture_path = argv[++i];
+            } else if (strcmp(argv[i], "--pool") == 0 && i + 1 < argc) {
+                pool_options.size = std::stoi(argv[++i]);
+            } else if (strcmp(argv[i], "--pool-max-idle-ms") == 0 && i + 1 < argc) {
+                pool_options.max_idle_ms = std::stoi(argv[++i]);
+            }
+        }
+#ifdef SIGPIPE
+        // a peer gone in the middle of a write is an error of that write, not the end of the proxy
+        signal(SIGPIPE, SIG_IGN);
+#endif
+        if (log_level == "none" && capture_path.empty() && SurakartaForwardingProxy::IsSupported()) {
+            // nothing to log, so nothing to parse: pass the bytes on as they are
+            SurakartaForwardingProxy proxy(servers, port, loops, pool_options);
+            signal(SIGINT, onSignal);
+
+            std::unique_lock lock(mutex);
+            condition_variable.wait(lock, [&] { return !running; });
+
+            proxy.Shutdown();
+            return 0;
+        }
+        auto async_logger = std::make_shared<SurakartaLoggerAsync>(1, log_options);
+        std::shared_ptr<SurakartaLogger> logger = async_logger;
+        if (log_level == "info")
+            logger = std::make_shared<SurakartaLoggerFiltered>(logger, SurakartaLogLevel::INFO);
+        else if (log_level == "none")
+            logger = std::make_shared<SurakartaLoggerNull>();
+        std::shared_ptr<SurakartaCapture> capture;
+        if (!capture_path.empty()) {
+            try {
+                capture = std::make_shared<SurakartaCapture>(SurakartaCapture::Options{capture_path});
+            } catch (const std::exception& e) {
+                fprintf(stderr, "%s\n", e.what());
+                return 1;
+            }
+        }
+        auto service = std::make_shared<ReverseProxyService>(servers, [&](auto socket) -> std::shared_ptr<NetworkFramework::Socket> {
+            if (capture)
+                return std::make_shared<SurakartaNetworkSocketCaptureWrapper>(socket, capture);
             auto prefixed_logger = logger->CreateSublogger(socket->PeerAddress() + ":" + std::to_string(socket->PeerPort()));
             return std::make_shared<SurakartaNetworkSocketLogWrapper>(
                 std::make_shared<SurakartaNetworkSocketRawLogWrapper>(socket, prefixed_logger), prefixed_logger);
-        });
+        }, pool_options);
         NetworkFramework::Server server(service, port);
         signal(SIGINT, onSignal);
 
@@ -38,9 +99,25 @@ int main(int argc, char** argv) {
 
         logger->Log("Server is shutting down...");
         server.Shutdown();
+        if (capture) {
+            capture->Flush();
+            logger->Log("Captured %lld records, %lld dropped, in %lld bytes", capture->Records(), capture->Dropped(), capture->Bytes());
+        }
         return 0;
     } else {
-        printf("Usage: %s <port> <server_address> <server_port>\n", argv[0]);
+        printf("Usage: %s <port> <server_address> <server_port> [args..]\n", argv[0]);
+        printf("Args:\n");
+        printf("  -L|--log-level <level> none, info (no message traffic) or debug, default: debug\n");
+        printf("  --log-drop             Drop log lines instead of waiting when the log writer falls behind\n");
+        printf("  -b|--backend <address:port> Another server to spread the rooms over, by consistent hashing of the\n");
+        printf("                         room id of the first READY of each connection; may be repeated\n");
+        printf("  --capture    <path>    Append the messages to a capture file instead of logging them, to be read with\n");
+        printf("                         surakarta-network-capture-decode; connections are always parsed\n");
+        printf("  --pool       <n>       Keep this many connections to each server ready for new clients (Linux only)\n");
+        printf("  --pool-max-idle-ms <ms> Replace a ready connection after this long, below the handshake timeout\n");
+        printf("                         of the servers, default: 30000\n");
+        printf("  -l|--loops   <loops>   With -L none, connections are forwarded unparsed from epoll event loops\n");
+        printf("                         (Linux only); the number of loops, default: one per hardware thread\n");
         return 1;
     }
 }
@@ -1,15 +1,26 @@
 #include "reverse_proxy_service.h"
+#include "wire_codec.h"
 
 void ReverseProxyService::Execute(std::shared_ptr<NetworkFramework::Socket> socket) {
-    const auto server_socket = NetworkFramework::ConnectToServer(server_address_, server_port_);
     socket = middle_ware_(socket);
+    std::optional<NetworkFramework::Message> first;
+    try {
+        first = socket->Receive();
+    } catch (...) {
+        return;
+    }
+    if (!first.has_value())
+        return;
+    auto room_id = SurakartaBackendRing::RoomOf(first.value());
+    const auto index = room_id.has_value() ? ring_.Pick(room_id.value()) : ring_.PickDefault();
+    auto server_socket = pool_ ? pool_->TakeSocket(index) : nullptr;
+    if (!server_socket)
+        server_socket = NetworkFramework::ConnectToServer(ring_.Backends()[index].address, ring_.Backends()[index].port);
     std::thread client_to_server_thread([&]() {
         try {
-            while (true) {
-                auto message = socket->Receive();
-                if (!message.has_value()) {
-                    break;
-                }
+            for (auto message = std::move(first); message.has_value(); message = socket->Receive()) {
+                // The compact encoding cannot cross the proxy, whose sockets speak JSON only.
+                SurakartaWireSetCompactOption(message.value(), false);
                 server_socket->Send(message.value());
             }
             server_socket->Close();
@@ -33,4 +44,4 @@ void ReverseProxyService::Execute(std::shared_ptr<NetworkFramework::Socket> sock
     });
     client_to_server_thread.join();
     server_to_client_thread.join();
-}
\ No newline at end of file
+}
@@ -1,5 +1,7 @@
 #include <condition_variable>
 #include <csignal>
+#include <cstdio>
+#include <cstring>
 #include <mutex>
 #include "network_framework.h"
 #include "surakarta.h"
@@ -17,23 +19,154 @@ void onSignal(int signal) {
     }
 }
 
+// <per second>[/<burst>]
+SurakartaNetworkRateLimit ParseRateLimit(const char* text) {
+    SurakartaNetworkRateLimit limit;
+    sscanf(text, "%lf/%d", &limit.per_second, &limit.burst);
+    return limit;
+}
+
 int main(int argc, char** argv) {
     if (argc > 1) {
         int port = std::stoi(argv[1]);
-        auto logger = std::make_shared<SurakartaLoggerStdout>();
-        auto service = std::make_shared<SurakartaNetworkService>(logger);
-        NetworkFramework::Server server(service, port);
+        bool reactor = false;
+        SurakartaNetworkReactorOptions reactor_options;
+        SurakartaNetworkServiceOptions options;
+        std::string log_level = "debug";
+        SurakartaLoggerAsyncOptions log_options;
+        int stats_port = 0;
+        std::string stats_socket;
+        for (int i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "--reactor") == 0 || strcmp(argv[i], "-R") == 0) {
+                reactor = true;
+            } else if ((strcmp(argv[i], "--loops") == 0 || strcmp(argv[i], "-l") == 0) && i + 1 < argc) {
+                reactor_options.loops = std::stoi(argv[++i]);
+            } else if (strcmp(argv[i], "--reuse-port") == 0) {
+                reactor_options.reuse_port = true;
+            } else if (strcmp(argv[i], "--pin-threads") == 0) {
+                reactor_options.pin_threads = true;
+            } else if ((strcmp(argv[i], "--workers") == 0 || strcmp(argv[i], "-w") == 0) && i + 1 < argc) {
+                options.worker_threads = std::stoi(argv[++i]);
+            } else if ((strcmp(argv[i], "--log-level") == 0 || strcmp(argv[i], "-L") == 0) && i + 1 < argc) {
+                log_level = argv[++i];
+            } else if (strcmp(argv[i], "--log-drop") == 0) {
+                log_options.overflow = SurakartaLogOverflow::DROP;
+            } else if (strcmp(argv[i], "--stats-port") == 0 && i + 1 < argc) {
+                stats_port = std::stoi(argv[++i]);
+            } else if (strcmp(argv[i], "--stats-socket") == 0 && i + 1 < argc) {
+                stats_socket = argv[++i];
+            } else if ((strcmp(argv[i], "--journal") == 0 || strcmp(argv[i], "-J") == 0) && i + 1 < argc) {
+                options.journal_directory = argv[++i];
+            } else if (strcmp(argv[i], "--journal-commit-us") == 0 && i + 1 < argc) {
+                options.journal_commit_interval_us = std::stoi(argv[++i]);
+            } else if (strcmp(argv[i], "--resume-grace-ms") == 0 && i + 1 < argc) {
+                options.resume_grace_ms = std::stoi(argv[++i]);
+            } else if (strcmp(argv[i], "--handshake-timeout-ms") == 0 && i + 1 < argc) {
+                options.handshake_timeout_ms = std::stoi(argv[++i]);
+            } else if (strcmp(argv[i], "--waiting-timeout-ms") == 0 && i + 1 < argc) {
+                options.waiting_timeout_ms = std::stoi(argv[++i]);
+            } else if (strcmp(argv[i], "--move-timeout-ms") == 0 && i + 1 < argc) {
+                options.move_timeout_ms = std::stoi(argv[++i]);
+            } else if (strcmp(argv[i], "--idle-timeout-ms") == 0 && i + 1 < argc) {
+                options.idle_timeout_ms = std::stoi(argv[++i]);
+            } else if (strcmp(argv[i], "--game-rate") == 0 && i + 1 < argc) {
+                options.game_rate_limit = ParseRateLimit(argv[++i]);
+            } else if (strcmp(argv[i], "--chat-rate") == 0 && i + 1 < argc) {
+                options.chat_rate_limit = ParseRateLimit(argv[++i]);
+            } else if (strcmp(argv[i], "--other-rate") == 0 && i + 1 < argc) {
+                options.other_rate_limit = ParseRateLimit(argv[++i]);
+            } else if (strcmp(argv[i], "--max-dropped") == 0 && i + 1 < argc) {
+                options.max_dropped_messages = std::stoi(argv[++i]);
+            } else if (strcmp(argv[i], "--cluster-node") == 0 && i + 1 < argc) {
+                options.cluster_nodes.push_back(argv[++i]);
+            } else if (strcmp(argv[i], "--cluster-self") == 0 && i + 1 < argc) {
+                options.cluster_self = argv[++i];
+            } else if (strcmp(argv[i], "--cluster-redirect") == 0) {
+                options.cluster_redirect = true;
+            } else if (strcmp(argv[i], "--cluster-pool") == 0 && i + 1 < argc) {
+                options.cluster_pool_size = std::stoi(argv[++i]);
+            } else if (strcmp(argv[i], "--cluster-secret") == 0 && i + 1 < argc) {
+                options.cluster_secret = argv[++i];
+            }
+        }
+        auto async_logger = std::make_shared<SurakartaLoggerAsync>(1, log_options);
+        std::shared_ptr<SurakartaLogger> logger = async_logger;
+        if (log_level == "info")
+            logger = std::make_shared<SurakartaLoggerFiltered>(logger, SurakartaLogLevel::INFO);
+        else if (log_level == "none")
+            logger = std::make_shared<SurakartaLoggerNull>();
+#ifdef SIGPIPE
+        // a client gone in the middle of a write is an error of that write, not the end of the server
+        signal(SIGPIPE, SIG_IGN);
+#endif
+        auto service = std::make_shared<SurakartaNetworkService>(logger, options);
+        std::unique_ptr<NetworkFramework::Server> server;
+        std::unique_ptr<SurakartaNetworkReactorServer> reactor_server;
+        if (reactor) {
+            reactor_server = std::make_unique<SurakartaNetworkReactorServer>(service, port, reactor_options);
+        } else {
+            server = std::make_unique<NetworkFramework::Server>(service, port);
+        }
+        std::unique_ptr<SurakartaNetworkStatsServer> stats_server;
+        if (stats_port > 0)
+            stats_server = std::make_unique<SurakartaNetworkStatsServer>(service, stats_port);
+        else if (!stats_socket.empty())
+            stats_server = std::make_unique<SurakartaNetworkStatsServer>(service, stats_socket);
         signal(SIGINT, onSignal);
 
         std::unique_lock lock(mutex);
         condition_variable.wait(lock, [&] { return !running; });
 
+        std::string rooms_per_worker;
+        for (auto rooms : service->Stats().rooms_per_worker)
+            rooms_per_worker += " " + std::to_string(rooms);
+        logger->Log("Rooms per worker:%s", rooms_per_worker.c_str());
+        if (reactor_server) {
+            std::string accepted_per_loop;
+            for (auto accepted : reactor_server->AcceptedPerLoop())
+                accepted_per_loop += " " + std::to_string(accepted);
+            logger->Log("Connections accepted per event loop:%s", accepted_per_loop.c_str());
+        }
         logger->Log("Server is shutting down...");
+        if (stats_server)
+            stats_server->Shutdown();
         service->ShutdownService();
-        server.Shutdown();
+        if (reactor_server)
+            reactor_server->Shutdown();
+        if (server)
+            server->Shutdown();
         return 0;
     } else {
-        printf("Usage: %s <port>\n", argv[0]);
+        printf("Usage: %s <port> [args..]\n", argv[0]);
+        printf("Args:\n");
+        printf("  -R|--reactor           Serve connections from epoll event loops instead of one thread each (Linux only)\n");
+        printf("  -l|--loops   <loops>   The number of event loops in reactor mode, default: one per hardware thread\n");
+        printf("  --reuse-port           In reactor mode, every event loop listens on the port and accepts its own\n");
+        printf("                         connections (SO_REUSEPORT), instead of the first accepting them all\n");
+        printf("  --pin-threads          In reactor mode, pin every event loop to a hardware thread of its own\n");
+        printf("  -w|--workers <workers> The number of threads that run the games, default: one per hardware thread\n");
+        printf("  -L|--log-level <level> none, info (no message traffic) or debug, default: debug\n");
+        printf("  --log-drop             Drop log lines instead of waiting when the log writer falls behind\n");
+        printf("  --stats-port <port>    Serve metrics to Prometheus on this port of the loopback interface (Linux only)\n");
+        printf("  --stats-socket <path>  Serve metrics to Prometheus on this Unix socket instead (Linux only)\n");
+        printf("  -J|--journal <dir>     Journal every game to this directory (Linux only)\n");
+        printf("  --journal-commit-us <us> How long a journaled move may wait for the disk flush, default: 2000\n");
+        printf("  --resume-grace-ms <ms> Keep the seat of a player who loses the connection this long, default: 0 (lose at once)\n");
+        printf("  --handshake-timeout-ms <ms> Close a connection that sends no READY this long, default: 0 (no limit)\n");
+        printf("  --waiting-timeout-ms <ms>   Remove a room whose second player does not come this long, default: 0 (no limit)\n");
+        printf("  --move-timeout-ms <ms>      A player who does not move this long loses with TIMEOUT, default: 0 (no limit)\n");
+        printf("  --idle-timeout-ms <ms>      Close a connection silent this long out of any game, default: 0 (no limit)\n");
+        printf("  --game-rate <rate>[/<burst>] MOVE, RESIGN and LEAVE messages a connection may send per second, default: no limit\n");
+        printf("  --chat-rate <rate>[/<burst>] CHAT messages a connection may send per second, default: no limit\n");
+        printf("  --other-rate <rate>[/<burst>] Other messages, READY included, a connection may send per second, default: no limit\n");
+        printf("  --max-dropped <n>      Close a connection once this many of its messages are over the rate, default: 0 (never)\n");
+        printf("  --cluster-node <address>:<port> A server of the cluster this one is part of, itself included; repeat for\n");
+        printf("                         each. Every server of a cluster must be given the same ones\n");
+        printf("  --cluster-self <address>:<port> This server, as given to --cluster-node\n");
+        printf("  --cluster-redirect     Redirect players asking for a room of another server there instead of relaying them\n");
+        printf("  --cluster-pool <n>     Keep this many connections to each other server ready for relaying, default: 0\n");
+        printf("  --cluster-secret <secret> Shared by every server of the cluster, which pass it on with the READYs they\n");
+        printf("                         relay. Without it, relayed READYs are looked up again like any other\n");
         return 1;
     }
 }
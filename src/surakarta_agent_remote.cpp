@@ -40,20 +40,20 @@ class SurakartaAgentRemoteImpl : public SurakartaAgentBase {
     receive:
         auto response_optional = socket_->Receive();
         if (response_optional.has_value()) {
-            auto response = response_optional.value();
+            auto response = std::move(response_optional.value());
             if (response.opcode == OPCODE::MOVE_OP) {
-                auto decoded = SurakartaNetworkMessageMove(response);
+                auto decoded = SurakartaNetworkMessageMove(std::move(response));
                 auto move = SurakartaMove(decoded.From(), decoded.To(), my_color);
                 auto guard = SurakartaTemporarilyApplyMoveGuardUtil(board_, move);
                 on_board_update_util_.UpdateAndGetTrace();
                 return move;
             } else if (response.opcode == OPCODE::END_OP) {
-                auto decoded = SurakartaNetworkMessageEnd(response);
+                auto decoded = SurakartaNetworkMessageEnd(std::move(response));
                 OnRemoteGameEnded.Invoke(decoded.IllegalMoveReason(), decoded.EndReason(), my_color);
                 remote_game_ended_ = true;
                 return SurakartaMove(SurakartaPosition(0, 0), SurakartaPosition(0, 0), my_color);
             } else if (response.opcode == OPCODE::CHAT_OP) {
-                auto decoded = SurakartaNetworkMessageChat(response);
+                auto decoded = SurakartaNetworkMessageChat(std::move(response));
                 OnChatMessageArrived.Invoke(decoded.Username(), decoded.ChatMessage());
                 goto receive;
             } else {
@@ -93,11 +93,11 @@ class SurakartaAgentRemoteFactoryImpl : public SurakartaDaemon::AgentFactory {
         socket_->Send(SurakartaNetworkMessageReady(username, requested_color, room_id));
         auto response_optional = socket_->Receive();
         if (response_optional.has_value()) {
-            auto response = response_optional.value();
+            auto response = std::move(response_optional.value());
             if (response.opcode == OPCODE::READY_OP) {
-                assigned_color_ = SurakartaNetworkMessageReady(response).Color();
+                assigned_color_ = SurakartaNetworkMessageReady(std::move(response)).Color();
             } else if (response.opcode == OPCODE::REJECT_OP) {
-                auto decoded = SurakartaNetworkMessageReject(response);
+                auto decoded = SurakartaNetworkMessageReject(std::move(response));
                 throw SurakartaNetworkRejectedException(decoded.Username(), decoded.Reason());
             } else {
                 throw SurakartaNetworkUnexpectedMessageException(response);
@@ -145,7 +145,7 @@ class SurakartaAgentRemoteFactoryImpl : public SurakartaDaemon::AgentFactory {
                 auto response_opt = socket_->Receive();
                 if (response_opt.has_value()) {
                     if (response_opt.value().opcode == OPCODE::END_OP) {
-                        auto decoded = SurakartaNetworkMessageEnd(response_opt.value());
+                        auto decoded = SurakartaNetworkMessageEnd(std::move(response_opt.value()));
                         OnRemoteGameEnded.Invoke(decoded.IllegalMoveReason(), decoded.EndReason(), assigned_color_);
                     } else {
                         throw SurakartaNetworkUnexpectedMessageException(response_opt.value());
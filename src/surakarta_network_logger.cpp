@@ -0,0 +1,237 @@
+#include "surakarta_network_logger.h"
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "mpmc_ring.h"
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+SurakartaLoggerFiltered::SurakartaLoggerFiltered(std::shared_ptr<SurakartaLogger> sink, SurakartaLogLevel max_level)
+    : sink_(std::move(sink)), max_level_(max_level), sink_enabled_(SurakartaLogEnabled(*sink_, SurakartaLogLevel::INFO)) {}
+
+void SurakartaLoggerFiltered::Log(const char* format, ...) {
+    if (!sink_enabled_)
+        return;
+    va_list args;
+    va_start(args, format);
+    va_list args_copy;
+    va_copy(args_copy, args);
+    int length = vsnprintf(nullptr, 0, format, args_copy);
+    va_end(args_copy);
+    if (length >= 0) {
+        std::string line(length, '\0');
+        vsnprintf(line.data(), line.size() + 1, format, args);
+        sink_->Log("%s", line.c_str());
+    }
+    va_end(args);
+}
+
+std::shared_ptr<SurakartaLogger> SurakartaLoggerFiltered::CreateSublogger(const std::string& prefix) {
+    return std::make_shared<SurakartaLoggerFiltered>(sink_->CreateSublogger(prefix), max_level_);
+}
+
+bool SurakartaLogEnabled(const SurakartaLogger& logger, SurakartaLogLevel level) {
+    if (dynamic_cast<const SurakartaLoggerNull*>(&logger) != nullptr)
+        return false;
+    if (auto filtered = dynamic_cast<const SurakartaLoggerFiltered*>(&logger)) {
+        return level <= filtered->MaxLevel() && SurakartaLogEnabled(*filtered->Sink(), level);
+    }
+    return true;
+}
+
+// ---- SurakartaLoggerAsync ----
+
+class SurakartaLoggerAsyncImpl {
+   public:
+    static constexpr size_t LINE_SIZE = 512;
+
+    SurakartaLoggerAsyncImpl(int fd, SurakartaLoggerAsyncOptions options)
+        : fd_(fd), overflow_(options.overflow), ring_(options.capacity) {
+        writer_ = std::thread([this] { Write(); });
+    }
+
+    ~SurakartaLoggerAsyncImpl() {
+        {
+            std::lock_guard lock(mutex_);
+            stopping_ = true;
+            when_logged_.notify_one();
+        }
+        writer_.join();
+    }
+
+    // The hot path: one claim on the ring and a copy of the line.
+    void Push(const char* text, size_t length) {
+        auto fill = [&](Line& line) {
+            line.length = (uint16_t)length;
+            memcpy(line.text, text, length);
+        };
+        if (!ring_.TryPushWith(fill)) {
+            if (overflow_ == SurakartaLogOverflow::DROP) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            std::unique_lock lock(mutex_);
+            waiting_++;
+            while (!ring_.TryPushWith(fill)) {
+                WakeWriterLocked();
+                when_written_.wait(lock);
+            }
+            waiting_--;
+            return;
+        }
+        // The writer comes round on its own every few milliseconds; waking it for every
+        // line would cost a context switch per line.
+        if (ring_.ApproximateSize() >= ring_.Capacity() / 2)
+            WakeWriter();
+    }
+
+    void Flush() {
+        std::unique_lock lock(mutex_);
+        waiting_++;
+        while (!ring_.Empty() || writing_) {
+            WakeWriterLocked();
+            when_written_.wait(lock);
+        }
+        waiting_--;
+    }
+
+    long long Dropped() const { return dropped_; }
+
+   private:
+    struct Line {
+        uint16_t length;
+        char text[LINE_SIZE];
+    };
+
+    void WakeWriter() {
+        // only the first producer to see the writer asleep pays for the wake-up
+        if (writer_sleeping_.load(std::memory_order_relaxed) && writer_sleeping_.exchange(false)) {
+            std::lock_guard lock(mutex_);
+            when_logged_.notify_one();
+        }
+    }
+
+    void WakeWriterLocked() {
+        if (writer_sleeping_.exchange(false))
+            when_logged_.notify_one();
+    }
+
+    // The producers waiting for room, and the callers of Flush(), are woken once the writer has
+    // taken lines off the ring, and once it has nothing left to write. They check again under the
+    // lock, so that a wake-up between their check and their wait is not lost: one missed here is
+    // made up for when the writer runs out of lines, which it does while they wait.
+    void WakeWaiters() {
+        if (waiting_.load(std::memory_order_relaxed) == 0)
+            return;
+        std::lock_guard lock(mutex_);
+        when_written_.notify_all();
+    }
+
+    void Write() {
+        const size_t batch_size = 64 * 1024;
+        std::string batch;
+        batch.reserve(batch_size + LINE_SIZE);
+        long long reported_dropped = 0;
+        while (true) {
+            writing_ = true;
+            while (batch.size() < batch_size &&
+                   ring_.TryPopWith([&](Line& line) { batch.append(line.text, line.length); })) {
+            }
+            long long dropped = dropped_;
+            if (dropped != reported_dropped) {
+                batch += "[logger] " + std::to_string(dropped - reported_dropped) + " lines dropped\n";
+                reported_dropped = dropped;
+            }
+            if (!batch.empty()) {
+                WakeWaiters();
+                WriteAll(batch);
+                batch.clear();
+                writing_ = false;
+                continue;
+            }
+            writing_ = false;
+            std::unique_lock lock(mutex_);
+            if (waiting_ > 0)
+                when_written_.notify_all();
+            if (stopping_)
+                return;
+            writer_sleeping_ = true;
+            if (ring_.Empty())
+                when_logged_.wait_for(lock, std::chrono::milliseconds(10));
+            writer_sleeping_ = false;
+        }
+    }
+
+    void WriteAll(const std::string& data) {
+        size_t offset = 0;
+        while (offset < data.size()) {
+#ifdef _WIN32
+            auto written = _write(fd_, data.data() + offset, (unsigned int)(data.size() - offset));
+#else
+            auto written = write(fd_, data.data() + offset, data.size() - offset);
+#endif
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0)
+                return;  // nowhere to report it; the lines are lost
+            offset += written;
+        }
+    }
+
+    const int fd_;
+    const SurakartaLogOverflow overflow_;
+    SurakartaMpmcRing<Line> ring_;
+    std::atomic<long long> dropped_ = 0;
+    std::atomic<bool> writing_ = false;
+    std::atomic<bool> writer_sleeping_ = false;
+    std::mutex mutex_;
+    std::condition_variable when_logged_;
+    std::condition_variable when_written_;
+    std::atomic<int> waiting_ = 0;  // on when_written_; changed under the lock
+    bool stopping_ = false;
+    std::thread writer_;
+};
+
+SurakartaLoggerAsync::SurakartaLoggerAsync(int fd, SurakartaLoggerAsyncOptions options)
+    : impl_(std::make_shared<SurakartaLoggerAsyncImpl>(fd, options)) {}
+
+SurakartaLoggerAsync::SurakartaLoggerAsync(std::shared_ptr<SurakartaLoggerAsyncImpl> impl, std::string prefix)
+    : impl_(std::move(impl)), prefix_(std::move(prefix)) {}
+
+void SurakartaLoggerAsync::Log(const char* format, ...) {
+    char line[SurakartaLoggerAsyncImpl::LINE_SIZE];
+    // leave room for the newline
+    const size_t capacity = sizeof(line) - 1;
+    size_t length = std::min(prefix_.size(), capacity);
+    memcpy(line, prefix_.data(), length);
+    va_list args;
+    va_start(args, format);
+    int formatted = vsnprintf(line + length, capacity - length + 1, format, args);
+    va_end(args);
+    if (formatted > 0)
+        length = std::min(length + formatted, capacity);
+    line[length++] = '\n';
+    impl_->Push(line, length);
+}
+
+std::shared_ptr<SurakartaLogger> SurakartaLoggerAsync::CreateSublogger(const std::string& prefix) {
+    return std::shared_ptr<SurakartaLoggerAsync>(new SurakartaLoggerAsync(impl_, prefix_ + "[" + prefix + "] "));
+}
+
+void SurakartaLoggerAsync::Flush() {
+    impl_->Flush();
+}
+
+long long SurakartaLoggerAsync::Dropped() const {
+    return impl_->Dropped();
+}
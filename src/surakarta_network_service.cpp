@@ -1,413 +1,1162 @@
 #include "surakarta_network_service.h"
-#include <condition_variable>
-#include <mutex>
+#include <algorithm>
+#include <cstdio>
+#include <limits>
+#include <random>
 #include <thread>
+#include <tuple>
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 #include "exception_as_eof_wrapper.h"
-#include "message.h"
 #include "opcode.h"
+#include "queued_socket.h"
 #include "socket_log_wrapper.h"
-#include "surakarta.h"
-
-class SurakartaNetworkServiceImpl : public NetworkFramework::Service {
-   public:
-    SurakartaNetworkServiceImpl(std::shared_ptr<SurakartaLogger> logger)
-        : logger_(logger) {}
-
-    enum class RoomStatus {
-        EMPTY,
-        WAITING_SECOND_PLAYER,
-        PLAYING,
-        ENDED,
-        CLOSED,
-        REMOVED,
-    };
+#include "surakarta_network_service_impl.h"
+
+std::pair<std::shared_ptr<SurakartaNetworkServiceImpl::Room>, bool> SurakartaNetworkServiceImpl::GetOrCreateRoom(
+    int room_id,
+    const SurakartaNetworkMessageReady& message,
+    std::shared_ptr<NetworkFramework::Socket> socket_of_first_player,
+    const std::shared_ptr<SurakartaLogger>& logger,
+    const std::function<void(const std::shared_ptr<Room>&)>& prepare) {
+    auto [room, created] = rooms_.GetOrCreate(
+        room_id,
+        [&] {
+            auto room_logger = logger->CreateSublogger("room " + std::to_string(room_id));
+            rooms_by_status_[(int)RoomStatus::WAITING_SECOND_PLAYER].Add();
+            auto room = std::make_shared<Room>(room_id, socket_of_first_player, message, room_logger);
+            if (prepare)
+                prepare(room);
+            return room;
+        },
+        // a room being removed gives its place to a new one
+        [](const std::shared_ptr<Room>& room) { return room->Status() == RoomStatus::REMOVED; });
+    if (created)
+        room->logger->Log("Room created.");
+    return std::make_pair(room, created);
+}
 
-    struct Room {
-        const int id;  // This field can be access without lock, since it is only written once
-        mutable std::mutex mutex;
-        std::condition_variable when_game_started_or_initialization_failed;
-        RoomStatus status = RoomStatus::EMPTY;
-        const std::shared_ptr<NetworkFramework::Socket> first_player_socket;
-        std::shared_ptr<NetworkFramework::Socket> second_player_socket;
-        const SurakartaNetworkMessageReady first_player_message;
-        std::shared_ptr<SurakartaDaemon> daemon;
-        std::shared_ptr<std::thread> daemon_thread;
-        std::shared_ptr<SurakartaAgentInteractiveHandler> first_player_handler;
-        std::shared_ptr<SurakartaAgentInteractiveHandler> second_player_handler;
-        PieceColor first_player_color, second_player_color;
-        std::string first_player_username, second_player_username;
-
-        Room(int id,
-             std::shared_ptr<NetworkFramework::Socket> first_player_socket,
-             SurakartaNetworkMessageReady first_player_message)
-            : id(id), first_player_socket(first_player_socket), first_player_message(first_player_message) {}
-
-        RoomStatus Status() const {
-            std::lock_guard lock(mutex);
-            return status;
+void SurakartaNetworkServiceImpl::ShutdownAndRemoveRoom(std::shared_ptr<Room> room,
+                                                        std::shared_ptr<SurakartaLogger> logger) {
+    int worker;
+    std::chrono::steady_clock::time_point teardown_started;
+    std::shared_ptr<const std::vector<Spectator>> spectators;
+    std::optional<SurakartaNetworkMessageEnd> end_message;
+    uint64_t journal_game;
+    {
+        std::lock_guard lock(room->mutex);
+        if (room->status == RoomStatus::REMOVED)
+            return;
+        // Steps still queued on the worker see this status and do nothing,
+        // so there is no game to stop here.
+        SetRoomStatus(*room, RoomStatus::REMOVED);
+        room->BeginTeardown();
+        teardown_started = room->teardown_started.value();
+        timers_.Cancel(room->deadline);
+        worker = room->worker;
+        spectators = std::atomic_exchange(&room->spectators, std::shared_ptr<const std::vector<Spectator>>());
+        end_message = std::move(room->end_message);
+        journal_game = room->journal_game;
+        for (bool is_first_player : {true, false}) {
+            auto& seat = room->PlayerSeat(is_first_player);
+            timers_.Cancel(seat.grace_timer);
+            if (seat.away) {
+                seat.away = false;
+                players_away_.Add(-1);
+            }
         }
+        if (room->started_at.has_value())
+            room_playing_.RecordSince(room->started_at.value());
+        else
+            room_waiting_.RecordSince(room->created_at);
+    }
+    const bool watched = spectators && !spectators->empty();
+    if (watched)
+        spectators_.Add(-(long long)spectators->size());
+    if (watched || journal_game != 0) {
+        auto end = end_message.value_or(SurakartaNetworkMessageEnd(std::nullopt, SurakartaEndReason::NONE, PieceColor::NONE));
+        auto record_end = [this, room, spectators, watched, journal_game, end = std::move(end)] {
+            if (journal_game != 0)
+                journal_->End(journal_game, room->id, end.EndReason(), end.Winner(), end.IllegalMoveReason());
+            if (watched) {
+                auto frame = std::make_shared<const SurakartaBroadcastFrame>(end);
+                broadcaster_.Post(0, [this, room, spectators, frame] { SendToSpectators(room, *spectators, frame); });
+            }
+        };
+        // The move the worker may be playing now is journaled and broadcast before the end.
+        if (worker >= 0)
+            workers_.Post(worker, std::move(record_end));
+        else
+            record_end();
+    }
+    if (worker >= 0)
+        workers_.Detach(worker);
+    rooms_.Remove(room->id, room);
+    auto latency = std::chrono::steady_clock::now() - teardown_started;
+    room_teardown_.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count());
+    long long latency_us = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+    rooms_torn_down_++;
+    teardown_total_us_ += latency_us;
+    long long max_us = teardown_max_us_;
+    while (latency_us > max_us && !teardown_max_us_.compare_exchange_weak(max_us, latency_us)) {
+    }
+    logger->Log("Room %d is closed in %lld us.", room->id, latency_us);
+}
 
-        // returns:
-        // 0: is first, success
-        // 1: is first, failed
-        // 2: is second
-        int WaitingIfIsFirst(std::shared_ptr<SurakartaLogger> logger) {
-            std::unique_lock lock(mutex);
-            if (status == RoomStatus::WAITING_SECOND_PLAYER)
-                return 2;
-            logger->Log("Room created.");
-            status = RoomStatus::WAITING_SECOND_PLAYER;
-            // now nothing to do, just wait
-            when_game_started_or_initialization_failed.wait(lock, [this] {
-                return status != RoomStatus::WAITING_SECOND_PLAYER;
-            });
-            return status != RoomStatus::PLAYING;
+void SurakartaNetworkServiceImpl::CancelRoom(const std::shared_ptr<Room>& room) {
+    RoomStatus previous_status;
+    {
+        std::lock_guard lock(room->mutex);
+        previous_status = room->status;
+        if (previous_status != RoomStatus::WAITING_SECOND_PLAYER && previous_status != RoomStatus::PLAYING) {
+            // already on its way out
+            return;
         }
+        SetRoomStatus(*room, RoomStatus::CLOSED);
+        room->BeginTeardown();
+    }
+    room->logger->Log("Room is cancelled.");
+    if (previous_status == RoomStatus::WAITING_SECOND_PLAYER) {
+        try {
+            room->first_player_socket->Send(SurakartaNetworkMessageReject(
+                room->first_player_message.Username(), std::string("Room ") + std::to_string(room->id) + " is cancelled."));
+        } catch (...) {
+            // the player may have gone already
+        }
+        ShutdownAndRemoveRoom(room, room->logger);
+        return;
+    }
+    // The steps queued before this one see the status and return at once, so the worker
+    // reaches it right after the move it may be playing now.
+    workers_.Post(room->worker, [this, room] {
+        CountGameEnded(SurakartaEndReason::NONE);
+        SurakartaNetworkMessageEnd message(std::nullopt, SurakartaEndReason::NONE, PieceColor::NONE);
+        try {
+            SendToPlayer(*room, true, message);
+            SendToPlayer(*room, false, std::move(message));
+        } catch (...) {
+            // the players may have gone already
+        }
+        ShutdownAndRemoveRoom(room, room->logger);
+    });
+}
+
+void SurakartaNetworkServiceImpl::ExpireWaitingRoom(const std::shared_ptr<Room>& room) {
+    {
+        std::lock_guard lock(room->mutex);
+        if (room->status != RoomStatus::WAITING_SECOND_PLAYER)
+            return;
+        SetRoomStatus(*room, RoomStatus::CLOSED);
+        room->BeginTeardown();
+        room->deadline = SurakartaTimerWheel::NO_TIMER;
+    }
+    deadlines_expired_[WAITING_DEADLINE].Add();
+    room->logger->Log("No second player has come in %lld ms.",
+                      (long long)std::chrono::duration_cast<std::chrono::milliseconds>(waiting_timeout_).count());
+    try {
+        room->first_player_socket->Send(SurakartaNetworkMessageReject(
+            room->first_player_message.Username(), std::string("No one has joined room ") + std::to_string(room->id) + " in time."));
+    } catch (...) {
+        // the player may have gone already
+    }
+    ShutdownAndRemoveRoom(room, room->logger);
+}
 
-        void StartFailed() {
-            std::lock_guard lock(mutex);
-            status = RoomStatus::EMPTY;
-            when_game_started_or_initialization_failed.notify_all();
+std::optional<std::pair<PieceColor, PieceColor>> SurakartaNetworkServiceImpl::ResolveColor(std::pair<PieceColor, PieceColor> request) {
+    if (request.first != PieceColor::NONE && request.second != PieceColor::NONE) {
+        if (request.first == request.second) {
+            return std::nullopt;
+        }
+        return request;
+    } else if (request.first == PieceColor::NONE && request.second == PieceColor::NONE) {
+        if (GlobalRandomGenerator::getInstance()() % 2 == 0) {
+            return std::make_pair(PieceColor::WHITE, PieceColor::BLACK);
+        } else {
+            return std::make_pair(PieceColor::BLACK, PieceColor::WHITE);
         }
+    } else if (request.first == PieceColor::NONE) {
+        return std::make_pair(ReverseColor(request.second), request.second);
+    } else {
+        return std::make_pair(request.first, ReverseColor(request.first));
+    }
+}
 
-        void StartRoom(
-            std::shared_ptr<NetworkFramework::Socket> _second_player_socket,
-            PieceColor _first_player_color,
-            PieceColor _second_player_color,
-            std::string _first_player_username,
-            std::string _second_player_username,
-            std::shared_ptr<SurakartaAgentInteractiveHandler> _first_player_handler,
-            std::shared_ptr<SurakartaAgentInteractiveHandler> _second_player_handler,
-            std::shared_ptr<SurakartaDaemon> _daemon,
-            std::shared_ptr<std::thread> _daemon_thread) {
-            std::lock_guard lock(mutex);
-            second_player_socket = _second_player_socket;
-            first_player_color = _first_player_color;
-            second_player_color = _second_player_color;
-            first_player_username = _first_player_username;
-            second_player_username = _second_player_username;
-            first_player_handler = _first_player_handler;
-            second_player_handler = _second_player_handler;
-            daemon = _daemon;
-            daemon_thread = _daemon_thread;
-            status = RoomStatus::PLAYING;
-            when_game_started_or_initialization_failed.notify_all();
+std::shared_ptr<SurakartaNetworkServiceImpl::Session> SurakartaNetworkServiceImpl::OpenSession(
+    std::shared_ptr<NetworkFramework::Socket> socket) {
+    auto peer_address = socket->PeerAddress();
+    auto peer_port = socket->PeerPort();
+    auto session = std::make_shared<Session>();
+    session->logger = logger_->CreateSublogger(peer_address + ":" + std::to_string(peer_port));
+    // taken before the wrappers hide it
+    session->frame_sink = std::dynamic_pointer_cast<SurakartaFrameSink>(socket);
+    if (std::any_of(std::begin(rate_limits_), std::end(rate_limits_), [](auto& limit) { return limit.per_second > 0; })) {
+        socket = std::make_shared<SurakartaRateLimitWrapper>(std::move(socket), rate_limits_, max_dropped_messages_,
+                                                             rate_limit_counters_, session->logger);
+    }
+    socket = std::make_shared<SurakartaNetworkSocketLogWrapper>(std::move(socket), session->logger);
+    socket = std::make_shared<SurakartaExceptionAsEofWrapper>(std::move(socket));
+    session->socket = socket;
+    opened_sessions_.Add();
+    session->closed_sessions = &closed_sessions_;
+    auto opened_at = std::chrono::steady_clock::now();
+    session->heard_at = opened_at.time_since_epoch().count();
+    auto limit = QuietLimit(*session);
+    if (limit > std::chrono::steady_clock::duration::zero())
+        WatchQuiet(session, limit, opened_at);
+    session->logger->Log("Connection established.");
+    return session;
+}
+
+bool SurakartaNetworkServiceImpl::HandleMessage(const std::shared_ptr<Session>& session,
+                                                std::optional<NetworkFramework::Message> message) {
+    int handled = HANDLED_DISCONNECT;
+    if (message.has_value()) {
+        handled = message->opcode - OPCODE::READY_OP;
+        if (handled < 0 || handled >= HANDLED_OTHER)
+            handled = HANDLED_OTHER;
+    }
+    SurakartaHistogram::Scope handling(message_handling_[handled]);
+    if (!message.has_value()) {
+        // One being armed again this very moment finds the session gone when it fires.
+        timers_.Cancel(session->quiet_timer.load());
+        return DispatchMessage(session, std::nullopt, handling.Start());
+    }
+    bool open = DispatchMessage(session, std::move(message), handling.Start());
+    if (handshake_timeout_ > std::chrono::steady_clock::duration::zero() || idle_timeout_ > std::chrono::steady_clock::duration::zero())
+        NoteHeard(*session, handling.Start());
+    return open;
+}
+
+bool SurakartaNetworkServiceImpl::DispatchMessage(const std::shared_ptr<Session>& session,
+                                                  std::optional<NetworkFramework::Message> message,
+                                                  std::chrono::steady_clock::time_point received) {
+    if (session->relay) {
+        // everything goes to the server of the room, which answers through the relay
+        if (!message.has_value()) {
+            session->relay->Close();
+            return false;
+        }
+        session->relay->Forward(std::move(message.value()));
+        return true;
+    }
+    if (session->ticket) {
+        auto ticket = session->ticket;
+        auto room = std::atomic_load(&ticket->room);
+        if (!room) {
+            if (message.has_value()) {
+                if (ticket->state.load() != SurakartaMatchmaker<MatchTicket>::CANCELLED) {
+                    // nothing to do but waiting to be paired
+                    return true;
+                }
+                // pairing it has failed; it will never be given a room
+                session->ticket = nullptr;
+                session->socket->Send(SurakartaNetworkMessageReject(ticket->ready->Username(), "Failed to start the game; try again."));
+                return true;
+            }
+            room = LeaveMatchmaking(ticket);
         }
+        session->ticket = nullptr;
+        if (!room)
+            return false;
+        // the game has started; the message is the first of it
+        session->room = room;
+        session->is_first_player = ticket->is_first_player;
+    }
+    if (session->room) {
+        auto room = session->room;
+        auto status = room->Status();
+        if (status == RoomStatus::WAITING_SECOND_PLAYER) {
+            if (message.has_value()) {
+                // nothing to do but waiting for the second player
+                return true;
+            }
+            // The first player has left before the game started. The room stays, and the second
+            // player to come wins it at once.
+            {
+                std::lock_guard lock(room->mutex);
+                status = room->status;
+                if (status == RoomStatus::WAITING_SECOND_PLAYER)
+                    room->first_player_left = true;
+            }
+            if (status == RoomStatus::WAITING_SECOND_PLAYER) {
+                session->room = nullptr;
+                return false;
+            }
+            // the second player has come meanwhile
+        }
+        if (status == RoomStatus::PLAYING) {
+            bool connected = message.has_value();
+            HandleGameMessage(session, std::move(message), received);
+            return connected;
+        }
+        // the room is over; the message belongs to the next round
+        session->room = nullptr;
+    }
+    if (session->watched_room) {
+        auto room = session->watched_room;
+        if (message.has_value() == false || message->opcode == OPCODE::LEAVE_OP) {
+            RemoveSpectator(room, session->socket);
+            session->watched_room = nullptr;
+            return message.has_value();
+        }
+        auto status = room->Status();
+        if (status == RoomStatus::WAITING_SECOND_PLAYER || status == RoomStatus::PLAYING) {
+            // spectators have nothing to say but LEAVE
+            return true;
+        }
+        session->watched_room = nullptr;
+    }
+    if (message.has_value() == false) {
+        // disconnect
+        return false;
+    }
+    if (message->opcode == OPCODE::READY_OP) {
+        session->greeted.store(true, std::memory_order_relaxed);
+        // Only another server of the cluster, which knows its secret, may say that it has relayed
+        // the READY here; from anyone else the marker is dropped, so that the room is still
+        // looked up.
+        const bool forwarded = cluster_ && cluster_->TakeForwarded(message.value(), session->socket->PeerAddress());
+        SurakartaNetworkMessageReady ready(std::move(message.value()));
+        if (cluster_ && !forwarded && ready.RoomId() != SURAKARTA_MATCHMAKING_ROOM_ID && !cluster_->IsLocal(ready.RoomId()))
+            ForwardToOwner(session, std::move(ready), received);
+        else if (!ready.ResumeToken().empty())
+            ResumeRoom(session, ready);
+        else if (ready.Spectating())
+            WatchRoom(session, ready);
+        else if (ready.RoomId() == SURAKARTA_MATCHMAKING_ROOM_ID)
+            JoinMatchmaking(session, ready);
+        else
+            JoinRoom(session, ready);
+    } else {
+        // invalid opcode; just ignore
+    }
+    return true;
+}
+
+void SurakartaNetworkServiceImpl::NoteHeard(Session& session, std::chrono::steady_clock::time_point heard_at) {
+    session.heard_at.store(heard_at.time_since_epoch().count(), std::memory_order_relaxed);
+    // Only this thread writes them, and they seldom change, so they are compared without the atomics.
+    auto& room = session.room ? session.room : session.watched_room;
+    if (room != session.waiting_on_room)
+        std::atomic_store(&session.waiting_on_room, room);
+    if (session.ticket != session.waiting_on_ticket)
+        std::atomic_store(&session.waiting_on_ticket, session.ticket);
+}
+
+std::chrono::steady_clock::duration SurakartaNetworkServiceImpl::QuietLimit(const Session& session) const {
+    if (!session.greeted.load(std::memory_order_relaxed) && handshake_timeout_ > std::chrono::steady_clock::duration::zero())
+        return handshake_timeout_;
+    return idle_timeout_;
+}
+
+bool SurakartaNetworkServiceImpl::IsWaitingOnService(const Session& session) {
+    if (session.relayed.load(std::memory_order_relaxed))
+        return true;
+    auto active = [](const Room& room) {
+        auto status = room.Status();
+        return status == RoomStatus::WAITING_SECOND_PLAYER || status == RoomStatus::PLAYING;
     };
+    if (auto ticket = std::atomic_load(&session.waiting_on_ticket)) {
+        if (auto room = std::atomic_load(&ticket->room))
+            return active(*room);
+        return ticket->state.load() != SurakartaMatchmaker<MatchTicket>::CANCELLED;
+    }
+    auto room = std::atomic_load(&session.waiting_on_room);
+    return room && active(*room);
+}
 
-    mutable std::mutex mutex;
-    std::vector<std::shared_ptr<Room>> rooms;
+void SurakartaNetworkServiceImpl::WatchQuiet(const std::shared_ptr<Session>& session,
+                                             std::chrono::steady_clock::duration delay,
+                                             std::chrono::steady_clock::time_point quiet_since) {
+    session->quiet_timer.store(timers_.Arm(delay, [this, weak_session = std::weak_ptr<Session>(session), quiet_since] {
+        CheckQuiet(weak_session, quiet_since);
+    }));
+}
 
-    std::shared_ptr<Room> GetOrCreateRoom(
-        SurakartaNetworkMessageReady message,
-        std::shared_ptr<NetworkFramework::Socket> socket_of_first_player) {
-        std::lock_guard<std::mutex> lock(mutex);
-        for (int i = 0; i < (int)rooms.size(); i++) {
-            if (rooms[i]->id == message.RoomId()) {
-                return rooms[i];
-            }
+void SurakartaNetworkServiceImpl::CheckQuiet(const std::weak_ptr<Session>& weak_session,
+                                             std::chrono::steady_clock::time_point quiet_since) {
+    auto session = weak_session.lock();
+    if (!session)
+        return;
+    auto limit = QuietLimit(*session);
+    if (limit == std::chrono::steady_clock::duration::zero())
+        return;  // it has said READY, and may be idle for ever
+    auto now = std::chrono::steady_clock::now();
+    if (IsWaitingOnService(*session)) {
+        WatchQuiet(session, limit, std::chrono::steady_clock::time_point::max());
+        return;
+    }
+    if (quiet_since == std::chrono::steady_clock::time_point::max()) {
+        // its game has ended, or its room gone, since the last check
+        WatchQuiet(session, limit, now);
+        return;
+    }
+    std::chrono::steady_clock::time_point heard_at(std::chrono::steady_clock::duration(session->heard_at.load(std::memory_order_relaxed)));
+    auto silent_since = std::max(quiet_since, heard_at);
+    if (now - silent_since < limit) {
+        WatchQuiet(session, silent_since + limit - now, quiet_since);
+        return;
+    }
+    const bool greeted = session->greeted.load(std::memory_order_relaxed);
+    deadlines_expired_[greeted ? IDLE_DEADLINE : HANDSHAKE_DEADLINE].Add();
+    session->logger->Log(greeted ? "Connection closed after %lld ms idle." : "Connection closed after %lld ms without READY.",
+                         (long long)std::chrono::duration_cast<std::chrono::milliseconds>(now - silent_since).count());
+    // Its session sees the connection closed, and goes away as usual.
+    session->socket->Close();
+}
+
+void SurakartaNetworkServiceImpl::JoinRoom(const std::shared_ptr<Session>& session,
+                                           const SurakartaNetworkMessageReady& ready_decoded) {
+    // A number the matchmaker has given out is not made a room again; a room made by its number
+    // before the matchmaker came to it may still be joined, and a matched one is never waiting.
+    if (IsMatchedRoomId(ready_decoded.RoomId()) && !rooms_.Find(ready_decoded.RoomId())) {
+        session->socket->Send(SurakartaNetworkMessageReject(
+            ready_decoded.Username(), std::string("Room ") + std::to_string(ready_decoded.RoomId()) + " is not creatable or joinable."));
+        return;
+    }
+    auto [room, created] = GetOrCreateRoom(ready_decoded.RoomId(), ready_decoded, session->socket, session->logger);
+    if (created) {
+        // This session is for the first player
+        session->room = room;
+        session->is_first_player = true;
+        if (waiting_timeout_ > std::chrono::steady_clock::duration::zero()) {
+            std::lock_guard lock(room->mutex);
+            // unless the second player has come already
+            if (room->status == RoomStatus::WAITING_SECOND_PLAYER)
+                room->deadline = timers_.Arm(waiting_timeout_, [this, room] { ExpireWaitingRoom(room); });
         }
-        auto room = std::make_shared<Room>(
-            message.RoomId(), socket_of_first_player, message);
-        rooms.push_back(room);
-        return room;
+        return;
+    }
+    auto room_logger = session->logger->CreateSublogger("room " + std::to_string(room->id));
+    std::unique_lock lock(room->mutex);
+    if (room->status != RoomStatus::WAITING_SECOND_PLAYER) {
+        // This room is not available
+        lock.unlock();
+        SurakartaNetworkMessageReject reject_message(ready_decoded.Username(), std::string("Room ") + std::to_string(room->id) + " is not creatable or joinable.");
+        session->socket->Send(reject_message);
+        return;
+    }
+    // This session is for the second player
+    // assign color
+    room_logger->Log("Try to join room.");
+    PieceColor first_player_requested_color = room->first_player_message.Color();
+    PieceColor second_player_requested_color = ready_decoded.Color();
+    auto resolved_colors = ResolveColor(std::make_pair(first_player_requested_color, second_player_requested_color));
+    if (resolved_colors.has_value() == false) {
+        // color conflict
+        room_logger->Log("Color conflict.");
+        SetRoomStatus(*room, RoomStatus::CLOSED);
+        room->BeginTeardown();
+        lock.unlock();
+        SurakartaNetworkMessageReject reject_message(ready_decoded.Username(), "Color conflict.");
+        session->socket->Send(reject_message);
+        room->first_player_socket->Send(reject_message);
+        ShutdownAndRemoveRoom(room, room_logger);
+        return;
     }
+    room->second_player_socket = session->socket;
+    room->first_player_username = room->first_player_message.Username();
+    room->second_player_username = ready_decoded.Username();
+    StartGame(room, resolved_colors->first, resolved_colors->second);
+    const bool first_player_left = room->first_player_left;
+    if (first_player_left)
+        room->BeginTeardown();
+    lock.unlock();
+    session->room = room;
+    session->is_first_player = false;
+    room_logger->Log("Room is ready.");
 
-    void ShutdownAndRemoveRoom(std::shared_ptr<Room> room,
-                               std::shared_ptr<SurakartaLogger> logger) {
-        if (room->status == RoomStatus::REMOVED)
-            return;
-        auto daemon = room->daemon;
-        if (daemon) {
-            daemon->OnGameEnded.RemoveListeners();
-            daemon->OnUpdateBoard.RemoveListeners();
-            while (daemon->Status() != SurakartaDaemon::ExecuteStatus::ENDED) {
-                try {
-                    if (daemon->Status() == SurakartaDaemon::ExecuteStatus::WAITING_FOR_BLACK_AGENT) {
-                        (room->first_player_color == PieceColor::BLACK ? room->first_player_handler : room->second_player_handler)
-                            ->CommitMoveRaw(SurakartaMove(0, 0, 0, 0, PieceColor::BLACK));
-                    } else if (daemon->Status() == SurakartaDaemon::ExecuteStatus::WAITING_FOR_WHITE_AGENT) {
-                        (room->first_player_color == PieceColor::WHITE ? room->first_player_handler : room->second_player_handler)
-                            ->CommitMoveRaw(SurakartaMove(0, 0, 0, 0, PieceColor::WHITE));
-                    }
-                } catch (...) {
-                    // ignore
-                }
+    room->first_player_socket->Send(ReadyForPlayer(*room, true, 0));
+    room->second_player_socket->Send(ReadyForPlayer(*room, false, 0));
+    if (first_player_left) {
+        workers_.Post(room->worker, [this, room, socket = room->first_player_socket] {
+            Resign(room, true, socket);
+        });
+    }
+}
+
+SurakartaNetworkMessageReady SurakartaNetworkServiceImpl::ReadyForPlayer(const Room& room, bool is_first_player, int moves) {
+    const auto& opponent = is_first_player ? room.second_player_username : room.first_player_username;
+    const auto color = is_first_player ? room.first_player_color : room.second_player_color;
+    const auto& token = is_first_player ? room.first_player_seat.token : room.second_player_seat.token;
+    if (token.empty())
+        return SurakartaNetworkMessageReady(opponent, color, room.id);
+    return SurakartaNetworkMessageReady(opponent, color, room.id, token, moves);
+}
+
+std::string SurakartaNetworkServiceImpl::NewResumeToken() {
+    // Anyone holding the token can take the seat, so it must not be guessed from the tokens of
+    // other games: it comes from the system's source of randomness, not from a seeded generator.
+    thread_local std::random_device random;
+    char token[17];
+    snprintf(token, sizeof(token), "%08x%08x", (unsigned)random(), (unsigned)random());
+    return token;
+}
+
+// Must be called with room->mutex held.
+void SurakartaNetworkServiceImpl::StartGame(const std::shared_ptr<Room>& room,
+                                            PieceColor first_player_color,
+                                            PieceColor second_player_color) {
+    room->first_player_color = first_player_color;
+    room->second_player_color = second_player_color;
+    room->game = std::make_shared<SurakartaGame>(BOARD_SIZE, MAX_NO_CAPTURE_ROUND);
+    room->game->StartGame();
+    room->worker = workers_.Attach();
+    timers_.Cancel(room->deadline);
+    room->deadline = SurakartaTimerWheel::NO_TIMER;
+    ArmMoveDeadline(room, 0);
+    if (resume_grace_ > std::chrono::steady_clock::duration::zero()) {
+        room->first_player_seat.token = NewResumeToken();
+        room->second_player_seat.token = NewResumeToken();
+    }
+    SetRoomStatus(*room, RoomStatus::PLAYING);
+    room->started_at = std::chrono::steady_clock::now();
+    if (journal_) {
+        room->journal_game = journal_->Start(room->id, room->first_player_username, first_player_color,
+                                             room->second_player_username, second_player_color);
+    }
+    room_waiting_.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(room->started_at.value() - room->created_at).count());
+    room->logger->Log("Game is started on worker %d.", room->worker);
+}
+
+// Must be called with room->mutex held.
+void SurakartaNetworkServiceImpl::ArmMoveDeadline(const std::shared_ptr<Room>& room, size_t played) {
+    if (move_timeout_ == std::chrono::steady_clock::duration::zero())
+        return;
+    timers_.Cancel(room->deadline);
+    room->deadline = timers_.Arm(move_timeout_, [this, room, played] {
+        workers_.Post(room->worker, [this, room, played] {
+            if (room->moves.size() != played)
+                return;  // moved after all, just before the deadline
+            // black moves first
+            const bool is_first_player = room->first_player_color == (played % 2 == 0 ? PieceColor::BLACK : PieceColor::WHITE);
+            {
+                std::lock_guard lock(room->mutex);
+                if (room->status != RoomStatus::PLAYING)
+                    return;
+                room->BeginTeardown();
             }
+            deadlines_expired_[MOVE_DEADLINE].Add();
+            room->logger->Log("The %s player has not moved in %lld ms.", is_first_player ? "first" : "second",
+                              (long long)std::chrono::duration_cast<std::chrono::milliseconds>(move_timeout_).count());
+            Forfeit(room, is_first_player, SurakartaEndReason::TIMEOUT);
+        });
+    });
+}
+
+void SurakartaNetworkServiceImpl::JoinMatchmaking(const std::shared_ptr<Session>& session,
+                                                  const SurakartaNetworkMessageReady& ready_decoded) {
+    auto ticket = std::make_shared<MatchTicket>();
+    ticket->color = ready_decoded.Color();
+    ticket->socket = session->socket;
+    ticket->logger = session->logger;
+    ticket->ready = ready_decoded;
+    if (!matchmaker_.Join(ticket)) {
+        session->socket->Send(SurakartaNetworkMessageReject(ready_decoded.Username(), "Too many players are joining; try again."));
+        return;
+    }
+    session->ticket = std::move(ticket);
+}
+
+std::shared_ptr<SurakartaNetworkServiceImpl::Room> SurakartaNetworkServiceImpl::LeaveMatchmaking(
+    const std::shared_ptr<MatchTicket>& ticket) {
+    while (true) {
+        if (auto room = std::atomic_load(&ticket->room))
+            return room;
+        if (matchmaker_.Cancel(*ticket))
+            return nullptr;
+        // being paired this very moment
+        std::this_thread::yield();
+    }
+}
+
+void SurakartaNetworkServiceImpl::StartMatchedGame(const std::shared_ptr<MatchTicket>& first,
+                                                   const std::shared_ptr<MatchTicket>& second) {
+    // Two players are only paired if they did not ask for the same color.
+    auto resolved_colors = ResolveColor(std::make_pair(first->color, second->color)).value();
+    std::shared_ptr<Room> room;
+    bool created = false;
+    while (!created) {
+        const int room_id = next_matched_room_id_;
+        if (room_id == std::numeric_limits<int>::min()) {
+            next_matched_room_id_ = SURAKARTA_MATCHMAKING_ROOM_ID - 1;
+            matched_room_ids_wrapped_ = true;
+        } else {
+            next_matched_room_id_ = room_id - 1;
         }
-        if (room->daemon_thread && room->daemon_thread->joinable()) {
-            room->daemon_thread->join();
+        // before the room is published, so that a READY for it by its number is rejected
+        if (room_id < lowest_matched_room_id_)
+            lowest_matched_room_id_ = room_id;
+        // players coming back through another server of the cluster must be sent here
+        if (cluster_ && !cluster_->IsLocal(room_id))
+            continue;
+        // The room is published playing, so that nobody asking for it by its number sees it
+        // waiting; one from an earlier round of the numbers may still be there.
+        std::tie(room, created) = GetOrCreateRoom(room_id, first->ready.value(), first->socket, first->logger,
+                                                  [&](const std::shared_ptr<Room>& created_room) {
+                                                      std::lock_guard lock(created_room->mutex);
+                                                      created_room->second_player_socket = second->socket;
+                                                      created_room->first_player_username = first->ready->Username();
+                                                      created_room->second_player_username = second->ready->Username();
+                                                      StartGame(created_room, resolved_colors.first, resolved_colors.second);
+                                                  });
+    }
+    first->is_first_player = true;
+    std::atomic_store(&first->room, room);
+    second->is_first_player = false;
+    std::atomic_store(&second->room, room);
+    room->logger->Log("Room is ready for %s and %s.", room->first_player_username.c_str(), room->second_player_username.c_str());
+    // Sent by the worker, so that the matchmaker never waits for a connection.
+    workers_.Post(room->worker, [this, room] {
+        try {
+            SendToPlayer(*room, true, ReadyForPlayer(*room, true, 0));
+            SendToPlayer(*room, false, ReadyForPlayer(*room, false, 0));
+        } catch (...) {
+            // the player that has gone is found out by its session
         }
+    });
+}
+
+bool SurakartaNetworkServiceImpl::IsMatchedRoomId(int room_id) const {
+    return room_id < SURAKARTA_MATCHMAKING_ROOM_ID && (matched_room_ids_wrapped_ || room_id >= lowest_matched_room_id_);
+}
+
+void SurakartaNetworkServiceImpl::WatchRoom(const std::shared_ptr<Session>& session,
+                                            const SurakartaNetworkMessageReady& ready_decoded) {
+    auto room = rooms_.Find(ready_decoded.RoomId());
+    Spectator spectator{session->socket, session->frame_sink};
+    if (room) {
+        std::unique_lock lock(room->mutex);
         if (room->status == RoomStatus::WAITING_SECOND_PLAYER) {
-            room->StartFailed();
+            std::vector<NetworkFramework::Message> greeting;
+            greeting.push_back(SurakartaNetworkMessageReady(
+                room->first_player_message.Username(), PieceColor::NONE, room->id, true));
+            AddSpectator(*room, spectator, std::move(greeting));
+            session->watched_room = room;
+            return;
         }
-        {
-            std::lock_guard lock(mutex);
-            // remove the room from the list
-            for (int i = 0; i < (int)rooms.size(); i++) {
-                if (rooms[i]->id == room->id) {
-                    rooms.erase(rooms.begin() + i);
-                    logger->Log("Room %d is closed.", room->id);
-                    break;
+        if (room->status == RoomStatus::PLAYING) {
+            // The moves played so far are only known to the worker.
+            int worker = room->worker;
+            lock.unlock();
+            session->watched_room = room;
+            workers_.Post(worker, [this, room, spectator, username = ready_decoded.Username()] {
+                std::lock_guard lock(room->mutex);
+                if (room->status != RoomStatus::PLAYING) {
+                    auto reject = std::make_shared<const SurakartaBroadcastFrame>(SurakartaNetworkMessageReject(
+                        username, std::string("Room ") + std::to_string(room->id) + " is not watchable."));
+                    broadcaster_.Post(0, [this, room, spectator, reject] { SendToSpectators(room, {spectator}, reject); });
+                    return;
                 }
-            }
-            room->status = RoomStatus::REMOVED;
+                std::vector<NetworkFramework::Message> greeting;
+                greeting.push_back(SurakartaNetworkMessageReady(
+                    room->first_player_username + " vs " + room->second_player_username, PieceColor::NONE, room->id, true));
+                for (auto& [from, to] : room->moves)
+                    greeting.push_back(SurakartaNetworkMessageMove(from, to));
+                AddSpectator(*room, spectator, std::move(greeting));
+            });
+            return;
         }
     }
+    session->socket->Send(SurakartaNetworkMessageReject(
+        ready_decoded.Username(), std::string("Room ") + std::to_string(ready_decoded.RoomId()) + " is not watchable."));
+}
 
-    std::optional<SurakartaNetworkMessageReady> WaitReadyMessage(
-        std::shared_ptr<NetworkFramework::Socket> socket,
-        std::optional<NetworkFramework::Message> message_remained_in_last_loop) {
-        auto message_opt = message_remained_in_last_loop.has_value()
-                               ? message_remained_in_last_loop
-                               : socket->Receive();
-        while (true) {
-            if (message_opt.has_value() == false) {
-                // disconnect
-                return std::nullopt;
-            } else {
-                if (message_opt.value().opcode == OPCODE::READY_OP) {
-                    return SurakartaNetworkMessageReady(message_opt.value());
-                } else {
-                    // invalid opcode; just ignore
-                }
-            }
+void SurakartaNetworkServiceImpl::ForwardToOwner(const std::shared_ptr<Session>& session,
+                                                 SurakartaNetworkMessageReady ready_decoded,
+                                                 std::chrono::steady_clock::time_point received) {
+    const size_t owner = cluster_->Owner(ready_decoded.RoomId());
+    const auto node = cluster_->Node(owner).ToString();
+    if (cluster_redirect_) {
+        cluster_counters_.redirected.Add();
+        session->logger->Log("Redirected to %s for room %d.", node.c_str(), ready_decoded.RoomId());
+        session->socket->Send(SurakartaNetworkMessageReject(ready_decoded.Username(), SURAKARTA_REDIRECT_REASON + node));
+        return;
+    }
+    cluster_counters_.forwarded.Add();
+    session->logger->Log("Relayed to %s for room %d.", node.c_str(), ready_decoded.RoomId());
+    session->relay = cluster_->Relay(owner, session->socket, std::move(ready_decoded), received, cluster_counters_, session->logger);
+    session->relayed.store(true, std::memory_order_relaxed);
+}
+
+void SurakartaNetworkServiceImpl::ResumeRoom(const std::shared_ptr<Session>& session,
+                                             const SurakartaNetworkMessageReady& ready_decoded) {
+    auto room = resume_grace_ > std::chrono::steady_clock::duration::zero() ? rooms_.Find(ready_decoded.RoomId()) : nullptr;
+    if (room) {
+        std::unique_lock lock(room->mutex);
+        const auto& token = ready_decoded.ResumeToken();
+        const bool is_first_player = token == room->first_player_seat.token;
+        if (room->status == RoomStatus::PLAYING && (is_first_player || token == room->second_player_seat.token)) {
+            int worker = room->worker;
+            lock.unlock();
+            session->room = room;
+            session->is_first_player = is_first_player;
+            // Queued before any move of this session, so the seat is taken before they are played.
+            workers_.Post(worker, [this, room, is_first_player, socket = session->socket,
+                                   username = ready_decoded.Username(), seen = ready_decoded.ResumeMoves()] {
+                ReturnToSeat(room, is_first_player, socket, username, seen);
+            });
+            return;
         }
     }
+    session->socket->Send(SurakartaNetworkMessageReject(
+        ready_decoded.Username(), std::string("Room ") + std::to_string(ready_decoded.RoomId()) + " is not resumable."));
+}
 
-    static std::optional<std::pair<PieceColor, PieceColor>> ResolveColor(std::pair<PieceColor, PieceColor> request) {
-        if (request.first != PieceColor::NONE && request.second != PieceColor::NONE) {
-            if (request.first == request.second) {
-                return std::nullopt;
-            }
-            return request;
-        } else if (request.first == PieceColor::NONE && request.second == PieceColor::NONE) {
-            if (GlobalRandomGenerator::getInstance()() % 2 == 0) {
-                return std::make_pair(PieceColor::WHITE, PieceColor::BLACK);
-            } else {
-                return std::make_pair(PieceColor::BLACK, PieceColor::WHITE);
+// Must be called with room.mutex held.
+void SurakartaNetworkServiceImpl::AddSpectator(Room& room,
+                                               const Spectator& spectator,
+                                               std::vector<NetworkFramework::Message> greeting) {
+    auto spectators = std::make_shared<std::vector<Spectator>>();
+    if (room.spectators)
+        *spectators = *room.spectators;
+    spectators->push_back(spectator);
+    std::atomic_store(&room.spectators, std::shared_ptr<const std::vector<Spectator>>(std::move(spectators)));
+    spectators_.Add();
+    room.logger->Log("Spectator %s:%d joined.", spectator.socket->PeerAddress().c_str(), spectator.socket->PeerPort());
+    // Posted with the mutex held, so that it is queued before anything broadcast to the spectator.
+    // The greeting goes through the socket, not as a frame: it is logged, and its READY settles
+    // the encoding the frames are sent in.
+    broadcaster_.Post(0, [socket = spectator.socket, greeting = std::move(greeting)]() mutable {
+        try {
+            for (auto& message : greeting)
+                socket->Send(std::move(message));
+        } catch (...) {
+            // the spectator may have gone already
+        }
+    });
+}
+
+bool SurakartaNetworkServiceImpl::RemoveSpectator(const std::shared_ptr<Room>& room,
+                                                  const std::shared_ptr<NetworkFramework::Socket>& socket) {
+    std::lock_guard lock(room->mutex);
+    if (!room->spectators)
+        return false;
+    auto spectators = std::make_shared<std::vector<Spectator>>();
+    for (auto& spectator : *room->spectators) {
+        if (spectator.socket != socket)
+            spectators->push_back(spectator);
+    }
+    if (spectators->size() == room->spectators->size())
+        return false;
+    spectators_.Add(-1);
+    std::atomic_store(&room->spectators, std::shared_ptr<const std::vector<Spectator>>(std::move(spectators)));
+    return true;
+}
+
+// Runs on the worker of the room; all it costs there without spectators is the load.
+void SurakartaNetworkServiceImpl::Broadcast(const std::shared_ptr<Room>& room, NetworkFramework::Message message) {
+    auto spectators = std::atomic_load(&room->spectators);
+    if (!spectators || spectators->empty())
+        return;
+    broadcaster_.Post(0, [this, room, spectators, message = std::move(message)]() mutable {
+        auto frame = std::make_shared<const SurakartaBroadcastFrame>(std::move(message));
+        SendToSpectators(room, *spectators, frame);
+    });
+}
+
+void SurakartaNetworkServiceImpl::SendToSpectators(const std::shared_ptr<Room>& room,
+                                                   const std::vector<Spectator>& spectators,
+                                                   const std::shared_ptr<const SurakartaBroadcastFrame>& frame) {
+    for (auto& spectator : spectators) {
+        if (spectator.frame_sink) {
+            // queued without blocking; one too far behind is closed
+            if (!spectator.frame_sink->SendFrame(frame))
+                DropSpectator(room, spectator);
+            continue;
+        }
+        // Both the reactor's connections and those of Execute are frame sinks; a socket that is
+        // neither blocks, and a slow spectator on it holds up the broadcaster, never the players.
+        try {
+            spectator.socket->Send(frame->message);
+        } catch (...) {
+            DropSpectator(room, spectator);
+        }
+    }
+}
+
+void SurakartaNetworkServiceImpl::LowerBroadcasterPriority() {
+#ifdef __linux__
+    // On Linux the nice value belongs to the thread.
+    broadcaster_.Post(0, [] { setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 10); });
+#endif
+}
+
+std::shared_ptr<SurakartaClusterDirectory> SurakartaNetworkServiceImpl::OpenCluster(const SurakartaNetworkServiceOptions& options) {
+    if (options.cluster_nodes.empty())
+        return nullptr;
+    SurakartaUpstreamPoolOptions pool_options;
+    pool_options.size = options.cluster_pool_size;
+    // below the handshake timeout of the other servers, which close connections quiet for longer
+    if (options.handshake_timeout_ms > 0)
+        pool_options.max_idle_ms = std::max(1, options.handshake_timeout_ms / 2);
+    return std::make_shared<SurakartaClusterDirectory>(options.cluster_nodes, options.cluster_self, pool_options, options.cluster_secret);
+}
+
+std::unique_ptr<SurakartaJournal> SurakartaNetworkServiceImpl::OpenJournal(const SurakartaNetworkServiceOptions& options,
+                                                                          const std::shared_ptr<SurakartaLogger>& logger) {
+    if (options.journal_directory.empty())
+        return nullptr;
+    SurakartaJournal::Options journal_options;
+    journal_options.directory = options.journal_directory;
+    journal_options.segment_bytes = options.journal_segment_bytes;
+    journal_options.commit_interval = std::chrono::microseconds(options.journal_commit_interval_us);
+    return std::make_unique<SurakartaJournal>(journal_options, logger->CreateSublogger("journal"));
+}
+
+void SurakartaNetworkServiceImpl::DropSpectator(const std::shared_ptr<Room>& room, const Spectator& spectator) {
+    if (!RemoveSpectator(room, spectator.socket))
+        return;  // dropped already, or the game is over
+    spectators_dropped_.Add();
+    try {
+        spectator.socket->Close();
+    } catch (...) {
+    }
+}
+
+void SurakartaNetworkServiceImpl::HandleGameMessage(const std::shared_ptr<Session>& session,
+                                                    std::optional<NetworkFramework::Message> message_opt,
+                                                    std::chrono::steady_clock::time_point received) {
+    auto room = session->room;
+    const bool is_first_player = session->is_first_player;
+    if (message_opt.has_value() == false) {
+        // connection has been unexpectedly closed
+        session->room = nullptr;
+        if (resume_grace_ > std::chrono::steady_clock::duration::zero()) {
+            workers_.Post(room->worker, [this, room, is_first_player, socket = session->socket] {
+                LeaveSeat(room, is_first_player, socket);
+            });
+            return;
+        }
+        {
+            std::lock_guard lock(room->mutex);
+            room->BeginTeardown();
+        }
+        workers_.Post(room->worker, [this, room, is_first_player, socket = session->socket] {
+            Resign(room, is_first_player, socket);
+        });
+        return;
+    }
+    try {
+        auto& message = message_opt.value();
+        if (message.opcode == OPCODE::MOVE_OP) {
+            // move piece
+            auto decoded = SurakartaNetworkMessageMove(std::move(message));
+            auto move = SurakartaMove(decoded.From(), decoded.To(),
+                                      is_first_player ? room->first_player_color : room->second_player_color);
+            workers_.Post(room->worker, [this, room, move, received, socket = session->socket] {
+                StepGame(room, move, received, socket);
+            });
+        } else if (message.opcode == OPCODE::LEAVE_OP || message.opcode == OPCODE::RESIGN_OP) {
+            // leave room or resign
+            session->room = nullptr;
+            {
+                std::lock_guard lock(room->mutex);
+                room->BeginTeardown();
             }
-        } else if (request.first == PieceColor::NONE) {
-            return std::make_pair(ReverseColor(request.second), request.second);
+            workers_.Post(room->worker, [this, room, is_first_player, socket = session->socket] {
+                Resign(room, is_first_player, socket);
+            });
+        } else if (message.opcode == OPCODE::CHAT_OP) {
+            // chat
+            auto decoded = SurakartaNetworkMessageChat(std::move(message));
+            auto peer_socket = std::atomic_load(&room->PlayerSocket(!is_first_player));
+            if (peer_socket)
+                peer_socket->Send(std::move(decoded));
         } else {
-            return std::make_pair(request.first, ReverseColor(request.first));
+            // invalid opcode; just ignore
         }
+    } catch (...) {
+        // A message that cannot be handled loses the game, and the opponent is told so as if
+        // the player had resigned.
+        session->room = nullptr;
+        {
+            std::lock_guard lock(room->mutex);
+            room->BeginTeardown();
+        }
+        workers_.Post(room->worker, [this, room, is_first_player, socket = session->socket] {
+            Resign(room, is_first_player, socket);
+        });
     }
+}
 
-    void Execute(std::shared_ptr<NetworkFramework::Socket> socket) override {
-        auto peer_address = socket->PeerAddress();
-        auto peer_port = socket->PeerPort();
-        auto logger = logger_->CreateSublogger(peer_address + ":" + std::to_string(peer_port));
-        try {
-            socket = std::make_shared<SurakartaNetworkSocketLogWrapper>(std::move(socket), logger);
-            socket = std::make_shared<SurakartaExceptionAsEofWrapper>(std::move(socket));
-            logger->Log("Connection established.");
-            auto message_remained_in_last_loop = std::optional<NetworkFramework::Message>();
-            while (true) {
-                auto ready_message_opt = WaitReadyMessage(socket, message_remained_in_last_loop);
-                if (ready_message_opt.has_value() == false) {
-                    // disconnect
+void SurakartaNetworkServiceImpl::StepGame(const std::shared_ptr<Room>& room,
+                                           SurakartaMove move,
+                                           std::chrono::steady_clock::time_point received,
+                                           const std::shared_ptr<NetworkFramework::Socket>& from) {
+    if (room->Status() != RoomStatus::PLAYING)
+        return;
+    if (from != room->PlayerSocket(move.player == room->first_player_color))
+        return;
+    auto commit_started = std::chrono::steady_clock::now();
+    move_queue_.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(commit_started - received).count());
+    try {
+        auto response = room->game->Move(move);
+        move_commit_.RecordSince(commit_started);
+        const bool is_first_player = move.player == room->first_player_color;
+        if (response.IsLegal()) {
+            SendToPlayer(*room, !is_first_player, SurakartaNetworkMessageMove(move.from, move.to));
+            move_relay_.RecordSince(received);
+            room->moves.emplace_back(move.from, move.to);
+            Broadcast(room, SurakartaNetworkMessageMove(move.from, move.to));
+            if (move_timeout_ > std::chrono::steady_clock::duration::zero() && !response.IsEnd()) {
+                std::lock_guard lock(room->mutex);
+                if (room->status == RoomStatus::PLAYING)
+                    ArmMoveDeadline(room, room->moves.size());
+            }
+        }
+        // after the relay, and only a copy into the batch of the journal writer
+        if (room->journal_game != 0)
+            journal_->Move(room->journal_game, room->id, move, response.GetMoveReason());
+        if (response.IsEnd()) {
+            auto message = SurakartaNetworkMessageEnd(response.GetMoveReason(), response.GetEndReason(), response.GetWinner());
+            {
+                std::lock_guard lock(room->mutex);
+                if (room->status != RoomStatus::PLAYING)
                     return;
-                }
-                auto ready_decoded = SurakartaNetworkMessageReady(ready_message_opt.value());
-                std::shared_ptr<Room> room =
-                    GetOrCreateRoom(ready_decoded, socket);
-                auto room_logger = logger->CreateSublogger("room " + std::to_string(room->id));
-                int result = room->WaitingIfIsFirst(room_logger);
-                bool is_first_player;
-                if (result == 0) {
-                    // This thread is for the first player
-                    is_first_player = true;
-                } else if (result == 1) {
-                    ShutdownAndRemoveRoom(room, room_logger);
-                    continue;
-                } else if (room->Status() == RoomStatus::WAITING_SECOND_PLAYER) {
-                    // This thread is for the second player
-                    // assign color
-                    is_first_player = false;
-                    room_logger->Log("Try to join room.");
-                    PieceColor first_player_requested_color = room->first_player_message.Color();
-                    PieceColor second_player_requested_color = ready_decoded.Color();
-                    auto resolved_colors = ResolveColor(std::make_pair(first_player_requested_color, second_player_requested_color));
-                    if (resolved_colors.has_value() == false) {
-                        // color conflict
-                        room_logger->Log("Color conflict.");
-                        SurakartaNetworkMessageReject reject_message(ready_decoded.Username(), "Color conflict.");
-                        socket->Send(reject_message);
-                        room->first_player_socket->Send(reject_message);
-                        room->StartFailed();
-                        continue;
-                    }
-                    auto first_player_color = resolved_colors.value().first;
-                    auto second_player_color = resolved_colors.value().second;
-                    // create daemon
-                    auto first_player_handler = std::make_shared<SurakartaAgentInteractiveHandler>();
-                    auto second_player_handler = std::make_shared<SurakartaAgentInteractiveHandler>();
-                    first_player_handler->BlockAgentCreation();
-                    second_player_handler->BlockAgentCreation();
-                    auto daemon = std::make_shared<SurakartaDaemon>(
-                        BOARD_SIZE, MAX_NO_CAPTURE_ROUND,
-                        first_player_color == PieceColor::BLACK ? first_player_handler->GetAgentFactory()
-                                                                : second_player_handler->GetAgentFactory(),
-                        first_player_color == PieceColor::WHITE ? first_player_handler->GetAgentFactory()
-                                                                : second_player_handler->GetAgentFactory());
-                    // start the daemon
-                    auto daemon_thread = std::make_shared<std::thread>([daemon, logger] {
-                        try {
-                            daemon->Execute();
-                        } catch (const std::exception& e) {
-                            logger->Log("Daemon thread failed: %s", e.what());
-                        } catch (...) {
-                            logger->Log("Daemon thread failed: unknown error");
-                        }
-                    });
-                    room->StartRoom(
-                        socket, first_player_color, second_player_color,
-                        room->first_player_message.Username(), ready_decoded.Username(),
-                        first_player_handler, second_player_handler,
-                        daemon, daemon_thread);
-                    room_logger->Log("Room is ready.");
-                } else {
-                    // This room is not available
-                    SurakartaNetworkMessageReject reject_message(ready_decoded.Username(), std::string("Room ") + std::to_string(room->id) + " is not creatable or joinable.");
-                    socket->Send(reject_message);
-                    continue;
-                }
-                const auto first_player_color = room->first_player_color;
-                const auto second_player_color = room->second_player_color;
-                const auto my_color = is_first_player ? first_player_color : second_player_color;
-                auto my_handler = is_first_player ? room->first_player_handler : room->second_player_handler;
-                auto peer_socket = is_first_player ? room->second_player_socket : room->first_player_socket;
-                auto peer_username = is_first_player ? room->second_player_username : room->first_player_username;
-                my_handler->OnMoveCommitted.AddListener([my_color, socket, logger](SurakartaMoveTrace trace) {
-                    if (trace.color == ReverseColor(my_color)) {
-                        auto from = trace.path[0].From();
-                        auto to = trace.path[trace.path.size() - 1].To();
-                        SurakartaNetworkMessageMove message(from, to);
-                        socket->Send(message);
-                    }
-                });
-                my_handler->OnGameEnded.AddListener([&](SurakartaMoveResponse response) {
-                    std::lock_guard lock(room->mutex);
-                    if (room->status == RoomStatus::PLAYING) {
-                        auto message = SurakartaNetworkMessageEnd(response.GetMoveReason(), response.GetEndReason(), response.GetWinner());
-                        socket->Send(message);
-                        peer_socket->Send(message);
-                        room->status = RoomStatus::ENDED;
-                    }
-                });
-                // check room status
+                SetRoomStatus(*room, RoomStatus::ENDED);
+                room->BeginTeardown();
+                room->end_message = message;
+            }
+            CountGameEnded(response.GetEndReason());
+            SendToPlayer(*room, true, message);
+            SendToPlayer(*room, false, std::move(message));
+            ShutdownAndRemoveRoom(room, room->logger);
+        }
+    } catch (const std::exception& e) {
+        room->logger->Log("Game step failed: %s", e.what());
+        ShutdownAndRemoveRoom(room, room->logger);
+    }
+}
+
+void SurakartaNetworkServiceImpl::Resign(const std::shared_ptr<Room>& room,
+                                         bool is_first_player,
+                                         const std::shared_ptr<NetworkFramework::Socket>& from) {
+    if (from == room->PlayerSocket(is_first_player))
+        Forfeit(room, is_first_player, SurakartaEndReason::RESIGN);
+}
+
+void SurakartaNetworkServiceImpl::Forfeit(const std::shared_ptr<Room>& room, bool is_first_player, SurakartaEndReason reason) {
+    const auto my_color = is_first_player ? room->first_player_color : room->second_player_color;
+    SurakartaNetworkMessageEnd message(
+        std::nullopt,
+        reason,
+        ReverseColor(my_color));
+    {
+        std::lock_guard lock(room->mutex);
+        if (room->status != RoomStatus::PLAYING)
+            return;
+        SetRoomStatus(*room, RoomStatus::CLOSED);
+        room->end_message = message;
+    }
+    CountGameEnded(reason);
+    SendToPlayer(*room, !is_first_player, std::move(message));
+    ShutdownAndRemoveRoom(room, room->logger);
+}
+
+void SurakartaNetworkServiceImpl::LeaveSeat(const std::shared_ptr<Room>& room,
+                                            bool is_first_player,
+                                            const std::shared_ptr<NetworkFramework::Socket>& socket) {
+    auto& current = room->PlayerSocket(is_first_player);
+    if (current != socket)
+        return;  // the player is back already, on another connection
+    {
+        std::lock_guard lock(room->mutex);
+        if (room->status != RoomStatus::PLAYING)
+            return;
+        auto& seat = room->PlayerSeat(is_first_player);
+        seat.away = true;
+        seat.left_at = std::chrono::steady_clock::now();
+        unsigned departure = ++seat.departures;
+        std::atomic_store(&current, std::shared_ptr<NetworkFramework::Socket>());
+        seat.grace_timer = timers_.Arm(resume_grace_, [this, room, is_first_player, departure] {
+            workers_.Post(room->worker, [this, room, is_first_player, departure] {
                 {
                     std::lock_guard lock(room->mutex);
-                    if (room->status == RoomStatus::ENDED) {
-                        // game is ended and status is changed by daemon thread
-                        //
-                        // there must be one and only one thread that has flag is_exited_by_this_thread
-                        // to clean the room
-                        {
-                            room->status = RoomStatus::CLOSED;
-                        }
-                        ShutdownAndRemoveRoom(room, room_logger);
-                        continue;
-                    }
-                    if (room->status == RoomStatus::CLOSED) {
-                        continue;
-                    }
-                }
-                // send ready message
-                SurakartaNetworkMessageReady ready_message(
-                    peer_username, my_color, room->id);
-                socket->Send(ready_message);
-                // preparations have been done; allow agent creation
-                my_handler->UnblockAgentCreation();
-
-                auto Resign = [&](bool do_not_send_to_this_socket = false) {
-                    // connection has been unexpectedly closed
-                    SurakartaNetworkMessageEnd message(
-                        std::nullopt,
-                        SurakartaEndReason::RESIGN,
-                        ReverseColor(my_color));
-                    if (!do_not_send_to_this_socket) {
-                        // socket->Send(message);
-                    }
-                    peer_socket->Send(message);
-                    {
-                        std::lock_guard lock(room->mutex);
-                        room->status = RoomStatus::CLOSED;
-                    }
-                    ShutdownAndRemoveRoom(room, room_logger);
-                };
-
-                // now, the game is started
-                try {
-                    room_logger->Log("Listen loop is started.");
-                    while (true) {
-                        auto message_opt = socket->Receive();
-                        {
-                            std::lock_guard lock(room->mutex);
-                            if (room->status != RoomStatus::PLAYING) {
-                                if (room->status == RoomStatus::ENDED) {
-                                    // game is ended and status is changed by daemon thread
-                                    //
-                                    // there must be one and only one thread that has flag is_exited_by_this_thread
-                                    // to clean the room
-                                    room->status = RoomStatus::CLOSED;
-                                    ShutdownAndRemoveRoom(room, room_logger);
-                                }
-                                message_remained_in_last_loop = message_opt;
-                                break;
-                            }
-                        }
-                        if (message_opt.has_value() == false) {
-                            Resign();
-                            break;
-                        }
-                        auto message = message_opt.value();
-                        if (message.opcode == OPCODE::MOVE_OP) {
-                            // move piece
-                            auto decoded = SurakartaNetworkMessageMove(message);
-                            my_handler->CommitMoveRaw(
-                                SurakartaMove(decoded.From(), decoded.To(), my_handler->MyColor()));
-                        } else if (message.opcode == OPCODE::LEAVE_OP) {
-                            // leave room
-                            Resign();
-                            break;
-                        } else if (message.opcode == OPCODE::RESIGN_OP) {
-                            // resign
-                            Resign();
-                            break;
-                        } else if (message.opcode == OPCODE::CHAT_OP) {
-                            // chat
-                            auto decoded = SurakartaNetworkMessageChat(message);
-                            peer_socket->Send(decoded);
-                        } else {
-                            // invalid opcode; just ignore
-                        }
-                    }
-                } catch (...) {
-                    room->status = RoomStatus::CLOSED;
-                    ShutdownAndRemoveRoom(room, room_logger);
+                    auto& seat = room->PlayerSeat(is_first_player);
+                    if (room->status != RoomStatus::PLAYING || !seat.away || seat.departures != departure)
+                        return;
+                    room->BeginTeardown();
                 }
+                deadlines_expired_[GRACE_DEADLINE].Add();
+                Forfeit(room, is_first_player, SurakartaEndReason::TIMEOUT);
+            });
+        });
+    }
+    players_away_.Add();
+    room->logger->Log("The %s player has left; the seat is kept for %lld ms.", is_first_player ? "first" : "second",
+                      (long long)std::chrono::duration_cast<std::chrono::milliseconds>(resume_grace_).count());
+}
+
+void SurakartaNetworkServiceImpl::ReturnToSeat(const std::shared_ptr<Room>& room,
+                                               bool is_first_player,
+                                               const std::shared_ptr<NetworkFramework::Socket>& socket,
+                                               const std::string& username,
+                                               int seen) {
+    auto& current = room->PlayerSocket(is_first_player);
+    std::shared_ptr<NetworkFramework::Socket> replaced;
+    {
+        std::lock_guard lock(room->mutex);
+        if (room->status == RoomStatus::PLAYING) {
+            auto& seat = room->PlayerSeat(is_first_player);
+            if (seat.away) {
+                seat.away = false;
+                timers_.Cancel(seat.grace_timer);
+                players_away_.Add(-1);
+                player_away_.RecordSince(seat.left_at);
             }
-        } catch (const std::exception& e) {
-            logger->Log("Oops! Service failed with exception: %s", e.what());
-        } catch (...) {
-            logger->Log("Oops! Service failed with unknown exception.");
+            replaced = std::atomic_exchange(&current, socket);
         }
     }
+    if (current != socket) {
+        socket->Send(SurakartaNetworkMessageReject(username, std::string("Room ") + std::to_string(room->id) + " is not resumable."));
+        return;
+    }
+    players_resumed_.Add();
+    room->logger->Log("The %s player is back, having seen %d of %zu moves.", is_first_player ? "first" : "second", seen,
+                      room->moves.size());
+    if (replaced && replaced != socket) {
+        // The player is back before its old connection was found lost; what comes on it is ignored.
+        replaced->Close();
+    }
+    socket->Send(ReadyForPlayer(*room, is_first_player, (int)room->moves.size()));
+    for (size_t i = seen; i < room->moves.size(); i++)
+        socket->Send(SurakartaNetworkMessageMove(room->moves[i].first, room->moves[i].second));
+}
+
+void SurakartaNetworkServiceImpl::SendToPlayer(Room& room, bool is_first_player, NetworkFramework::Message message) {
+    auto& socket = room.PlayerSocket(is_first_player);
+    if (socket)
+        socket->Send(std::move(message));
+}
 
-    void ShutdownService() {
-        while (rooms.empty() == false) {
-            ShutdownAndRemoveRoom(rooms[0], logger_);
+void SurakartaNetworkServiceImpl::CloseSession(const std::shared_ptr<Session>& session) {
+    try {
+        HandleMessage(session, std::nullopt);
+    } catch (const std::exception& e) {
+        session->logger->Log("Failed to close session: %s", e.what());
+    } catch (...) {
+        session->logger->Log("Failed to close session: unknown error");
+    }
+}
+
+void SurakartaNetworkServiceImpl::Execute(std::shared_ptr<NetworkFramework::Socket> socket) {
+    // The socket blocks; whoever sends to it, such as a worker, only queues, for the writers.
+    auto queued = std::make_shared<SurakartaQueuedSocket>(std::move(socket), writers_, timers_);
+    auto session = OpenSession(queued);
+    try {
+        while (HandleMessage(session, session->socket->Receive())) {
         }
+    } catch (const std::exception& e) {
+        session->logger->Log("Oops! Service failed with exception: %s", e.what());
+        CloseSession(session);
+    } catch (...) {
+        session->logger->Log("Oops! Service failed with unknown exception.");
+        CloseSession(session);
     }
+    // the last messages, such as the END of a game the peer has resigned, before the socket is closed
+    queued->Stop();
+}
 
-   private:
-    std::shared_ptr<SurakartaLogger> logger_;
-};
+void SurakartaNetworkServiceImpl::ShutdownService() {
+    for (auto& room : rooms_.Values()) {
+        CancelRoom(room);
+    }
+}
+
+bool SurakartaNetworkServiceImpl::CancelRoom(int room_id) {
+    auto room = rooms_.Find(room_id);
+    if (room == nullptr)
+        return false;
+    CancelRoom(room);
+    return true;
+}
 
-SurakartaNetworkService::SurakartaNetworkService(std::shared_ptr<SurakartaLogger> logger)
-    : impl_(std::make_shared<SurakartaNetworkServiceImpl>(logger)) {}
+SurakartaNetworkServiceStats SurakartaNetworkServiceImpl::Stats() const {
+    SurakartaNetworkServiceStats stats;
+    stats.active_rooms = (int)rooms_.Size();
+    stats.rooms_per_worker = workers_.RoomsPerWorker();
+    stats.rooms_torn_down = rooms_torn_down_;
+    if (stats.rooms_torn_down > 0)
+        stats.teardown_latency_mean_us = (double)teardown_total_us_ / stats.rooms_torn_down;
+    stats.teardown_latency_max_us = teardown_max_us_;
+    return stats;
+}
+
+static SurakartaNetworkLatency ToLatency(const SurakartaHistogram& histogram) {
+    auto snapshot = histogram.Collect();
+    SurakartaNetworkLatency latency;
+    latency.count = snapshot.count;
+    latency.mean_us = snapshot.Mean() / 1000;
+    latency.p50_us = snapshot.Percentile(0.50) / 1000;
+    latency.p99_us = snapshot.Percentile(0.99) / 1000;
+    latency.p999_us = snapshot.Percentile(0.999) / 1000;
+    latency.max_us = snapshot.Max() / 1000;
+    return latency;
+}
+
+SurakartaNetworkServiceMetrics SurakartaNetworkServiceImpl::Metrics() const {
+    static const char* const handled_names[] = {"READY", "MOVE", "RESIGN", "REJECT", "LEAVE", "CHAT", "END", "OTHER", "DISCONNECT"};
+    SurakartaNetworkServiceMetrics metrics;
+    for (int i = 0; i <= HANDLED_DISCONNECT; i++)
+        metrics.message_handling.emplace_back(handled_names[i], ToLatency(message_handling_[i]));
+    metrics.move_queue = ToLatency(move_queue_);
+    metrics.move_commit = ToLatency(move_commit_);
+    metrics.move_relay = ToLatency(move_relay_);
+    metrics.room_waiting = ToLatency(room_waiting_);
+    metrics.room_playing = ToLatency(room_playing_);
+    metrics.room_teardown = ToLatency(room_teardown_);
+    // read closed first, so that a session opened meanwhile is not seen closed but not opened
+    long long closed = closed_sessions_.Value();
+    metrics.connections_opened = opened_sessions_.Value();
+    metrics.active_connections = (int)(metrics.connections_opened - closed);
+    metrics.active_rooms = (int)rooms_.Size();
+    static const std::pair<const char*, RoomStatus> statuses[] = {
+        {"WAITING_SECOND_PLAYER", RoomStatus::WAITING_SECOND_PLAYER},
+        {"PLAYING", RoomStatus::PLAYING},
+        {"ENDED", RoomStatus::ENDED},
+        {"CLOSED", RoomStatus::CLOSED},
+    };
+    for (auto& [name, status] : statuses)
+        metrics.rooms_by_status.emplace_back(name, (int)rooms_by_status_[(int)status].Value());
+    static const char* const end_reason_names[END_REASONS] = {"NONE", "STALEMATE", "CHECKMATE", "TRAPPED", "RESIGN", "TIMEOUT", "ILLIGAL_MOVE"};
+    for (int i = 0; i < END_REASONS; i++)
+        metrics.games_ended.emplace_back(end_reason_names[i], games_ended_[i].Value());
+    metrics.spectators = (int)spectators_.Value();
+    metrics.spectators_dropped = spectators_dropped_.Value();
+    metrics.players_away = (int)players_away_.Value();
+    metrics.players_resumed = players_resumed_.Value();
+    metrics.player_away = ToLatency(player_away_);
+    metrics.matchmaking_waiting = (int)matchmaker_.Waiting();
+    metrics.matchmaking_pairs = matchmaker_.Pairs();
+    metrics.matchmaking_wait = ToLatency(matchmaker_.Wait());
+    static const char* const deadline_names[DEADLINES] = {"HANDSHAKE", "WAITING", "MOVE", "GRACE", "IDLE"};
+    for (int i = 0; i < DEADLINES; i++)
+        metrics.deadlines_expired.emplace_back(deadline_names[i], deadlines_expired_[i].Value());
+    metrics.timers_armed = timers_.Armed();
+    static const char* const rate_class_names[SURAKARTA_RATE_CLASSES] = {"GAME", "CHAT", "OTHER"};
+    for (int i = 0; i < SURAKARTA_RATE_CLASSES; i++)
+        metrics.messages_dropped.emplace_back(rate_class_names[i], rate_limit_counters_.dropped[i].Value());
+    metrics.connections_rate_limited = rate_limit_counters_.disconnected.Value();
+    metrics.cluster_forwarded = cluster_counters_.forwarded.Value();
+    metrics.cluster_redirected = cluster_counters_.redirected.Value();
+    metrics.cluster_relaying = (int)cluster_counters_.relaying.Value();
+    metrics.cluster_forward = ToLatency(cluster_counters_.forward_latency);
+    if (journal_) {
+        metrics.journal_commit = ToLatency(journal_->CommitLatency());
+        metrics.journal_records = journal_->Records();
+        metrics.journal_bytes = journal_->Bytes();
+        metrics.journal_failures = journal_->Failures();
+    }
+    return metrics;
+}
+
+SurakartaNetworkService::SurakartaNetworkService(std::shared_ptr<SurakartaLogger> logger,
+                                                 SurakartaNetworkServiceOptions options)
+    : impl_(std::make_shared<SurakartaNetworkServiceImpl>(logger, options)) {}
 
 void SurakartaNetworkService::Execute(std::shared_ptr<NetworkFramework::Socket> socket) {
     impl_->Execute(socket);
@@ -416,3 +1165,15 @@ void SurakartaNetworkService::Execute(std::shared_ptr<NetworkFramework::Socket>
 void SurakartaNetworkService::ShutdownService() {
     impl_->ShutdownService();
 }
+
+bool SurakartaNetworkService::CancelRoom(int room_id) {
+    return impl_->CancelRoom(room_id);
+}
+
+SurakartaNetworkServiceStats SurakartaNetworkService::Stats() const {
+    return impl_->Stats();
+}
+
+SurakartaNetworkServiceMetrics SurakartaNetworkService::Metrics() const {
+    return impl_->Metrics();
+}
@@ -0,0 +1,280 @@
+#include "surakarta_network_stats.h"
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+#include <tuple>
+
+static void AppendLine(std::string& text, const char* format, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (length > 0)
+        text.append(line, std::min<size_t>(length, sizeof(line) - 1));
+    text += '\n';
+}
+
+static void AppendHeader(std::string& text, const char* name, const char* type, const char* help) {
+    AppendLine(text, "# HELP %s %s", name, help);
+    AppendLine(text, "# TYPE %s %s", name, type);
+}
+
+// A summary in seconds; label is either empty or `name="value",`.
+static void AppendSummary(std::string& text, const char* name, const std::string& label, const SurakartaNetworkLatency& latency) {
+    const std::pair<const char*, double> quantiles[] = {
+        {"0.5", latency.p50_us},
+        {"0.99", latency.p99_us},
+        {"0.999", latency.p999_us},
+        {"1", latency.max_us},
+    };
+    for (auto& [quantile, value_us] : quantiles)
+        AppendLine(text, "%s{%squantile=\"%s\"} %.9g", name, label.c_str(), quantile, value_us / 1e6);
+    std::string bare_label = label.empty() ? "" : "{" + label.substr(0, label.size() - 1) + "}";
+    AppendLine(text, "%s_sum%s %.9g", name, bare_label.c_str(), latency.mean_us * latency.count / 1e6);
+    AppendLine(text, "%s_count%s %lld", name, bare_label.c_str(), latency.count);
+}
+
+std::string SurakartaNetworkFormatPrometheus(const SurakartaNetworkServiceStats& stats,
+                                             const SurakartaNetworkServiceMetrics& metrics) {
+    std::string text;
+    AppendHeader(text, "surakarta_connections", "gauge", "Open connections.");
+    AppendLine(text, "surakarta_connections %d", metrics.active_connections);
+    AppendHeader(text, "surakarta_connections_opened_total", "counter", "Connections accepted.");
+    AppendLine(text, "surakarta_connections_opened_total %lld", metrics.connections_opened);
+
+    AppendHeader(text, "surakarta_rooms", "gauge", "Rooms by status.");
+    for (auto& [status, rooms] : metrics.rooms_by_status)
+        AppendLine(text, "surakarta_rooms{status=\"%s\"} %d", status.c_str(), rooms);
+    AppendHeader(text, "surakarta_worker_rooms", "gauge", "Rooms attached to each game worker.");
+    for (size_t i = 0; i < stats.rooms_per_worker.size(); i++)
+        AppendLine(text, "surakarta_worker_rooms{worker=\"%zu\"} %d", i, stats.rooms_per_worker[i]);
+    AppendHeader(text, "surakarta_games_ended_total", "counter", "Games ended, by the reason sent to the players.");
+    for (auto& [reason, games] : metrics.games_ended)
+        AppendLine(text, "surakarta_games_ended_total{reason=\"%s\"} %lld", reason.c_str(), games);
+    AppendHeader(text, "surakarta_spectators", "gauge", "Connections watching a game.");
+    AppendLine(text, "surakarta_spectators %d", metrics.spectators);
+    AppendHeader(text, "surakarta_spectators_dropped_total", "counter", "Spectators closed because they fell behind or failed.");
+    AppendLine(text, "surakarta_spectators_dropped_total %lld", metrics.spectators_dropped);
+    AppendHeader(text, "surakarta_players_away", "gauge", "Players who lost the connection during a game and may still come back.");
+    AppendLine(text, "surakarta_players_away %d", metrics.players_away);
+    AppendHeader(text, "surakarta_players_resumed_total", "counter", "Players who came back to their game on a new connection.");
+    AppendLine(text, "surakarta_players_resumed_total %lld", metrics.players_resumed);
+    AppendHeader(text, "surakarta_matchmaking_waiting", "gauge", "Players waiting to be paired with anyone.");
+    AppendLine(text, "surakarta_matchmaking_waiting %d", metrics.matchmaking_waiting);
+    AppendHeader(text, "surakarta_matchmaking_pairs_total", "counter", "Games started by pairing players who asked for no room in particular.");
+    AppendLine(text, "surakarta_matchmaking_pairs_total %lld", metrics.matchmaking_pairs);
+    AppendHeader(text, "surakarta_deadlines_expired_total", "counter", "Deadlines that have passed, by kind.");
+    for (auto& [kind, deadlines] : metrics.deadlines_expired)
+        AppendLine(text, "surakarta_deadlines_expired_total{kind=\"%s\"} %lld", kind.c_str(), deadlines);
+    AppendHeader(text, "surakarta_timers_armed", "gauge", "Deadlines being kept for connections, rooms and seats.");
+    AppendLine(text, "surakarta_timers_armed %lld", metrics.timers_armed);
+    AppendHeader(text, "surakarta_messages_dropped_total", "counter", "Messages dropped for going over the rate limit, by kind.");
+    for (auto& [kind, messages] : metrics.messages_dropped)
+        AppendLine(text, "surakarta_messages_dropped_total{kind=\"%s\"} %lld", kind.c_str(), messages);
+    AppendHeader(text, "surakarta_connections_rate_limited_total", "counter", "Connections closed for having too many messages dropped.");
+    AppendLine(text, "surakarta_connections_rate_limited_total %lld", metrics.connections_rate_limited);
+    AppendHeader(text, "surakarta_cluster_forwarded_total", "counter", "Connections relayed to the server of their room in the cluster.");
+    AppendLine(text, "surakarta_cluster_forwarded_total %lld", metrics.cluster_forwarded);
+    AppendHeader(text, "surakarta_cluster_redirected_total", "counter", "Connections redirected to the server of their room in the cluster.");
+    AppendLine(text, "surakarta_cluster_redirected_total %lld", metrics.cluster_redirected);
+    AppendHeader(text, "surakarta_cluster_relaying", "gauge", "Connections being relayed to another server of the cluster.");
+    AppendLine(text, "surakarta_cluster_relaying %d", metrics.cluster_relaying);
+    AppendHeader(text, "surakarta_journal_records_total", "counter", "Records appended to the game journal.");
+    AppendLine(text, "surakarta_journal_records_total %lld", metrics.journal_records);
+    AppendHeader(text, "surakarta_journal_bytes_total", "counter", "Bytes written to the game journal.");
+    AppendLine(text, "surakarta_journal_bytes_total %lld", metrics.journal_bytes);
+    AppendHeader(text, "surakarta_journal_failures_total", "counter", "Failed writes and flushes of the game journal.");
+    AppendLine(text, "surakarta_journal_failures_total %lld", metrics.journal_failures);
+
+    AppendHeader(text, "surakarta_message_handling_seconds", "summary",
+                 "Time to handle a received message, by opcode; the count gives the message rate.");
+    for (auto& [opcode, latency] : metrics.message_handling)
+        AppendSummary(text, "surakarta_message_handling_seconds", "opcode=\"" + opcode + "\",", latency);
+    const std::tuple<const char*, const char*, const SurakartaNetworkLatency&> summaries[] = {
+        {"surakarta_move_queue_seconds", "From receiving a move until the worker of the room starts playing it.", metrics.move_queue},
+        {"surakarta_move_commit_seconds", "Time the game takes to check and commit a move.", metrics.move_commit},
+        {"surakarta_move_relay_seconds", "From receiving a move until it has been sent to the opponent.", metrics.move_relay},
+        {"surakarta_room_waiting_seconds", "Time rooms spend waiting for the second player.", metrics.room_waiting},
+        {"surakarta_room_playing_seconds", "From the start of a game until its room is removed.", metrics.room_playing},
+        {"surakarta_room_teardown_seconds", "From asking a room to go away until it is removed.", metrics.room_teardown},
+        {"surakarta_player_away_seconds", "From losing the connection until coming back, for the players who did.", metrics.player_away},
+        {"surakarta_matchmaking_wait_seconds", "From asking to play anyone until being paired.", metrics.matchmaking_wait},
+        {"surakarta_journal_commit_seconds", "Time to write and flush one batch of the game journal.", metrics.journal_commit},
+        {"surakarta_cluster_forward_seconds", "From a READY for a room of another server until it has been passed on there.", metrics.cluster_forward},
+    };
+    for (auto& [name, help, latency] : summaries) {
+        AppendHeader(text, name, "summary", help);
+        AppendSummary(text, name, "", latency);
+    }
+    return text;
+}
+
+#ifdef __linux__
+
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+class SurakartaNetworkStatsServerImpl {
+   public:
+    SurakartaNetworkStatsServerImpl(std::shared_ptr<SurakartaNetworkService> service, int port)
+        : service_(std::move(service)) {
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(port);
+        Listen(AF_INET, (sockaddr*)&address, sizeof(address), "port " + std::to_string(port));
+    }
+
+    SurakartaNetworkStatsServerImpl(std::shared_ptr<SurakartaNetworkService> service, const std::string& path)
+        : service_(std::move(service)), unix_socket_path_(path) {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path))
+            throw std::runtime_error("The path of the Unix socket is too long: " + path);
+        memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        ::unlink(path.c_str());
+        Listen(AF_UNIX, (sockaddr*)&address, sizeof(address), path);
+    }
+
+    ~SurakartaNetworkStatsServerImpl() {
+        Shutdown();
+    }
+
+    void Shutdown() {
+        if (listen_fd_ < 0)
+            return;
+        uint64_t one = 1;
+        [[maybe_unused]] auto written = write(wake_fd_, &one, sizeof(one));
+        thread_.join();
+        ::close(listen_fd_);
+        ::close(wake_fd_);
+        listen_fd_ = -1;
+        if (!unix_socket_path_.empty())
+            ::unlink(unix_socket_path_.c_str());
+    }
+
+   private:
+    void Listen(int family, const sockaddr* address, socklen_t length, const std::string& where) {
+        listen_fd_ = socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listen_fd_ < 0)
+            throw std::runtime_error(std::string("Failed to create socket: ") + strerror(errno));
+        int flag = 1;
+        if (family == AF_INET)
+            setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+        if (bind(listen_fd_, address, length) < 0 || listen(listen_fd_, 16) < 0) {
+            auto error = "Failed to listen on " + where + ": " + strerror(errno);
+            ::close(listen_fd_);
+            listen_fd_ = -1;
+            throw std::runtime_error(error);
+        }
+        wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        thread_ = std::thread([this] { Run(); });
+    }
+
+    void Run() {
+        pollfd fds[2] = {{listen_fd_, POLLIN, 0}, {wake_fd_, POLLIN, 0}};
+        while (true) {
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR)
+                    continue;
+                return;
+            }
+            if (fds[1].revents & POLLIN)
+                return;
+            if (fds[0].revents & POLLIN) {
+                int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+                if (fd >= 0) {
+                    Answer(fd);
+                    ::close(fd);
+                }
+            }
+        }
+    }
+
+    // Read the request, whatever it is, and answer with a snapshot. A client that sends
+    // nothing is given up on after a second, so that it cannot hold up the next scrape.
+    void Answer(int fd) {
+        timeval timeout{1, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        std::string request;
+        char buffer[1024];
+        while (request.find("\r\n\r\n") == std::string::npos && request.size() < 16 * 1024) {
+            auto size = recv(fd, buffer, sizeof(buffer), 0);
+            if (size <= 0)
+                return;
+            request.append(buffer, size);
+        }
+        auto body = SurakartaNetworkFormatPrometheus(service_->Stats(), service_->Metrics());
+        std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n";
+        response += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+        response += "Connection: close\r\n\r\n";
+        response += body;
+        size_t offset = 0;
+        while (offset < response.size()) {
+            auto written = send(fd, response.data() + offset, response.size() - offset, MSG_NOSIGNAL);
+            if (written <= 0)
+                return;
+            offset += written;
+        }
+    }
+
+    const std::shared_ptr<SurakartaNetworkService> service_;
+    const std::string unix_socket_path_;
+    int listen_fd_ = -1;
+    int wake_fd_ = -1;
+    std::thread thread_;
+};
+
+SurakartaNetworkStatsServer::SurakartaNetworkStatsServer(std::shared_ptr<SurakartaNetworkService> service, int port)
+    : impl_(std::make_shared<SurakartaNetworkStatsServerImpl>(std::move(service), port)) {}
+
+SurakartaNetworkStatsServer::SurakartaNetworkStatsServer(std::shared_ptr<SurakartaNetworkService> service,
+                                                         const std::string& unix_socket_path)
+    : impl_(std::make_shared<SurakartaNetworkStatsServerImpl>(std::move(service), unix_socket_path)) {}
+
+bool SurakartaNetworkStatsServer::IsSupported() {
+    return true;
+}
+
+#else
+
+#include <stdexcept>
+
+class SurakartaNetworkStatsServerImpl {
+   public:
+    void Shutdown() {}
+};
+
+SurakartaNetworkStatsServer::SurakartaNetworkStatsServer(std::shared_ptr<SurakartaNetworkService>, int) {
+    throw std::runtime_error("The stats server is only supported on Linux.");
+}
+
+SurakartaNetworkStatsServer::SurakartaNetworkStatsServer(std::shared_ptr<SurakartaNetworkService>, const std::string&) {
+    throw std::runtime_error("The stats server is only supported on Linux.");
+}
+
+bool SurakartaNetworkStatsServer::IsSupported() {
+    return false;
+}
+
+#endif
+
+SurakartaNetworkStatsServer::~SurakartaNetworkStatsServer() {
+    Shutdown();
+}
+
+void SurakartaNetworkStatsServer::Shutdown() {
+    if (impl_)
+        impl_->Shutdown();
+}
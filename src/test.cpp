@@ -1,8 +1,24 @@
+#include <cstdio>
 #include <thread>
 #include "network_framework.h"
+#include "private-include/capture.h"
+#include "private-include/exception.h"
+#include "private-include/forwarding_proxy.h"
+#include "private-include/journal.h"
+#include "private-include/journal_replay.h"
 #include "private-include/message.h"
 #include "private-include/play.h"
+#include "private-include/reverse_proxy_service.h"
+#include "private-include/socket_capture_wrapper.h"
 #include "private-include/socket_log_wrapper.h"
+#include "private-include/wire_codec.h"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
 
 #define PORT 6666
 
@@ -12,6 +28,55 @@ void Assert(bool condition) {
     }
 }
 
+// Decode a stream fed one byte at a time, as it may arrive.
+std::vector<NetworkFramework::Message> DecodeBytewise(const std::string& bytes) {
+    SurakartaWireDecoder decoder;
+    std::vector<NetworkFramework::Message> messages;
+    for (char c : bytes) {
+        decoder.Feed(&c, 1);
+        while (auto message = decoder.Next())
+            messages.push_back(std::move(message.value()));
+    }
+    Assert(decoder.Pending() == 0);
+    return messages;
+}
+
+bool IsMalformed(const std::string& bytes) {
+    try {
+        DecodeBytewise(bytes);
+        return false;
+    } catch (const SurakartaNetworkWireFormatException&) {
+        return true;
+    }
+}
+
+#ifdef __linux__
+// A connection that speaks the wire format itself, to see the bytes the server sends.
+int ConnectRaw(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    Assert(fd >= 0 && connect(fd, (sockaddr*)&address, sizeof(address)) == 0);
+    return fd;
+}
+
+void SendRaw(int fd, const std::string& bytes) {
+    Assert(send(fd, bytes.data(), bytes.size(), MSG_NOSIGNAL) == (ssize_t)bytes.size());
+}
+
+std::string ReceiveRaw(int fd, size_t size) {
+    std::string bytes(size, '\0');
+    for (size_t received = 0; received < size;) {
+        auto count = recv(fd, bytes.data() + received, size - received, 0);
+        Assert(count > 0);
+        received += count;
+    }
+    return bytes;
+}
+#endif
+
 int main() {
     auto logger = std::make_shared<SurakartaLoggerStdout>();
     auto service = std::make_shared<SurakartaNetworkService>(logger->CreateSublogger("server "));
@@ -27,6 +92,12 @@ int main() {
     client_thread_1.join();
     client_thread_2.join();
 
+    // Test metrics
+    auto metrics = service->Metrics();
+    Assert(metrics.message_handling[1].first == "MOVE" && metrics.message_handling[1].second.count > 0);
+    Assert(metrics.move_relay.count > 0 && metrics.move_relay.p50_us <= metrics.move_relay.max_us);
+    Assert(metrics.room_waiting.count >= 1);
+
     // Test game not started
     auto socket3 = std::make_shared<SurakartaNetworkSocketLogWrapper>(
         NetworkFramework::ConnectToServer("localhost", PORT),
@@ -62,9 +133,830 @@ int main() {
                                              SurakartaEndReason::RESIGN,
                                              PieceColor::WHITE));
 
+    // Test spectator, who is told of the end as well
+    auto socket49 = std::make_shared<SurakartaNetworkSocketLogWrapper>(
+        NetworkFramework::ConnectToServer("localhost", PORT),
+        logger->CreateSublogger("client49"));
+    socket49->Send(SurakartaNetworkMessageReady("user49", PieceColor::BLACK, 11));
+    auto socket50 = std::make_shared<SurakartaNetworkSocketLogWrapper>(
+        NetworkFramework::ConnectToServer("localhost", PORT),
+        logger->CreateSublogger("client50"));
+    socket50->Send(SurakartaNetworkMessageReady("user50", PieceColor::WHITE, 11));
+    Assert(socket50->Receive().value() == SurakartaNetworkMessageReady("user49", PieceColor::WHITE, 11));
+    auto socket51 = std::make_shared<SurakartaNetworkSocketLogWrapper>(
+        NetworkFramework::ConnectToServer("localhost", PORT),
+        logger->CreateSublogger("client51"));
+    socket51->Send(SurakartaNetworkMessageReady("user51", PieceColor::NONE, 11, true));
+    Assert(socket51->Receive().value() == SurakartaNetworkMessageReady("user49 vs user50", PieceColor::NONE, 11, true));
+    socket49->Close();
+    Assert(socket50->Receive().value() == SurakartaNetworkMessageEnd(
+                                              std::nullopt,
+                                              SurakartaEndReason::RESIGN,
+                                              PieceColor::WHITE));
+    Assert(socket51->Receive().value() == SurakartaNetworkMessageEnd(
+                                              std::nullopt,
+                                              SurakartaEndReason::RESIGN,
+                                              PieceColor::WHITE));
+
+    // Test cancelling rooms: the players of a game are told it has ended with no winner, and
+    // a player still waiting for an opponent is rejected
+    auto socket56 = std::make_shared<SurakartaNetworkSocketLogWrapper>(
+        NetworkFramework::ConnectToServer("localhost", PORT),
+        logger->CreateSublogger("client56"));
+    socket56->Send(SurakartaNetworkMessageReady("user56", PieceColor::BLACK, 12));
+    auto socket57 = std::make_shared<SurakartaNetworkSocketLogWrapper>(
+        NetworkFramework::ConnectToServer("localhost", PORT),
+        logger->CreateSublogger("client57"));
+    socket57->Send(SurakartaNetworkMessageReady("user57", PieceColor::WHITE, 12));
+    Assert(socket56->Receive().value() == SurakartaNetworkMessageReady("user57", PieceColor::BLACK, 12));
+    Assert(socket57->Receive().value() == SurakartaNetworkMessageReady("user56", PieceColor::WHITE, 12));
+    Assert(service->CancelRoom(12));
+    auto cancelled = SurakartaNetworkMessageEnd(std::nullopt, SurakartaEndReason::NONE, PieceColor::NONE);
+    Assert(socket56->Receive().value() == cancelled);
+    Assert(socket57->Receive().value() == cancelled);
+    auto socket58 = std::make_shared<SurakartaNetworkSocketLogWrapper>(
+        NetworkFramework::ConnectToServer("localhost", PORT),
+        logger->CreateSublogger("client58"));
+    socket58->Send(SurakartaNetworkMessageReady("user58", PieceColor::NONE, 13));
+    while (!service->CancelRoom(13))
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));  // until the room is made
+    Assert(socket58->Receive().value() == SurakartaNetworkMessageReject("user58", "Room 13 is cancelled."));
+    Assert(!service->CancelRoom(13));
+    socket56->Close();
+    socket57->Close();
+    socket58->Close();
+
+    // Test a MOVE that cannot be read: its sender loses, and the opponent is told so
+    auto socket61 = std::make_shared<SurakartaNetworkSocketLogWrapper>(
+        NetworkFramework::ConnectToServer("localhost", PORT),
+        logger->CreateSublogger("client61"));
+    socket61->Send(SurakartaNetworkMessageReady("user61", PieceColor::BLACK, 14));
+    auto socket62 = std::make_shared<SurakartaNetworkSocketLogWrapper>(
+        NetworkFramework::ConnectToServer("localhost", PORT),
+        logger->CreateSublogger("client62"));
+    socket62->Send(SurakartaNetworkMessageReady("user62", PieceColor::WHITE, 14));
+    Assert(socket61->Receive().value() == SurakartaNetworkMessageReady("user62", PieceColor::BLACK, 14));
+    Assert(socket62->Receive().value() == SurakartaNetworkMessageReady("user61", PieceColor::WHITE, 14));
+    socket61->Send(NetworkFramework::Message(OPCODE::MOVE_OP, "Z9", "A1"));
+    Assert(socket62->Receive().value() == SurakartaNetworkMessageEnd(
+                                              std::nullopt,
+                                              SurakartaEndReason::RESIGN,
+                                              PieceColor::WHITE));
+    socket61->Close();
+    socket62->Close();
+
+    // Test matchmaking, which pairs players who ask for no room with one they can play against
+    auto socket12 = std::make_shared<SurakartaNetworkSocketLogWrapper>(
+        NetworkFramework::ConnectToServer("localhost", PORT),
+        logger->CreateSublogger("client12"));
+    socket12->Send(SurakartaNetworkMessageReady("user12", PieceColor::WHITE, SURAKARTA_MATCHMAKING_ROOM_ID));
+    auto socket13 = std::make_shared<SurakartaNetworkSocketLogWrapper>(
+        NetworkFramework::ConnectToServer("localhost", PORT),
+        logger->CreateSublogger("client13"));
+    socket13->Send(SurakartaNetworkMessageReady("user13", PieceColor::WHITE, SURAKARTA_MATCHMAKING_ROOM_ID));
+    auto socket14 = std::make_shared<SurakartaNetworkSocketLogWrapper>(
+        NetworkFramework::ConnectToServer("localhost", PORT),
+        logger->CreateSublogger("client14"));
+    socket14->Send(SurakartaNetworkMessageReady("user14", PieceColor::NONE, SURAKARTA_MATCHMAKING_ROOM_ID));
+    auto matched = SurakartaNetworkMessageReady(socket14->Receive().value());
+    Assert(matched.Color() == PieceColor::BLACK && matched.RoomId() != SURAKARTA_MATCHMAKING_ROOM_ID);
+    // a room of the matchmaker cannot be joined by its number
+    auto socket48 = std::make_shared<SurakartaNetworkSocketLogWrapper>(
+        NetworkFramework::ConnectToServer("localhost", PORT),
+        logger->CreateSublogger("client48"));
+    socket48->Send(SurakartaNetworkMessageReady("user48", PieceColor::NONE, matched.RoomId()));
+    Assert(socket48->Receive()->opcode == OPCODE::REJECT_OP);
+    socket48->Close();
+    // while a negative room the matchmaker has not come to may be played by its number
+    auto socket67 = std::make_shared<SurakartaNetworkSocketLogWrapper>(
+        NetworkFramework::ConnectToServer("localhost", PORT),
+        logger->CreateSublogger("client67"));
+    socket67->Send(SurakartaNetworkMessageReady("user67", PieceColor::BLACK, -1000));
+    auto socket68 = std::make_shared<SurakartaNetworkSocketLogWrapper>(
+        NetworkFramework::ConnectToServer("localhost", PORT),
+        logger->CreateSublogger("client68"));
+    socket68->Send(SurakartaNetworkMessageReady("user68", PieceColor::WHITE, -1000));
+    Assert(socket67->Receive().value() == SurakartaNetworkMessageReady("user68", PieceColor::BLACK, -1000));
+    Assert(socket68->Receive().value() == SurakartaNetworkMessageReady("user67", PieceColor::WHITE, -1000));
+    socket67->Close();
+    socket68->Close();
+    socket13->Close();
+    socket12->Close();
+    socket14->Close();
+
+    // Test resuming a game on a new connection, with the move missed meanwhile
+    SurakartaNetworkServiceOptions resume_options;
+    resume_options.resume_grace_ms = 10000;
+    auto resume_service = std::make_shared<SurakartaNetworkService>(logger->CreateSublogger("resume server "), resume_options);
+    NetworkFramework::Server resume_server(resume_service, PORT + 1);
+    auto socket9 = std::make_shared<SurakartaNetworkSocketLogWrapper>(
+        NetworkFramework::ConnectToServer("localhost", PORT + 1),
+        logger->CreateSublogger("client9"));
+    socket9->Send(SurakartaNetworkMessageReady("user9", PieceColor::BLACK, 3));
+    auto socket10 = std::make_shared<SurakartaNetworkSocketLogWrapper>(
+        NetworkFramework::ConnectToServer("localhost", PORT + 1),
+        logger->CreateSublogger("client10"));
+    socket10->Send(SurakartaNetworkMessageReady("user10", PieceColor::WHITE, 3));
+    socket9->Receive();
+    auto token = SurakartaNetworkMessageReady(socket10->Receive().value()).ResumeToken();
+    Assert(!token.empty());
+    socket10->Close();
+    auto move = SurakartaNetworkMessageMove(SurakartaPosition(0, 1), SurakartaPosition(0, 2));
+    socket9->Send(move);
+    auto socket11 = std::make_shared<SurakartaNetworkSocketLogWrapper>(
+        NetworkFramework::ConnectToServer("localhost", PORT + 1),
+        logger->CreateSublogger("client11"));
+    socket11->Send(SurakartaNetworkMessageReady("user10", PieceColor::WHITE, 3, token, 0));
+    auto resumed = SurakartaNetworkMessageReady(socket11->Receive().value());
+    Assert(resumed.Username() == "user9" && resumed.Color() == PieceColor::WHITE && resumed.ResumeToken() == token);
+    // the move is sent once: as the catch-up if played before the seat was taken back, or after
+    Assert(socket11->Receive().value() == move);
+    socket9->Close();
+    socket11->Close();
+
+    // Test deadlines: for the READY, for the second player, for a move, and for an idle connection
+    SurakartaNetworkServiceOptions deadline_options;
+    deadline_options.handshake_timeout_ms = 200;
+    deadline_options.waiting_timeout_ms = 200;
+    deadline_options.move_timeout_ms = 200;
+    deadline_options.idle_timeout_ms = 300;
+    auto deadline_service = std::make_shared<SurakartaNetworkService>(logger->CreateSublogger("deadline server "), deadline_options);
+    NetworkFramework::Server deadline_server(deadline_service, PORT + 2);
+    auto closed_by_server = [](const std::shared_ptr<SurakartaNetworkSocketLogWrapper>& socket) {
+        try {
+            return !socket->Receive().has_value();
+        } catch (...) {
+            return true;
+        }
+    };
+    auto socket15 = std::make_shared<SurakartaNetworkSocketLogWrapper>(
+        NetworkFramework::ConnectToServer("localhost", PORT + 2),
+        logger->CreateSublogger("client15"));
+    auto socket16 = std::make_shared<SurakartaNetworkSocketLogWrapper>(
+        NetworkFramework::ConnectToServer("localhost", PORT + 2),
+        logger->CreateSublogger("client16"));
+    socket16->Send(SurakartaNetworkMessageReady("user16", PieceColor::NONE, 4));
+    auto socket17 = std::make_shared<SurakartaNetworkSocketLogWrapper>(
+        NetworkFramework::ConnectToServer("localhost", PORT + 2),
+        logger->CreateSublogger("client17"));
+    socket17->Send(SurakartaNetworkMessageReady("user17", PieceColor::BLACK, 5));
+    auto socket18 = std::make_shared<SurakartaNetworkSocketLogWrapper>(
+        NetworkFramework::ConnectToServer("localhost", PORT + 2),
+        logger->CreateSublogger("client18"));
+    socket18->Send(SurakartaNetworkMessageReady("user18", PieceColor::WHITE, 5));
+    Assert(closed_by_server(socket15));
+    Assert(socket16->Receive()->opcode == OPCODE::REJECT_OP);
+    Assert(socket17->Receive()->opcode == OPCODE::READY_OP);
+    Assert(socket18->Receive()->opcode == OPCODE::READY_OP);
+    // black has not moved
+    Assert(socket18->Receive().value() == SurakartaNetworkMessageEnd(
+                                              std::nullopt,
+                                              SurakartaEndReason::TIMEOUT,
+                                              PieceColor::WHITE));
+    // and, the game over, the players are closed once idle
+    Assert(closed_by_server(socket17));
+    Assert(closed_by_server(socket16));
+    auto deadline_metrics = deadline_service->Metrics();
+    Assert(deadline_metrics.deadlines_expired[0].first == "HANDSHAKE" && deadline_metrics.deadlines_expired[0].second == 1);
+    Assert(deadline_metrics.deadlines_expired[1].first == "WAITING" && deadline_metrics.deadlines_expired[1].second == 1);
+    Assert(deadline_metrics.deadlines_expired[2].first == "MOVE" && deadline_metrics.deadlines_expired[2].second == 1);
+    socket18->Close();
+
+    // Test rate limits: a chat flood reaches the opponent only up to the burst, and pre-game
+    // garbage gets its sender closed
+    SurakartaNetworkServiceOptions limit_options;
+    limit_options.chat_rate_limit = SurakartaNetworkRateLimit{5, 5};
+    limit_options.other_rate_limit = SurakartaNetworkRateLimit{5, 5};
+    limit_options.max_dropped_messages = 20;
+    auto limit_service = std::make_shared<SurakartaNetworkService>(logger->CreateSublogger("limit server "), limit_options);
+    NetworkFramework::Server limit_server(limit_service, PORT + 3);
+    auto socket19 = std::make_shared<SurakartaNetworkSocketLogWrapper>(
+        NetworkFramework::ConnectToServer("localhost", PORT + 3),
+        logger->CreateSublogger("client19"));
+    socket19->Send(SurakartaNetworkMessageReady("user19", PieceColor::BLACK, 6));
+    auto socket20 = std::make_shared<SurakartaNetworkSocketLogWrapper>(
+        NetworkFramework::ConnectToServer("localhost", PORT + 3),
+        logger->CreateSublogger("client20"));
+    socket20->Send(SurakartaNetworkMessageReady("user20", PieceColor::WHITE, 6));
+    socket19->Receive();
+    socket20->Receive();
+    // the burst, then as many as may be dropped
+    for (int i = 0; i < 25; i++)
+        socket19->Send(SurakartaNetworkMessageChat("user19", "spam"));
+    int chats = 0;
+    auto received = socket20->Receive();
+    for (; received.has_value() && received->opcode == OPCODE::CHAT_OP; received = socket20->Receive())
+        chats++;
+    Assert(chats >= 5 && chats <= 6);
+    Assert(received.value() == SurakartaNetworkMessageEnd(std::nullopt, SurakartaEndReason::RESIGN, PieceColor::WHITE));
+    auto socket21 = std::make_shared<SurakartaNetworkSocketLogWrapper>(
+        NetworkFramework::ConnectToServer("localhost", PORT + 3),
+        logger->CreateSublogger("client21"));
+    for (int i = 0; i < 25; i++)
+        socket21->Send(SurakartaNetworkMessageEnd(std::nullopt, SurakartaEndReason::NONE, PieceColor::NONE));
+    Assert(closed_by_server(socket21));
+    auto limit_metrics = limit_service->Metrics();
+    Assert(limit_metrics.messages_dropped[1].first == "CHAT" && limit_metrics.messages_dropped[1].second >= 19);
+    Assert(limit_metrics.messages_dropped[2].first == "OTHER" && limit_metrics.messages_dropped[2].second >= 19);
+    Assert(limit_metrics.connections_rate_limited == 2);
+    socket19->Close();
+    socket20->Close();
+
+    // Test the forwarding proxy: a game through it, and both connections closed after it
+    std::unique_ptr<SurakartaForwardingProxy> proxy;
+    if (SurakartaForwardingProxy::IsSupported())
+        proxy = std::make_unique<SurakartaForwardingProxy>("127.0.0.1", PORT, PORT + 4, 1);
+    if (proxy) {
+        auto socket22 = std::make_shared<SurakartaNetworkSocketLogWrapper>(
+            NetworkFramework::ConnectToServer("localhost", PORT + 4),
+            logger->CreateSublogger("client22"));
+        socket22->Send(SurakartaNetworkMessageReady("user22", PieceColor::BLACK, 7));
+        auto socket23 = std::make_shared<SurakartaNetworkSocketLogWrapper>(
+            NetworkFramework::ConnectToServer("localhost", PORT + 4),
+            logger->CreateSublogger("client23"));
+        socket23->Send(SurakartaNetworkMessageReady("user23", PieceColor::WHITE, 7));
+        Assert(SurakartaNetworkMessageReady(socket22->Receive().value()).Username() == "user23");
+        Assert(SurakartaNetworkMessageReady(socket23->Receive().value()).Username() == "user22");
+        auto forwarded = SurakartaNetworkMessageMove(SurakartaPosition(1, 1), SurakartaPosition(1, 2));
+        socket22->Send(forwarded);
+        Assert(socket23->Receive().value() == forwarded);
+        Assert(proxy->Connections() == 2);
+        socket22->Send(SurakartaNetworkMessageResign());
+        Assert(socket23->Receive()->opcode == OPCODE::END_OP);
+        socket22->Close();
+        socket23->Close();
+        for (int i = 0; i < 100 && proxy->Connections() > 0; i++)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        Assert(proxy->Connections() == 0 && proxy->BytesForwarded() > 0);
+    }
+
+    // Test routing rooms over several servers: a fourth takes a quarter of the rooms from the
+    // other three, and the players of a room meet on its server through either proxy
+    std::vector<SurakartaBackend> backends{{"127.0.0.1", PORT + 5}, {"127.0.0.1", PORT + 6}, {"127.0.0.1", PORT + 7}};
+    SurakartaBackendRing ring(backends);
+    auto more_backends = backends;
+    more_backends.push_back({"127.0.0.1", PORT + 8});
+    SurakartaBackendRing bigger_ring(more_backends);
+    int moved = 0;
+    std::vector<int> rooms_per_backend(backends.size());
+    for (int room_id = 0; room_id < 10000; room_id++) {
+        auto before = ring.Pick(room_id);
+        auto after = bigger_ring.Pick(room_id);
+        rooms_per_backend[before]++;
+        if (before != after) {
+            Assert(after == 3);
+            moved++;
+        }
+    }
+    Assert(moved > 1500 && moved < 3500);
+    for (int rooms : rooms_per_backend)
+        Assert(rooms > 2000 && rooms < 4700);
+    std::vector<std::shared_ptr<SurakartaNetworkService>> backend_services;
+    std::vector<std::unique_ptr<NetworkFramework::Server>> backend_servers;
+    for (auto& backend : backends) {
+        backend_services.push_back(std::make_shared<SurakartaNetworkService>(logger->CreateSublogger("backend " + backend.ToString() + " ")));
+        backend_servers.push_back(std::make_unique<NetworkFramework::Server>(backend_services.back(), backend.port));
+    }
+    NetworkFramework::Server routing_proxy(std::make_shared<ReverseProxyService>(backends), PORT + 9);
+    std::unique_ptr<SurakartaForwardingProxy> routing_forwarder;
+    if (SurakartaForwardingProxy::IsSupported())
+        routing_forwarder = std::make_unique<SurakartaForwardingProxy>(backends, PORT + 10, 1);
+    std::vector<std::shared_ptr<SurakartaNetworkSocketLogWrapper>> routed_sockets;
+    std::vector<int> expected_rooms(backends.size());
+    for (int room_id = 100; room_id < 112; room_id++) {
+        for (auto color : {PieceColor::BLACK, PieceColor::WHITE}) {
+            // black through the proxy with threads, white through the one with event loops
+            int port = color == PieceColor::WHITE && routing_forwarder ? PORT + 10 : PORT + 9;
+            auto socket = std::make_shared<SurakartaNetworkSocketLogWrapper>(
+                NetworkFramework::ConnectToServer("localhost", port),
+                logger->CreateSublogger("routed" + std::to_string(routed_sockets.size())));
+            socket->Send(SurakartaNetworkMessageReady("routed" + std::to_string(routed_sockets.size()), color, room_id));
+            routed_sockets.push_back(socket);
+        }
+        expected_rooms[ring.Pick(room_id)]++;
+    }
+    for (auto& socket : routed_sockets)
+        Assert(socket->Receive()->opcode == OPCODE::READY_OP);
+    for (size_t i = 0; i < backends.size(); i++)
+        Assert(backend_services[i]->Stats().active_rooms == expected_rooms[i]);
+    for (auto& socket : routed_sockets)
+        socket->Close();
+
+    // Test the pool of connections to the server: players get ready ones, which are made up for,
+    // and those the server closes for never sending a READY are replaced
+    if (SurakartaUpstreamPool::IsSupported()) {
+        auto pool_ready = [](const SurakartaUpstreamPool* pool, int ready) {
+            for (int i = 0; i < 300 && pool->Ready(0) < ready; i++)
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            return pool->Ready(0) == ready;
+        };
+        SurakartaUpstreamPoolOptions pool_options;
+        pool_options.size = 2;
+        auto pooled_proxy_service = std::make_shared<ReverseProxyService>(
+            std::vector<SurakartaBackend>{{"127.0.0.1", PORT}}, [](auto socket) { return socket; }, pool_options);
+        NetworkFramework::Server pooled_proxy(pooled_proxy_service, PORT + 11);
+        auto pool = pooled_proxy_service->UpstreamPool();
+        Assert(pool_ready(pool, 2));
+        auto socket24 = std::make_shared<SurakartaNetworkSocketLogWrapper>(
+            NetworkFramework::ConnectToServer("localhost", PORT + 11),
+            logger->CreateSublogger("client24"));
+        socket24->Send(SurakartaNetworkMessageReady("user24", PieceColor::BLACK, 8));
+        auto socket25 = std::make_shared<SurakartaNetworkSocketLogWrapper>(
+            NetworkFramework::ConnectToServer("localhost", PORT + 11),
+            logger->CreateSublogger("client25"));
+        socket25->Send(SurakartaNetworkMessageReady("user25", PieceColor::WHITE, 8));
+        Assert(SurakartaNetworkMessageReady(socket24->Receive().value()).Username() == "user25");
+        Assert(SurakartaNetworkMessageReady(socket25->Receive().value()).Username() == "user24");
+        Assert(pool->Hits() == 2 && pool->Misses() == 0);
+        Assert(pool_ready(pool, 2));
+        socket24->Close();
+        socket25->Close();
+        SurakartaUpstreamPool deadline_pool({{"127.0.0.1", PORT + 2}}, pool_options);
+        Assert(pool_ready(&deadline_pool, 2));
+        for (int i = 0; i < 300 && deadline_pool.Discarded() < 2; i++)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        Assert(deadline_pool.Discarded() >= 2 && pool_ready(&deadline_pool, 2));
+        pooled_proxy.Shutdown();
+    }
+
+    // Test the capture: what goes through a proxy is read back from the file as it was
+    const char* capture_path = "surakarta-network-test.skcap";
+    std::remove(capture_path);
+    auto capture = std::make_shared<SurakartaCapture>(SurakartaCapture::Options{capture_path});
+    auto capturing_proxy_service = std::make_shared<ReverseProxyService>(
+        "127.0.0.1", PORT, [&](auto socket) { return std::make_shared<SurakartaNetworkSocketCaptureWrapper>(socket, capture); });
+    NetworkFramework::Server capturing_proxy(capturing_proxy_service, PORT + 12);
+    auto socket26 = NetworkFramework::ConnectToServer("localhost", PORT + 12);
+    auto socket27 = NetworkFramework::ConnectToServer("localhost", PORT + 12);
+    const auto ready26 = SurakartaNetworkMessageReady("user26", PieceColor::BLACK, 9);
+    socket26->Send(ready26);
+    socket27->Send(SurakartaNetworkMessageReady("user27", PieceColor::WHITE, 9));
+    Assert(SurakartaNetworkMessageReady(socket26->Receive().value()).Username() == "user27");
+    Assert(SurakartaNetworkMessageReady(socket27->Receive().value()).Username() == "user26");
+    capture->Flush();
+    Assert(capture->Records() == 6 && capture->Dropped() == 0);
+    {
+        SurakartaCaptureReader reader(capture_path);
+        int counts[6] = {};
+        bool ready26_captured = false;
+        while (auto record = reader.Next()) {
+            counts[(int)record->type]++;
+            if (record->type == SurakartaCaptureRecordType::RECEIVED && record->message == ready26)
+                ready26_captured = true;
+        }
+        Assert(!reader.Torn() && ready26_captured);
+        Assert(counts[(int)SurakartaCaptureRecordType::OPEN] == 2);
+        Assert(counts[(int)SurakartaCaptureRecordType::RECEIVED] == 2 && counts[(int)SurakartaCaptureRecordType::SENT] == 2);
+    }
+    socket26->Close();
+    socket27->Close();
+
+    // Test the wire codec: every message comes back as it was, in either form, from a stream
+    // that mixes them, and a \u escape of a character beyond the BMP needs both of its halves
+    std::vector<NetworkFramework::Message> codec_messages = {
+        SurakartaNetworkMessageReady("user \"quoted\"\n", PieceColor::BLACK, 3),
+        SurakartaNetworkMessageMove(SurakartaPosition(0, 1), SurakartaPosition(5, 4)),
+        SurakartaNetworkMessageEnd(std::nullopt, SurakartaEndReason::RESIGN, PieceColor::WHITE),
+        SurakartaNetworkMessageEnd(SurakartaIllegalMoveReason::LEGAL_NON_CAPTURE_MOVE, SurakartaEndReason::STALEMATE, PieceColor::NONE),
+        SurakartaNetworkMessageResign(),
+        SurakartaNetworkMessageChat("user\x01", "\xe4\xbd\xa0\\/\t"),
+    };
+    std::string codec_json, codec_compact, codec_mixed;
+    for (size_t i = 0; i < codec_messages.size(); i++) {
+        SurakartaWireEncode(codec_messages[i], codec_json);
+        SurakartaWireEncode(codec_messages[i], codec_compact, true);
+        SurakartaWireEncode(codec_messages[i], codec_mixed, i % 2 == 1);
+    }
+    Assert(codec_compact.size() < codec_json.size());
+    for (auto& bytes : {codec_json, codec_compact, codec_mixed})
+        Assert(DecodeBytewise(bytes) == codec_messages);
+    auto codec_ready = SurakartaNetworkMessageReady("user", PieceColor::NONE, 3);
+    SurakartaWireSetCompactOption(codec_ready, true);
+    Assert(SurakartaWireHasCompactOption(codec_ready) && SurakartaNetworkMessageReady(codec_ready).RoomId() == 3);
+    SurakartaWireSetCompactOption(codec_ready, false);
+    Assert(!SurakartaWireHasCompactOption(codec_ready) && codec_ready == SurakartaNetworkMessageReady("user", PieceColor::NONE, 3));
+    std::string codec_escaped;
+    SurakartaWireEncode(SurakartaNetworkMessageChat("user", "@"), codec_escaped);
+    auto with_escape = [&](const std::string& escape) {
+        auto bytes = codec_escaped;
+        return bytes.replace(bytes.find('@'), 1, escape);
+    };
+    Assert(DecodeBytewise(with_escape("\\ud83d\\ude00")) ==
+           std::vector<NetworkFramework::Message>{SurakartaNetworkMessageChat("user", "\xf0\x9f\x98\x80")});
+    Assert(IsMalformed(with_escape("\\ud83d\\u0041")));
+    Assert(IsMalformed(with_escape("\\ud83dA")));
+    Assert(IsMalformed(with_escape("\\ude00")));
+    // a message that never ends is not buffered for ever
+    Assert(IsMalformed("{\"op\":1,\"data1\":\"" + std::string(SurakartaWireDecoder::MAX_MESSAGE_SIZE + 1, 'x')));
+
+    // Test the async logger: the lines logged before it goes are all written, in order, and
+    // long ones are cut
+    FILE* log_file = std::tmpfile();
+    {
+        auto async_logger = std::make_shared<SurakartaLoggerAsync>(fileno(log_file));
+        auto async_sublogger = async_logger->CreateSublogger("sub");
+        for (int i = 0; i < 1000; i++)
+            async_sublogger->Log("line %d", i);
+        async_logger->Log("%s", std::string(1000, 'x').c_str());
+    }
+    std::string logged;
+    std::rewind(log_file);
+    for (int c; (c = std::fgetc(log_file)) != EOF;)
+        logged.push_back((char)c);
+    std::fclose(log_file);
+    std::string expected_log;
+    for (int i = 0; i < 1000; i++)
+        expected_log += "[sub] line " + std::to_string(i) + "\n";
+    expected_log += std::string(511, 'x') + "\n";
+    Assert(logged == expected_log);
+
+#ifdef __linux__
+    // Test the async logger dropping lines: with the writer stuck on a full pipe, what does not
+    // fit in the ring is counted, and reported once the writer gets on
+    int log_pipe[2];
+    Assert(pipe(log_pipe) == 0);
+    fcntl(log_pipe[1], F_SETFL, O_NONBLOCK);
+    while (write(log_pipe[1], "-", 1) == 1) {
+    }
+    fcntl(log_pipe[1], F_SETFL, 0);
+    {
+        SurakartaLoggerAsyncOptions drop_options;
+        drop_options.capacity = 4;
+        drop_options.overflow = SurakartaLogOverflow::DROP;
+        SurakartaLoggerAsync drop_logger(log_pipe[1], drop_options);
+        drop_logger.Log("stuck");
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));  // until the writer is stuck with it
+        for (int i = 0; i < 100; i++)
+            drop_logger.Log("line %d", i);
+        // the ring holds 4, and the writer may not have taken the first line yet
+        Assert(drop_logger.Dropped() == 96 || drop_logger.Dropped() == 97);
+        std::string piped;
+        char buffer[4096];
+        while (piped.find(" lines dropped\n") == std::string::npos) {
+            auto size = read(log_pipe[0], buffer, sizeof(buffer));
+            Assert(size > 0);
+            piped.append(buffer, size);
+        }
+        Assert(piped.find("[logger] " + std::to_string(drop_logger.Dropped()) + " lines dropped\n") != std::string::npos);
+    }
+    close(log_pipe[0]);
+    close(log_pipe[1]);
+#endif
+
+    // Test a game on the reactor: both players are answered, the move is relayed, and the
+    // opponent of the player who resigns is told of the end
+    auto reactor_service = std::make_shared<SurakartaNetworkService>(logger->CreateSublogger("reactor server "));
+    std::unique_ptr<SurakartaNetworkReactorServer> reactor_server;
+    if (SurakartaNetworkReactorServer::IsSupported()) {
+        reactor_server = std::make_unique<SurakartaNetworkReactorServer>(reactor_service, PORT + 17, SurakartaNetworkReactorOptions());
+        auto socket52 = std::make_shared<SurakartaNetworkSocketLogWrapper>(
+            NetworkFramework::ConnectToServer("localhost", PORT + 17),
+            logger->CreateSublogger("client52"));
+        socket52->Send(SurakartaNetworkMessageReady("user52", PieceColor::BLACK, 1));
+        auto socket53 = std::make_shared<SurakartaNetworkSocketLogWrapper>(
+            NetworkFramework::ConnectToServer("localhost", PORT + 17),
+            logger->CreateSublogger("client53"));
+        socket53->Send(SurakartaNetworkMessageReady("user53", PieceColor::WHITE, 1));
+        Assert(socket52->Receive().value() == SurakartaNetworkMessageReady("user53", PieceColor::BLACK, 1));
+        Assert(socket53->Receive().value() == SurakartaNetworkMessageReady("user52", PieceColor::WHITE, 1));
+        auto move = SurakartaNetworkMessageMove(SurakartaPosition(0, 1), SurakartaPosition(0, 2));
+        socket52->Send(move);
+        Assert(socket53->Receive().value() == move);
+        socket53->Send(SurakartaNetworkMessageResign());
+        Assert(socket52->Receive().value() == SurakartaNetworkMessageEnd(
+                                                  std::nullopt,
+                                                  SurakartaEndReason::RESIGN,
+                                                  PieceColor::BLACK));
+        socket52->Close();
+        socket53->Close();
+        Assert(reactor_service->Metrics().move_relay.count == 1);
+
+#ifdef __linux__
+        // Test a scrape of the stats server: the game just played shows in the text it serves
+        if (SurakartaNetworkStatsServer::IsSupported()) {
+            SurakartaNetworkStatsServer stats_server(reactor_service, PORT + 18);
+            int stats_fd = ConnectRaw(PORT + 18);
+            SendRaw(stats_fd, "GET /metrics HTTP/1.0\r\n\r\n");
+            std::string scraped;
+            char buffer[4096];
+            for (ssize_t size; (size = recv(stats_fd, buffer, sizeof(buffer), 0)) > 0;)
+                scraped.append(buffer, size);
+            ::close(stats_fd);
+            Assert(scraped.rfind("HTTP/1.0 200 OK\r\n", 0) == 0);
+            auto body = scraped.substr(scraped.find("\r\n\r\n") + 4);
+            Assert(body.find("# TYPE surakarta_connections_opened_total counter\n"
+                             "surakarta_connections_opened_total 2\n") != std::string::npos);
+            Assert(body.find("\nsurakarta_games_ended_total{reason=\"RESIGN\"} 1\n") != std::string::npos);
+            Assert(body.find("\nsurakarta_rooms{status=\"WAITING_SECOND_PLAYER\"} 0\n") != std::string::npos);
+            Assert(body.find("\nsurakarta_move_relay_seconds_count 1\n") != std::string::npos);
+            Assert(body.find("\nsurakarta_move_relay_seconds{quantile=\"0.5\"} ") != std::string::npos);
+            stats_server.Shutdown();
+        }
+
+        // Test the compact encoding: agreed to in the READY of a player who asks for it, who then
+        // gets moves compact and may send them so, while the other player speaks JSON throughout
+        int fd54 = ConnectRaw(PORT + 17);
+        auto ready54 = SurakartaNetworkMessageReady("user54", PieceColor::BLACK, 2);
+        SurakartaWireSetCompactOption(ready54, true);
+        std::string bytes54;
+        SurakartaWireEncode(ready54, bytes54);
+        SendRaw(fd54, bytes54);
+        auto socket55 = std::make_shared<SurakartaNetworkSocketLogWrapper>(
+            NetworkFramework::ConnectToServer("localhost", PORT + 17),
+            logger->CreateSublogger("client55"));
+        socket55->Send(SurakartaNetworkMessageReady("user55", PieceColor::WHITE, 2));
+        auto ready55 = socket55->Receive().value();
+        Assert(!SurakartaWireHasCompactOption(ready55) && ready55 == SurakartaNetworkMessageReady("user54", PieceColor::WHITE, 2));
+        auto agreed = SurakartaNetworkMessageReady("user55", PieceColor::BLACK, 2);
+        SurakartaWireSetCompactOption(agreed, true);
+        std::string agreed_bytes;
+        SurakartaWireEncode(agreed, agreed_bytes);
+        Assert(DecodeBytewise(ReceiveRaw(fd54, agreed_bytes.size())) == std::vector<NetworkFramework::Message>{agreed});
+        auto move54 = SurakartaNetworkMessageMove(SurakartaPosition(0, 1), SurakartaPosition(0, 2));
+        std::string move54_bytes;
+        SurakartaWireEncode(move54, move54_bytes, true);
+        SendRaw(fd54, move54_bytes);
+        Assert(socket55->Receive().value() == move54);
+        auto move55 = SurakartaNetworkMessageMove(SurakartaPosition(0, 4), SurakartaPosition(0, 3));
+        socket55->Send(move55);
+        std::string move55_bytes;
+        SurakartaWireEncode(move55, move55_bytes, true);
+        Assert(move55_bytes.size() == 2 && ReceiveRaw(fd54, 2) == move55_bytes);
+        ::close(fd54);
+        socket55->Close();
+
+        // Test a last move that arrives along with the close of its connection: it is still
+        // played, and only then is the game resigned
+        int fd63 = ConnectRaw(PORT + 17);
+        std::string bytes63;
+        SurakartaWireEncode(SurakartaNetworkMessageReady("user63", PieceColor::BLACK, 3), bytes63);
+        SendRaw(fd63, bytes63);
+        auto socket64 = std::make_shared<SurakartaNetworkSocketLogWrapper>(
+            NetworkFramework::ConnectToServer("localhost", PORT + 17),
+            logger->CreateSublogger("client64"));
+        socket64->Send(SurakartaNetworkMessageReady("user64", PieceColor::WHITE, 3));
+        Assert(socket64->Receive().value() == SurakartaNetworkMessageReady("user63", PieceColor::WHITE, 3));
+        std::string ready63_bytes;
+        SurakartaWireEncode(SurakartaNetworkMessageReady("user64", PieceColor::BLACK, 3), ready63_bytes);
+        Assert(ReceiveRaw(fd63, ready63_bytes.size()) == ready63_bytes);
+        auto move63 = SurakartaNetworkMessageMove(SurakartaPosition(0, 1), SurakartaPosition(0, 2));
+        // padded so that the move ends a full read of the server, whose next read finds the EOF
+        std::string move63_bytes(16384, ' ');
+        std::string move63_encoded;
+        SurakartaWireEncode(move63, move63_encoded);
+        move63_bytes.replace(move63_bytes.size() - move63_encoded.size(), move63_encoded.size(), move63_encoded);
+        SendRaw(fd63, move63_bytes);
+        ::close(fd63);
+        Assert(socket64->Receive().value() == move63);
+        Assert(socket64->Receive().value() == SurakartaNetworkMessageEnd(
+                                                  std::nullopt,
+                                                  SurakartaEndReason::RESIGN,
+                                                  PieceColor::WHITE));
+        socket64->Close();
+#endif
+    }
+
+#ifdef __linux__
+    // Test the journal: a game played is written as START, MOVE and END records, each of which
+    // passes its checksum, and a record that does not is where a reader stops
+    const std::string journal_directory = "surakarta-network-test-journal";
+    const char* torn_path = "surakarta-network-test-torn.skj";
+    auto remove_journal = [&] {
+        try {
+            for (auto& [index, path] : SurakartaJournalSegments(journal_directory))
+                std::remove(path.c_str());
+        } catch (const std::exception&) {
+        }
+        rmdir(journal_directory.c_str());
+        std::remove(torn_path);
+    };
+    remove_journal();
+    SurakartaNetworkServiceOptions journal_options;
+    journal_options.journal_directory = journal_directory;
+    auto journal_service = std::make_shared<SurakartaNetworkService>(logger->CreateSublogger("journal server "), journal_options);
+    NetworkFramework::Server journal_server(journal_service, PORT + 19);
+    auto socket59 = std::make_shared<SurakartaNetworkSocketLogWrapper>(
+        NetworkFramework::ConnectToServer("localhost", PORT + 19),
+        logger->CreateSublogger("client59"));
+    socket59->Send(SurakartaNetworkMessageReady("user59", PieceColor::BLACK, 1));
+    auto socket60 = std::make_shared<SurakartaNetworkSocketLogWrapper>(
+        NetworkFramework::ConnectToServer("localhost", PORT + 19),
+        logger->CreateSublogger("client60"));
+    socket60->Send(SurakartaNetworkMessageReady("user60", PieceColor::WHITE, 1));
+    Assert(socket59->Receive().value() == SurakartaNetworkMessageReady("user60", PieceColor::BLACK, 1));
+    Assert(socket60->Receive().value() == SurakartaNetworkMessageReady("user59", PieceColor::WHITE, 1));
+    auto journaled_move = SurakartaNetworkMessageMove(SurakartaPosition(0, 1), SurakartaPosition(0, 2));
+    socket59->Send(journaled_move);
+    Assert(socket60->Receive().value() == journaled_move);
+    socket60->Send(SurakartaNetworkMessageResign());
+    Assert(socket59->Receive().value() == SurakartaNetworkMessageEnd(
+                                              std::nullopt,
+                                              SurakartaEndReason::RESIGN,
+                                              PieceColor::BLACK));
+    socket59->Close();
+    socket60->Close();
+    auto journal_segments = SurakartaJournalSegments(journal_directory);
+    Assert(journal_segments.size() == 1);
+    const std::string& journal_path = journal_segments[0].second;
+    std::vector<SurakartaJournalRecordHeader> journaled;
+    std::string journal_bytes;
+    for (int i = 0; i < 1000 && journaled.size() < 3; i++) {  // the END is written after it is sent
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        SurakartaJournalSegment segment(journal_path);
+        journaled.clear();
+        Assert(segment.ForEachRecord([&](const SurakartaJournalRecordHeader& record) {
+            const size_t checked_from = offsetof(SurakartaJournalRecordHeader, time_ns);
+            Assert(SurakartaJournalChecksum((const char*)&record + checked_from, record.size - checked_from) == record.checksum);
+            journaled.push_back(record);
+            if (record.type == (uint8_t)SurakartaJournalRecordType::START) {
+                auto start = reinterpret_cast<const SurakartaJournalStart*>(&record + 1);
+                Assert(start->first_player_color == (uint8_t)PieceColor::BLACK && start->second_player_color == (uint8_t)PieceColor::WHITE);
+                Assert(std::string((const char*)(start + 1), start->first_player_username_size + start->second_player_username_size) == "user59user60");
+            } else if (record.type == (uint8_t)SurakartaJournalRecordType::MOVE) {
+                auto move = reinterpret_cast<const SurakartaJournalMove*>(&record + 1);
+                Assert(move->from_x == 0 && move->from_y == 1 && move->to_x == 0 && move->to_y == 2);
+                Assert(move->player == (uint8_t)PieceColor::BLACK && move->move_reason == (uint8_t)SurakartaIllegalMoveReason::LEGAL_NON_CAPTURE_MOVE);
+            } else if (record.type == (uint8_t)SurakartaJournalRecordType::END) {
+                auto end = reinterpret_cast<const SurakartaJournalEnd*>(&record + 1);
+                Assert(end->end_reason == (uint8_t)SurakartaEndReason::RESIGN && end->winner == (uint8_t)PieceColor::BLACK);
+                Assert(end->illegal_move_reason == SurakartaJournalEnd::NO_MOVE_REASON);
+            }
+        }) == 0);
+        journal_bytes.assign((const char*)&segment.Header(), segment.Size());
+    }
+    Assert(journaled.size() == 3);
+    Assert(journaled[0].type == (uint8_t)SurakartaJournalRecordType::START &&
+           journaled[1].type == (uint8_t)SurakartaJournalRecordType::MOVE &&
+           journaled[2].type == (uint8_t)SurakartaJournalRecordType::END);
+    const uint64_t journaled_game = (journal_segments[0].first << 40) | sizeof(SurakartaJournalSegmentHeader);
+    for (auto& record : journaled)
+        Assert(record.game == journaled_game && record.room == 1);
+    Assert(journal_service->Metrics().journal_records == 3);
+    // a byte changed in the END leaves the first two records, and the END as the torn tail
+    journal_bytes[journal_bytes.size() - 1 - 4] ^= 1;
+    FILE* torn_file = std::fopen(torn_path, "wb");
+    Assert(torn_file && std::fwrite(journal_bytes.data(), 1, journal_bytes.size(), torn_file) == journal_bytes.size());
+    std::fclose(torn_file);
+    size_t torn_records = 0;
+    Assert(SurakartaJournalSegment(torn_path).ForEachRecord([&](const SurakartaJournalRecordHeader&) { torn_records++; }) ==
+           sizeof(SurakartaJournalRecordHeader) + sizeof(SurakartaJournalEnd));
+    Assert(torn_records == 2);
+
+    // Test a replay of the journal: the game is rebuilt by the rules, which agree with the
+    // journal about every move, and the game cut short by the torn END is left unfinished
+    SurakartaJournalReplay replay(true);
+    Assert(replay.Open({journal_directory}) && replay.Errors().empty());
+    replay.Run(2);
+    auto& replayed = replay.Totals();
+    Assert(replay.Segments() == 1 && replay.TornBytes() == 0 && replay.Unfinished() == 0);
+    Assert(replayed.games == 1 && replayed.moves == 1 && replayed.mismatched == 0);
+    Assert(replayed.end_reasons[(int)SurakartaEndReason::RESIGN] == 1 && replayed.winners[(int)PieceColor::BLACK] == 1);
+    Assert(replayed.users.at("user59").wins == 1 && replayed.users.at("user59").as_black == 1);
+    Assert(replayed.users.at("user60").losses == 1 && replayed.LengthPercentile(0.5) == 1);
+    SurakartaJournalReplay torn_replay(true);
+    Assert(torn_replay.Open({torn_path}));
+    torn_replay.Run(1);
+    Assert(torn_replay.Totals().games == 0 && torn_replay.Unfinished() == 1);
+    Assert(torn_replay.TornBytes() == sizeof(SurakartaJournalRecordHeader) + sizeof(SurakartaJournalEnd));
+#endif
+
+    // Test listener shards: with a listener per event loop, the players of a room meet whichever
+    // loops accept them, and every connection is accepted once
+    auto shard_service = std::make_shared<SurakartaNetworkService>(logger->CreateSublogger("shard server "));
+    std::unique_ptr<SurakartaNetworkReactorServer> shard_server;
+    if (SurakartaNetworkReactorServer::IsSupported()) {
+        SurakartaNetworkReactorOptions shard_options;
+        shard_options.loops = 2;
+        shard_options.reuse_port = true;
+        shard_options.pin_threads = true;
+        shard_server = std::make_unique<SurakartaNetworkReactorServer>(shard_service, PORT + 13, shard_options);
+        std::vector<std::shared_ptr<NetworkFramework::Socket>> shard_sockets;
+        for (int i = 0; i < 8; i++) {
+            shard_sockets.push_back(NetworkFramework::ConnectToServer("localhost", PORT + 13));
+            shard_sockets.back()->Send(SurakartaNetworkMessageReady(
+                "user" + std::to_string(28 + i), i % 2 == 0 ? PieceColor::BLACK : PieceColor::WHITE, 10 + i / 2));
+        }
+        for (int i = 0; i < 8; i++) {
+            auto opponent = SurakartaNetworkMessageReady(shard_sockets[i]->Receive().value()).Username();
+            Assert(opponent == "user" + std::to_string(28 + (i ^ 1)));
+        }
+        auto accepted = shard_server->AcceptedPerLoop();
+        Assert(accepted.size() == 2 && accepted[0] + accepted[1] == 8);
+        for (auto& socket : shard_sockets)
+            socket->Close();
+    }
+
+    // Test a cluster: the players of a room meet on the server of the room whichever servers
+    // they connect to, relayed there by the first two, or redirected there by the third
+    std::vector<std::string> cluster_nodes;
+    std::vector<SurakartaBackend> cluster_backends;
+    for (int i = 0; i < 3; i++) {
+        cluster_nodes.push_back("127.0.0.1:" + std::to_string(PORT + 14 + i));
+        cluster_backends.push_back({"127.0.0.1", PORT + 14 + i});
+    }
+    SurakartaBackendRing cluster_ring(cluster_backends);
+    std::vector<std::shared_ptr<SurakartaNetworkService>> cluster_services;
+    std::vector<std::unique_ptr<NetworkFramework::Server>> cluster_servers;
+    for (int i = 0; i < 3; i++) {
+        SurakartaNetworkServiceOptions cluster_options;
+        cluster_options.cluster_nodes = cluster_nodes;
+        cluster_options.cluster_self = cluster_nodes[i];
+        cluster_options.cluster_redirect = i == 2;
+        cluster_options.cluster_secret = "cluster secret";
+        cluster_services.push_back(std::make_shared<SurakartaNetworkService>(
+            logger->CreateSublogger("cluster node " + cluster_nodes[i] + " "), cluster_options));
+        cluster_servers.push_back(std::make_unique<NetworkFramework::Server>(cluster_services.back(), PORT + 14 + i));
+    }
+    std::vector<std::shared_ptr<NetworkFramework::Socket>> cluster_sockets;
+    std::vector<int> cluster_rooms(3);
+    long long relayed = 0, redirected = 0;
+    for (int i = 0; i < 12; i++) {
+        // the players of a room connect to different servers
+        const int room_id = 20 + i / 2;
+        const int node = i % 3;
+        const int owner = (int)cluster_ring.Pick(room_id);
+        auto socket = NetworkFramework::ConnectToServer("localhost", PORT + 14 + node);
+        const auto ready = SurakartaNetworkMessageReady(
+            "user" + std::to_string(36 + i), i % 2 == 0 ? PieceColor::BLACK : PieceColor::WHITE, room_id);
+        socket->Send(ready);
+        if (node != owner && node == 2) {
+            Assert(SurakartaNetworkMessageReject(socket->Receive().value()).RedirectTarget() == cluster_nodes[owner]);
+            socket->Close();
+            socket = NetworkFramework::ConnectToServer("localhost", PORT + 14 + owner);
+            socket->Send(ready);
+            redirected++;
+        } else if (node != owner) {
+            relayed++;
+        }
+        if (i % 2 == 0)
+            cluster_rooms[owner]++;
+        cluster_sockets.push_back(socket);
+    }
+    for (int i = 0; i < 12; i++) {
+        auto opponent = SurakartaNetworkMessageReady(cluster_sockets[i]->Receive().value()).Username();
+        Assert(opponent == "user" + std::to_string(36 + (i ^ 1)));
+    }
+    for (int i = 0; i < 3; i++)
+        Assert(cluster_services[i]->Stats().active_rooms == cluster_rooms[i]);
+    Assert(relayed > 0 && redirected > 0);
+    Assert(cluster_services[0]->Metrics().cluster_forwarded + cluster_services[1]->Metrics().cluster_forwarded == relayed);
+    Assert(cluster_services[2]->Metrics().cluster_redirected == redirected);
+    for (auto& socket : cluster_sockets)
+        socket->Close();
+
+    // Test READYs that say they have been relayed, from the address of a server of the cluster
+    // but without the secret: they are relayed to the server of their room all the same
+    int marked_room = 26;
+    for (const std::string guess : {"", "=guess"}) {
+        while (cluster_ring.Pick(marked_room) != 1)
+            marked_room++;
+        auto socket65 = NetworkFramework::ConnectToServer("localhost", PORT + 14);
+        auto marked = SurakartaNetworkMessageReady("user65", PieceColor::BLACK, marked_room);
+        marked.data3 += SURAKARTA_CLUSTER_FORWARDED_OPTION + guess;
+        socket65->Send(marked);
+        auto socket66 = NetworkFramework::ConnectToServer("localhost", PORT + 15);
+        socket66->Send(SurakartaNetworkMessageReady("user66", PieceColor::WHITE, marked_room));
+        Assert(socket65->Receive().value() == SurakartaNetworkMessageReady("user66", PieceColor::BLACK, marked_room));
+        Assert(socket66->Receive().value() == SurakartaNetworkMessageReady("user65", PieceColor::WHITE, marked_room));
+        socket65->Close();
+        socket66->Close();
+        marked_room++;
+    }
+    Assert(cluster_services[0]->Metrics().cluster_forwarded + cluster_services[1]->Metrics().cluster_forwarded == relayed + 2);
+
     std::this_thread::sleep_for(std::chrono::seconds(1));  // Wait for server to process the message
     service->ShutdownService();
     server.Shutdown();
+    resume_service->ShutdownService();
+    resume_server.Shutdown();
+    deadline_service->ShutdownService();
+    deadline_server.Shutdown();
+    limit_service->ShutdownService();
+    limit_server.Shutdown();
+    if (proxy)
+        proxy->Shutdown();
+    if (routing_forwarder)
+        routing_forwarder->Shutdown();
+    routing_proxy.Shutdown();
+    capturing_proxy.Shutdown();
+    shard_service->ShutdownService();
+    if (shard_server)
+        shard_server->Shutdown();
+#ifdef __linux__
+    journal_service->ShutdownService();
+    journal_server.Shutdown();
+    remove_journal();
+#endif
+    capture.reset();
+    std::remove(capture_path);
+    for (size_t i = 0; i < backends.size(); i++) {
+        backend_services[i]->ShutdownService();
+        backend_servers[i]->Shutdown();
+    }
+    for (size_t i = 0; i < cluster_services.size(); i++) {
+        cluster_services[i]->ShutdownService();
+        cluster_servers[i]->Shutdown();
+    }
 
     return 0;
 }
@@ -0,0 +1,130 @@
+// Counts heap allocations on the message path, to check that a message is moved through the
+// socket wrappers and decoded in place rather than copied on the way.
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <stdexcept>
+#include "private-include/exception_as_eof_wrapper.h"
+#include "private-include/memory_socket.h"
+#include "private-include/message.h"
+#include "private-include/socket_log_wrapper.h"
+
+// Only allocations made by the thread running the test are counted.
+static thread_local long allocations = 0;
+
+void* operator new(std::size_t size) {
+    allocations++;
+    if (void* pointer = std::malloc(size == 0 ? 1 : size))
+        return pointer;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* pointer) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void* pointer, std::size_t) noexcept {
+    std::free(pointer);
+}
+
+void Assert(bool condition, const char* what) {
+    if (!condition) {
+        throw std::runtime_error(std::string("Assertion failed: ") + what);
+    }
+}
+
+template <typename Body>
+long CountAllocations(Body&& body) {
+    long before = allocations;
+    body();
+    return allocations - before;
+}
+
+// The chain SurakartaNetworkServiceImpl::OpenSession builds around every connection.
+std::shared_ptr<NetworkFramework::Socket> Wrap(std::shared_ptr<NetworkFramework::Socket> socket) {
+    socket = std::make_shared<SurakartaNetworkSocketLogWrapper>(std::move(socket), std::make_shared<SurakartaLoggerNull>());
+    return std::make_shared<SurakartaExceptionAsEofWrapper>(std::move(socket));
+}
+
+// Strings too long for the small string optimization, so that every copy shows up.
+const std::string long_username(64, 'u');
+const std::string long_text(256, 't');
+
+void TestTypedViews() {
+    NetworkFramework::Message chat(OPCODE::CHAT_OP, long_username, long_text);
+    NetworkFramework::Message ready(OPCODE::READY_OP, long_username, "BLACK", "42");
+    auto count = CountAllocations([&] {
+        auto decoded_chat = SurakartaNetworkMessageChat(std::move(chat));
+        Assert(decoded_chat.Username().size() == long_username.size(), "chat username");
+        Assert(decoded_chat.ChatMessage().size() == long_text.size(), "chat message");
+        auto decoded_ready = SurakartaNetworkMessageReady(std::move(ready));
+        Assert(decoded_ready.Username().size() == long_username.size(), "ready username");
+        Assert(decoded_ready.RoomId() == 42, "ready room id");
+    });
+    printf("decoding received messages: %ld allocations\n", count);
+    Assert(count == 0, "typed messages decode without copying");
+}
+
+// Send and receive long chat messages on a pair of sockets, and count the allocations.
+long RelayChats(const std::shared_ptr<NetworkFramework::Socket>& sender,
+                const std::shared_ptr<NetworkFramework::Socket>& receiver,
+                int messages) {
+    return CountAllocations([&] {
+        for (int i = 0; i < messages; i++) {
+            sender->Send(SurakartaNetworkMessageChat(long_username, long_text));
+            auto received = SurakartaNetworkMessageChat(std::move(receiver->Receive().value()));
+            Assert(received.ChatMessage().size() == long_text.size(), "relayed chat");
+        }
+    });
+}
+
+void TestWrapperChain() {
+    const int messages = 1000;
+    auto [bare_client, bare_server] = SurakartaMemorySocket::CreatePair();
+    auto [client, server] = SurakartaMemorySocket::CreatePair();
+    auto wrapped_server = Wrap(server);
+    // let the queues grow first
+    RelayChats(bare_client, bare_server, messages);
+    RelayChats(client, wrapped_server, messages);
+    RelayChats(wrapped_server, client, messages);
+
+    long bare = RelayChats(bare_client, bare_server, messages);
+    long received = RelayChats(client, wrapped_server, messages);
+    long sent = RelayChats(wrapped_server, client, messages);
+    printf("chat messages: %.2f allocations each on a bare socket, %.2f received and %.2f sent through the wrappers\n",
+           (double)bare / messages, (double)received / messages, (double)sent / messages);
+    Assert(received == bare, "receiving through the wrappers copies nothing");
+    Assert(sent == bare, "sending through the wrappers copies nothing");
+}
+
+// A move as the service relays it: received from one player, decoded, and sent to the other.
+void TestRelayedMove() {
+    const int moves = 1000;
+    auto [first_client, first_server] = SurakartaMemorySocket::CreatePair();
+    auto [second_client, second_server] = SurakartaMemorySocket::CreatePair();
+    auto first = Wrap(first_server);
+    auto second = Wrap(second_server);
+    auto relay = [&](int count) {
+        return CountAllocations([&] {
+            for (int i = 0; i < count; i++) {
+                first_client->Send(SurakartaNetworkMessageMove(SurakartaPosition(i % 6, 1), SurakartaPosition(i % 6, 2)));
+                auto decoded = SurakartaNetworkMessageMove(std::move(first->Receive().value()));
+                second->Send(SurakartaNetworkMessageMove(decoded.From(), decoded.To()));
+                auto relayed = SurakartaNetworkMessageMove(std::move(second_client->Receive().value()));
+                Assert(relayed.From().x == i % 6 && relayed.To().y == 2, "relayed move");
+            }
+        });
+    };
+    relay(moves);
+    long count = relay(moves);
+    printf("relayed moves: %.2f allocations each\n", (double)count / moves);
+    Assert(count == 0, "a relayed move allocates nothing");
+}
+
+int main() {
+    TestTypedViews();
+    TestWrapperChain();
+    TestRelayedMove();
+    return 0;
+}
@@ -0,0 +1,172 @@
+#include "timer_wheel.h"
+
+SurakartaTimerWheel::SurakartaTimerWheel(std::chrono::steady_clock::duration tick)
+    : tick_(tick), start_(std::chrono::steady_clock::now()), thread_([this] { Run(); }) {}
+
+SurakartaTimerWheel::~SurakartaTimerWheel() {
+    Stop();
+}
+
+void SurakartaTimerWheel::Stop() {
+    {
+        std::lock_guard lock(mutex_);
+        stopping_ = true;
+        when_armed_.notify_one();
+    }
+    if (thread_.joinable())
+        thread_.join();
+}
+
+SurakartaTimerWheel::TimerId SurakartaTimerWheel::Arm(std::chrono::steady_clock::duration delay, std::function<void()> task) {
+    auto at = std::chrono::steady_clock::now() + delay;
+    // rounded up, so that it never fires early
+    uint64_t due = (uint64_t)((std::max(at - start_, std::chrono::steady_clock::duration::zero()) + tick_ - std::chrono::steady_clock::duration(1)) / tick_);
+    std::lock_guard lock(mutex_);
+    const bool was_idle = armed_.load(std::memory_order_relaxed) == 0;
+    if (was_idle) {
+        // with no timer to pass on the way, the wheel can jump to the present
+        now_ = std::max(now_, TicksAt(std::chrono::steady_clock::now()));
+    }
+    int32_t index = Allocate();
+    auto& timer = timers_[index];
+    timer.due = std::max(due, now_ + 1);
+    timer.task = std::move(task);
+    Link(index);
+    armed_.fetch_add(1, std::memory_order_relaxed);
+    if (was_idle)
+        when_armed_.notify_one();
+    return ((TimerId)timer.generation << 32) | (uint32_t)index;
+}
+
+bool SurakartaTimerWheel::Cancel(TimerId id) {
+    if (id == NO_TIMER)
+        return false;
+    auto index = (int32_t)(uint32_t)id;
+    auto generation = (uint32_t)(id >> 32);
+    std::function<void()> task;  // destroyed after the lock is released
+    {
+        std::lock_guard lock(mutex_);
+        if (index >= (int32_t)timers_.size() || timers_[index].generation != generation || timers_[index].slot == NONE)
+            return false;
+        Unlink(index);
+        task = std::move(timers_[index].task);
+        Release(index);
+        armed_.fetch_sub(1, std::memory_order_relaxed);
+    }
+    return true;
+}
+
+int32_t SurakartaTimerWheel::Allocate() {
+    if (free_ == NONE) {
+        timers_.emplace_back();
+        return (int32_t)timers_.size() - 1;
+    }
+    int32_t index = free_;
+    free_ = timers_[index].next;
+    return index;
+}
+
+void SurakartaTimerWheel::Release(int32_t index) {
+    auto& timer = timers_[index];
+    if (++timer.generation == 0)
+        timer.generation = 1;  // so that no id is NO_TIMER
+    timer.slot = NONE;
+    timer.previous = NONE;
+    timer.next = free_;
+    free_ = index;
+}
+
+void SurakartaTimerWheel::Link(int32_t index) {
+    auto& timer = timers_[index];
+    // the timer is due at or after now_
+    uint64_t due = timer.due;
+    if (due - now_ >= SPAN)
+        due = now_ + SPAN - 1;  // put off until it comes within reach
+    int level = 0;
+    while (level < LEVELS - 1 && due - now_ >= (1ULL << (SLOT_BITS * (level + 1))))
+        level++;
+    timer.slot = level * SLOTS + (int32_t)((due >> (SLOT_BITS * level)) & (SLOTS - 1));
+    timer.previous = NONE;
+    timer.next = slots_[timer.slot];
+    if (timer.next != NONE)
+        timers_[timer.next].previous = index;
+    slots_[timer.slot] = index;
+}
+
+void SurakartaTimerWheel::Unlink(int32_t index) {
+    auto& timer = timers_[index];
+    if (timer.previous != NONE)
+        timers_[timer.previous].next = timer.next;
+    else
+        slots_[timer.slot] = timer.next;
+    if (timer.next != NONE)
+        timers_[timer.next].previous = timer.previous;
+    timer.slot = NONE;
+}
+
+void SurakartaTimerWheel::Cascade(int level) {
+    int32_t slot = level * SLOTS + (int32_t)((now_ >> (SLOT_BITS * level)) & (SLOTS - 1));
+    int32_t index = slots_[slot];
+    slots_[slot] = NONE;
+    while (index != NONE) {
+        int32_t next = timers_[index].next;
+        Link(index);
+        index = next;
+    }
+}
+
+void SurakartaTimerWheel::AdvanceLocked(std::vector<std::function<void()>>& fired) {
+    now_++;
+    // each time a wheel has gone round, the next slot of the coarser one comes down
+    for (int level = 1; level < LEVELS; level++) {
+        if (((now_ >> (SLOT_BITS * (level - 1))) & (SLOTS - 1)) != 0)
+            break;
+        Cascade(level);
+    }
+    int32_t slot = (int32_t)(now_ & (SLOTS - 1));
+    int32_t index = slots_[slot];
+    slots_[slot] = NONE;
+    while (index != NONE) {
+        auto& timer = timers_[index];
+        int32_t next = timer.next;
+        fired.push_back(std::move(timer.task));
+        Release(index);
+        armed_.fetch_sub(1, std::memory_order_relaxed);
+        index = next;
+    }
+}
+
+uint64_t SurakartaTimerWheel::TicksAt(std::chrono::steady_clock::time_point time) const {
+    if (time <= start_)
+        return 0;
+    return (uint64_t)((time - start_) / tick_);
+}
+
+void SurakartaTimerWheel::Run() {
+    std::vector<std::function<void()>> fired;
+    std::unique_lock lock(mutex_);
+    while (!stopping_) {
+        if (armed_.load(std::memory_order_relaxed) == 0) {
+            when_armed_.wait(lock);
+            continue;
+        }
+        auto present = TicksAt(std::chrono::steady_clock::now());
+        while (now_ < present && armed_.load(std::memory_order_relaxed) > 0)
+            AdvanceLocked(fired);
+        if (fired.empty()) {
+            when_armed_.wait_until(lock, start_ + tick_ * (now_ + 1));
+            continue;
+        }
+        lock.unlock();
+        for (auto& task : fired) {
+            try {
+                task();
+            } catch (...) {
+                // tasks report their own errors; keep the wheel turning
+            }
+        }
+        fired_.Add((long long)fired.size());
+        fired.clear();
+        lock.lock();
+    }
+}
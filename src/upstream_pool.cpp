@@ -0,0 +1,304 @@
+#include "upstream_pool.h"
+
+#ifdef __linux__
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include "wire_codec.h"
+
+// How long a server that could not be reached is left alone, and how long a connection may
+// take to be made.
+static constexpr auto RETRY_INTERVAL = std::chrono::seconds(1);
+static constexpr auto CONNECT_TIMEOUT = std::chrono::seconds(3);
+
+// A blocking NetworkFramework::Socket over a connection from the pool, which speaks the same
+// JSON messages as the sockets of NetworkFramework. One thread may send while another receives.
+class SurakartaUpstreamSocket : public NetworkFramework::Socket {
+   public:
+    explicit SurakartaUpstreamSocket(int fd) : fd_(fd) {
+        fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) & ~O_NONBLOCK);
+        sockaddr_storage address{};
+        socklen_t length = sizeof(address);
+        if (getpeername(fd_, (sockaddr*)&address, &length) == 0) {
+            char text[INET6_ADDRSTRLEN] = "";
+            if (address.ss_family == AF_INET) {
+                inet_ntop(AF_INET, &((sockaddr_in*)&address)->sin_addr, text, sizeof(text));
+                peer_port_ = ntohs(((sockaddr_in*)&address)->sin_port);
+            } else if (address.ss_family == AF_INET6) {
+                inet_ntop(AF_INET6, &((sockaddr_in6*)&address)->sin6_addr, text, sizeof(text));
+                peer_port_ = ntohs(((sockaddr_in6*)&address)->sin6_port);
+            }
+            peer_address_ = text;
+        }
+    }
+
+    ~SurakartaUpstreamSocket() override { ::close(fd_); }
+
+    void Send(NetworkFramework::Message message) override {
+        std::string bytes;
+        SurakartaWireEncode(message, bytes);
+        size_t total = 0;
+        while (total < bytes.size()) {
+            auto written = ::send(fd_, bytes.data() + total, bytes.size() - total, MSG_NOSIGNAL);
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                throw std::runtime_error(std::string("Failed to send: ") + strerror(errno));
+            }
+            total += written;
+        }
+    }
+
+    std::optional<NetworkFramework::Message> Receive() override {
+        char buffer[4096];
+        while (true) {
+            if (auto message = decoder_.Next())
+                return message;
+            auto size = ::recv(fd_, buffer, sizeof(buffer), 0);
+            if (size < 0 && errno == EINTR)
+                continue;
+            if (size <= 0)
+                return std::nullopt;
+            decoder_.Feed(buffer, size);
+        }
+    }
+
+    void Close() override { ::shutdown(fd_, SHUT_RDWR); }
+
+    std::string PeerAddress() const override { return peer_address_; }
+    int PeerPort() const override { return peer_port_; }
+
+   private:
+    const int fd_;
+    std::string peer_address_;
+    int peer_port_ = 0;
+    SurakartaWireDecoder decoder_;  // only used by the receiving thread
+};
+
+SurakartaUpstreamPool::SurakartaUpstreamPool(const std::vector<SurakartaBackend>& servers, SurakartaUpstreamPoolOptions options)
+    : options_(options), servers_(servers.size()) {
+    for (size_t i = 0; i < servers.size(); i++) {
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* resolved = nullptr;
+        int error = getaddrinfo(servers[i].address.c_str(), std::to_string(servers[i].port).c_str(), &hints, &resolved);
+        if (error != 0 || resolved == nullptr)
+            throw std::runtime_error("Failed to resolve " + servers[i].address + ": " + gai_strerror(error));
+        servers_[i].address.assign((char*)resolved->ai_addr, (char*)resolved->ai_addr + resolved->ai_addrlen);
+        freeaddrinfo(resolved);
+    }
+    if (pipe2(wake_fds_, O_NONBLOCK | O_CLOEXEC) < 0)
+        throw std::runtime_error(std::string("Failed to create pipe: ") + strerror(errno));
+    if (options_.size > 0)
+        thread_ = std::thread([this] { Run(); });
+}
+
+SurakartaUpstreamPool::~SurakartaUpstreamPool() {
+    {
+        std::lock_guard lock(mutex_);
+        stopping_ = true;
+    }
+    Wake();
+    if (thread_.joinable())
+        thread_.join();
+    for (auto& server : servers_) {
+        for (auto& idle : server.idle)
+            ::close(idle.fd);
+    }
+    ::close(wake_fds_[0]);
+    ::close(wake_fds_[1]);
+}
+
+int SurakartaUpstreamPool::Take(size_t server) {
+    if (options_.size <= 0)
+        return -1;
+    int fd = -1;
+    {
+        std::lock_guard lock(mutex_);
+        auto& idle = servers_.at(server).idle;
+        auto oldest_allowed = std::chrono::steady_clock::now() - std::chrono::milliseconds(options_.max_idle_ms);
+        while (!idle.empty() && fd < 0) {
+            auto candidate = idle.back();
+            idle.pop_back();
+            if (candidate.since >= oldest_allowed && Healthy(candidate.fd)) {
+                fd = candidate.fd;
+            } else {
+                ::close(candidate.fd);
+                discarded_.Add();
+            }
+        }
+    }
+    if (fd >= 0)
+        hits_.Add();
+    else
+        misses_.Add();
+    Wake();
+    return fd;
+}
+
+std::shared_ptr<NetworkFramework::Socket> SurakartaUpstreamPool::TakeSocket(size_t server) {
+    int fd = Take(server);
+    if (fd < 0)
+        return nullptr;
+    return std::make_shared<SurakartaUpstreamSocket>(fd);
+}
+
+int SurakartaUpstreamPool::Ready(size_t server) const {
+    std::lock_guard lock(mutex_);
+    return (int)servers_.at(server).idle.size();
+}
+
+bool SurakartaUpstreamPool::IsSupported() {
+    return true;
+}
+
+bool SurakartaUpstreamPool::Healthy(int fd) {
+    char byte;
+    auto size = ::recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+void SurakartaUpstreamPool::ConnectLocked(std::vector<Pending>& pending) {
+    auto now = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < servers_.size(); i++) {
+        auto& server = servers_[i];
+        if (now < server.retry_at)
+            continue;
+        while ((int)server.idle.size() + server.connecting < options_.size) {
+            auto address = (const sockaddr*)server.address.data();
+            int fd = socket(address->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd < 0) {
+                server.retry_at = now + RETRY_INTERVAL;
+                break;
+            }
+            int flag = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+            if (connect(fd, address, server.address.size()) == 0) {
+                server.idle.push_back(Idle{fd, now});
+            } else if (errno == EINPROGRESS) {
+                pending.push_back(Pending{fd, i, now});
+                server.connecting++;
+            } else {
+                ::close(fd);
+                server.retry_at = now + RETRY_INTERVAL;
+                break;
+            }
+        }
+    }
+}
+
+void SurakartaUpstreamPool::SweepLocked() {
+    auto oldest_allowed = std::chrono::steady_clock::now() - std::chrono::milliseconds(options_.max_idle_ms);
+    for (auto& server : servers_) {
+        auto usable = std::remove_if(server.idle.begin(), server.idle.end(), [&](const Idle& idle) {
+            if (idle.since >= oldest_allowed && Healthy(idle.fd))
+                return false;
+            ::close(idle.fd);
+            discarded_.Add();
+            return true;
+        });
+        server.idle.erase(usable, server.idle.end());
+    }
+}
+
+void SurakartaUpstreamPool::Wake() {
+    char byte = 0;
+    [[maybe_unused]] auto _ = ::write(wake_fds_[1], &byte, 1);
+}
+
+void SurakartaUpstreamPool::Run() {
+    // Connections expire max_idle_ms after they were made, so sweeping ten times as often
+    // replaces them with little delay. Take() checks the one it hands out anyway.
+    const auto sweep_interval = std::chrono::milliseconds(std::clamp(options_.max_idle_ms / 10, 10, 1000));
+    auto next_sweep = std::chrono::steady_clock::now();
+    std::vector<Pending> pending;  // connections being made
+    std::vector<pollfd> polled;
+    while (true) {
+        {
+            std::lock_guard lock(mutex_);
+            if (stopping_)
+                break;
+            if (std::chrono::steady_clock::now() >= next_sweep) {
+                SweepLocked();
+                next_sweep = std::chrono::steady_clock::now() + sweep_interval;
+            }
+            ConnectLocked(pending);
+        }
+        // wait for a connection to be made, one to be taken, or the next sweep
+        int timeout_ms = (int)std::max<long long>(
+            0, std::chrono::duration_cast<std::chrono::milliseconds>(next_sweep - std::chrono::steady_clock::now()).count() + 1);
+        polled.clear();
+        polled.push_back(pollfd{wake_fds_[0], POLLIN, 0});
+        for (auto& connection : pending)
+            polled.push_back(pollfd{connection.fd, POLLOUT, 0});
+        if (poll(polled.data(), polled.size(), timeout_ms) < 0 && errno != EINTR)
+            break;
+        if (polled[0].revents & POLLIN) {
+            char bytes[256];
+            while (::read(wake_fds_[0], bytes, sizeof(bytes)) > 0) {
+            }
+        }
+        auto now = std::chrono::steady_clock::now();
+        std::lock_guard lock(mutex_);
+        std::vector<Pending> still_pending;
+        for (size_t i = 0; i < pending.size(); i++) {
+            auto& connection = pending[i];
+            auto& server = servers_[connection.server];
+            auto events = polled[i + 1].revents;
+            if (events == 0 && now - connection.since < CONNECT_TIMEOUT) {
+                still_pending.push_back(connection);
+                continue;
+            }
+            server.connecting--;
+            int error = 0;
+            socklen_t length = sizeof(error);
+            if (events != 0 && getsockopt(connection.fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0) {
+                server.idle.push_back(Idle{connection.fd, now});
+            } else {
+                ::close(connection.fd);
+                server.retry_at = now + RETRY_INTERVAL;
+            }
+        }
+        pending.swap(still_pending);
+    }
+    for (auto& connection : pending)
+        ::close(connection.fd);
+}
+
+#else
+
+SurakartaUpstreamPool::SurakartaUpstreamPool(const std::vector<SurakartaBackend>& servers, SurakartaUpstreamPoolOptions options)
+    : options_(options), servers_(servers.size()) {}
+
+SurakartaUpstreamPool::~SurakartaUpstreamPool() {}
+
+int SurakartaUpstreamPool::Take(size_t) {
+    misses_.Add();
+    return -1;
+}
+
+std::shared_ptr<NetworkFramework::Socket> SurakartaUpstreamPool::TakeSocket(size_t) {
+    misses_.Add();
+    return nullptr;
+}
+
+int SurakartaUpstreamPool::Ready(size_t) const {
+    return 0;
+}
+
+bool SurakartaUpstreamPool::IsSupported() {
+    return false;
+}
+
+#endif
@@ -0,0 +1,398 @@
+#include "wire_codec.h"
+#include <cstdio>
+#include "exception.h"
+#include "opcode.h"
+
+static void AppendEscaped(const std::string& str, std::string& out) {
+    out.push_back('"');
+    for (char c : str) {
+        switch (c) {
+            case '"':
+                out.append("\\\"");
+                break;
+            case '\\':
+                out.append("\\\\");
+                break;
+            case '\n':
+                out.append("\\n");
+                break;
+            case '\r':
+                out.append("\\r");
+                break;
+            case '\t':
+                out.append("\\t");
+                break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char buffer[7];
+                    snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+                    out.append(buffer);
+                } else {
+                    out.push_back(c);
+                }
+        }
+    }
+    out.push_back('"');
+}
+
+namespace {
+
+enum CompactTag : unsigned char {
+    COMPACT_MOVE = 0x10,
+    COMPACT_END = 0x30,
+    COMPACT_RESIGN = 0x40,
+};
+
+// "A1" .. "H8" as x * 8 + y, or -1 if the string is anything else
+int CompactPosition(const std::string& str) {
+    if (str.size() != 2 || str[0] < 'A' || str[0] > 'H' || str[1] < '1' || str[1] > '8')
+        return -1;
+    return (str[0] - 'A') * 8 + (str[1] - '1');
+}
+
+std::string PositionFromCompact(int value) {
+    return std::string{(char)('A' + value / 8), (char)('1' + value % 8)};
+}
+
+// a number as std::to_string writes it, between 0 and 255, or -1 if the string is anything else
+int CompactByte(const std::string& str) {
+    if (str.empty() || str.size() > 3 || (str.size() > 1 && str[0] == '0'))
+        return -1;
+    int value = 0;
+    for (char c : str) {
+        if (c < '0' || c > '9')
+            return -1;
+        value = value * 10 + (c - '0');
+    }
+    return value <= 255 ? value : -1;
+}
+
+bool EncodeCompact(const NetworkFramework::Message& message, std::string& out) {
+    if (message.opcode == OPCODE::MOVE_OP) {
+        int from = CompactPosition(message.data1);
+        int to = CompactPosition(message.data2);
+        if (from < 0 || to < 0 || !message.data3.empty())
+            return false;
+        out.push_back((char)(COMPACT_MOVE | (from >> 2)));
+        out.push_back((char)(((from & 3) << 6) | to));
+        return true;
+    }
+    if (message.opcode == OPCODE::END_OP) {
+        int move_reason = message.data1.empty() ? 0 : CompactByte(message.data1);
+        int end_reason = CompactByte(message.data2);
+        int winner = CompactByte(message.data3);
+        if (move_reason < 0 || end_reason < 0 || winner < 0)
+            return false;
+        out.push_back((char)(COMPACT_END | (message.data1.empty() ? 0 : 1)));
+        out.push_back((char)move_reason);
+        out.push_back((char)end_reason);
+        out.push_back((char)winner);
+        return true;
+    }
+    if (message.opcode == OPCODE::RESIGN_OP) {
+        if (!message.data1.empty() || !message.data2.empty() || !message.data3.empty())
+            return false;
+        out.push_back((char)COMPACT_RESIGN);
+        return true;
+    }
+    return false;
+}
+
+// The size of the compact frame starting with the byte, or 0 if it does not start one.
+size_t CompactFrameSize(unsigned char first) {
+    switch (first & 0xf0) {
+        case COMPACT_MOVE:
+            return 2;
+        case COMPACT_END:
+            return (first & 0x0e) == 0 ? 4 : 0;
+        case COMPACT_RESIGN:
+            return first == COMPACT_RESIGN ? 1 : 0;
+        default:
+            return 0;
+    }
+}
+
+NetworkFramework::Message DecodeCompact(const unsigned char* frame) {
+    switch (frame[0] & 0xf0) {
+        case COMPACT_MOVE: {
+            int from = ((frame[0] & 0x0f) << 2) | (frame[1] >> 6);
+            int to = frame[1] & 0x3f;
+            return NetworkFramework::Message(OPCODE::MOVE_OP, PositionFromCompact(from), PositionFromCompact(to));
+        }
+        case COMPACT_END:
+            return NetworkFramework::Message(OPCODE::END_OP,
+                                             (frame[0] & 1) ? std::to_string(frame[1]) : "",
+                                             std::to_string(frame[2]),
+                                             std::to_string(frame[3]));
+        default:
+            return NetworkFramework::Message(OPCODE::RESIGN_OP);
+    }
+}
+
+}  // namespace
+
+bool SurakartaWireHasCompactOption(const NetworkFramework::Message& message) {
+    const std::string option = SURAKARTA_WIRE_COMPACT_OPTION;
+    return message.opcode == OPCODE::READY_OP &&
+           message.data3.size() >= option.size() &&
+           message.data3.compare(message.data3.size() - option.size(), option.size(), option) == 0;
+}
+
+void SurakartaWireSetCompactOption(NetworkFramework::Message& message, bool compact) {
+    if (message.opcode != OPCODE::READY_OP || SurakartaWireHasCompactOption(message) == compact)
+        return;
+    if (compact)
+        message.data3 += SURAKARTA_WIRE_COMPACT_OPTION;
+    else
+        message.data3.resize(message.data3.size() - std::string(SURAKARTA_WIRE_COMPACT_OPTION).size());
+}
+
+void SurakartaWireEncode(const NetworkFramework::Message& message, std::string& out, bool compact) {
+    if (compact && EncodeCompact(message, out))
+        return;
+    out.append("{\"op\":");
+    out.append(std::to_string(message.opcode));
+    out.append(",\"data1\":");
+    AppendEscaped(message.data1, out);
+    out.append(",\"data2\":");
+    AppendEscaped(message.data2, out);
+    out.append(",\"data3\":");
+    AppendEscaped(message.data3, out);
+    out.push_back('}');
+}
+
+namespace {
+
+class ObjectParser {
+   public:
+    ObjectParser(const char* begin, const char* end)
+        : pos_(begin), end_(end) {}
+
+    NetworkFramework::Message Parse() {
+        NetworkFramework::Message message;
+        Expect('{');
+        SkipSpaces();
+        if (Peek() == '}') {
+            pos_++;
+            return message;
+        }
+        while (true) {
+            SkipSpaces();
+            auto key = ParseString();
+            SkipSpaces();
+            Expect(':');
+            SkipSpaces();
+            if (key == "op") {
+                message.opcode = ParseInt();
+            } else if (key == "data1") {
+                message.data1 = ParseString();
+            } else if (key == "data2") {
+                message.data2 = ParseString();
+            } else if (key == "data3") {
+                message.data3 = ParseString();
+            } else if (Peek() == '"') {
+                ParseString();
+            } else {
+                ParseInt();
+            }
+            SkipSpaces();
+            if (Peek() == ',') {
+                pos_++;
+                continue;
+            }
+            Expect('}');
+            return message;
+        }
+    }
+
+   private:
+    char Peek() const {
+        if (pos_ == end_)
+            throw SurakartaNetworkWireFormatException("unexpected end of object");
+        return *pos_;
+    }
+
+    void Expect(char c) {
+        if (Peek() != c)
+            throw SurakartaNetworkWireFormatException(std::string("expected '") + c + "'");
+        pos_++;
+    }
+
+    void SkipSpaces() {
+        while (pos_ != end_ && (*pos_ == ' ' || *pos_ == '\n' || *pos_ == '\r' || *pos_ == '\t'))
+            pos_++;
+    }
+
+    int ParseInt() {
+        bool negative = false;
+        if (Peek() == '-') {
+            negative = true;
+            pos_++;
+        }
+        if (Peek() < '0' || Peek() > '9')
+            throw SurakartaNetworkWireFormatException("expected a number");
+        long long value = 0;
+        while (pos_ != end_ && *pos_ >= '0' && *pos_ <= '9') {
+            value = value * 10 + (*pos_ - '0');
+            if (value > 0x7fffffffLL)
+                throw SurakartaNetworkWireFormatException("number out of range");
+            pos_++;
+        }
+        return static_cast<int>(negative ? -value : value);
+    }
+
+    static void AppendUtf8(unsigned int code_point, std::string& out) {
+        if (code_point < 0x80) {
+            out.push_back(static_cast<char>(code_point));
+        } else if (code_point < 0x800) {
+            out.push_back(static_cast<char>(0xc0 | (code_point >> 6)));
+            out.push_back(static_cast<char>(0x80 | (code_point & 0x3f)));
+        } else if (code_point < 0x10000) {
+            out.push_back(static_cast<char>(0xe0 | (code_point >> 12)));
+            out.push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3f)));
+            out.push_back(static_cast<char>(0x80 | (code_point & 0x3f)));
+        } else {
+            out.push_back(static_cast<char>(0xf0 | (code_point >> 18)));
+            out.push_back(static_cast<char>(0x80 | ((code_point >> 12) & 0x3f)));
+            out.push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3f)));
+            out.push_back(static_cast<char>(0x80 | (code_point & 0x3f)));
+        }
+    }
+
+    unsigned int ParseHex4() {
+        unsigned int value = 0;
+        for (int i = 0; i < 4; i++) {
+            char c = Peek();
+            pos_++;
+            value <<= 4;
+            if (c >= '0' && c <= '9')
+                value |= c - '0';
+            else if (c >= 'a' && c <= 'f')
+                value |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F')
+                value |= c - 'A' + 10;
+            else
+                throw SurakartaNetworkWireFormatException("invalid \\u escape");
+        }
+        return value;
+    }
+
+    std::string ParseString() {
+        Expect('"');
+        std::string result;
+        while (true) {
+            char c = Peek();
+            pos_++;
+            if (c == '"')
+                return result;
+            if (c != '\\') {
+                result.push_back(c);
+                continue;
+            }
+            char escape = Peek();
+            pos_++;
+            switch (escape) {
+                case '"':
+                case '\\':
+                case '/':
+                    result.push_back(escape);
+                    break;
+                case 'b':
+                    result.push_back('\b');
+                    break;
+                case 'f':
+                    result.push_back('\f');
+                    break;
+                case 'n':
+                    result.push_back('\n');
+                    break;
+                case 'r':
+                    result.push_back('\r');
+                    break;
+                case 't':
+                    result.push_back('\t');
+                    break;
+                case 'u': {
+                    unsigned int code_point = ParseHex4();
+                    if (code_point >= 0xdc00 && code_point < 0xe000)
+                        throw SurakartaNetworkWireFormatException("unpaired low surrogate");
+                    if (code_point >= 0xd800 && code_point < 0xdc00) {
+                        // surrogate pair
+                        Expect('\\');
+                        Expect('u');
+                        unsigned int low = ParseHex4();
+                        if (low < 0xdc00 || low >= 0xe000)
+                            throw SurakartaNetworkWireFormatException("invalid low surrogate");
+                        code_point = 0x10000 + ((code_point - 0xd800) << 10) + (low - 0xdc00);
+                    }
+                    AppendUtf8(code_point, result);
+                    break;
+                }
+                default:
+                    throw SurakartaNetworkWireFormatException("invalid escape");
+            }
+        }
+    }
+
+    const char* pos_;
+    const char* end_;
+};
+
+}  // namespace
+
+void SurakartaWireDecoder::Feed(const char* data, size_t size) {
+    if (consumed_ > 0 && consumed_ * 2 >= buffer_.size()) {
+        buffer_.erase(0, consumed_);
+        scanned_ -= consumed_;
+        consumed_ = 0;
+    }
+    buffer_.append(data, size);
+}
+
+std::optional<NetworkFramework::Message> SurakartaWireDecoder::Next() {
+    if (depth_ == 0) {
+        // skip whitespace between messages, and take a compact frame if one starts here
+        while (consumed_ < buffer_.size() && buffer_[consumed_] != '{') {
+            char c = buffer_[consumed_];
+            if (size_t size = CompactFrameSize((unsigned char)c)) {
+                if (buffer_.size() - consumed_ < size)
+                    return std::nullopt;
+                auto message = DecodeCompact((const unsigned char*)buffer_.data() + consumed_);
+                consumed_ += size;
+                scanned_ = consumed_;
+                return message;
+            }
+            if (c != ' ' && c != '\n' && c != '\r' && c != '\t' && c != '\0')
+                throw SurakartaNetworkWireFormatException("garbage between messages");
+            consumed_++;
+        }
+        scanned_ = consumed_;
+    }
+    for (; scanned_ < buffer_.size(); scanned_++) {
+        char c = buffer_[scanned_];
+        if (in_string_) {
+            if (escaped_)
+                escaped_ = false;
+            else if (c == '\\')
+                escaped_ = true;
+            else if (c == '"')
+                in_string_ = false;
+        } else if (c == '"') {
+            in_string_ = true;
+        } else if (c == '{') {
+            depth_++;
+        } else if (c == '}') {
+            depth_--;
+            if (depth_ == 0) {
+                const char* begin = buffer_.data() + consumed_;
+                const char* end = buffer_.data() + scanned_ + 1;
+                auto message = ObjectParser(begin, end).Parse();
+                consumed_ = ++scanned_;
+                return message;
+            }
+        }
+    }
+    if (scanned_ - consumed_ > MAX_MESSAGE_SIZE)
+        throw SurakartaNetworkWireFormatException("message too long");
+    return std::nullopt;
+}
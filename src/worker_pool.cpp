@@ -0,0 +1,69 @@
+#include "worker_pool.h"
+
+SurakartaWorkerPool::SurakartaWorkerPool(int workers) {
+    if (workers <= 0)
+        workers = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 0; i < workers; i++) {
+        workers_.push_back(std::make_unique<Worker>());
+        auto& worker = *workers_.back();
+        worker.thread = std::thread([&worker] { Run(worker); });
+    }
+}
+
+SurakartaWorkerPool::~SurakartaWorkerPool() {
+    for (auto& worker : workers_) {
+        std::lock_guard lock(worker->mutex);
+        worker->stopping = true;
+        worker->when_task_posted.notify_all();
+    }
+    for (auto& worker : workers_) {
+        worker->thread.join();
+    }
+}
+
+int SurakartaWorkerPool::Attach() {
+    int best = 0;
+    for (int i = 1; i < (int)workers_.size(); i++) {
+        if (workers_[i]->rooms < workers_[best]->rooms)
+            best = i;
+    }
+    workers_[best]->rooms++;
+    return best;
+}
+
+void SurakartaWorkerPool::Detach(int worker) {
+    workers_[worker]->rooms--;
+}
+
+void SurakartaWorkerPool::Post(int worker, std::function<void()> task) {
+    auto& target = *workers_[worker];
+    std::lock_guard lock(target.mutex);
+    target.tasks.push_back(std::move(task));
+    target.when_task_posted.notify_one();
+}
+
+std::vector<int> SurakartaWorkerPool::RoomsPerWorker() const {
+    std::vector<int> result;
+    for (auto& worker : workers_)
+        result.push_back(worker->rooms);
+    return result;
+}
+
+void SurakartaWorkerPool::Run(Worker& worker) {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock lock(worker.mutex);
+            worker.when_task_posted.wait(lock, [&] { return worker.stopping || !worker.tasks.empty(); });
+            if (worker.tasks.empty())
+                return;
+            task = std::move(worker.tasks.front());
+            worker.tasks.pop_front();
+        }
+        try {
+            task();
+        } catch (...) {
+            // tasks report their own errors; keep the worker alive
+        }
+    }
+}